@@ -1,6 +1,11 @@
 /* Copyright (c) 2010-2015 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "hash.h"
+#include "ioloop.h"
+#include "fd-set-nonblock.h"
+#include "istream.h"
+#include "ostream.h"
 #include "mail-storage.h"
 #include "doveadm-print.h"
 #include "doveadm-mailbox-list-iter.h"
@@ -8,10 +13,26 @@
 #include "doveadm-mail.h"
 
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+struct search_cmd_context {
+	struct doveadm_mail_cmd_context ctx;
+	unsigned int worker_count;
+	unsigned int running_worker_count;
+};
+
+struct search_worker {
+	struct search_cmd_context *ctx;
+	pid_t pid;
+	int fd;
+	struct istream *input;
+	struct io *io;
+};
 
 static int
 cmd_search_box(struct doveadm_mail_cmd_context *ctx,
-	       const struct mailbox_info *info)
+	       const struct mailbox_info *info, struct ostream *output)
 {
 	struct doveadm_mail_iter *iter;
 	struct mailbox *box;
@@ -34,6 +55,12 @@ cmd_search_box(struct doveadm_mail_cmd_context *ctx,
 	} else {
 		guid_str = guid_128_to_string(metadata.guid);
 		while (doveadm_mail_iter_next(iter, &mail)) {
+			if (output != NULL) {
+				/* we're a worker process */
+				o_stream_nsend_str(output, t_strdup_printf(
+					"%s\t%u\n", guid_str, mail->uid));
+				continue;
+			}
 			doveadm_print(guid_str);
 			T_BEGIN {
 				doveadm_print(dec2str(mail->uid));
@@ -45,9 +72,152 @@ cmd_search_box(struct doveadm_mail_cmd_context *ctx,
 	return ret;
 }
 
+static void ATTR_NORETURN
+cmd_search_worker_run(struct search_cmd_context *ctx,
+		      struct mail_storage_service_user *service_user,
+		      unsigned int worker_idx, int fd)
+{
+	struct doveadm_mail_cmd_context *_ctx = &ctx->ctx;
+	const enum mailbox_list_iter_flags iter_flags =
+		MAILBOX_LIST_ITER_NO_AUTO_BOXES |
+		MAILBOX_LIST_ITER_RETURN_NO_FLAGS;
+	struct ioloop *ioloop;
+	struct mail_user *user;
+	struct doveadm_mailbox_list_iter *iter;
+	const struct mailbox_info *info;
+	struct ostream *output;
+	int ret = 0;
+
+	/* the user wasn't initialized before forking, so each worker has
+	   its own mail user and storage. */
+	ioloop = io_loop_create();
+	if (mail_storage_service_next(_ctx->storage_service, service_user,
+				      &user) < 0) {
+		i_error("User init failed");
+		_exit(EX_TEMPFAIL);
+	}
+	_ctx->cur_mail_user = user;
+
+	/* all the workers list the same mailboxes. each of them searches
+	   the ones whose name hashes to it. */
+	output = o_stream_create_fd(fd, IO_BLOCK_SIZE, FALSE);
+	iter = doveadm_mailbox_list_iter_init(_ctx, user, _ctx->search_args,
+					      iter_flags);
+	while ((info = doveadm_mailbox_list_iter_next(iter)) != NULL) {
+		if (str_hash(info->vname) % ctx->worker_count != worker_idx)
+			continue;
+		T_BEGIN {
+			if (cmd_search_box(_ctx, info, output) < 0)
+				ret = -1;
+		} T_END;
+	}
+	if (doveadm_mailbox_list_iter_deinit(&iter) < 0)
+		ret = -1;
+	if (o_stream_nfinish(output) < 0) {
+		i_error("write(search worker) failed: %s",
+			o_stream_get_error(output));
+		ret = -1;
+	}
+	o_stream_destroy(&output);
+	mail_user_unref(&user);
+	io_loop_destroy(&ioloop);
+
+	if (ret < 0 && _ctx->exit_code == 0)
+		_ctx->exit_code = EX_TEMPFAIL;
+	_exit(_ctx->exit_code);
+}
+
+static void search_worker_input(struct search_worker *worker)
+{
+	struct search_cmd_context *ctx = worker->ctx;
+	const char *line, *p;
+	int status;
+
+	while ((line = i_stream_read_next_line(worker->input)) != NULL) {
+		p = strchr(line, '\t');
+		if (p == NULL) {
+			i_error("Search worker sent invalid line: %s", line);
+			continue;
+		}
+		doveadm_print(t_strdup_until(line, p));
+		doveadm_print(p + 1);
+	}
+	if (worker->input->eof || worker->input->stream_errno != 0) {
+		io_remove(&worker->io);
+		i_stream_destroy(&worker->input);
+		i_close_fd(&worker->fd);
+
+		if (waitpid(worker->pid, &status, 0) < 0)
+			i_error("waitpid() failed: %m");
+		else if (!WIFEXITED(status)) {
+			i_error("Search worker process %s died with status %d",
+				dec2str(worker->pid), status);
+			ctx->ctx.exit_code = EX_TEMPFAIL;
+		} else if (WEXITSTATUS(status) != 0) {
+			/* the worker already logged the error */
+			if (ctx->ctx.exit_code == 0 ||
+			    WEXITSTATUS(status) == EX_TEMPFAIL)
+				ctx->ctx.exit_code = WEXITSTATUS(status);
+		}
+		if (--ctx->running_worker_count == 0)
+			io_loop_stop(current_ioloop);
+	}
+}
+
 static int
-cmd_search_run(struct doveadm_mail_cmd_context *ctx, struct mail_user *user)
+cmd_search_prerun(struct doveadm_mail_cmd_context *_ctx,
+		  struct mail_storage_service_user *service_user,
+		  const char **error_r ATTR_UNUSED)
 {
+	struct search_cmd_context *ctx = (struct search_cmd_context *)_ctx;
+	struct search_worker *workers;
+	struct ioloop *ioloop;
+	unsigned int i, j;
+	int fd[2];
+
+	if (ctx->worker_count <= 1)
+		return 0;
+
+	/* fork the workers before the mail user is initialized, so they
+	   don't share any storage state with us or each other. the matches
+	   are sent back to us through a pipe. */
+	workers = t_new(struct search_worker, ctx->worker_count);
+	for (i = 0; i < ctx->worker_count; i++) {
+		if (pipe(fd) < 0)
+			i_fatal("pipe() failed: %m");
+
+		workers[i].ctx = ctx;
+		workers[i].pid = fork();
+		if (workers[i].pid < 0)
+			i_fatal("fork() failed: %m");
+		if (workers[i].pid == 0) {
+			i_close_fd(&fd[0]);
+			for (j = 0; j < i; j++)
+				i_close_fd(&workers[j].fd);
+			cmd_search_worker_run(ctx, service_user, i, fd[1]);
+		}
+		i_close_fd(&fd[1]);
+		workers[i].fd = fd[0];
+	}
+
+	ioloop = io_loop_create();
+	for (i = 0; i < ctx->worker_count; i++) {
+		fd_set_nonblock(workers[i].fd, TRUE);
+		workers[i].input = i_stream_create_fd(workers[i].fd,
+						      (size_t)-1, FALSE);
+		workers[i].io = io_add(workers[i].fd, IO_READ,
+				       search_worker_input, &workers[i]);
+	}
+	ctx->running_worker_count = ctx->worker_count;
+	io_loop_run(ioloop);
+	io_loop_destroy(&ioloop);
+	return 0;
+}
+
+static int
+cmd_search_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user)
+{
+	struct search_cmd_context *ctx = (struct search_cmd_context *)_ctx;
 	const enum mailbox_list_iter_flags iter_flags =
 		MAILBOX_LIST_ITER_NO_AUTO_BOXES |
 		MAILBOX_LIST_ITER_RETURN_NO_FLAGS;
@@ -55,10 +225,15 @@ cmd_search_run(struct doveadm_mail_cmd_context *ctx, struct mail_user *user)
 	const struct mailbox_info *info;
 	int ret = 0;
 
-	iter = doveadm_mailbox_list_iter_init(ctx, user, ctx->search_args,
+	if (ctx->worker_count > 1) {
+		/* the workers already did the search in prerun() */
+		return _ctx->exit_code == 0 ? 0 : -1;
+	}
+
+	iter = doveadm_mailbox_list_iter_init(_ctx, user, _ctx->search_args,
 					      iter_flags);
 	while ((info = doveadm_mailbox_list_iter_next(iter)) != NULL) T_BEGIN {
-		if (cmd_search_box(ctx, info) < 0)
+		if (cmd_search_box(_ctx, info, NULL) < 0)
 			ret = -1;
 	} T_END;
 	if (doveadm_mailbox_list_iter_deinit(&iter) < 0)
@@ -80,17 +255,38 @@ static void cmd_search_init(struct doveadm_mail_cmd_context *ctx,
 	ctx->search_args = doveadm_mail_build_search_args(args);
 }
 
+static bool
+cmd_search_parse_arg(struct doveadm_mail_cmd_context *_ctx, int c)
+{
+	struct search_cmd_context *ctx = (struct search_cmd_context *)_ctx;
+
+	switch (c) {
+	case 'j':
+		if (str_to_uint(optarg, &ctx->worker_count) < 0) {
+			i_fatal_status(EX_USAGE,
+				"Invalid -j parameter number: %s", optarg);
+		}
+		break;
+	default:
+		return FALSE;
+	}
+	return TRUE;
+}
+
 static struct doveadm_mail_cmd_context *cmd_search_alloc(void)
 {
-	struct doveadm_mail_cmd_context *ctx;
+	struct search_cmd_context *ctx;
 
-	ctx = doveadm_mail_cmd_alloc(struct doveadm_mail_cmd_context);
-	ctx->v.init = cmd_search_init;
-	ctx->v.run = cmd_search_run;
+	ctx = doveadm_mail_cmd_alloc(struct search_cmd_context);
+	ctx->ctx.getopt_args = "j:";
+	ctx->ctx.v.parse_arg = cmd_search_parse_arg;
+	ctx->ctx.v.init = cmd_search_init;
+	ctx->ctx.v.prerun = cmd_search_prerun;
+	ctx->ctx.v.run = cmd_search_run;
 	doveadm_print_init(DOVEADM_PRINT_TYPE_FLOW);
-	return ctx;
+	return &ctx->ctx;
 }
 
 struct doveadm_mail_cmd cmd_search = {
-	cmd_search_alloc, "search", "<search query>"
+	cmd_search_alloc, "search", "[-j <workers>] <search query>"
 };
@@ -0,0 +1,146 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "env-util.h"
+#include "mail-storage.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TEST_DOVEADM_PATH "./doveadm"
+#define TEST_MAILBOX_COUNT 6
+#define TEST_MAILBOX_MAIL_COUNT 3
+
+static struct test_mail_storage_ctx *test_ctx;
+
+static void test_mailboxes_create(void)
+{
+	struct mailbox *box;
+	unsigned int i, j;
+
+	for (i = 1; i <= TEST_MAILBOX_COUNT; i++) {
+		box = test_mail_storage_mailbox_create(test_ctx,
+			t_strdup_printf("box%u", i));
+		for (j = 1; j <= TEST_MAILBOX_MAIL_COUNT; j++) {
+			(void)test_mail_storage_save(box,
+				t_strdup_printf("Subject: s%u box%u\n", j, i),
+				"body\n");
+		}
+		mailbox_free(&box);
+	}
+}
+
+static int test_strcmp_p(const char *const *s1, const char *const *s2)
+{
+	return strcmp(*s1, *s2);
+}
+
+/* Run doveadm search and return its output lines sorted, since the
+   workers' output isn't in any specific order. */
+static const char *test_doveadm_search(unsigned int worker_count)
+{
+	ARRAY_TYPE(const_string) lines;
+	const char *home, *args[12], *const *linep;
+	unsigned int argc = 0;
+	string_t *output;
+	char buf[1024];
+	ssize_t ret;
+	pid_t pid;
+	int fd[2], status;
+
+	home = t_strconcat(test_ctx->home_root, "/testuser", NULL);
+	args[argc++] = TEST_DOVEADM_PATH;
+	args[argc++] = "-O";
+	args[argc++] = "-o";
+	args[argc++] = t_strconcat("mail_location=sdbox:", home, "/mail",
+				   NULL);
+	args[argc++] = "-o";
+	args[argc++] = t_strconcat("base_dir=", test_ctx->home_root,
+				   "/run", NULL);
+	args[argc++] = "search";
+	if (worker_count > 0) {
+		args[argc++] = "-j";
+		args[argc++] = dec2str(worker_count);
+	}
+	args[argc++] = "subject";
+	args[argc++] = "s2";
+	args[argc] = NULL;
+	i_assert(argc < N_ELEMENTS(args));
+
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+	if ((pid = fork()) < 0)
+		i_fatal("fork() failed: %m");
+	if (pid == 0) {
+		if (dup2(fd[1], STDOUT_FILENO) < 0)
+			i_fatal("dup2() failed: %m");
+		i_close_fd(&fd[0]);
+		i_close_fd(&fd[1]);
+		env_put(t_strconcat("HOME=", home, NULL));
+		env_put("USER=testuser");
+		execv(TEST_DOVEADM_PATH, (void *)args);
+		i_fatal("execv(%s) failed: %m", TEST_DOVEADM_PATH);
+	}
+	i_close_fd(&fd[1]);
+
+	output = t_str_new(256);
+	while ((ret = read(fd[0], buf, sizeof(buf))) > 0)
+		str_append_n(output, buf, ret);
+	if (ret < 0)
+		i_fatal("read() failed: %m");
+	i_close_fd(&fd[0]);
+	if (waitpid(pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	t_array_init(&lines, 32);
+	for (linep = t_strsplit(str_c(output), "\n"); *linep != NULL; linep++) {
+		if (**linep != '\0')
+			array_append(&lines, linep, 1);
+	}
+	array_sort(&lines, test_strcmp_p);
+	array_append_zero(&lines);
+	return t_strarray_join(array_idx(&lines, 0), "\n");
+}
+
+static void test_doveadm_search_workers(void)
+{
+	static const unsigned int worker_counts[] = {
+		2, 3, TEST_MAILBOX_COUNT + 4
+	};
+	const char *serial;
+	unsigned int i;
+
+	test_begin("doveadm search -j");
+	test_mail_storage_init_user(test_ctx, NULL);
+	test_mailboxes_create();
+	if (mkdir(t_strconcat(test_ctx->home_root, "/run", NULL), 0700) < 0)
+		i_fatal("mkdir(run) failed: %m");
+
+	serial = test_doveadm_search(0);
+	test_assert(strlen(serial) > 0 &&
+		    str_array_length(t_strsplit(serial, "\n")) ==
+		    TEST_MAILBOX_COUNT);
+	for (i = 0; i < N_ELEMENTS(worker_counts); i++) {
+		test_assert_idx(strcmp(test_doveadm_search(worker_counts[i]),
+				       serial) == 0, i);
+	}
+	test_mail_storage_deinit_user(test_ctx);
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*test_functions[])(void) = {
+		test_doveadm_search_workers,
+		NULL
+	};
+
+	test_ctx = test_mail_storage_init(&argc, &argv);
+	return test_run(test_functions);
+}
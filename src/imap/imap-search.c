@@ -580,6 +580,14 @@ bool imap_search_start(struct imap_search_context *ctx,
 		(void)client_enable(cmd->client, MAILBOX_FEATURE_CONDSTORE);
 	}
 
+	if (sort_program != NULL &&
+	    (ctx->return_options & ~(SEARCH_RETURN_ESEARCH |
+				     SEARCH_RETURN_PARTIAL)) == 0 &&
+	    (ctx->return_options & SEARCH_RETURN_PARTIAL) != 0) {
+		/* only the beginning of the sorted result is returned */
+		sargs->sort_limit = ctx->partial2;
+	}
+
 	ctx->box = cmd->client->mailbox;
 	ctx->trans = mailbox_transaction_begin(ctx->box, 0);
 	ctx->sargs = sargs;
@@ -138,6 +138,7 @@ extern const struct fs fs_class_posix;
 extern const struct fs fs_class_metawrap;
 extern const struct fs fs_class_sis;
 extern const struct fs fs_class_sis_queue;
+extern const struct fs fs_class_chunk;
 
 void fs_class_register(const struct fs *fs_class);
 
@@ -0,0 +1,1006 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Files are split into variable sized chunks at content-defined boundaries,
+   which are found with a gear rolling hash. Because the boundaries depend
+   only on the nearby content, an insertion or deletion in the middle of a
+   file changes only the chunks around it and the rest of the chunks can be
+   shared with earlier similar files.
+
+   Each chunk is stored once as <root>/chunks/<xx>/<sha1>. A file <path>
+   references its chunks via hard links <path>.0, <path>.1, ... so the link
+   count works as the chunk's reference count the same way as with SIS. The
+   <path> itself contains a small manifest listing the chunks. Because of
+   this the "chunks" directory and names ending with .<digits> are reserved
+   and they are hidden from iteration. */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "strnum.h"
+#include "hex-binary.h"
+#include "sha1.h"
+#include "istream.h"
+#include "istream-concat.h"
+#include "istream-sized.h"
+#include "ostream.h"
+#include "iostream-temp.h"
+#include "fs-api-private.h"
+#include "fs-chunk.h"
+
+#define FS_CHUNK_REQUIRED_PROPS \
+	(FS_PROPERTY_FASTCOPY | FS_PROPERTY_STAT)
+#define FS_CHUNK_DIR_NAME "chunks"
+#define FS_CHUNK_MANIFEST_VERSION 1
+
+#define FS_CHUNK_DEFAULT_AVG_SIZE (1024*16)
+#define FS_CHUNK_MIN_AVG_SIZE 256
+#define FS_CHUNK_MAX_AVG_SIZE (1024*1024*4)
+
+struct chunk_fs {
+	struct fs fs;
+	char *root_path;
+
+	struct fs_chunk_params params;
+};
+
+struct fs_chunk {
+	char hash[SHA1_RESULTLEN*2 + 1];
+	uoff_t size;
+};
+ARRAY_DEFINE_TYPE(fs_chunk, struct fs_chunk);
+
+struct chunk_fs_file {
+	struct fs_file file;
+	struct chunk_fs *fs;
+	struct fs_file *super;
+	enum fs_open_mode open_mode;
+	enum fs_open_flags open_flags;
+
+	struct ostream *temp_output;
+	/* files used by the read stream */
+	ARRAY(struct fs_file *) chunk_files;
+
+	ARRAY_TYPE(fs_chunk) chunks;
+	uoff_t size;
+	bool manifest_read;
+};
+
+struct chunk_fs_iter {
+	struct fs_iter iter;
+	struct fs_iter *super;
+};
+
+static uint64_t fs_chunk_gear[256];
+
+static void fs_chunk_gear_init(void)
+{
+	uint64_t seed = 0x646f7665636f7421ULL, z;
+	unsigned int i;
+
+	if (fs_chunk_gear[0] != 0)
+		return;
+
+	/* the table must be the same everywhere, so generate it from a fixed
+	   seed using splitmix64 */
+	for (i = 0; i < N_ELEMENTS(fs_chunk_gear); i++) {
+		seed += 0x9e3779b97f4a7c15ULL;
+		z = seed;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		fs_chunk_gear[i] = z ^ (z >> 31);
+	}
+}
+
+void fs_chunk_params_init(struct fs_chunk_params *params,
+			  unsigned int avg_size)
+{
+	unsigned int bits;
+
+	/* cut the chunk when the highest bits of the hash are zero. the
+	   minimum size skips over most of the too-small chunks, and the
+	   maximum size limits how much a single change can affect. */
+	for (bits = 0; (2U << bits) <= avg_size; bits++) ;
+	params->mask = ((1ULL << bits) - 1) << (64 - bits);
+	params->min_size = avg_size / 4;
+	params->max_size = avg_size * 4;
+	fs_chunk_gear_init();
+}
+
+bool fs_chunk_find_boundary(const struct fs_chunk_params *params,
+			    uint64_t *hashp, size_t chunk_size,
+			    const unsigned char *data, size_t size,
+			    size_t *pos_r)
+{
+	uint64_t hash = *hashp;
+	size_t i = 0;
+
+	/* each byte is shifted out of the hash after 64 bytes, so the bytes
+	   before the last 64 of the minimum chunk size can be skipped */
+	if (chunk_size + 64 < params->min_size) {
+		i = params->min_size - 64 - chunk_size;
+		if (i >= size) {
+			*pos_r = size;
+			return FALSE;
+		}
+	}
+	for (; i < size; i++) {
+		hash = (hash << 1) + fs_chunk_gear[data[i]];
+		if (chunk_size + i + 1 < params->min_size)
+			continue;
+		if ((hash & params->mask) == 0 ||
+		    chunk_size + i + 1 >= params->max_size) {
+			*hashp = 0;
+			*pos_r = i + 1;
+			return TRUE;
+		}
+	}
+	*hashp = hash;
+	*pos_r = size;
+	return FALSE;
+}
+
+static void fs_chunk_copy_error(struct chunk_fs *fs, struct fs *super_fs)
+{
+	fs_set_error(&fs->fs, "%s", fs_last_error(super_fs));
+}
+
+static struct fs *fs_chunk_alloc(void)
+{
+	struct chunk_fs *fs;
+
+	fs = i_new(struct chunk_fs, 1);
+	fs->fs = fs_class_chunk;
+	return &fs->fs;
+}
+
+static int
+fs_chunk_init(struct fs *_fs, const char *args, const struct fs_settings *set)
+{
+	struct chunk_fs *fs = (struct chunk_fs *)_fs;
+	enum fs_properties props;
+	const char *parent_name, *parent_args, *p, *error;
+	unsigned int avg_size = FS_CHUNK_DEFAULT_AVG_SIZE;
+
+	if (strncmp(args, "avg_size=", 9) == 0) {
+		p = strchr(args, ':');
+		if (p == NULL) {
+			fs_set_error(_fs, "Parent filesystem not given as parameter");
+			return -1;
+		}
+		if (str_to_uint(t_strdup_until(args + 9, p), &avg_size) < 0 ||
+		    avg_size < FS_CHUNK_MIN_AVG_SIZE ||
+		    avg_size > FS_CHUNK_MAX_AVG_SIZE) {
+			fs_set_error(_fs, "Invalid avg_size: %s",
+				     t_strdup_until(args + 9, p));
+			return -1;
+		}
+		args = p + 1;
+	}
+	if (*args == '\0') {
+		fs_set_error(_fs, "Parent filesystem not given as parameter");
+		return -1;
+	}
+
+	parent_args = strchr(args, ':');
+	if (parent_args == NULL) {
+		parent_name = args;
+		parent_args = "";
+	} else {
+		parent_name = t_strdup_until(args, parent_args);
+		parent_args++;
+	}
+	if (fs_init(parent_name, parent_args, set, &_fs->parent, &error) < 0) {
+		fs_set_error(_fs, "%s: %s", parent_name, error);
+		return -1;
+	}
+	props = fs_get_properties(_fs->parent);
+	if ((props & FS_CHUNK_REQUIRED_PROPS) != FS_CHUNK_REQUIRED_PROPS) {
+		fs_set_error(_fs, "%s backend can't be used with chunk",
+			     parent_name);
+		return -1;
+	}
+	fs->root_path = i_strdup(set->root_path);
+	fs_chunk_params_init(&fs->params, avg_size);
+	return 0;
+}
+
+static void fs_chunk_deinit(struct fs *_fs)
+{
+	struct chunk_fs *fs = (struct chunk_fs *)_fs;
+
+	if (_fs->parent != NULL)
+		fs_deinit(&_fs->parent);
+	i_free(fs->root_path);
+	i_free(fs);
+}
+
+static enum fs_properties fs_chunk_get_properties(struct fs *_fs)
+{
+	return fs_get_properties(_fs->parent);
+}
+
+static struct fs_file *
+fs_chunk_file_init(struct fs *_fs, const char *path,
+		   enum fs_open_mode mode, enum fs_open_flags flags)
+{
+	struct chunk_fs *fs = (struct chunk_fs *)_fs;
+	struct chunk_fs_file *file;
+
+	file = i_new(struct chunk_fs_file, 1);
+	file->file.fs = _fs;
+	file->file.path = i_strdup(path);
+	file->fs = fs;
+	file->open_mode = mode;
+	file->open_flags = flags;
+	i_array_init(&file->chunk_files, 4);
+	i_array_init(&file->chunks, 4);
+	if (mode == FS_OPEN_MODE_APPEND) {
+		fs_set_error(_fs, "APPEND mode not supported");
+		return &file->file;
+	}
+	file->super = fs_file_init(_fs->parent, path, mode | flags);
+	return &file->file;
+}
+
+static void fs_chunk_file_close_chunks(struct chunk_fs_file *file)
+{
+	struct fs_file **chunk_filep;
+
+	array_foreach_modifiable(&file->chunk_files, chunk_filep)
+		fs_file_deinit(chunk_filep);
+	array_clear(&file->chunk_files);
+}
+
+static void fs_chunk_file_deinit(struct fs_file *_file)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+
+	fs_chunk_file_close_chunks(file);
+	if (file->super != NULL)
+		fs_file_deinit(&file->super);
+	array_free(&file->chunk_files);
+	array_free(&file->chunks);
+	i_free(file->file.path);
+	i_free(file);
+}
+
+static void fs_chunk_file_close(struct fs_file *_file)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+
+	fs_chunk_file_close_chunks(file);
+	if (file->super != NULL)
+		fs_file_close(file->super);
+}
+
+static const char *fs_chunk_file_get_path(struct fs_file *_file)
+{
+	return _file->path;
+}
+
+static void
+fs_chunk_set_async_callback(struct fs_file *_file,
+			    fs_file_async_callback_t *callback, void *context)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+
+	fs_file_set_async_callback(file->super, callback, context);
+}
+
+static int fs_chunk_wait_async(struct fs *_fs)
+{
+	return fs_wait_async(_fs->parent);
+}
+
+static void
+fs_chunk_set_metadata(struct fs_file *_file, const char *key,
+		      const char *value)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+
+	fs_set_metadata(file->super, key, value);
+}
+
+static int
+fs_chunk_get_metadata(struct fs_file *_file,
+		      const ARRAY_TYPE(fs_metadata) **metadata_r)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+
+	if (fs_get_metadata(file->super, metadata_r) < 0) {
+		fs_chunk_copy_error(file->fs, file->super->fs);
+		return -1;
+	}
+	return 0;
+}
+
+static bool fs_chunk_prefetch(struct fs_file *_file ATTR_UNUSED,
+			      uoff_t length ATTR_UNUSED)
+{
+	return TRUE;
+}
+
+static const char *
+fs_chunk_get_ref_path(struct chunk_fs_file *file, unsigned int idx)
+{
+	return t_strdup_printf("%s.%u", file->file.path, idx);
+}
+
+static const char *
+fs_chunk_get_chunk_path(struct chunk_fs_file *file, const char *hash)
+{
+	const char *dir, *p;
+
+	if (file->fs->root_path != NULL)
+		dir = file->fs->root_path;
+	else {
+		p = strrchr(file->file.path, '/');
+		dir = p == NULL ? "." : t_strdup_until(file->file.path, p);
+	}
+	return t_strdup_printf("%s/"FS_CHUNK_DIR_NAME"/%c%c/%s",
+			       dir, hash[0], hash[1], hash);
+}
+
+static int
+fs_chunk_parse_manifest(struct chunk_fs_file *file, struct istream *input)
+{
+	struct fs_chunk *chunk;
+	const char *line, *const *args;
+	uoff_t size = 0;
+	unsigned int version;
+
+	line = i_stream_read_next_line(input);
+	if (line == NULL)
+		return -1;
+	args = t_strsplit_tab(line);
+	if (str_array_length(args) < 3 || strcmp(args[0], "CHUNKS") != 0 ||
+	    str_to_uint(args[1], &version) < 0 ||
+	    version != FS_CHUNK_MANIFEST_VERSION ||
+	    str_to_uoff(args[2], &file->size) < 0)
+		return -1;
+
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		args = t_strsplit_tab(line);
+		if (str_array_length(args) < 2 ||
+		    strlen(args[0]) != sizeof(chunk->hash)-1)
+			return -1;
+		chunk = array_append_space(&file->chunks);
+		memcpy(chunk->hash, args[0], sizeof(chunk->hash)-1);
+		if (str_to_uoff(args[1], &chunk->size) < 0)
+			return -1;
+		size += chunk->size;
+	}
+	return input->stream_errno != 0 || size != file->size ? -1 : 0;
+}
+
+static int
+fs_chunk_read_manifest_file(struct chunk_fs_file *file,
+			    struct fs_file *manifest_file)
+{
+	struct istream *input;
+	int ret;
+
+	array_clear(&file->chunks);
+	input = fs_read_stream(manifest_file, IO_BLOCK_SIZE);
+	T_BEGIN {
+		ret = fs_chunk_parse_manifest(file, input);
+	} T_END;
+	if (input->stream_errno != 0) {
+		fs_set_error(file->file.fs, "read(%s) failed: %s",
+			     i_stream_get_name(input),
+			     i_stream_get_error(input));
+		errno = input->stream_errno;
+	} else if (ret < 0) {
+		fs_set_error(file->file.fs, "%s: Invalid chunk manifest",
+			     fs_file_path(manifest_file));
+		errno = EINVAL;
+	}
+	i_stream_unref(&input);
+	return ret;
+}
+
+static int fs_chunk_read_manifest(struct chunk_fs_file *file)
+{
+	if (file->manifest_read)
+		return 0;
+	if (file->super == NULL)
+		return -1;
+
+	if (fs_chunk_read_manifest_file(file, file->super) < 0)
+		return -1;
+	file->manifest_read = TRUE;
+	return 0;
+}
+
+/* Read the chunks of the existing file that is going to be replaced by file
+   into file->chunks. Returns 1 if the file exists, 0 if not, -1 on error.
+   If the existing manifest is invalid, its refs are unknown and they're
+   left alone. */
+static int fs_chunk_read_old_manifest(struct chunk_fs_file *file)
+{
+	struct fs_file *old_file;
+	int ret;
+
+	old_file = fs_file_init(file->fs->fs.parent, file->file.path,
+				FS_OPEN_MODE_READONLY);
+	if (fs_chunk_read_manifest_file(file, old_file) == 0)
+		ret = 1;
+	else {
+		array_clear(&file->chunks);
+		ret = errno == ENOENT ? 0 : (errno == EINVAL ? 1 : -1);
+	}
+	fs_file_deinit(&old_file);
+	file->manifest_read = FALSE;
+	return ret;
+}
+
+static struct istream *
+fs_chunk_read_stream(struct fs_file *_file, size_t max_buffer_size)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+	const struct fs_chunk *chunks;
+	struct fs_file *chunk_file;
+	struct istream *input, **inputs;
+	unsigned int i, count;
+
+	if (fs_chunk_read_manifest(file) < 0) {
+		input = i_stream_create_error_str(errno, "%s",
+						  fs_file_last_error(_file));
+		i_stream_set_name(input, _file->path);
+		return input;
+	}
+
+	chunks = array_get(&file->chunks, &count);
+	inputs = t_new(struct istream *, count + 1);
+	for (i = 0; i < count; i++) {
+		chunk_file = fs_file_init(_file->fs->parent,
+					  fs_chunk_get_ref_path(file, i),
+					  FS_OPEN_MODE_READONLY);
+		array_append(&file->chunk_files, &chunk_file, 1);
+		input = fs_read_stream(chunk_file, max_buffer_size);
+		inputs[i] = i_stream_create_sized(input, chunks[i].size);
+		i_stream_unref(&input);
+	}
+	input = i_stream_create_concat(inputs);
+	for (i = 0; i < count; i++)
+		i_stream_unref(&inputs[i]);
+	i_stream_set_name(input, _file->path);
+	return input;
+}
+
+static void fs_chunk_write_stream(struct fs_file *_file)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+
+	i_assert(_file->output == NULL);
+
+	if (file->super == NULL) {
+		_file->output = o_stream_create_error_str(EINVAL, "%s",
+						fs_file_last_error(_file));
+	} else {
+		file->temp_output =
+			iostream_temp_create_named(_file->fs->temp_path_prefix,
+						   IOSTREAM_TEMP_FLAG_TRY_FD_DUP,
+						   fs_file_path(_file));
+		_file->output = file->temp_output;
+		o_stream_ref(_file->output);
+	}
+	o_stream_set_name(_file->output, _file->path);
+}
+
+static void
+fs_chunk_try_unlink_chunk(struct chunk_fs_file *file, unsigned int idx,
+			  const char *hash)
+{
+	struct fs *super_fs = file->fs->fs.parent;
+	struct fs_file *ref_file, *chunk_file;
+	struct stat st1, st2;
+
+	ref_file = fs_file_init(super_fs, fs_chunk_get_ref_path(file, idx),
+				FS_OPEN_MODE_READONLY);
+	if (fs_stat(ref_file, &st1) < 0 || st1.st_nlink != 2) {
+		fs_file_deinit(&ref_file);
+		return;
+	}
+
+	/* this may be the last link. if the chunks/ file is the same,
+	   delete it. */
+	chunk_file = fs_file_init(super_fs, fs_chunk_get_chunk_path(file, hash),
+				  FS_OPEN_MODE_READONLY);
+	if (fs_stat(chunk_file, &st2) == 0 &&
+	    st1.st_ino == st2.st_ino &&
+	    CMP_DEV_T(st1.st_dev, st2.st_dev)) {
+		if (fs_delete(chunk_file) < 0)
+			i_error("fs-chunk: %s", fs_last_error(super_fs));
+	}
+	fs_file_deinit(&chunk_file);
+	fs_file_deinit(&ref_file);
+}
+
+/* Delete file's refs start..end-1, which point to the given chunks, along
+   with the chunks that aren't referenced anymore. */
+static void
+fs_chunk_delete_refs(struct chunk_fs_file *file,
+		     const ARRAY_TYPE(fs_chunk) *chunks,
+		     unsigned int start, unsigned int end)
+{
+	struct fs *super_fs = file->fs->fs.parent;
+	const struct fs_chunk *chunk;
+	struct fs_file *ref_file;
+	unsigned int i;
+
+	for (i = start; i < end; i++) {
+		chunk = array_idx(chunks, i);
+		fs_chunk_try_unlink_chunk(file, i, chunk->hash);
+		ref_file = fs_file_init(super_fs, fs_chunk_get_ref_path(file, i),
+					FS_OPEN_MODE_READONLY);
+		if (fs_delete(ref_file) < 0 && errno != ENOENT)
+			i_error("fs-chunk: %s", fs_last_error(super_fs));
+		fs_file_deinit(&ref_file);
+	}
+}
+
+/* Drop the replaced file, whose refs below replaced_count were already
+   overwritten. */
+static void
+fs_chunk_delete_replaced(struct chunk_fs_file *file,
+			 unsigned int replaced_count)
+{
+	unsigned int count = array_count(&file->chunks);
+
+	if (replaced_count == 0 || count == 0)
+		return;
+	if (fs_delete(file->super) < 0 && errno != ENOENT)
+		i_error("fs-chunk: %s", fs_last_error(file->super->fs));
+	fs_chunk_delete_refs(file, &file->chunks, replaced_count, count);
+}
+
+static int
+fs_chunk_store(struct chunk_fs_file *file, unsigned int idx,
+	       const void *data, size_t size, struct fs_chunk *chunk_r)
+{
+	struct fs *super_fs = file->fs->fs.parent;
+	struct fs_file *chunk_file, *ref_file;
+	const struct fs_chunk *old_chunk = NULL;
+	unsigned char digest[SHA1_RESULTLEN];
+	bool share;
+	int ret = 0;
+
+	sha1_get_digest(data, size, digest);
+	memcpy(chunk_r->hash, binary_to_hex(digest, sizeof(digest)),
+	       sizeof(chunk_r->hash));
+	chunk_r->size = size;
+
+	if (idx < array_count(&file->chunks)) {
+		/* replacing an existing file */
+		old_chunk = array_idx(&file->chunks, idx);
+		if (strcmp(old_chunk->hash, chunk_r->hash) == 0)
+			return 0;
+		fs_chunk_try_unlink_chunk(file, idx, old_chunk->hash);
+	}
+
+	chunk_file = fs_file_init(super_fs,
+				  fs_chunk_get_chunk_path(file, chunk_r->hash),
+				  FS_OPEN_MODE_READONLY);
+	ref_file = fs_file_init(super_fs, fs_chunk_get_ref_path(file, idx),
+				FS_OPEN_MODE_REPLACE |
+				(file->open_flags & FS_OPEN_FLAG_FSYNC));
+	if (fs_copy(chunk_file, ref_file) == 0) {
+		/* the chunk already existed */
+	} else if (errno != ENOENT && errno != EMLINK) {
+		fs_chunk_copy_error(file->fs, super_fs);
+		ret = -1;
+	} else {
+		/* with EMLINK the existing chunk has too many links already.
+		   leave this one unshared. */
+		share = errno == ENOENT;
+		if (fs_write(ref_file, data, size) < 0) {
+			fs_chunk_copy_error(file->fs, super_fs);
+			ret = -1;
+		} else if (share && fs_copy(ref_file, chunk_file) < 0) {
+			if (errno == EEXIST) {
+				/* someone else just created the same chunk.
+				   it's too much trouble trying to deduplicate
+				   it anymore */
+			} else {
+				i_error("fs-chunk: %s", fs_last_error(super_fs));
+			}
+		}
+	}
+	fs_file_deinit(&chunk_file);
+	fs_file_deinit(&ref_file);
+	return ret;
+}
+
+static int
+fs_chunk_write_chunk(struct chunk_fs_file *file, ARRAY_TYPE(fs_chunk) *chunks,
+		     const buffer_t *buf)
+{
+	struct fs_chunk *chunk;
+
+	chunk = array_append_space(chunks);
+	return fs_chunk_store(file, array_count(chunks) - 1,
+			      buf->data, buf->used, chunk);
+}
+
+static int
+fs_chunk_write_chunks(struct chunk_fs_file *file, struct istream *input,
+		      ARRAY_TYPE(fs_chunk) *chunks, uoff_t *size_r)
+{
+	buffer_t *buf;
+	const unsigned char *data;
+	size_t size, pos;
+	uint64_t hash = 0;
+	uoff_t total_size = 0;
+	bool cut;
+	int ret = 0;
+
+	buf = buffer_create_dynamic(default_pool, file->fs->params.max_size);
+	while (ret == 0 && i_stream_read_data(input, &data, &size, 0) > 0) {
+		cut = fs_chunk_find_boundary(&file->fs->params, &hash,
+					     buf->used, data, size, &pos);
+		buffer_append(buf, data, pos);
+		i_stream_skip(input, pos);
+		if (cut) {
+			total_size += buf->used;
+			ret = fs_chunk_write_chunk(file, chunks, buf);
+			buffer_set_used_size(buf, 0);
+		}
+	}
+	if (ret == 0 && input->stream_errno != 0) {
+		fs_set_error(file->file.fs, "read(%s) failed: %s",
+			     i_stream_get_name(input),
+			     i_stream_get_error(input));
+		ret = -1;
+	}
+	if (ret == 0 && buf->used > 0) {
+		total_size += buf->used;
+		ret = fs_chunk_write_chunk(file, chunks, buf);
+	}
+	buffer_free(&buf);
+	*size_r = total_size;
+	return ret;
+}
+
+static int
+fs_chunk_write_manifest(struct chunk_fs_file *file,
+			const ARRAY_TYPE(fs_chunk) *chunks, uoff_t size)
+{
+	const struct fs_chunk *chunk;
+	string_t *manifest;
+	int ret = 0;
+
+	manifest = str_new(default_pool, 64 + array_count(chunks) *
+			   (sizeof(chunk->hash) + MAX_INT_STRLEN));
+	str_printfa(manifest, "CHUNKS\t%u\t%"PRIuUOFF_T"\n",
+		    FS_CHUNK_MANIFEST_VERSION, size);
+	array_foreach(chunks, chunk) {
+		str_printfa(manifest, "%s\t%"PRIuUOFF_T"\n",
+			    chunk->hash, chunk->size);
+	}
+	if (fs_write(file->super, str_data(manifest), str_len(manifest)) < 0) {
+		fs_chunk_copy_error(file->fs, file->super->fs);
+		ret = -1;
+	}
+	str_free(&manifest);
+	return ret;
+}
+
+static int fs_chunk_write_stream_finish(struct fs_file *_file, bool success)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+	ARRAY_TYPE(fs_chunk) new_chunks;
+	struct istream *input;
+	uoff_t size;
+	unsigned int new_count;
+	int ret, old_errno;
+
+	if (_file->output != NULL) {
+		if (o_stream_nfinish(_file->output) < 0)
+			success = FALSE;
+		o_stream_unref(&_file->output);
+	}
+	if (!success) {
+		if (file->temp_output != NULL)
+			o_stream_destroy(&file->temp_output);
+		return -1;
+	}
+
+	/* the old file's chunks are needed to drop its refs that are
+	   replaced by the new file or left over after it */
+	ret = fs_chunk_read_old_manifest(file);
+	if (ret > 0 && file->open_mode != FS_OPEN_MODE_REPLACE) {
+		fs_set_error(_file->fs, "%s already exists", _file->path);
+		errno = EEXIST;
+		ret = -1;
+	}
+
+	input = iostream_temp_finish(&file->temp_output, IO_BLOCK_SIZE);
+	i_array_init(&new_chunks, 16);
+	if (ret >= 0) T_BEGIN {
+		ret = fs_chunk_write_chunks(file, input, &new_chunks, &size);
+		if (ret == 0)
+			ret = fs_chunk_write_manifest(file, &new_chunks, size);
+	} T_END;
+	i_stream_unref(&input);
+
+	new_count = array_count(&new_chunks);
+	old_errno = errno;
+	T_BEGIN {
+		if (ret == 0) {
+			fs_chunk_delete_refs(file, &file->chunks, new_count,
+					     array_count(&file->chunks));
+		} else {
+			/* the old file's refs may already have been
+			   replaced, so it can't be kept either */
+			fs_chunk_delete_replaced(file, new_count);
+			fs_chunk_delete_refs(file, &new_chunks, 0, new_count);
+		}
+	} T_END;
+	errno = old_errno;
+	array_free(&new_chunks);
+	array_clear(&file->chunks);
+	file->manifest_read = FALSE;
+	return ret < 0 ? -1 : 1;
+}
+
+static int
+fs_chunk_lock(struct fs_file *_file, unsigned int secs, struct fs_lock **lock_r)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+
+	if (fs_lock(file->super, secs, lock_r) < 0) {
+		fs_chunk_copy_error(file->fs, file->super->fs);
+		return -1;
+	}
+	return 0;
+}
+
+static void fs_chunk_unlock(struct fs_lock *_lock ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+static int fs_chunk_exists(struct fs_file *_file)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+	int ret;
+
+	if ((ret = fs_exists(file->super)) < 0)
+		fs_chunk_copy_error(file->fs, file->super->fs);
+	return ret;
+}
+
+static int fs_chunk_stat(struct fs_file *_file, struct stat *st_r)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+
+	if (fs_stat(file->super, st_r) < 0) {
+		fs_chunk_copy_error(file->fs, file->super->fs);
+		return -1;
+	}
+	if (fs_chunk_read_manifest(file) < 0)
+		return -1;
+	st_r->st_size = file->size;
+	return 0;
+}
+
+static int
+fs_chunk_link_ref(struct chunk_fs_file *src, struct chunk_fs_file *dest,
+		  unsigned int idx, bool rename)
+{
+	struct fs *super_fs = src->fs->fs.parent;
+	struct fs_file *src_ref, *dest_ref;
+	int ret;
+
+	src_ref = fs_file_init(super_fs, fs_chunk_get_ref_path(src, idx),
+			       FS_OPEN_MODE_READONLY);
+	dest_ref = fs_file_init(super_fs, fs_chunk_get_ref_path(dest, idx),
+				FS_OPEN_MODE_REPLACE |
+				(dest->open_flags & FS_OPEN_FLAG_FSYNC));
+	ret = rename ? fs_rename(src_ref, dest_ref) : fs_copy(src_ref, dest_ref);
+	if (ret < 0)
+		fs_chunk_copy_error(src->fs, super_fs);
+	fs_file_deinit(&src_ref);
+	fs_file_deinit(&dest_ref);
+	return ret;
+}
+
+static int
+fs_chunk_link_refs(struct chunk_fs_file *src, struct chunk_fs_file *dest,
+		   bool rename)
+{
+	const struct fs_chunk *chunks, *old_chunks;
+	const char *error;
+	unsigned int i, count, old_count;
+	int ret;
+
+	/* rename() replaces the destination like with the parent fs, but
+	   copying requires the REPLACE mode */
+	ret = fs_chunk_read_old_manifest(dest);
+	if (ret < 0)
+		return -1;
+	if (ret > 0 && !rename && dest->open_mode != FS_OPEN_MODE_REPLACE) {
+		fs_set_error(&dest->fs->fs, "%s already exists",
+			     dest->file.path);
+		errno = EEXIST;
+		return -1;
+	}
+
+	chunks = array_get(&src->chunks, &count);
+	old_chunks = array_get(&dest->chunks, &old_count);
+	for (i = 0; i < count; i++) {
+		if (i < old_count &&
+		    strcmp(old_chunks[i].hash, chunks[i].hash) != 0)
+			fs_chunk_try_unlink_chunk(dest, i, old_chunks[i].hash);
+		if (fs_chunk_link_ref(src, dest, i, rename) < 0)
+			break;
+	}
+	if (i == count) {
+		ret = rename ? fs_rename(src->super, dest->super) :
+			fs_copy(src->super, dest->super);
+		if (ret == 0) {
+			fs_chunk_delete_refs(dest, &dest->chunks,
+					     count, old_count);
+			array_clear(&dest->chunks);
+			return 0;
+		}
+		fs_chunk_copy_error(src->fs, src->super->fs);
+	}
+	error = t_strdup(fs_last_error(&src->fs->fs));
+
+	/* revert the chunk links that were already done */
+	if (!rename)
+		fs_chunk_delete_refs(dest, &src->chunks, 0, i);
+	else {
+		unsigned int j = i;
+
+		while (j > 0) {
+			if (fs_chunk_link_ref(dest, src, --j, TRUE) < 0)
+				i_error("fs-chunk: %s", fs_last_error(&src->fs->fs));
+		}
+	}
+	fs_chunk_delete_replaced(dest, i);
+	array_clear(&dest->chunks);
+	fs_set_error(&src->fs->fs, "%s", error);
+	return -1;
+}
+
+static int fs_chunk_copy(struct fs_file *_src, struct fs_file *_dest)
+{
+	struct chunk_fs_file *src = (struct chunk_fs_file *)_src;
+	struct chunk_fs_file *dest = (struct chunk_fs_file *)_dest;
+	int ret;
+
+	if (_src == NULL)
+		return fs_copy_finish_async(dest->super);
+	if (fs_chunk_read_manifest(src) < 0)
+		return -1;
+	T_BEGIN {
+		ret = fs_chunk_link_refs(src, dest, FALSE);
+	} T_END;
+	return ret;
+}
+
+static int fs_chunk_rename(struct fs_file *_src, struct fs_file *_dest)
+{
+	struct chunk_fs_file *src = (struct chunk_fs_file *)_src;
+	struct chunk_fs_file *dest = (struct chunk_fs_file *)_dest;
+	int ret;
+
+	if (fs_chunk_read_manifest(src) < 0)
+		return -1;
+	T_BEGIN {
+		ret = fs_chunk_link_refs(src, dest, TRUE);
+	} T_END;
+	return ret;
+}
+
+static int fs_chunk_delete(struct fs_file *_file)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+
+	/* if the manifest can't be read, the delete below fails with the
+	   proper error */
+	if (fs_chunk_read_manifest(file) < 0)
+		array_clear(&file->chunks);
+
+	/* delete the manifest first, so that an interrupted delete leaks
+	   only some chunk links instead of leaving a broken file */
+	if (fs_delete(file->super) < 0) {
+		fs_chunk_copy_error(file->fs, file->super->fs);
+		return -1;
+	}
+	T_BEGIN {
+		fs_chunk_delete_refs(file, &file->chunks, 0,
+				     array_count(&file->chunks));
+	} T_END;
+	file->manifest_read = FALSE;
+	return 0;
+}
+
+static struct fs_iter *
+fs_chunk_iter_init(struct fs *_fs, const char *path, enum fs_iter_flags flags)
+{
+	struct chunk_fs_iter *iter;
+
+	iter = i_new(struct chunk_fs_iter, 1);
+	iter->iter.fs = _fs;
+	iter->iter.flags = flags;
+	iter->super = fs_iter_init(_fs->parent, path, flags);
+	return &iter->iter;
+}
+
+static bool
+fs_chunk_iter_is_internal(enum fs_iter_flags flags, const char *fname)
+{
+	const char *p;
+
+	if ((flags & FS_ITER_FLAG_DIRS) != 0)
+		return strcmp(fname, FS_CHUNK_DIR_NAME) == 0;
+
+	/* <path>.<idx> refs */
+	p = strrchr(fname, '.');
+	return p != NULL && p[1] != '\0' && str_is_numeric(p + 1, '\0');
+}
+
+static const char *fs_chunk_iter_next(struct fs_iter *_iter)
+{
+	struct chunk_fs_iter *iter = (struct chunk_fs_iter *)_iter;
+	const char *fname;
+
+	iter->super->async_callback = _iter->async_callback;
+	iter->super->async_context = _iter->async_context;
+
+	do {
+		fname = fs_iter_next(iter->super);
+	} while (fname != NULL &&
+		 fs_chunk_iter_is_internal(_iter->flags, fname));
+	_iter->async_have_more = iter->super->async_have_more;
+	return fname;
+}
+
+static int fs_chunk_iter_deinit(struct fs_iter *_iter)
+{
+	struct chunk_fs_iter *iter = (struct chunk_fs_iter *)_iter;
+	int ret;
+
+	if ((ret = fs_iter_deinit(&iter->super)) < 0)
+		fs_set_error(_iter->fs, "%s", fs_last_error(_iter->fs->parent));
+	i_free(iter);
+	return ret;
+}
+
+const struct fs fs_class_chunk = {
+	.name = "chunk",
+	.v = {
+		fs_chunk_alloc,
+		fs_chunk_init,
+		fs_chunk_deinit,
+		fs_chunk_get_properties,
+		fs_chunk_file_init,
+		fs_chunk_file_deinit,
+		fs_chunk_file_close,
+		fs_chunk_file_get_path,
+		fs_chunk_set_async_callback,
+		fs_chunk_wait_async,
+		fs_chunk_set_metadata,
+		fs_chunk_get_metadata,
+		fs_chunk_prefetch,
+		NULL,
+		fs_chunk_read_stream,
+		NULL,
+		fs_chunk_write_stream,
+		fs_chunk_write_stream_finish,
+		fs_chunk_lock,
+		fs_chunk_unlock,
+		fs_chunk_exists,
+		fs_chunk_stat,
+		fs_chunk_copy,
+		fs_chunk_rename,
+		fs_chunk_delete,
+		fs_chunk_iter_init,
+		fs_chunk_iter_next,
+		fs_chunk_iter_deinit
+	}
+};
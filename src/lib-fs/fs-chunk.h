@@ -0,0 +1,23 @@
+#ifndef FS_CHUNK_H
+#define FS_CHUNK_H
+
+/* Content-defined chunking used by the "chunk" fs backend. */
+struct fs_chunk_params {
+	unsigned int min_size, max_size;
+	uint64_t mask;
+};
+
+/* Initialize chunking parameters for the wanted average chunk size. */
+void fs_chunk_params_init(struct fs_chunk_params *params,
+			  unsigned int avg_size);
+/* Find the end of the current chunk from data. chunk_size is the number of
+   bytes already in the chunk and hash is the rolling hash state, which must
+   be 0 at the beginning of each chunk. Returns TRUE and the chunk's end
+   position within data if a boundary was found (and resets hash), FALSE if
+   the chunk continues after data (pos_r is then size). */
+bool fs_chunk_find_boundary(const struct fs_chunk_params *params,
+			    uint64_t *hash, size_t chunk_size,
+			    const unsigned char *data, size_t size,
+			    size_t *pos_r);
+
+#endif
@@ -0,0 +1,371 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "istream.h"
+#include "unlink-directory.h"
+#include "fs-api.h"
+#include "fs-chunk.h"
+#include "test-common.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-fs-chunk"
+#define TEST_AVG_SIZE 256
+
+static uint32_t test_rand_state;
+
+static void test_fill_random(buffer_t *buf, size_t size)
+{
+	unsigned char *data;
+	size_t i;
+
+	/* a fixed sequence, so the chunk boundaries are always the same */
+	data = buffer_append_space_unsafe(buf, size);
+	for (i = 0; i < size; i++) {
+		test_rand_state ^= test_rand_state << 13;
+		test_rand_state ^= test_rand_state >> 17;
+		test_rand_state ^= test_rand_state << 5;
+		data[i] = test_rand_state & 0xff;
+	}
+}
+
+static void
+test_get_boundaries(const struct fs_chunk_params *params,
+		    const unsigned char *data, size_t size, size_t piece_size,
+		    ARRAY_TYPE(uint32_t) *boundaries)
+{
+	uint64_t hash = 0;
+	size_t offset = 0, chunk_size = 0, n, pos;
+	uint32_t boundary;
+
+	array_clear(boundaries);
+	while (offset < size) {
+		n = I_MIN(piece_size, size - offset);
+		if (fs_chunk_find_boundary(params, &hash, chunk_size,
+					   data + offset, n, &pos)) {
+			boundary = offset + pos;
+			array_append(boundaries, &boundary, 1);
+			chunk_size = 0;
+		} else {
+			chunk_size += pos;
+		}
+		offset += pos;
+	}
+}
+
+static void test_fs_chunk_find_boundary(void)
+{
+	struct fs_chunk_params params;
+	ARRAY_TYPE(uint32_t) boundaries, boundaries2;
+	const uint32_t *b, *b2;
+	buffer_t *buf, *buf2;
+	unsigned int i, j, count, count2;
+	uint32_t prev = 0;
+
+	test_begin("fs chunk find boundary");
+	fs_chunk_params_init(&params, TEST_AVG_SIZE);
+	test_assert(params.min_size <= TEST_AVG_SIZE &&
+		    params.max_size >= TEST_AVG_SIZE);
+
+	test_rand_state = 2463534242U;
+	buf = buffer_create_dynamic(default_pool, 65536);
+	test_fill_random(buf, 65536);
+	t_array_init(&boundaries, 512);
+	t_array_init(&boundaries2, 512);
+
+	/* all the chunks are within the size limits */
+	test_get_boundaries(&params, buf->data, buf->used, buf->used,
+			    &boundaries);
+	b = array_get(&boundaries, &count);
+	test_assert(count > 65536 / params.max_size &&
+		    count < 65536 / params.min_size);
+	for (i = 0; i < count; i++) {
+		test_assert(b[i] - prev >= params.min_size &&
+			    b[i] - prev <= params.max_size);
+		prev = b[i];
+	}
+
+	/* the boundaries don't depend on how the data is split */
+	for (i = 1; i < 200; i += 37) {
+		test_get_boundaries(&params, buf->data, buf->used, i,
+				    &boundaries2);
+		b2 = array_get(&boundaries2, &count2);
+		test_assert(count2 == count &&
+			    memcmp(b, b2, sizeof(*b) * count) == 0);
+	}
+
+	/* inserting a byte changes only the nearby boundaries */
+	buf2 = buffer_create_dynamic(default_pool, 65537);
+	buffer_append(buf2, buf->data, 30000);
+	buffer_append_c(buf2, 'x');
+	buffer_append(buf2, CONST_PTR_OFFSET(buf->data, 30000),
+		      buf->used - 30000);
+	test_get_boundaries(&params, buf2->data, buf2->used, buf2->used,
+			    &boundaries2);
+	b2 = array_get(&boundaries2, &count2);
+	for (i = 0; i < count && b[i] < 30000; i++)
+		test_assert(b2[i] == b[i]);
+	for (i = 0; b[i] < 30000 + params.max_size * 4; i++) ;
+	for (j = 0; b2[j] < 30001 + params.max_size * 4; j++) ;
+	test_assert(count - i == count2 - j);
+	for (; i < count && j < count2; i++, j++)
+		test_assert(b2[j] == b[i] + 1);
+
+	buffer_free(&buf);
+	buffer_free(&buf2);
+	test_end();
+}
+
+static struct fs *test_fs_init(void)
+{
+	struct fs_settings set;
+	struct fs *fs;
+	const char *error;
+
+	memset(&set, 0, sizeof(set));
+	set.root_path = TEST_DIR;
+	set.temp_dir = TEST_DIR;
+	if (fs_init("chunk", t_strdup_printf("avg_size=%u:posix",
+					     TEST_AVG_SIZE),
+		    &set, &fs, &error) < 0)
+		i_fatal("fs_init() failed: %s", error);
+	return fs;
+}
+
+static int
+test_fs_write(struct fs *fs, const char *name, const buffer_t *buf,
+	      enum fs_open_mode mode)
+{
+	struct fs_file *file;
+	int ret;
+
+	file = fs_file_init(fs, t_strconcat(TEST_DIR"/", name, NULL), mode);
+	ret = fs_write(file, buf->data, buf->used);
+	fs_file_deinit(&file);
+	return ret;
+}
+
+static bool test_fs_equals(struct fs *fs, const char *name, const buffer_t *buf)
+{
+	struct fs_file *file;
+	struct istream *input;
+	struct stat st;
+	const unsigned char *data;
+	size_t size;
+	bool ret;
+
+	file = fs_file_init(fs, t_strconcat(TEST_DIR"/", name, NULL),
+			    FS_OPEN_MODE_READONLY);
+	input = fs_read_stream(file, buf->used + IO_BLOCK_SIZE);
+	while (i_stream_read(input) > 0) ;
+	data = i_stream_get_data(input, &size);
+	ret = input->stream_errno == 0 && size == buf->used &&
+		memcmp(data, buf->data, size) == 0;
+	i_stream_unref(&input);
+	if (fs_stat(file, &st) < 0 || st.st_size != (off_t)buf->used)
+		ret = FALSE;
+	fs_file_deinit(&file);
+	return ret;
+}
+
+static int
+test_fs_copy(struct fs *fs, const char *src_name, const char *dest_name,
+	     bool rename)
+{
+	struct fs_file *src, *dest;
+	int ret;
+
+	src = fs_file_init(fs, t_strconcat(TEST_DIR"/", src_name, NULL),
+			   FS_OPEN_MODE_READONLY);
+	dest = fs_file_init(fs, t_strconcat(TEST_DIR"/", dest_name, NULL),
+			    FS_OPEN_MODE_REPLACE);
+	ret = rename ? fs_rename(src, dest) : fs_copy(src, dest);
+	fs_file_deinit(&src);
+	fs_file_deinit(&dest);
+	return ret;
+}
+
+static int test_fs_delete(struct fs *fs, const char *name)
+{
+	struct fs_file *file;
+	int ret;
+
+	file = fs_file_init(fs, t_strconcat(TEST_DIR"/", name, NULL),
+			    FS_OPEN_MODE_READONLY);
+	ret = fs_delete(file);
+	fs_file_deinit(&file);
+	return ret;
+}
+
+/* Returns the number of name.<idx> refs. */
+static unsigned int test_ref_count(const char *name)
+{
+	const char *path;
+	struct stat st;
+	unsigned int i, j;
+
+	for (i = 0;; i++) {
+		path = t_strdup_printf(TEST_DIR"/%s.%u", name, i);
+		if (stat(path, &st) < 0)
+			break;
+	}
+	/* there are no gaps or leftovers after the last ref */
+	for (j = i + 1; j < i + 64; j++) {
+		path = t_strdup_printf(TEST_DIR"/%s.%u", name, j);
+		if (stat(path, &st) == 0)
+			return UINT_MAX;
+	}
+	return i;
+}
+
+/* Returns the number of chunks, or UINT_MAX if some of them aren't
+   referenced by any file. */
+static unsigned int test_chunk_count(const char *dir)
+{
+	DIR *dirp;
+	struct dirent *d;
+	struct stat st;
+	const char *path;
+	unsigned int n, count = 0;
+
+	dirp = opendir(dir);
+	if (dirp == NULL)
+		return 0;
+	while ((d = readdir(dirp)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		path = t_strconcat(dir, "/", d->d_name, NULL);
+		if (stat(path, &st) < 0)
+			i_fatal("stat(%s) failed: %m", path);
+		if (S_ISDIR(st.st_mode)) {
+			n = test_chunk_count(path);
+			count = n == UINT_MAX || count == UINT_MAX ?
+				UINT_MAX : count + n;
+		} else if (st.st_nlink < 2) {
+			count = UINT_MAX;
+		} else if (count != UINT_MAX) {
+			count++;
+		}
+	}
+	(void)closedir(dirp);
+	return count;
+}
+
+static const char *test_fs_iter(struct fs *fs, enum fs_iter_flags flags)
+{
+	struct fs_iter *iter;
+	const char *fname, *const *names;
+	ARRAY_TYPE(const_string) list;
+
+	t_array_init(&list, 8);
+	iter = fs_iter_init(fs, TEST_DIR, flags);
+	while ((fname = fs_iter_next(iter)) != NULL) {
+		fname = t_strdup(fname);
+		array_append(&list, &fname, 1);
+	}
+	test_assert(fs_iter_deinit(&iter) == 0);
+	array_sort(&list, i_strcmp_p);
+	array_append_zero(&list);
+	names = array_idx(&list, 0);
+	return t_strarray_join(names, ",");
+}
+
+static void test_fs_chunk_file(void)
+{
+	struct fs *fs;
+	struct fs_file *file;
+	buffer_t *data1, *data2, *data3;
+	unsigned int refs1, count1;
+
+	test_begin("fs chunk file");
+	(void)unlink_directory(TEST_DIR, TRUE);
+	fs = test_fs_init();
+
+	test_rand_state = 88172645U;
+	data1 = buffer_create_dynamic(default_pool, 20000);
+	test_fill_random(data1, 20000);
+	data2 = buffer_create_dynamic(default_pool, 20001);
+	buffer_append(data2, data1->data, 10000);
+	buffer_append_c(data2, 'x');
+	buffer_append(data2, CONST_PTR_OFFSET(data1->data, 10000), 10000);
+	data3 = buffer_create_dynamic(default_pool, 10000);
+	test_fill_random(data3, 10000);
+
+	/* write and read back */
+	test_assert(test_fs_write(fs, "a", data1, FS_OPEN_MODE_REPLACE) == 0);
+	test_assert(test_fs_equals(fs, "a", data1));
+	refs1 = test_ref_count("a");
+	count1 = test_chunk_count(TEST_DIR"/chunks");
+	test_assert(refs1 > 20000 / (TEST_AVG_SIZE*4) && refs1 != UINT_MAX);
+	test_assert(count1 <= refs1);
+
+	/* a similar file shares most of the chunks */
+	test_assert(test_fs_write(fs, "b", data2, FS_OPEN_MODE_REPLACE) == 0);
+	test_assert(test_fs_equals(fs, "b", data2));
+	test_assert(test_chunk_count(TEST_DIR"/chunks") < count1 + 10);
+
+	/* overwriting with a shorter file drops the old refs and the chunks
+	   that only they used */
+	buffer_set_used_size(data1, 3000);
+	test_assert(test_fs_write(fs, "a", data1, FS_OPEN_MODE_REPLACE) == 0);
+	test_assert(test_fs_equals(fs, "a", data1));
+	test_assert(test_ref_count("a") < refs1);
+	test_assert(test_chunk_count(TEST_DIR"/chunks") != UINT_MAX);
+
+	/* creating an existing file fails without breaking it */
+	test_assert(test_fs_write(fs, "b", data3, FS_OPEN_MODE_CREATE) < 0 &&
+		    errno == EEXIST);
+	test_assert(test_fs_equals(fs, "b", data2));
+
+	/* copying and renaming over existing files */
+	test_assert(test_fs_copy(fs, "a", "b", FALSE) == 0);
+	test_assert(test_fs_equals(fs, "a", data1));
+	test_assert(test_fs_equals(fs, "b", data1));
+	test_assert(test_ref_count("b") == test_ref_count("a"));
+	test_assert(test_chunk_count(TEST_DIR"/chunks") != UINT_MAX);
+
+	test_assert(test_fs_write(fs, "c", data3, FS_OPEN_MODE_REPLACE) == 0);
+	test_assert(test_fs_copy(fs, "c", "b", TRUE) == 0);
+	test_assert(test_fs_equals(fs, "b", data3));
+	test_assert(test_ref_count("c") == 0);
+	test_assert(test_fs_copy(fs, "a", "b", TRUE) == 0);
+	test_assert(test_fs_equals(fs, "b", data1));
+	test_assert(test_ref_count("a") == 0);
+	test_assert(test_chunk_count(TEST_DIR"/chunks") != UINT_MAX);
+
+	/* the refs and the chunks aren't visible */
+	test_assert(test_fs_write(fs, "a", data2, FS_OPEN_MODE_REPLACE) == 0);
+	test_assert(strcmp(test_fs_iter(fs, 0), "a,b") == 0);
+	test_assert(strcmp(test_fs_iter(fs, FS_ITER_FLAG_DIRS), "") == 0);
+
+	/* deleting leaves nothing behind */
+	test_assert(test_fs_delete(fs, "a") == 0);
+	test_assert(test_fs_delete(fs, "b") == 0);
+	test_assert(test_ref_count("a") == 0 && test_ref_count("b") == 0);
+	test_assert(test_chunk_count(TEST_DIR) == 0);
+
+	/* APPEND isn't supported, but the file still has a path */
+	file = fs_file_init(fs, TEST_DIR"/d", FS_OPEN_MODE_APPEND);
+	test_assert(strcmp(fs_file_path(file), TEST_DIR"/d") == 0);
+	fs_file_deinit(&file);
+
+	buffer_free(&data1);
+	buffer_free(&data2);
+	buffer_free(&data3);
+	fs_deinit(&fs);
+	(void)unlink_directory(TEST_DIR, TRUE);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_fs_chunk_find_boundary,
+		test_fs_chunk_file,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -7,7 +7,11 @@
 
 struct imapc_client_connection {
 	struct imapc_connection *conn;
-	struct imapc_client_mailbox *box;
+	/* Number of mailboxes using this connection */
+	unsigned int box_count;
+	/* Mailbox whose SELECT was the last one queued to this connection.
+	   Commands for other mailboxes need to SELECT their mailbox first. */
+	struct imapc_client_mailbox *queued_box;
 };
 
 struct imapc_client {
@@ -28,11 +32,14 @@ struct imapc_client {
 struct imapc_client_mailbox {
 	struct imapc_client *client;
 	struct imapc_connection *conn;
+	struct imapc_client_connection *client_conn;
 	struct imapc_msgmap *msgmap;
 	struct timeout *to_send_idle;
 
 	void (*reopen_callback)(void *context);
 	void *reopen_context;
+	void (*reselect_callback)(void *context);
+	void *reselect_context;
 
 	void *untagged_box_context;
 	unsigned int pending_box_command_count;
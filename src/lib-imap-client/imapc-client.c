@@ -68,6 +68,7 @@ imapc_client_init(const struct imapc_client_settings *set)
 		IMAPC_DEFAULT_CONNECT_TIMEOUT_MSECS;
 	client->set.cmd_timeout_msecs = set->cmd_timeout_msecs != 0 ?
 		set->cmd_timeout_msecs : IMAPC_DEFAULT_COMMAND_TIMEOUT_MSECS;
+	client->set.max_connections = set->max_connections;
 	client->set.throttle_set = set->throttle_set;
 
 	if (client->set.throttle_set.init_msecs == 0)
@@ -217,13 +218,20 @@ imapc_client_add_connection(struct imapc_client *client)
 static struct imapc_connection *
 imapc_client_find_connection(struct imapc_client *client)
 {
-	struct imapc_client_connection *const *connp;
+	struct imapc_client_connection *const *conns;
+	unsigned int i, count;
 
-	/* FIXME: stupid algorithm */
-	if (array_count(&client->conns) == 0)
+	conns = array_get(&client->conns, &count);
+	if (count == 0)
 		return imapc_client_add_connection(client)->conn;
-	connp = array_idx(&client->conns, 0);
-	return (*connp)->conn;
+
+	/* prefer a connection without a selected mailbox, so the command
+	   doesn't need to interrupt IDLE */
+	for (i = 0; i < count; i++) {
+		if (imapc_connection_get_mailbox(conns[i]->conn) == NULL)
+			return conns[i]->conn;
+	}
+	return conns[0]->conn;
 }
 
 struct imapc_command *
@@ -237,17 +245,28 @@ imapc_client_cmd(struct imapc_client *client,
 }
 
 static struct imapc_client_connection *
-imapc_client_get_unboxed_connection(struct imapc_client *client)
+imapc_client_get_mailbox_connection(struct imapc_client *client)
 {
-	struct imapc_client_connection *const *conns;
+	struct imapc_client_connection *const *conns, *conn;
 	unsigned int i, count;
 
 	conns = array_get(&client->conns, &count);
 	for (i = 0; i < count; i++) {
-		if (conns[i]->box == NULL)
+		if (conns[i]->box_count == 0)
 			return conns[i];
 	}
-	return imapc_client_add_connection(client);
+	if (client->set.max_connections == 0 ||
+	    count < client->set.max_connections)
+		return imapc_client_add_connection(client);
+
+	/* connection limit reached. share the connection that has the
+	   fewest mailboxes. */
+	conn = conns[0];
+	for (i = 1; i < count; i++) {
+		if (conns[i]->box_count < conn->box_count)
+			conn = conns[i];
+	}
+	return conn;
 }
 
 
@@ -272,8 +291,11 @@ imapc_client_mailbox_open(struct imapc_client *client,
 	box = i_new(struct imapc_client_mailbox, 1);
 	box->client = client;
 	box->untagged_box_context = untagged_box_context;
-	conn = imapc_client_get_unboxed_connection(client);
-	conn->box = box;
+	conn = imapc_client_get_mailbox_connection(client);
+	conn->box_count++;
+	/* the caller SELECTs the mailbox next */
+	conn->queued_box = box;
+	box->client_conn = conn;
 	box->conn = conn->conn;
 	box->msgmap = imapc_msgmap_init();
 	return box;
@@ -287,6 +309,14 @@ void imapc_client_mailbox_set_reopen_cb(struct imapc_client_mailbox *box,
 	box->reopen_context = context;
 }
 
+void imapc_client_mailbox_set_reselect_cb(struct imapc_client_mailbox *box,
+					  void (*callback)(void *context),
+					  void *context)
+{
+	box->reselect_callback = callback;
+	box->reselect_context = context;
+}
+
 static void
 imapc_client_reconnect_cb(const struct imapc_command_reply *reply,
 			  void *context)
@@ -298,6 +328,7 @@ imapc_client_reconnect_cb(const struct imapc_command_reply *reply,
 
 	if (reply->state == IMAPC_COMMAND_STATE_OK) {
 		/* reopen the mailbox */
+		box->client_conn->queued_box = box;
 		box->reopen_callback(box->reopen_context);
 	} else {
 		imapc_connection_abort_commands(box->conn, NULL, FALSE);
@@ -328,7 +359,6 @@ void imapc_client_mailbox_reconnect(struct imapc_client_mailbox *box)
 void imapc_client_mailbox_close(struct imapc_client_mailbox **_box)
 {
 	struct imapc_client_mailbox *box = *_box;
-	struct imapc_client_connection *const *connp;
 
 	box->closing = TRUE;
 
@@ -345,12 +375,10 @@ void imapc_client_mailbox_close(struct imapc_client_mailbox **_box)
 	   reference this box */
 	*_box = NULL;
 
-	array_foreach(&box->client->conns, connp) {
-		if ((*connp)->box == box) {
-			(*connp)->box = NULL;
-			break;
-		}
-	}
+	i_assert(box->client_conn->box_count > 0);
+	box->client_conn->box_count--;
+	if (box->client_conn->queued_box == box)
+		box->client_conn->queued_box = NULL;
 
 	imapc_msgmap_deinit(&box->msgmap);
 	if (box->to_send_idle != NULL)
@@ -362,10 +390,19 @@ struct imapc_command *
 imapc_client_mailbox_cmd(struct imapc_client_mailbox *box,
 			 imapc_command_callback_t *callback, void *context)
 {
+	struct imapc_client_connection *conn = box->client_conn;
 	struct imapc_command *cmd;
 
 	i_assert(!box->closing);
 
+	if (conn->queued_box != box && box->reselect_callback != NULL) {
+		/* the connection is shared with other mailboxes, and one of
+		   them was selected after us. SELECT this mailbox again
+		   before sending the command. */
+		conn->queued_box = box;
+		box->reselect_callback(box->reselect_context);
+	}
+
 	cmd = imapc_connection_cmd(box->conn, callback, context);
 	imapc_command_set_mailbox(cmd, box);
 	return cmd;
@@ -406,13 +443,23 @@ bool imapc_client_mailbox_is_opened(struct imapc_client_mailbox *box)
 
 	selected_box = imapc_connection_get_mailbox(box->conn);
 	if (selected_box != box) {
-		if (selected_box != NULL)
+		if (selected_box != NULL && box->client_conn->box_count == 1)
 			i_error("imapc: Selected mailbox changed unexpectedly");
 		return FALSE;
 	}
 	return TRUE;
 }
 
+bool imapc_client_mailbox_is_unselected(struct imapc_client_mailbox *box)
+{
+	if (box->closing ||
+	    imapc_connection_get_state(box->conn) != IMAPC_CONNECTION_STATE_DONE)
+		return FALSE;
+
+	return box->client_conn->queued_box != box &&
+		box->reselect_callback != NULL;
+}
+
 enum imapc_capability
 imapc_client_get_capabilities(struct imapc_client *client)
 {
@@ -89,6 +89,11 @@ struct imapc_client_settings {
 	/* Timeout for IMAP commands. Reset every time more data is being
 	   sent or received. 0 = default. */
 	unsigned int cmd_timeout_msecs;
+	/* Maximum number of connections this client opens. When the limit
+	   is reached, opening a new mailbox shares one of the existing
+	   connections and switches between the mailboxes with SELECT.
+	   0 = unlimited. */
+	unsigned int max_connections;
 
 	struct imapc_throttling_settings throttle_set;
 };
@@ -182,6 +187,12 @@ imapc_client_mailbox_open(struct imapc_client *client,
 void imapc_client_mailbox_set_reopen_cb(struct imapc_client_mailbox *box,
 					void (*callback)(void *context),
 					void *context);
+/* Called before sending a command for the mailbox when another mailbox
+   sharing the connection was selected after it. The callback needs to send
+   the SELECT/EXAMINE. The msgmap is preserved. */
+void imapc_client_mailbox_set_reselect_cb(struct imapc_client_mailbox *box,
+					  void (*callback)(void *context),
+					  void *context);
 void imapc_client_mailbox_close(struct imapc_client_mailbox **box);
 bool imapc_client_mailbox_can_reconnect(struct imapc_client_mailbox *box);
 void imapc_client_mailbox_reconnect(struct imapc_client_mailbox *box);
@@ -192,7 +203,12 @@ struct imapc_msgmap *
 imapc_client_mailbox_get_msgmap(struct imapc_client_mailbox *box);
 
 void imapc_client_mailbox_idle(struct imapc_client_mailbox *box);
+/* Returns TRUE if the mailbox is currently selected in its connection. */
 bool imapc_client_mailbox_is_opened(struct imapc_client_mailbox *box);
+/* Returns TRUE if the mailbox is open, but another mailbox sharing the
+   connection is currently selected. The mailbox is SELECTed again before
+   its next command is sent. */
+bool imapc_client_mailbox_is_unselected(struct imapc_client_mailbox *box);
 
 enum imapc_capability
 imapc_client_get_capabilities(struct imapc_client *client);
@@ -1298,9 +1298,9 @@ static int imapc_connection_input_tagged(struct imapc_connection *conn)
 
 	if (reply.state == IMAPC_COMMAND_STATE_NO &&
 	    (cmd->flags & IMAPC_COMMAND_FLAG_SELECT) != 0 &&
-	    conn->selected_box != NULL) {
+	    imapc_connection_get_mailbox(conn) == cmd->box) {
 		/* EXAMINE/SELECT failed: mailbox is no longer selected */
-		imapc_connection_unselect(conn->selected_box);
+		imapc_connection_unselect(cmd->box);
 	}
 
 	imapc_connection_input_reset(conn);
@@ -1910,6 +1910,15 @@ static void imapc_command_send_more(struct imapc_connection *conn)
 	} else if (cmd->send_pos == 0 &&
 		   (cmd->flags & IMAPC_COMMAND_FLAG_SELECT) != 0) {
 		/* SELECT/EXAMINE command */
+		if (imapc_connection_get_mailbox(conn) != NULL &&
+		    imapc_connection_get_mailbox(conn) != cmd->box &&
+		    array_count(&conn->cmd_wait_list) > 0) {
+			/* switching to another mailbox in a shared
+			   connection. wait for the replies to the previous
+			   mailbox's commands, so their untagged replies
+			   aren't mixed with the new mailbox's. */
+			return;
+		}
 		imapc_connection_set_selecting(cmd->box);
 	} else if (!imapc_client_mailbox_is_opened(cmd->box)) {
 		if (cmd->box->reconnecting) {
@@ -1989,6 +1998,8 @@ static void imapc_connection_send_idle_done(struct imapc_connection *conn)
 static void imapc_connection_cmd_send(struct imapc_command *cmd)
 {
 	struct imapc_connection *conn = cmd->conn;
+	struct imapc_command *const *cmds;
+	unsigned int i, count;
 
 	imapc_connection_send_idle_done(conn);
 
@@ -2001,10 +2012,16 @@ static void imapc_connection_cmd_send(struct imapc_command *cmd)
 	}
 
 	if ((cmd->flags & IMAPC_COMMAND_FLAG_SELECT) != 0 &&
-	    conn->selected_box == NULL) {
-		/* reopening the mailbox. add it before other
-		   queued commands. */
-		array_insert(&conn->cmd_send_queue, 0, &cmd, 1);
+	    imapc_connection_get_mailbox(conn) == NULL) {
+		/* reopening the mailbox. add it before the mailbox's other
+		   queued commands. if the connection is shared, other
+		   mailboxes' commands must stay before it. */
+		cmds = array_get(&conn->cmd_send_queue, &count);
+		for (i = 0; i < count; i++) {
+			if (cmds[i]->box == cmd->box)
+				break;
+		}
+		array_insert(&conn->cmd_send_queue, i, &cmd, 1);
 	} else {
 		array_append(&conn->cmd_send_queue, &cmd, 1);
 	}
@@ -2173,10 +2190,12 @@ void imapc_connection_unselect(struct imapc_client_mailbox *box)
 {
 	struct imapc_connection *conn = box->conn;
 
-	if (conn->selected_box != NULL || conn->selecting_box != NULL) {
-		i_assert(conn->selected_box == box ||
-			 conn->selecting_box == box);
-
+	if (conn->selected_box == box && conn->selecting_box != NULL &&
+	    conn->selecting_box != box) {
+		/* another mailbox sharing the connection is being selected.
+		   the server sends [CLOSED] once this mailbox is closed. */
+		conn->selected_box = NULL;
+	} else if (conn->selected_box == box || conn->selecting_box == box) {
 		conn->selected_box = NULL;
 		conn->selecting_box = NULL;
 	}
@@ -0,0 +1,389 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "array.h"
+#include "net.h"
+#include "str.h"
+#include "istream.h"
+#include "write-full.h"
+#include "imapc-client-private.h"
+#include "test-common.h"
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+struct test_server_conn {
+	unsigned int id;
+	int fd;
+	struct istream *input;
+	struct io *io;
+};
+
+struct test_mailbox {
+	const char *name;
+	struct imapc_client_mailbox *box;
+	unsigned int reopen_count, reselect_count;
+};
+
+static int test_server_listen_fd, test_server_log_fd;
+static unsigned int test_server_conn_count;
+static unsigned int test_server_port;
+static pid_t test_server_pid;
+static unsigned int test_pending_cmd_count;
+
+static void test_server_send(struct test_server_conn *conn, const char *str)
+{
+	if (write_full(conn->fd, str, strlen(str)) < 0)
+		i_fatal("write() failed: %m");
+}
+
+static void test_server_disconnect(struct test_server_conn *conn)
+{
+	io_remove(&conn->io);
+	i_stream_unref(&conn->input);
+	i_close_fd(&conn->fd);
+	i_free(conn);
+}
+
+static void
+test_server_command(struct test_server_conn *conn, const char *line)
+{
+	const char *const *args = t_strsplit(line, " ");
+	const char *tag = args[0], *cmd = args[1];
+
+	if (cmd == NULL)
+		return;
+	if (strcasecmp(cmd, "SELECT") == 0 || strcasecmp(cmd, "EXAMINE") == 0 ||
+	    strcasecmp(cmd, "NOOP") == 0) {
+		/* log the commands before replying to them, so the client
+		   sees them once it has the reply */
+		const char *str = t_strdup_printf("%u %s\n", conn->id,
+						  line + strlen(tag) + 1);
+		if (write_full(test_server_log_fd, str, strlen(str)) < 0)
+			i_fatal("write(log) failed: %m");
+	}
+
+	if (strcasecmp(cmd, "SELECT") == 0 || strcasecmp(cmd, "EXAMINE") == 0) {
+		test_server_send(conn, t_strdup_printf(
+			"* 0 EXISTS\r\n"
+			"* OK [UIDVALIDITY 1] UIDs valid\r\n"
+			"* OK [UIDNEXT 1] Predicted next UID\r\n"
+			"%s OK [READ-WRITE] Selected\r\n", tag));
+	} else if (strcasecmp(cmd, "CAPABILITY") == 0) {
+		test_server_send(conn, t_strdup_printf(
+			"* CAPABILITY IMAP4rev1\r\n"
+			"%s OK Done\r\n", tag));
+	} else {
+		test_server_send(conn, t_strdup_printf("%s OK Done\r\n", tag));
+	}
+}
+
+static void test_server_input(struct test_server_conn *conn)
+{
+	const char *line;
+
+	while ((line = i_stream_read_next_line(conn->input)) != NULL) T_BEGIN {
+		test_server_command(conn, line);
+	} T_END;
+	if (conn->input->eof || conn->input->stream_errno != 0)
+		test_server_disconnect(conn);
+}
+
+static void test_server_accept(void *context ATTR_UNUSED)
+{
+	struct test_server_conn *conn;
+	int fd;
+
+	fd = net_accept(test_server_listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	conn = i_new(struct test_server_conn, 1);
+	conn->id = ++test_server_conn_count;
+	conn->fd = fd;
+	net_set_nonblock(fd, TRUE);
+	conn->input = i_stream_create_fd(fd, 1024, FALSE);
+	conn->io = io_add(fd, IO_READ, test_server_input, conn);
+	test_server_send(conn, "* OK [CAPABILITY IMAP4rev1] Ready\r\n");
+}
+
+static void test_server_run(void)
+{
+	struct ioloop *ioloop;
+	struct io *io;
+
+	ioloop = io_loop_create();
+	io = io_add(test_server_listen_fd, IO_READ, test_server_accept, NULL);
+	io_loop_run(ioloop);
+	io_remove(&io);
+	io_loop_destroy(&ioloop);
+}
+
+static struct ioloop *test_server_start(void)
+{
+	struct ip_addr ip;
+	int log_fd[2];
+
+	if (net_addr2ip("127.0.0.1", &ip) < 0)
+		i_unreached();
+	test_server_port = 0;
+	test_server_listen_fd = net_listen(&ip, &test_server_port, 128);
+	if (test_server_listen_fd == -1)
+		i_fatal("listen(127.0.0.1) failed: %m");
+	if (pipe(log_fd) < 0)
+		i_fatal("pipe() failed: %m");
+
+	switch ((test_server_pid = fork())) {
+	case -1:
+		i_fatal("fork() failed: %m");
+	case 0:
+		i_close_fd(&log_fd[0]);
+		test_server_log_fd = log_fd[1];
+		test_server_run();
+		_exit(0);
+	default:
+		i_close_fd(&log_fd[1]);
+		test_server_log_fd = log_fd[0];
+		i_close_fd(&test_server_listen_fd);
+		break;
+	}
+	return io_loop_create();
+}
+
+/* Destroy the client's ioloop, stop the server and return the SELECT,
+   EXAMINE and NOOP commands it received, prefixed with the connection
+   number. */
+static const char *test_server_stop(struct ioloop **ioloop)
+{
+	string_t *log = t_str_new(256);
+	char buf[1024];
+	ssize_t ret;
+
+	io_loop_destroy(ioloop);
+	if (kill(test_server_pid, SIGKILL) < 0)
+		i_fatal("kill() failed: %m");
+	if (waitpid(test_server_pid, NULL, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+
+	while ((ret = read(test_server_log_fd, buf, sizeof(buf))) > 0)
+		str_append_n(log, buf, ret);
+	if (ret < 0)
+		i_fatal("read(log) failed: %m");
+	i_close_fd(&test_server_log_fd);
+	return str_c(log);
+}
+
+static void
+test_command_callback(const struct imapc_command_reply *reply,
+		      void *context)
+{
+	struct imapc_client *client = context;
+
+	test_assert(reply->state == IMAPC_COMMAND_STATE_OK);
+	i_assert(test_pending_cmd_count > 0);
+	if (--test_pending_cmd_count == 0)
+		imapc_client_stop(client);
+}
+
+static void test_client_run(struct imapc_client *client)
+{
+	while (test_pending_cmd_count > 0)
+		imapc_client_run(client);
+}
+
+static struct imapc_client *test_client_init(unsigned int max_connections)
+{
+	struct imapc_client_settings set;
+	struct imapc_client *client;
+
+	memset(&set, 0, sizeof(set));
+	set.host = "127.0.0.1";
+	set.port = test_server_port;
+	set.username = "testuser";
+	set.password = "testpass";
+	set.dns_client_socket_path = "";
+	set.temp_path_prefix = "";
+	set.rawlog_dir = "";
+	set.max_idle_time = 60;
+	set.connect_timeout_msecs = 5000;
+	set.cmd_timeout_msecs = 5000;
+	set.max_connections = max_connections;
+	client = imapc_client_init(&set);
+
+	test_pending_cmd_count++;
+	imapc_client_login(client, test_command_callback, client);
+	test_client_run(client);
+	return client;
+}
+
+static void test_mailbox_select(struct test_mailbox *tbox)
+{
+	struct imapc_command *cmd;
+
+	cmd = imapc_client_mailbox_cmd(tbox->box, test_command_callback,
+				       tbox->box->client);
+	imapc_command_set_flags(cmd, IMAPC_COMMAND_FLAG_SELECT);
+	imapc_command_sendf(cmd, "SELECT %s", tbox->name);
+	test_pending_cmd_count++;
+}
+
+static void test_mailbox_reopen(void *context)
+{
+	struct test_mailbox *tbox = context;
+
+	tbox->reopen_count++;
+	test_mailbox_select(tbox);
+}
+
+static void test_mailbox_reselect(void *context)
+{
+	struct test_mailbox *tbox = context;
+
+	tbox->reselect_count++;
+	test_mailbox_select(tbox);
+}
+
+static void
+test_mailbox_open(struct imapc_client *client, struct test_mailbox *tbox,
+		  const char *name)
+{
+	memset(tbox, 0, sizeof(*tbox));
+	tbox->name = name;
+	tbox->box = imapc_client_mailbox_open(client, NULL);
+	imapc_client_mailbox_set_reopen_cb(tbox->box,
+					   test_mailbox_reopen, tbox);
+	imapc_client_mailbox_set_reselect_cb(tbox->box,
+					     test_mailbox_reselect, tbox);
+	test_mailbox_select(tbox);
+	test_client_run(client);
+}
+
+static void test_mailbox_noop(struct test_mailbox *tbox)
+{
+	struct imapc_command *cmd;
+
+	cmd = imapc_client_mailbox_cmd(tbox->box, test_command_callback,
+				       tbox->box->client);
+	imapc_command_send(cmd, "NOOP");
+	test_pending_cmd_count++;
+	test_client_run(tbox->box->client);
+}
+
+static void test_imapc_client_shared_connection(void)
+{
+	struct ioloop *ioloop;
+	struct imapc_client *client;
+	struct test_mailbox box1, box2;
+
+	test_begin("imapc client shared connection");
+	ioloop = test_server_start();
+	client = test_client_init(1);
+
+	test_mailbox_open(client, &box1, "box1");
+	test_mailbox_open(client, &box2, "box2");
+	test_assert(array_count(&client->conns) == 1);
+	test_assert(box1.box->conn == box2.box->conn);
+	test_assert(!imapc_client_mailbox_is_opened(box1.box));
+	test_assert(imapc_client_mailbox_is_unselected(box1.box));
+	test_assert(imapc_client_mailbox_is_opened(box2.box));
+	test_assert(!imapc_client_mailbox_is_unselected(box2.box));
+
+	/* switching back selects the mailbox again, without reopening */
+	test_mailbox_noop(&box1);
+	test_assert(box1.reselect_count == 1 && box1.reopen_count == 0);
+	test_assert(imapc_client_mailbox_is_opened(box1.box));
+	test_assert(!imapc_client_mailbox_is_opened(box2.box));
+	test_assert(imapc_client_mailbox_is_unselected(box2.box));
+
+	/* no switch needed */
+	test_mailbox_noop(&box1);
+	test_assert(box1.reselect_count == 1);
+
+	test_mailbox_noop(&box2);
+	test_assert(box2.reselect_count == 1 && box2.reopen_count == 0);
+
+	imapc_client_mailbox_close(&box1.box);
+	imapc_client_mailbox_close(&box2.box);
+	imapc_client_deinit(&client);
+	test_assert(strcmp(test_server_stop(&ioloop),
+			   "1 SELECT \"box1\"\n"
+			   "1 SELECT \"box2\"\n"
+			   "1 SELECT \"box1\"\n"
+			   "1 NOOP\n"
+			   "1 NOOP\n"
+			   "1 SELECT \"box2\"\n"
+			   "1 NOOP\n") == 0);
+	test_end();
+}
+
+static void test_imapc_client_unlimited_connections(void)
+{
+	struct ioloop *ioloop;
+	struct imapc_client *client;
+	struct test_mailbox box1, box2;
+
+	test_begin("imapc client unlimited connections");
+	ioloop = test_server_start();
+	client = test_client_init(0);
+
+	test_mailbox_open(client, &box1, "box1");
+	test_mailbox_open(client, &box2, "box2");
+	test_assert(array_count(&client->conns) == 2);
+	test_assert(imapc_client_mailbox_is_opened(box1.box));
+	test_assert(imapc_client_mailbox_is_opened(box2.box));
+
+	test_mailbox_noop(&box1);
+	test_assert(box1.reselect_count == 0);
+
+	imapc_client_mailbox_close(&box1.box);
+	imapc_client_mailbox_close(&box2.box);
+	imapc_client_deinit(&client);
+	test_assert(strcmp(test_server_stop(&ioloop),
+			   "1 SELECT \"box1\"\n"
+			   "2 SELECT \"box2\"\n"
+			   "1 NOOP\n") == 0);
+	test_end();
+}
+
+static void test_imapc_client_connection_limit_per_client(void)
+{
+	struct ioloop *ioloop;
+	struct imapc_client *client1, *client2;
+	struct test_mailbox box1, box2;
+
+	test_begin("imapc client connection limit per client");
+	ioloop = test_server_start();
+	/* the other client's connection doesn't count towards the limit */
+	client2 = test_client_init(1);
+	client1 = test_client_init(2);
+
+	test_mailbox_open(client1, &box1, "box1");
+	test_mailbox_open(client1, &box2, "box2");
+	test_assert(array_count(&client1->conns) == 2);
+	test_assert(box1.box->conn != box2.box->conn);
+	test_assert(imapc_client_mailbox_is_opened(box1.box));
+	test_assert(imapc_client_mailbox_is_opened(box2.box));
+
+	imapc_client_mailbox_close(&box1.box);
+	imapc_client_mailbox_close(&box2.box);
+	imapc_client_deinit(&client1);
+	imapc_client_deinit(&client2);
+	test_assert(strcmp(test_server_stop(&ioloop),
+			   "2 SELECT \"box1\"\n"
+			   "3 SELECT \"box2\"\n") == 0);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_imapc_client_shared_connection,
+		test_imapc_client_unlimited_connections,
+		test_imapc_client_connection_limit_per_client,
+		NULL
+	};
+
+	return test_run(test_functions);
+}
@@ -0,0 +1,459 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "mail-index-private.h"
+
+/* The bitmaps have one bit for each record. Record at seq is in word
+   (seq-1)/64 at bit (seq-1)%64. Operating on full words lets the compiler
+   vectorize the loops. */
+#define FLAGMAP_WORD_BITS 64
+#define FLAGMAP_WORD_COUNT(records_count) \
+	(((records_count) + FLAGMAP_WORD_BITS-1) / FLAGMAP_WORD_BITS)
+#define FLAGMAP_ALL_BITS ((uint64_t)-1)
+
+struct mail_index_map_flagmap {
+	/* number of records the bitmaps cover */
+	uint32_t records_count;
+	/* one bitmap for each bit in mail_index_record.flags */
+	buffer_t *flags[CHAR_BIT];
+	/* file keyword index -> bitmap, NULL if it's not built yet */
+	ARRAY(buffer_t *) keywords;
+};
+
+static buffer_t *flagmap_bits_alloc(unsigned int word_count)
+{
+	buffer_t *bits;
+
+	bits = buffer_create_dynamic(default_pool,
+				     (word_count + 1) * sizeof(uint64_t));
+	buffer_append_zero(bits, word_count * sizeof(uint64_t));
+	return bits;
+}
+
+static uint64_t *flagmap_words(buffer_t *bits)
+{
+	return buffer_get_modifiable_data(bits, NULL);
+}
+
+static void
+flagmap_bits_update_range(buffer_t *bits, uint32_t seq1, uint32_t seq2,
+			  bool set)
+{
+	uint64_t *words = flagmap_words(bits);
+	unsigned int w, w1 = (seq1-1) / FLAGMAP_WORD_BITS;
+	unsigned int w2 = (seq2-1) / FLAGMAP_WORD_BITS;
+	uint64_t mask1, mask2;
+
+	mask1 = FLAGMAP_ALL_BITS << ((seq1-1) % FLAGMAP_WORD_BITS);
+	mask2 = FLAGMAP_ALL_BITS >>
+		(FLAGMAP_WORD_BITS-1 - (seq2-1) % FLAGMAP_WORD_BITS);
+	if (w1 == w2) {
+		mask1 &= mask2;
+		mask2 = mask1;
+	}
+
+	if (set) {
+		words[w1] |= mask1;
+		for (w = w1 + 1; w < w2; w++)
+			words[w] = FLAGMAP_ALL_BITS;
+		words[w2] |= mask2;
+	} else {
+		words[w1] &= ~mask1;
+		for (w = w1 + 1; w < w2; w++)
+			words[w] = 0;
+		words[w2] &= ~mask2;
+	}
+}
+
+static void flagmap_bits_free(buffer_t **bits)
+{
+	if (*bits != NULL)
+		buffer_free(bits);
+}
+
+static void flagmap_build_flags(struct mail_index_map *map)
+{
+	struct mail_index_map_flagmap *flagmap;
+	uint64_t *dest[CHAR_BIT], cur[CHAR_BIT];
+	unsigned int i, w, word_count, first, last, idx;
+	uint8_t flags;
+
+	flagmap = i_new(struct mail_index_map_flagmap, 1);
+	flagmap->records_count = map->rec_map->records_count;
+	i_array_init(&flagmap->keywords, 8);
+
+	word_count = FLAGMAP_WORD_COUNT(flagmap->records_count);
+	for (i = 0; i < CHAR_BIT; i++) {
+		flagmap->flags[i] = flagmap_bits_alloc(word_count);
+		dest[i] = flagmap_words(flagmap->flags[i]);
+	}
+
+	for (w = 0; w < word_count; w++) {
+		memset(cur, 0, sizeof(cur));
+		first = w * FLAGMAP_WORD_BITS;
+		last = I_MIN(first + FLAGMAP_WORD_BITS,
+			     flagmap->records_count);
+		for (idx = first; idx < last; idx++) {
+			flags = MAIL_INDEX_MAP_IDX(map, idx)->flags;
+			for (i = 0; flags != 0; i++, flags >>= 1)
+				cur[i] |= (uint64_t)(flags & 1) << (idx - first);
+		}
+		for (i = 0; i < CHAR_BIT; i++)
+			dest[i][w] = cur[i];
+	}
+	map->rec_map->flagmap = flagmap;
+}
+
+static bool
+flagmap_keyword_get_data_pos(struct mail_index_map *map,
+			     unsigned int keyword_idx,
+			     unsigned int *offset_r, uint8_t *mask_r)
+{
+	const struct mail_index_ext *ext;
+	uint32_t ext_map_idx;
+
+	if (!mail_index_map_get_ext_idx(map, map->index->keywords_ext_id,
+					&ext_map_idx))
+		return FALSE;
+
+	ext = array_idx(&map->extensions, ext_map_idx);
+	if (keyword_idx / CHAR_BIT >= ext->record_size)
+		return FALSE;
+	*offset_r = ext->record_offset + keyword_idx / CHAR_BIT;
+	*mask_r = 1 << (keyword_idx % CHAR_BIT);
+	return TRUE;
+}
+
+static buffer_t *
+flagmap_get_keyword(struct mail_index_map *map, unsigned int keyword_idx)
+{
+	struct mail_index_map_flagmap *flagmap = map->rec_map->flagmap;
+	buffer_t *const *bitsp, *bits;
+	const uint8_t *data;
+	uint64_t *words;
+	unsigned int idx, offset;
+	uint8_t mask;
+
+	if (keyword_idx < array_count(&flagmap->keywords)) {
+		bitsp = array_idx(&flagmap->keywords, keyword_idx);
+		if (*bitsp != NULL)
+			return *bitsp;
+	}
+
+	bits = flagmap_bits_alloc(FLAGMAP_WORD_COUNT(flagmap->records_count));
+	if (flagmap_keyword_get_data_pos(map, keyword_idx, &offset, &mask)) {
+		words = flagmap_words(bits);
+		for (idx = 0; idx < flagmap->records_count; idx++) {
+			data = CONST_PTR_OFFSET(MAIL_INDEX_MAP_IDX(map, idx),
+						offset);
+			if ((*data & mask) != 0) {
+				words[idx / FLAGMAP_WORD_BITS] |=
+					(uint64_t)1 << (idx % FLAGMAP_WORD_BITS);
+			}
+		}
+	}
+	array_idx_set(&flagmap->keywords, keyword_idx, &bits);
+	return bits;
+}
+
+static bool
+flagmap_keyword_file_idx(struct mail_index_map *map, unsigned int idx,
+			 unsigned int *file_idx_r)
+{
+	const unsigned int *idx_map;
+	unsigned int i, count;
+
+	if (!array_is_created(&map->keyword_idx_map))
+		return FALSE;
+
+	idx_map = array_get(&map->keyword_idx_map, &count);
+	for (i = 0; i < count; i++) {
+		if (idx_map[i] == idx) {
+			*file_idx_r = i;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void
+flagmap_words_and(uint64_t *dest, const uint64_t *src, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		dest[i] &= src[i];
+}
+
+static void
+flagmap_filter_words(struct mail_index_map *map,
+		     const struct mail_index_flag_filter *filter,
+		     unsigned int first_word, uint64_t *words,
+		     unsigned int word_count)
+{
+	struct mail_index_map_flagmap *flagmap = map->rec_map->flagmap;
+	const struct mail_keywords *keywords = filter->keywords;
+	unsigned int i, file_idx;
+
+	for (i = 0; i < word_count; i++)
+		words[i] = FLAGMAP_ALL_BITS;
+
+	for (i = 0; i < CHAR_BIT; i++) {
+		if ((filter->flags & (1 << i)) != 0) {
+			flagmap_words_and(words,
+				flagmap_words(flagmap->flags[i]) + first_word,
+				word_count);
+		}
+	}
+	for (i = 0; keywords != NULL && i < keywords->count; i++) {
+		if (!flagmap_keyword_file_idx(map, keywords->idx[i],
+					      &file_idx)) {
+			/* no messages have this keyword */
+			memset(words, 0, word_count * sizeof(*words));
+			break;
+		}
+		flagmap_words_and(words,
+			flagmap_words(flagmap_get_keyword(map, file_idx)) +
+			first_word, word_count);
+	}
+}
+
+bool mail_index_map_flagmap_lookup(struct mail_index_map *map,
+				   uint32_t seq1, uint32_t seq2,
+				   const struct mail_index_flag_filter *filters,
+				   unsigned int filters_count,
+				   ARRAY_TYPE(seq_range) *seqs)
+{
+	struct mail_index_map_flagmap *flagmap = map->rec_map->flagmap;
+	uint64_t *result, *words, bits;
+	unsigned int i, w, first_word, word_count;
+	uint32_t seq;
+
+	i_assert(seq1 > 0 && seq1 <= seq2);
+	i_assert(seq2 <= map->rec_map->records_count);
+
+	if (flagmap != NULL &&
+	    flagmap->records_count != map->rec_map->records_count)
+		mail_index_map_flagmap_free(&map->rec_map->flagmap);
+	if (map->rec_map->flagmap == NULL)
+		flagmap_build_flags(map);
+
+	first_word = (seq1-1) / FLAGMAP_WORD_BITS;
+	word_count = (seq2-1) / FLAGMAP_WORD_BITS - first_word + 1;
+	result = t_new(uint64_t, word_count);
+	words = t_new(uint64_t, word_count);
+
+	for (w = 0; w < word_count; w++)
+		result[w] = FLAGMAP_ALL_BITS;
+	for (i = 0; i < filters_count; i++) {
+		flagmap_filter_words(map, &filters[i], first_word,
+				     words, word_count);
+		if (filters[i].match_not) {
+			for (w = 0; w < word_count; w++)
+				result[w] &= ~words[w];
+		} else {
+			flagmap_words_and(result, words, word_count);
+		}
+	}
+	result[0] &= FLAGMAP_ALL_BITS << ((seq1-1) % FLAGMAP_WORD_BITS);
+	result[word_count-1] &= FLAGMAP_ALL_BITS >>
+		(FLAGMAP_WORD_BITS-1 - (seq2-1) % FLAGMAP_WORD_BITS);
+
+	for (w = 0; w < word_count; w++) {
+		bits = result[w];
+		if (bits == 0)
+			continue;
+
+		seq = (first_word + w) * FLAGMAP_WORD_BITS + 1;
+		if (bits == FLAGMAP_ALL_BITS) {
+			seq_range_array_add_range(seqs, seq,
+						  seq + FLAGMAP_WORD_BITS-1);
+			continue;
+		}
+		for (; bits != 0; bits >>= 1, seq++) {
+			if ((bits & 1) != 0)
+				seq_range_array_add(seqs, seq);
+		}
+	}
+	return TRUE;
+}
+
+void mail_index_map_flagmap_append(struct mail_index_map *map)
+{
+	struct mail_index_map_flagmap *flagmap = map->rec_map->flagmap;
+	const struct mail_index_record *rec;
+	buffer_t **bitsp;
+	const uint8_t *data;
+	unsigned int i, idx, w, offset;
+	uint64_t bit;
+	uint8_t mask;
+
+	if (flagmap == NULL)
+		return;
+	if (flagmap->records_count + 1 != map->rec_map->records_count) {
+		mail_index_map_flagmap_free(&map->rec_map->flagmap);
+		return;
+	}
+
+	idx = flagmap->records_count++;
+	if (idx % FLAGMAP_WORD_BITS == 0) {
+		for (i = 0; i < CHAR_BIT; i++)
+			buffer_append_zero(flagmap->flags[i], sizeof(uint64_t));
+		array_foreach_modifiable(&flagmap->keywords, bitsp) {
+			if (*bitsp != NULL)
+				buffer_append_zero(*bitsp, sizeof(uint64_t));
+		}
+	}
+
+	w = idx / FLAGMAP_WORD_BITS;
+	bit = (uint64_t)1 << (idx % FLAGMAP_WORD_BITS);
+	rec = MAIL_INDEX_MAP_IDX(map, idx);
+	for (i = 0; i < CHAR_BIT; i++) {
+		if ((rec->flags & (1 << i)) != 0)
+			flagmap_words(flagmap->flags[i])[w] |= bit;
+	}
+	array_foreach_modifiable(&flagmap->keywords, bitsp) {
+		if (*bitsp == NULL)
+			continue;
+		i = array_foreach_idx(&flagmap->keywords, bitsp);
+		if (!flagmap_keyword_get_data_pos(map, i, &offset, &mask))
+			continue;
+		data = CONST_PTR_OFFSET(rec, offset);
+		if ((*data & mask) != 0)
+			flagmap_words(*bitsp)[w] |= bit;
+	}
+}
+
+static bool flagmap_is_usable(struct mail_index_map *map, uint32_t seq2)
+{
+	struct mail_index_map_flagmap *flagmap = map->rec_map->flagmap;
+
+	if (flagmap == NULL)
+		return FALSE;
+	if (seq2 > flagmap->records_count) {
+		/* shouldn't happen, but don't risk returning wrong data */
+		mail_index_map_flagmap_free(&map->rec_map->flagmap);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void mail_index_map_flagmap_update_flags(struct mail_index_map *map,
+					 uint32_t seq1, uint32_t seq2,
+					 uint8_t add_flags,
+					 uint8_t remove_flags)
+{
+	struct mail_index_map_flagmap *flagmap;
+	unsigned int i;
+
+	if (!flagmap_is_usable(map, seq2))
+		return;
+
+	flagmap = map->rec_map->flagmap;
+	for (i = 0; i < CHAR_BIT; i++) {
+		if ((add_flags & (1 << i)) != 0) {
+			flagmap_bits_update_range(flagmap->flags[i],
+						  seq1, seq2, TRUE);
+		} else if ((remove_flags & (1 << i)) != 0) {
+			flagmap_bits_update_range(flagmap->flags[i],
+						  seq1, seq2, FALSE);
+		}
+	}
+}
+
+void mail_index_map_flagmap_update_keyword(struct mail_index_map *map,
+					   unsigned int keyword_idx,
+					   uint32_t seq1, uint32_t seq2,
+					   bool set)
+{
+	struct mail_index_map_flagmap *flagmap;
+	buffer_t *const *bitsp;
+
+	if (!flagmap_is_usable(map, seq2))
+		return;
+
+	flagmap = map->rec_map->flagmap;
+	if (keyword_idx >= array_count(&flagmap->keywords))
+		return;
+	bitsp = array_idx(&flagmap->keywords, keyword_idx);
+	if (*bitsp != NULL)
+		flagmap_bits_update_range(*bitsp, seq1, seq2, set);
+}
+
+void mail_index_map_flagmap_reset_keywords(struct mail_index_map *map,
+					   uint32_t seq1, uint32_t seq2)
+{
+	buffer_t *const *bitsp;
+
+	if (!flagmap_is_usable(map, seq2))
+		return;
+
+	array_foreach(&map->rec_map->flagmap->keywords, bitsp) {
+		if (*bitsp != NULL)
+			flagmap_bits_update_range(*bitsp, seq1, seq2, FALSE);
+	}
+}
+
+void mail_index_map_flagmap_drop_keywords(struct mail_index_map *map)
+{
+	struct mail_index_map_flagmap *flagmap = map->rec_map->flagmap;
+	buffer_t **bitsp;
+
+	if (flagmap == NULL)
+		return;
+
+	array_foreach_modifiable(&flagmap->keywords, bitsp)
+		flagmap_bits_free(bitsp);
+	array_clear(&flagmap->keywords);
+}
+
+static buffer_t *flagmap_bits_clone(const buffer_t *src)
+{
+	buffer_t *dest;
+
+	dest = buffer_create_dynamic(default_pool,
+				     src->used + sizeof(uint64_t));
+	buffer_append_buf(dest, src, 0, (size_t)-1);
+	return dest;
+}
+
+struct mail_index_map_flagmap *
+mail_index_map_flagmap_clone(const struct mail_index_map_flagmap *flagmap)
+{
+	struct mail_index_map_flagmap *new_flagmap;
+	buffer_t *const *bitsp, *bits;
+	unsigned int i;
+
+	new_flagmap = i_new(struct mail_index_map_flagmap, 1);
+	new_flagmap->records_count = flagmap->records_count;
+	for (i = 0; i < CHAR_BIT; i++)
+		new_flagmap->flags[i] = flagmap_bits_clone(flagmap->flags[i]);
+
+	i_array_init(&new_flagmap->keywords,
+		     array_count(&flagmap->keywords) + 8);
+	array_foreach(&flagmap->keywords, bitsp) {
+		bits = *bitsp == NULL ? NULL : flagmap_bits_clone(*bitsp);
+		array_append(&new_flagmap->keywords, &bits, 1);
+	}
+	return new_flagmap;
+}
+
+void mail_index_map_flagmap_free(struct mail_index_map_flagmap **_flagmap)
+{
+	struct mail_index_map_flagmap *flagmap = *_flagmap;
+	buffer_t **bitsp;
+	unsigned int i;
+
+	if (flagmap == NULL)
+		return;
+	*_flagmap = NULL;
+
+	for (i = 0; i < CHAR_BIT; i++)
+		flagmap_bits_free(&flagmap->flags[i]);
+	array_foreach_modifiable(&flagmap->keywords, bitsp)
+		flagmap_bits_free(bitsp);
+	array_free(&flagmap->keywords);
+	i_free(flagmap);
+}
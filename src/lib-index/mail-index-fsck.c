@@ -374,6 +374,7 @@ mail_index_fsck_records(struct mail_index *index, struct mail_index_map *map,
 	if (records_dropped) {
 		/* all existing views are broken now */
 		index->inconsistency_id++;
+		mail_index_map_flagmap_free(&map->rec_map->flagmap);
 	}
 
 	if (hdr->next_uid <= last_uid) {
@@ -36,6 +36,7 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 	i_assert(rec_map->mmap_base == NULL);
 
 	buffer_free(&rec_map->buffer);
+	mail_index_map_flagmap_free(&rec_map->flagmap);
 	if (file_size > SSIZE_T_MAX) {
 		/* too large file to map into memory */
 		mail_index_set_error(index, "Index file too large: %s",
@@ -235,6 +236,7 @@ mail_index_try_read_map(struct mail_index_map *map,
 	map->rec_map->records =
 		buffer_get_modifiable_data(map->rec_map->buffer, NULL);
 	map->rec_map->records_count = records_count;
+	mail_index_map_flagmap_free(&map->rec_map->flagmap);
 
 	mail_index_map_copy_hdr(map, hdr);
 	map->hdr_base = map->hdr_copy_buf->data;
@@ -278,6 +278,7 @@ static void mail_index_record_map_free(struct mail_index_map *map,
 	array_free(&rec_map->maps);
 	if (rec_map->modseq != NULL)
 		mail_index_map_modseq_free(&rec_map->modseq);
+	mail_index_map_flagmap_free(&rec_map->flagmap);
 	i_free(rec_map);
 }
 
@@ -431,6 +432,10 @@ void mail_index_record_map_move_to_private(struct mail_index_map *map)
 		new_map = mail_index_record_map_alloc(map);
 		mail_index_map_copy_records(new_map, map->rec_map,
 					    map->hdr.record_size);
+		if (map->rec_map->flagmap != NULL) {
+			new_map->flagmap =
+				mail_index_map_flagmap_clone(map->rec_map->flagmap);
+		}
 		mail_index_record_map_unlink(map);
 		map->rec_map = new_map;
 		if (map->rec_map->modseq != NULL)
@@ -440,6 +445,7 @@ void mail_index_record_map_move_to_private(struct mail_index_map *map)
 	}
 
 	if (new_map->records_count != map->hdr.messages_count) {
+		mail_index_map_flagmap_free(&new_map->flagmap);
 		new_map->records_count = map->hdr.messages_count;
 		if (new_map->records_count == 0)
 			new_map->last_appended_uid = 0;
@@ -465,6 +471,8 @@ void mail_index_map_move_to_memory(struct mail_index_map *map)
 		new_map = mail_index_record_map_alloc(map);
 		new_map->modseq = map->rec_map->modseq == NULL ? NULL :
 			mail_index_map_modseq_clone(map->rec_map->modseq);
+		new_map->flagmap = map->rec_map->flagmap == NULL ? NULL :
+			mail_index_map_flagmap_clone(map->rec_map->flagmap);
 	}
 
 	mail_index_map_copy_records(new_map, map->rec_map,
@@ -12,6 +12,7 @@
 struct mail_transaction_header;
 struct mail_transaction_log_view;
 struct mail_index_sync_map_ctx;
+struct mail_index_map_flagmap;
 
 /* How large index files to mmap() instead of reading to memory. */
 #define MAIL_INDEX_MMAP_MIN_SIZE (1024*64)
@@ -129,6 +130,8 @@ struct mail_index_record_map {
 	unsigned int records_count;
 
 	struct mail_index_map_modseq *modseq;
+	/* flag/keyword bitmaps for the records, NULL until first needed */
+	struct mail_index_map_flagmap *flagmap;
 	uint32_t last_appended_uid;
 };
 
@@ -177,6 +180,9 @@ struct mail_index {
 	uint32_t ext_hdr_init_id;
 	void *ext_hdr_init_data;
 
+	const struct compression_handler *log_archive_handler;
+	int log_archive_level;
+
 	ARRAY(mail_index_sync_lost_handler_t *) sync_lost_handlers;
 
 	char *filepath;
@@ -331,6 +337,33 @@ int mail_index_map_ext_hdr_check(const struct mail_index_header *hdr,
 				 const char *name, const char **error_r);
 unsigned int mail_index_map_ext_hdr_offset(unsigned int name_len);
 
+/* Returns TRUE if the matching messages were added to seqs. The bitmaps are
+   built on first use and then kept up to date by syncing. */
+bool mail_index_map_flagmap_lookup(struct mail_index_map *map,
+				   uint32_t seq1, uint32_t seq2,
+				   const struct mail_index_flag_filter *filters,
+				   unsigned int filters_count,
+				   ARRAY_TYPE(seq_range) *seqs);
+/* Record appended to the end of map's records. */
+void mail_index_map_flagmap_append(struct mail_index_map *map);
+void mail_index_map_flagmap_update_flags(struct mail_index_map *map,
+					 uint32_t seq1, uint32_t seq2,
+					 uint8_t add_flags,
+					 uint8_t remove_flags);
+/* keyword_idx is the keyword's index in the file (not in index->keywords) */
+void mail_index_map_flagmap_update_keyword(struct mail_index_map *map,
+					   unsigned int keyword_idx,
+					   uint32_t seq1, uint32_t seq2,
+					   bool set);
+void mail_index_map_flagmap_reset_keywords(struct mail_index_map *map,
+					   uint32_t seq1, uint32_t seq2);
+/* Forget keyword bitmaps, e.g. because keyword record data was changed
+   directly. They're rebuilt when needed. */
+void mail_index_map_flagmap_drop_keywords(struct mail_index_map *map);
+struct mail_index_map_flagmap *
+mail_index_map_flagmap_clone(const struct mail_index_map_flagmap *flagmap);
+void mail_index_map_flagmap_free(struct mail_index_map_flagmap **flagmap);
+
 void mail_index_view_transaction_ref(struct mail_index_view *view);
 void mail_index_view_transaction_unref(struct mail_index_view *view);
 
@@ -37,6 +37,7 @@ struct mail_index_strmap_view {
 	mail_index_strmap_key_cmp_t *key_compare;
 	mail_index_strmap_rec_cmp_t *rec_compare;
 	mail_index_strmap_remap_t *remap_cb;
+	mail_index_strmap_expunge_t *expunge_cb;
 	void *cb_context;
 
 	uoff_t last_read_block_offset;
@@ -221,6 +222,12 @@ void mail_index_strmap_view_close(struct mail_index_strmap_view **_view)
 	i_free(view);
 }
 
+void mail_index_strmap_view_set_expunge_callback(struct mail_index_strmap_view *view,
+						 mail_index_strmap_expunge_t *expunge_cb)
+{
+	view->expunge_cb = expunge_cb;
+}
+
 uint32_t mail_index_strmap_view_get_highest_idx(struct mail_index_strmap_view *view)
 {
 	return view->next_str_idx-1;
@@ -412,6 +419,27 @@ mail_index_strmap_uid_exists(struct mail_index_strmap_read_context *ctx,
 	}
 }
 
+static void
+mail_index_strmap_read_rec_expunged(struct mail_index_strmap_read_context *ctx,
+				    uint32_t n, uint32_t count)
+{
+	struct mail_index_strmap_rec *recs;
+	uint32_t i;
+
+	T_BEGIN {
+		/* zero-terminated, like the view's records */
+		recs = t_new(struct mail_index_strmap_rec, count + 1);
+		for (i = 0; i < count; i++) {
+			recs[i].uid = ctx->rec.uid;
+			recs[i].ref_index = i == 0 ? 0 : (n == 1 ? 1 : i + 1);
+			memcpy(&recs[i].str_idx,
+			       ctx->str_idx_base + i * sizeof(recs[i].str_idx),
+			       sizeof(recs[i].str_idx));
+		}
+		ctx->view->expunge_cb(recs, count, ctx->view->cb_context);
+	} T_END;
+}
+
 static int
 mail_index_strmap_read_rec_first(struct mail_index_strmap_read_context *ctx,
 				 uint32_t *crc32_r)
@@ -443,6 +471,8 @@ mail_index_strmap_read_rec_first(struct mail_index_strmap_read_context *ctx,
 	if (ret == 0) {
 		/* this message has already been expunged, ignore it.
 		   update highest string indexes anyway. */
+		if (ctx->view->expunge_cb != NULL && !ctx->too_large_uids)
+			mail_index_strmap_read_rec_expunged(ctx, n, count);
 		for (i = 0; i < count; i++) {
 			memcpy(&str_idx, ctx->str_idx_base, sizeof(str_idx));
 			if (ctx->highest_str_idx < str_idx)
@@ -38,6 +38,11 @@ mail_index_strmap_rec_cmp_t(const struct mail_index_strmap_rec *rec1,
 typedef void mail_index_strmap_remap_t(const uint32_t *idx_map,
 				       unsigned int old_count,
 				       unsigned int new_count, void *context);
+/* called for messages that still exist in the strmap file, but have already
+   been expunged from the index view. recs[] contains all the records for the
+   message, and it's terminated with a record containing zeros. */
+typedef void mail_index_strmap_expunge_t(const struct mail_index_strmap_rec *recs,
+					 unsigned int count, void *context);
 
 struct mail_index_strmap *
 mail_index_strmap_init(struct mail_index *index, const char *suffix);
@@ -56,6 +61,9 @@ mail_index_strmap_view_open(struct mail_index_strmap *strmap,
 			    const ARRAY_TYPE(mail_index_strmap_rec) **recs_r,
 			    const struct hash2_table **hash_r);
 void mail_index_strmap_view_close(struct mail_index_strmap_view **view);
+/* Set a callback that gets called while reading the strmap file. */
+void mail_index_strmap_view_set_expunge_callback(struct mail_index_strmap_view *view,
+						 mail_index_strmap_expunge_t *expunge_cb);
 void mail_index_strmap_view_set_corrupted(struct mail_index_strmap_view *view);
 
 /* Return the highest used string index. */
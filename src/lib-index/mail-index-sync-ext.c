@@ -576,6 +576,8 @@ static void mail_index_sync_ext_clear(struct mail_index_view *view,
 		memset(PTR_OFFSET(rec, ext->record_offset), 0,
 		       ext->record_size);
 	}
+	if (ext->index_idx == view->index->keywords_ext_id)
+		mail_index_map_flagmap_drop_keywords(view->map);
 }
 
 int mail_index_sync_ext_reset(struct mail_index_sync_map_ctx *ctx,
@@ -693,6 +695,8 @@ mail_index_sync_ext_rec_update(struct mail_index_sync_map_ctx *ctx,
 
 	/* @UNSAFE */
 	memcpy(old_data, u + 1, ext->record_size);
+	if (ext->index_idx == view->index->keywords_ext_id)
+		mail_index_map_flagmap_drop_keywords(view->map);
 	return 1;
 }
 
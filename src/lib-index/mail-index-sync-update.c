@@ -141,6 +141,47 @@ mail_index_header_update_counts(struct mail_index_header *hdr,
 	return 0;
 }
 
+static int
+mail_index_header_add_counts(struct mail_index_header *hdr,
+			     int seen_diff, int deleted_diff,
+			     const char **error_r)
+{
+	if (seen_diff < 0) {
+		if (hdr->seen_messages_count < (uint32_t)-seen_diff) {
+			*error_r = "Seen counter wrong";
+			return -1;
+		}
+		hdr->seen_messages_count -= -seen_diff;
+	} else if (seen_diff > 0) {
+		if (hdr->seen_messages_count + seen_diff >
+		    hdr->messages_count) {
+			*error_r = "Seen counter wrong";
+			return -1;
+		}
+		hdr->seen_messages_count += seen_diff;
+		if (hdr->seen_messages_count == hdr->messages_count)
+			hdr->first_unseen_uid_lowwater = hdr->next_uid;
+	}
+
+	if (deleted_diff > 0) {
+		hdr->deleted_messages_count += deleted_diff;
+		if (hdr->deleted_messages_count > hdr->messages_count) {
+			*error_r = "Deleted counter wrong";
+			return -1;
+		}
+	} else if (deleted_diff < 0) {
+		if (hdr->deleted_messages_count < (uint32_t)-deleted_diff ||
+		    hdr->deleted_messages_count > hdr->messages_count) {
+			*error_r = "Deleted counter wrong";
+			return -1;
+		}
+		hdr->deleted_messages_count -= -deleted_diff;
+		if (hdr->deleted_messages_count == 0)
+			hdr->first_deleted_uid_lowwater = hdr->next_uid;
+	}
+	return 0;
+}
+
 static void
 mail_index_sync_header_update_counts_all(struct mail_index_sync_map_ctx *ctx,
 					 uint32_t uid,
@@ -248,6 +289,8 @@ sync_expunge_range(struct mail_index_sync_map_ctx *ctx, const ARRAY_TYPE(seq_ran
 		return;
 
 	map = mail_index_sync_get_atomic_map(ctx);
+	/* cheaper to rebuild the flag bitmaps later than to shift them */
+	mail_index_map_flagmap_free(&map->rec_map->flagmap);
 
 	/* call the expunge handlers first */
 	if (sync_expunge_handlers_init(ctx)) {
@@ -414,6 +457,7 @@ static int sync_append(const struct mail_index_record *rec,
 		map->rec_map->records_count++;
 		map->rec_map->last_appended_uid = rec->uid;
 		new_flags = rec->flags;
+		mail_index_map_flagmap_append(map);
 
 		mail_index_modseq_append(ctx->modseq_ctx,
 					 map->rec_map->records_count);
@@ -430,6 +474,80 @@ static int sync_append(const struct mail_index_record *rec,
 	return 1;
 }
 
+static bool
+sync_flag_update_can_bulk(struct mail_index_sync_map_ctx *ctx, uint32_t seq2)
+{
+	struct mail_index_map *const *maps;
+	const struct mail_index_record *rec;
+	unsigned int i, count;
+
+	/* the counters can be updated in one go only if all the maps
+	   contain all the messages in the range */
+	rec = MAIL_INDEX_REC_AT_SEQ(ctx->view->map, seq2);
+	maps = array_get(&ctx->view->map->rec_map->maps, &count);
+	for (i = 0; i < count; i++) {
+		if (rec->uid >= maps[i]->hdr.next_uid)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+sync_flag_update_bulk(struct mail_index_sync_map_ctx *ctx,
+		      const struct mail_transaction_flag_update *u,
+		      uint32_t seq1, uint32_t seq2)
+{
+	struct mail_index_map *map = ctx->view->map;
+	struct mail_index_map *const *maps;
+	struct mail_index_record *rec;
+	uint32_t seq, seen_changes = 0, deleted_changes = 0;
+	uint32_t first_unseen_uid = 0, first_deleted_uid = 0;
+	uint8_t flag_mask = ~u->remove_flags, add_flags = u->add_flags;
+	uint8_t old_flags, changed_flags;
+	int seen_diff, deleted_diff;
+	const char *error;
+	unsigned int i, count;
+
+	/* The same flag can't be both added and removed, so each counted
+	   flag can change only to one direction within the update. That
+	   allows counting the changes first and updating all the headers'
+	   counters and lowwaters only once. */
+	for (seq = seq1; seq <= seq2; seq++) {
+		rec = MAIL_INDEX_REC_AT_SEQ(map, seq);
+		old_flags = rec->flags;
+		rec->flags = (old_flags & flag_mask) | add_flags;
+
+		changed_flags = old_flags ^ rec->flags;
+		seen_changes += (changed_flags & MAIL_SEEN) != 0;
+		deleted_changes += (changed_flags & MAIL_DELETED) != 0;
+		if (first_unseen_uid == 0 && (rec->flags & MAIL_SEEN) == 0)
+			first_unseen_uid = rec->uid;
+		if (first_deleted_uid == 0 && (rec->flags & MAIL_DELETED) != 0)
+			first_deleted_uid = rec->uid;
+	}
+
+	if (first_unseen_uid != 0)
+		mail_index_header_update_lowwaters(ctx, first_unseen_uid, 0);
+	if (first_deleted_uid != 0) {
+		mail_index_header_update_lowwaters(ctx, first_deleted_uid,
+						   MAIL_SEEN | MAIL_DELETED);
+	}
+
+	seen_diff = (add_flags & MAIL_SEEN) != 0 ?
+		(int)seen_changes : -(int)seen_changes;
+	deleted_diff = (add_flags & MAIL_DELETED) != 0 ?
+		(int)deleted_changes : -(int)deleted_changes;
+	if (seen_diff == 0 && deleted_diff == 0)
+		return;
+
+	maps = array_get(&map->rec_map->maps, &count);
+	for (i = 0; i < count; i++) {
+		if (mail_index_header_add_counts(&maps[i]->hdr, seen_diff,
+						 deleted_diff, &error) < 0)
+			mail_index_sync_set_corrupted(ctx, "%s", error);
+	}
+}
+
 static int sync_flag_update(const struct mail_transaction_flag_update *u,
 			    struct mail_index_sync_map_ctx *ctx)
 {
@@ -459,6 +577,8 @@ static int sync_flag_update(const struct mail_transaction_flag_update *u,
 			rec = MAIL_INDEX_REC_AT_SEQ(view->map, seq);
 			rec->flags = (rec->flags & flag_mask) | u->add_flags;
 		}
+	} else if (sync_flag_update_can_bulk(ctx, seq2)) {
+		sync_flag_update_bulk(ctx, u, seq1, seq2);
 	} else {
 		for (seq = seq1; seq <= seq2; seq++) {
 			rec = MAIL_INDEX_REC_AT_SEQ(view->map, seq);
@@ -473,6 +593,8 @@ static int sync_flag_update(const struct mail_transaction_flag_update *u,
 								 rec->flags);
 		}
 	}
+	mail_index_map_flagmap_update_flags(view->map, seq1, seq2,
+					    u->add_flags, u->remove_flags);
 	return 1;
 }
 
@@ -260,6 +260,28 @@ static void tview_lookup_first(struct mail_index_view *view,
 	}
 }
 
+static bool
+tview_lookup_seqs_by_flags(struct mail_index_view *view,
+			   uint32_t seq1, uint32_t seq2,
+			   const struct mail_index_flag_filter *filters,
+			   unsigned int filters_count,
+			   ARRAY_TYPE(seq_range) *seqs)
+{
+	struct mail_index_view_transaction *tview =
+		(struct mail_index_view_transaction *)view;
+	struct mail_index_transaction *t = tview->t;
+
+	/* the bitmaps know only about committed changes */
+	if (t->reset || t->last_new_seq != 0 ||
+	    (array_is_created(&t->updates) && array_count(&t->updates) > 0) ||
+	    (array_is_created(&t->keyword_updates) &&
+	     array_count(&t->keyword_updates) > 0))
+		return FALSE;
+
+	return tview->super->lookup_seqs_by_flags(view, seq1, seq2, filters,
+						  filters_count, seqs);
+}
+
 static void keyword_index_add(ARRAY_TYPE(keyword_indexes) *keywords,
 			      unsigned int idx)
 {
@@ -484,6 +506,7 @@ static struct mail_index_view_vfuncs trans_view_vfuncs = {
 	tview_lookup_seq_range,
 	tview_lookup_first,
 	tview_lookup_keywords,
+	tview_lookup_seqs_by_flags,
 	tview_lookup_ext_full,
 	tview_get_header_ext,
 	tview_ext_get_reset_id
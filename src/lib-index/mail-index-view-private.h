@@ -28,6 +28,11 @@ struct mail_index_view_vfuncs {
 			     uint32_t *seq_r);
 	void (*lookup_keywords)(struct mail_index_view *view, uint32_t seq,
 				ARRAY_TYPE(keyword_indexes) *keyword_idx);
+	bool (*lookup_seqs_by_flags)(struct mail_index_view *view,
+				     uint32_t seq1, uint32_t seq2,
+				     const struct mail_index_flag_filter *filters,
+				     unsigned int filters_count,
+				     ARRAY_TYPE(seq_range) *seqs);
 	void (*lookup_ext_full)(struct mail_index_view *view, uint32_t seq,
 				uint32_t ext_id, struct mail_index_map **map_r,
 				const void **data_r, bool *expunged_r);
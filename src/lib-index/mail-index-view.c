@@ -288,6 +288,19 @@ static void view_lookup_first(struct mail_index_view *view,
 	}
 }
 
+static bool
+view_lookup_seqs_by_flags(struct mail_index_view *view,
+			  uint32_t seq1, uint32_t seq2,
+			  const struct mail_index_flag_filter *filters,
+			  unsigned int filters_count,
+			  ARRAY_TYPE(seq_range) *seqs)
+{
+	i_assert(seq2 <= view->map->hdr.messages_count);
+
+	return mail_index_map_flagmap_lookup(view->map, seq1, seq2,
+					     filters, filters_count, seqs);
+}
+
 static void
 mail_index_data_lookup_keywords(struct mail_index_map *map,
 				const unsigned char *data,
@@ -529,6 +542,20 @@ void mail_index_lookup_first(struct mail_index_view *view,
 	view->v.lookup_first(view, flags, flags_mask, seq_r);
 }
 
+bool mail_index_lookup_seqs_by_flags(struct mail_index_view *view,
+				     uint32_t seq1, uint32_t seq2,
+				     const struct mail_index_flag_filter *filters,
+				     unsigned int filters_count,
+				     ARRAY_TYPE(seq_range) *seqs)
+{
+	if (view->v.lookup_seqs_by_flags == NULL)
+		return FALSE;
+	if (seq1 > seq2)
+		return TRUE;
+	return view->v.lookup_seqs_by_flags(view, seq1, seq2, filters,
+					    filters_count, seqs);
+}
+
 void mail_index_lookup_ext(struct mail_index_view *view, uint32_t seq,
 			   uint32_t ext_id, const void **data_r,
 			   bool *expunged_r)
@@ -597,6 +624,7 @@ static struct mail_index_view_vfuncs view_vfuncs = {
 	view_lookup_seq_range,
 	view_lookup_first,
 	view_lookup_keywords,
+	view_lookup_seqs_by_flags,
 	view_lookup_ext_full,
 	view_get_header_ext,
 	view_ext_get_reset_id
@@ -112,6 +112,13 @@ void mail_index_set_lock_method(struct mail_index *index,
 	index->max_lock_timeout_secs = max_timeout_secs;
 }
 
+void mail_index_set_log_archive_compression(struct mail_index *index,
+	const struct compression_handler *handler, int level)
+{
+	index->log_archive_handler = handler;
+	index->log_archive_level = level;
+}
+
 void mail_index_set_ext_init_data(struct mail_index *index, uint32_t ext_id,
 				  const void *data, size_t size)
 {
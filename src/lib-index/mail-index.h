@@ -117,6 +117,16 @@ struct mail_keywords {
 	unsigned int idx[1];
 };
 
+/* Flag/keyword condition for mail_index_lookup_seqs_by_flags(). */
+struct mail_index_flag_filter {
+	/* All of these flags must be set. */
+	enum mail_flags flags;
+	/* All of these keywords must be set. May be NULL. */
+	const struct mail_keywords *keywords;
+	/* Match messages that don't match the above conditions instead. */
+	bool match_not;
+};
+
 enum mail_index_transaction_flags {
 	/* If transaction is marked as hidden, the changes are marked with
 	   hidden=TRUE when the view is synchronized. */
@@ -222,6 +232,7 @@ struct mail_index_transaction_commit_result {
 struct mail_index;
 struct mail_index_map;
 struct mail_index_view;
+struct compression_handler;
 struct mail_index_transaction;
 struct mail_index_sync_ctx;
 struct mail_index_view_sync_ctx;
@@ -240,6 +251,11 @@ void mail_index_set_permissions(struct mail_index *index,
 void mail_index_set_lock_method(struct mail_index *index,
 				enum file_lock_method lock_method,
 				unsigned int max_timeout_secs);
+/* Store rotated .log.2 files compressed with the given handler. The same
+   handler must be set for the compressed files to be readable again.
+   handler=NULL keeps the rotated logs uncompressed. */
+void mail_index_set_log_archive_compression(struct mail_index *index,
+	const struct compression_handler *handler, int level);
 /* When creating a new index file or reseting an existing one, add the given
    extension header data immediately to it. */
 void mail_index_set_ext_init_data(struct mail_index *index, uint32_t ext_id,
@@ -310,6 +326,8 @@ mail_index_transaction_get_view(struct mail_index_transaction *t);
 /* Returns TRUE if the given sequence is being expunged in this transaction. */
 bool mail_index_transaction_is_expunged(struct mail_index_transaction *t,
 					uint32_t seq);
+/* Returns TRUE if the transaction has any uncommitted changes. */
+bool mail_index_transaction_has_changes(struct mail_index_transaction *t);
 
 /* Returns a view containing the mailbox state after changes in transaction
    are applied. The view can still be used after transaction has been
@@ -450,6 +468,16 @@ bool mail_index_lookup_seq(struct mail_index_view *view,
 void mail_index_lookup_first(struct mail_index_view *view,
 			     enum mail_flags flags, uint8_t flags_mask,
 			     uint32_t *seq_r);
+/* Add to seqs all messages between seq1..seq2 that match all of the given
+   filters. This is answered from the map's in-memory flag bitmaps without
+   looking up the records one by one. Returns FALSE if the view can't answer
+   this quickly (e.g. transaction view with uncommitted flag changes), in which
+   case seqs isn't modified and the caller must check the records itself. */
+bool mail_index_lookup_seqs_by_flags(struct mail_index_view *view,
+				     uint32_t seq1, uint32_t seq2,
+				     const struct mail_index_flag_filter *filters,
+				     unsigned int filters_count,
+				     ARRAY_TYPE(seq_range) *seqs);
 
 /* Append a new record to index. */
 void mail_index_append(struct mail_index_transaction *t, uint32_t uid,
@@ -0,0 +1,329 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "istream.h"
+#include "ostream.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "compression.h"
+#include "mail-transaction-log-archive.h"
+
+#include <sys/stat.h>
+
+/* Larger blocks in the header are treated as corruption. */
+#define MAIL_TRANSACTION_LOG_ARCHIVE_MAX_BLOCK_SIZE (1024*1024*16)
+
+struct mail_transaction_log_archive {
+	int fd;
+	char *path;
+	const struct compression_handler *handler;
+
+	uint32_t block_size, blocks_count;
+	uoff_t uncompressed_size;
+	uint64_t *block_offsets;
+
+	/* the most recently uncompressed block */
+	uint32_t cached_block_idx;
+	buffer_t *block_buf;
+	buffer_t *compressed_buf;
+};
+
+static int
+archive_compress_block(const struct compression_handler *handler, int level,
+		       const void *data, size_t size, buffer_t *dest,
+		       const char **error_r)
+{
+	struct ostream *buf_output, *output;
+	int ret = 0;
+
+	buffer_set_used_size(dest, 0);
+	buf_output = o_stream_create_buffer(dest);
+	output = handler->create_ostream(buf_output, level);
+	if (o_stream_send(output, data, size) != (ssize_t)size ||
+	    o_stream_flush(output) < 0) {
+		*error_r = t_strdup_printf("%s compression failed: %s",
+					   handler->name,
+					   o_stream_get_error(output));
+		ret = -1;
+	}
+	o_stream_destroy(&output);
+	o_stream_destroy(&buf_output);
+	return ret;
+}
+
+int mail_transaction_log_archive_write(int fd_in, uoff_t size, int fd_out,
+				       const struct compression_handler *handler,
+				       int level, const char **error_r)
+{
+	struct mail_transaction_log_archive_header hdr;
+	buffer_t *offsets, *block, *compressed;
+	uoff_t offset;
+	uint64_t out_offset;
+	size_t block_size;
+	uint32_t i;
+	int ret;
+
+	if (handler->create_ostream == NULL) {
+		*error_r = t_strdup_printf(
+			"Support not compiled in for handler: %s",
+			handler->name);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MAIL_TRANSACTION_LOG_ARCHIVE_MAGIC,
+	       sizeof(hdr.magic));
+	i_assert(strlen(handler->name) <= sizeof(hdr.handler_name));
+	memcpy(hdr.handler_name, handler->name, strlen(handler->name));
+	hdr.block_size = MAIL_TRANSACTION_LOG_ARCHIVE_BLOCK_SIZE;
+	hdr.blocks_count = (size + hdr.block_size - 1) / hdr.block_size;
+	hdr.uncompressed_size = size;
+
+	offsets = buffer_create_dynamic(pool_datastack_create(),
+					(hdr.blocks_count + 1) * sizeof(uint64_t));
+	block = buffer_create_dynamic(pool_datastack_create(), hdr.block_size);
+	compressed = buffer_create_dynamic(pool_datastack_create(),
+					   hdr.block_size);
+	out_offset = sizeof(hdr) + (hdr.blocks_count + 1) * sizeof(uint64_t);
+
+	for (i = 0, offset = 0; i < hdr.blocks_count; i++) {
+		block_size = I_MIN(hdr.block_size, size - offset);
+		buffer_set_used_size(block, 0);
+		ret = pread_full(fd_in,
+				 buffer_append_space_unsafe(block, block_size),
+				 block_size, offset);
+		if (ret <= 0) {
+			*error_r = ret == 0 ? "Log file shrank" :
+				t_strdup_printf("pread() failed: %m");
+			return -1;
+		}
+		if (archive_compress_block(handler, level, block->data,
+					   block_size, compressed, error_r) < 0)
+			return -1;
+		if (pwrite_full(fd_out, compressed->data, compressed->used,
+				out_offset) < 0) {
+			*error_r = t_strdup_printf("pwrite() failed: %m");
+			return -1;
+		}
+		buffer_append(offsets, &out_offset, sizeof(out_offset));
+		out_offset += compressed->used;
+		offset += block_size;
+	}
+	buffer_append(offsets, &out_offset, sizeof(out_offset));
+
+	if (pwrite_full(fd_out, &hdr, sizeof(hdr), 0) < 0 ||
+	    pwrite_full(fd_out, offsets->data, offsets->used,
+			sizeof(hdr)) < 0) {
+		*error_r = t_strdup_printf("pwrite() failed: %m");
+		return -1;
+	}
+	return 0;
+}
+
+int mail_transaction_log_archive_open(int fd, const char *path,
+	const struct compression_handler *handler,
+	struct mail_transaction_log_archive **archive_r, const char **error_r)
+{
+	struct mail_transaction_log_archive_header hdr;
+	struct mail_transaction_log_archive *archive;
+	struct stat st;
+	uoff_t max_blocks_count;
+	size_t offsets_size;
+	uint32_t i;
+	int ret;
+
+	ret = pread_full(fd, &hdr, sizeof(hdr), 0);
+	if (ret < 0) {
+		*error_r = t_strdup_printf("pread(%s) failed: %m", path);
+		return -1;
+	}
+	if (ret == 0 || memcmp(hdr.magic, MAIL_TRANSACTION_LOG_ARCHIVE_MAGIC,
+			       sizeof(hdr.magic)) != 0)
+		return 0;
+
+	if (handler == NULL || handler->create_istream == NULL ||
+	    strncmp(hdr.handler_name, handler->name,
+		    sizeof(hdr.handler_name)) != 0) {
+		*error_r = t_strdup_printf(
+			"Transaction log archive %s: Can't read %s compressed "
+			"file with the current settings", path,
+			t_strndup(hdr.handler_name, sizeof(hdr.handler_name)));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m", path);
+		return -1;
+	}
+
+	/* the block table must fit into the file. this also keeps the
+	   table size calculation from overflowing. */
+	max_blocks_count = (uoff_t)st.st_size < sizeof(hdr) ? 0 :
+		((uoff_t)st.st_size - sizeof(hdr)) / sizeof(uint64_t);
+	if (hdr.block_size == 0 ||
+	    hdr.block_size > MAIL_TRANSACTION_LOG_ARCHIVE_MAX_BLOCK_SIZE ||
+	    (uoff_t)hdr.blocks_count + 1 > max_blocks_count ||
+	    hdr.uncompressed_size >
+	    (uint64_t)hdr.blocks_count * hdr.block_size ||
+	    (hdr.blocks_count > 0 && hdr.uncompressed_size <=
+	     (uint64_t)(hdr.blocks_count - 1) * hdr.block_size)) {
+		*error_r = t_strdup_printf(
+			"Transaction log archive %s: Broken header", path);
+		return -2;
+	}
+
+	archive = i_new(struct mail_transaction_log_archive, 1);
+	archive->fd = fd;
+	archive->path = i_strdup(path);
+	archive->handler = handler;
+	archive->block_size = hdr.block_size;
+	archive->blocks_count = hdr.blocks_count;
+	archive->uncompressed_size = hdr.uncompressed_size;
+	archive->cached_block_idx = (uint32_t)-1;
+
+	offsets_size = (hdr.blocks_count + 1) * sizeof(uint64_t);
+	archive->block_offsets = i_malloc(offsets_size);
+	ret = pread_full(fd, archive->block_offsets, offsets_size, sizeof(hdr));
+	if (ret <= 0) {
+		*error_r = ret < 0 ?
+			t_strdup_printf("pread(%s) failed: %m", path) :
+			t_strdup_printf("Transaction log archive %s: "
+					"Unexpected EOF in block table", path);
+		mail_transaction_log_archive_free(&archive);
+		return ret < 0 ? -1 : -2;
+	}
+	/* the blocks must be in order, after the block table and within
+	   the file */
+	for (i = 0; i < hdr.blocks_count; i++) {
+		if (archive->block_offsets[i] > archive->block_offsets[i+1])
+			break;
+	}
+	if (i < hdr.blocks_count ||
+	    archive->block_offsets[0] < sizeof(hdr) + offsets_size ||
+	    archive->block_offsets[hdr.blocks_count] > (uoff_t)st.st_size) {
+		*error_r = t_strdup_printf(
+			"Transaction log archive %s: Broken block table", path);
+		mail_transaction_log_archive_free(&archive);
+		return -2;
+	}
+	archive->block_buf = buffer_create_dynamic(default_pool,
+						   archive->block_size);
+	archive->compressed_buf = buffer_create_dynamic(default_pool,
+							archive->block_size);
+	*archive_r = archive;
+	return 1;
+}
+
+void mail_transaction_log_archive_free(struct mail_transaction_log_archive
+				       **_archive)
+{
+	struct mail_transaction_log_archive *archive = *_archive;
+
+	*_archive = NULL;
+	if (archive->block_buf != NULL)
+		buffer_free(&archive->block_buf);
+	if (archive->compressed_buf != NULL)
+		buffer_free(&archive->compressed_buf);
+	i_free(archive->block_offsets);
+	i_free(archive->path);
+	i_free(archive);
+}
+
+uoff_t
+mail_transaction_log_archive_get_size(struct mail_transaction_log_archive
+				      *archive)
+{
+	return archive->uncompressed_size;
+}
+
+static int
+archive_read_block(struct mail_transaction_log_archive *archive,
+		   uint32_t block_idx)
+{
+	struct istream *data_input, *input;
+	const unsigned char *data;
+	size_t size, compressed_size, expected_size;
+	uoff_t offset;
+	ssize_t ret;
+	bool failed;
+
+	if (archive->cached_block_idx == block_idx)
+		return 0;
+	archive->cached_block_idx = (uint32_t)-1;
+
+	offset = archive->block_offsets[block_idx];
+	compressed_size = archive->block_offsets[block_idx+1] - offset;
+	buffer_set_used_size(archive->compressed_buf, 0);
+	ret = pread_full(archive->fd,
+			 buffer_append_space_unsafe(archive->compressed_buf,
+						    compressed_size),
+			 compressed_size, offset);
+	if (ret <= 0) {
+		if (ret == 0) {
+			i_error("Transaction log archive %s: "
+				"Unexpected EOF in block %u",
+				archive->path, block_idx);
+			errno = EINVAL;
+		}
+		return -1;
+	}
+
+	expected_size = block_idx + 1 < archive->blocks_count ?
+		archive->block_size : archive->uncompressed_size -
+		(uoff_t)block_idx * archive->block_size;
+
+	buffer_set_used_size(archive->block_buf, 0);
+	data_input = i_stream_create_from_data(archive->compressed_buf->data,
+					       archive->compressed_buf->used);
+	input = archive->handler->create_istream(data_input, FALSE);
+	while ((ret = i_stream_read_data(input, &data, &size, 0)) > 0) {
+		if (size > expected_size - archive->block_buf->used) {
+			/* uncompresses to more than the block size */
+			break;
+		}
+		buffer_append(archive->block_buf, data, size);
+		i_stream_skip(input, size);
+	}
+	i_assert(ret > 0 || ret == -1);
+
+	failed = ret > 0 || input->stream_errno != 0 ||
+		archive->block_buf->used != expected_size;
+	i_stream_destroy(&input);
+	i_stream_destroy(&data_input);
+	if (failed) {
+		i_error("Transaction log archive %s: "
+			"Corrupted compressed block %u", archive->path,
+			block_idx);
+		errno = EINVAL;
+		return -1;
+	}
+	archive->cached_block_idx = block_idx;
+	return 0;
+}
+
+ssize_t
+mail_transaction_log_archive_pread(struct mail_transaction_log_archive *archive,
+				   void *buf, size_t size, uoff_t offset)
+{
+	uint32_t block_idx;
+	size_t pos = 0, block_offset, n;
+
+	if (offset >= archive->uncompressed_size)
+		return 0;
+	if (size > archive->uncompressed_size - offset)
+		size = archive->uncompressed_size - offset;
+
+	while (pos < size) {
+		block_idx = (offset + pos) / archive->block_size;
+		block_offset = (offset + pos) % archive->block_size;
+		if (archive_read_block(archive, block_idx) < 0)
+			return -1;
+
+		n = I_MIN(size - pos, archive->block_buf->used - block_offset);
+		memcpy(PTR_OFFSET(buf, pos),
+		       CONST_PTR_OFFSET(archive->block_buf->data, block_offset),
+		       n);
+		pos += n;
+	}
+	return pos;
+}
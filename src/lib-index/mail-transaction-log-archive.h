@@ -0,0 +1,53 @@
+#ifndef MAIL_TRANSACTION_LOG_ARCHIVE_H
+#define MAIL_TRANSACTION_LOG_ARCHIVE_H
+
+/* Rotated .log.2 files can be stored compressed. The log is split into
+   fixed size blocks which are compressed separately, so reading from any
+   offset requires uncompressing only a single block. */
+
+struct compression_handler;
+struct mail_transaction_log_archive;
+
+#define MAIL_TRANSACTION_LOG_ARCHIVE_MAGIC "DLOGARC1"
+#define MAIL_TRANSACTION_LOG_ARCHIVE_BLOCK_SIZE (1024*64)
+
+struct mail_transaction_log_archive_header {
+	/* The first byte can't be confused with a transaction log's
+	   major_version. */
+	unsigned char magic[8];
+	/* compression handler name, NUL-padded */
+	char handler_name[8];
+	uint32_t block_size;
+	uint32_t blocks_count;
+	uint64_t uncompressed_size;
+	/* followed by uint64_t block_offsets[blocks_count+1]. The last
+	   offset points to the end of the last block. */
+};
+
+/* Write the first size bytes of fd_in to fd_out in the archive format. The
+   handler's streams must detect their own end, so e.g. raw deflate can't be
+   used. Returns 0 if ok, -1 if failed. */
+int mail_transaction_log_archive_write(int fd_in, uoff_t size, int fd_out,
+				       const struct compression_handler *handler,
+				       int level, const char **error_r);
+
+/* Returns 1 if fd is an archive and it was opened successfully, 0 if fd
+   isn't an archive, -1 if it's an archive that can't be read with the given
+   handler or there was an I/O error, -2 if the archive is corrupted. */
+int mail_transaction_log_archive_open(int fd, const char *path,
+	const struct compression_handler *handler,
+	struct mail_transaction_log_archive **archive_r, const char **error_r);
+void mail_transaction_log_archive_free(struct mail_transaction_log_archive
+				       **archive);
+
+/* Returns the uncompressed size of the log. */
+uoff_t
+mail_transaction_log_archive_get_size(struct mail_transaction_log_archive
+				      *archive);
+/* Read uncompressed data like pread(). Returns the number of bytes read,
+   which is less than size only at EOF, or -1 on error. */
+ssize_t
+mail_transaction_log_archive_pread(struct mail_transaction_log_archive *archive,
+				   void *buf, size_t size, uoff_t offset);
+
+#endif
@@ -3,14 +3,20 @@
 #include "lib.h"
 #include "array.h"
 #include "ioloop.h"
+#include "str.h"
 #include "file-dotlock.h"
 #include "nfs-workarounds.h"
+#include "safe-mkstemp.h"
 #include "read-full.h"
 #include "write-full.h"
 #include "mmap-util.h"
 #include "mail-index-private.h"
 #include "mail-index-modseq.h"
 #include "mail-transaction-log-private.h"
+#include "mail-transaction-log-archive.h"
+
+#include <stdio.h>
+#include <utime.h>
 
 #define LOG_PREFETCH IO_BLOCK_SIZE
 #define MEMORY_LOG_NAME "(in-memory transaction log file)"
@@ -18,6 +24,9 @@
 
 static int
 mail_transaction_log_file_sync(struct mail_transaction_log_file *file);
+static void
+mail_transaction_log_file_archive(struct mail_transaction_log_file *file,
+				  const char *path2);
 
 static void
 log_file_set_syscall_error(struct mail_transaction_log_file *file,
@@ -27,6 +36,17 @@ log_file_set_syscall_error(struct mail_transaction_log_file *file,
 					  file->filepath, function);
 }
 
+static ssize_t
+log_file_pread(struct mail_transaction_log_file *file,
+	       void *buf, size_t size, uoff_t offset)
+{
+	if (file->archive != NULL) {
+		return mail_transaction_log_archive_pread(file->archive,
+							  buf, size, offset);
+	}
+	return pread(file->fd, buf, size, offset);
+}
+
 static void
 mail_transaction_log_mark_corrupted(struct mail_transaction_log_file *file)
 {
@@ -35,7 +55,7 @@ mail_transaction_log_mark_corrupted(struct mail_transaction_log_file *file)
 	int flags;
 
 	if (MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file) ||
-	    file->log->index->readonly)
+	    file->archive != NULL || file->log->index->readonly)
 		return;
 
 	/* indexid=0 marks the log file as corrupted. we opened the file with
@@ -121,6 +141,8 @@ void mail_transaction_log_file_free(struct mail_transaction_log_file **_file)
 			log_file_set_syscall_error(file, "munmap()");
 	}
 
+	if (file->archive != NULL)
+		mail_transaction_log_archive_free(&file->archive);
 	if (file->fd != -1) {
 		if (close(file->fd) < 0)
 			log_file_set_syscall_error(file, "close()");
@@ -414,12 +436,18 @@ void mail_transaction_log_file_unlock(struct mail_transaction_log_file *file,
 			  file->filepath, lock_time, lock_reason);
 	}
 
-	if (file->log->index->lock_method == FILE_LOCK_METHOD_DOTLOCK) {
+	if (file->log->index->lock_method == FILE_LOCK_METHOD_DOTLOCK)
 		(void)mail_transaction_log_file_undotlock(file);
-		return;
-	}
+	else
+		file_unlock(&file->file_lock);
 
-	file_unlock(&file->file_lock);
+	if (file->archive_pending) {
+		file->archive_pending = FALSE;
+		T_BEGIN {
+			mail_transaction_log_file_archive(file,
+				t_strconcat(file->filepath, ".2", NULL));
+		} T_END;
+	}
 }
 
 static ssize_t
@@ -450,8 +478,8 @@ mail_transaction_log_file_read_header(struct mail_transaction_log_file *file)
 	   since older versions of the log format used smaller headers. */
         pos = 0;
 	do {
-		ret = pread(file->fd, PTR_OFFSET(dest, pos),
-			    dest_size - pos, pos);
+		ret = log_file_pread(file, PTR_OFFSET(dest, pos),
+				     dest_size - pos, pos);
 		if (ret > 0)
 			pos += ret;
 	} while (ret > 0 && pos < dest_size);
@@ -664,6 +692,99 @@ static void log_write_ext_hdr_init_data(struct mail_index *index, buffer_t *buf)
 	hdr->size = mail_index_uint32_to_offset(buf->used - hdr_offset);
 }
 
+static void
+mail_transaction_log_file_archive(struct mail_transaction_log_file *file,
+				  const char *path2)
+{
+	struct mail_index *index = file->log->index;
+	struct stat st, st2;
+	string_t *temp_path;
+	const char *error;
+	int fd, temp_fd, ret;
+
+	fd = nfs_safe_open(path2, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			mail_index_file_set_syscall_error(index, path2, "open()");
+		return;
+	}
+	if (fstat(fd, &st) < 0) {
+		mail_index_file_set_syscall_error(index, path2, "fstat()");
+		i_close_fd(&fd);
+		return;
+	}
+
+	temp_path = t_str_new(256);
+	str_append(temp_path, path2);
+	temp_fd = safe_mkstemp_hostpid_group(temp_path, index->mode,
+					     index->gid, index->gid_origin);
+	if (temp_fd == -1) {
+		mail_index_set_error(index,
+				     "safe_mkstemp_hostpid(%s) failed: %m",
+				     str_c(temp_path));
+		i_close_fd(&fd);
+		return;
+	}
+
+	ret = mail_transaction_log_archive_write(fd, st.st_size, temp_fd,
+						 index->log_archive_handler,
+						 index->log_archive_level,
+						 &error);
+	if (ret < 0) {
+		mail_index_set_error(index, "Transaction log %s: "
+				     "Archiving failed: %s", path2, error);
+	} else if (index->fsync_mode != FSYNC_MODE_NEVER &&
+		   fdatasync(temp_fd) < 0) {
+		mail_index_file_set_syscall_error(index, str_c(temp_path),
+						  "fdatasync()");
+		ret = -1;
+	}
+	i_close_fd(&fd);
+	if (close(temp_fd) < 0) {
+		mail_index_file_set_syscall_error(index, str_c(temp_path),
+						  "close()");
+		ret = -1;
+	}
+	/* keep the original mtime, so .log.2 gets deleted at the same time
+	   as it would have without compression */
+	if (ret == 0) {
+		struct utimbuf ut;
+
+		ut.actime = st.st_atime;
+		ut.modtime = st.st_mtime;
+		if (utime(str_c(temp_path), &ut) < 0) {
+			mail_index_file_set_syscall_error(index,
+				str_c(temp_path), "utime()");
+		}
+	}
+	/* this is done without locking, so another process may have rotated
+	   the log again while we were compressing. don't replace its .log.2
+	   with ours. if that happens between the stat() and the rename(),
+	   .log.2 just contains an older log, which readers already handle
+	   by looking at its header. */
+	if (ret == 0) {
+		if (nfs_safe_stat(path2, &st2) < 0) {
+			if (errno != ENOENT) {
+				mail_index_file_set_syscall_error(index, path2,
+								  "stat()");
+			}
+			ret = -1;
+		} else if (st.st_ino != st2.st_ino ||
+			   !CMP_DEV_T(st.st_dev, st2.st_dev)) {
+			ret = -1;
+		}
+	}
+	if (ret == 0 && rename(str_c(temp_path), path2) < 0) {
+		mail_index_set_error(index, "rename(%s, %s) failed: %m",
+				     str_c(temp_path), path2);
+		ret = -1;
+	}
+	if (ret < 0) {
+		/* the uncompressed .log.2 is still there */
+		(void)unlink(str_c(temp_path));
+	}
+}
+
 static int
 mail_transaction_log_file_create2(struct mail_transaction_log_file *file,
 				  int new_fd, bool reset,
@@ -820,6 +941,19 @@ mail_transaction_log_file_create2(struct mail_transaction_log_file *file,
 	file->fd = new_fd;
 	mail_transaction_log_file_add_to_list(file);
 
+	if (rename_existing && index->log_archive_handler != NULL) {
+		/* compressing may take a while, so don't do it while the
+		   log is locked. if we're rotating, the new log stays locked
+		   until the caller's sync finishes and the compression is
+		   done only once it's unlocked. */
+		if (file->locked)
+			file->archive_pending = TRUE;
+		else T_BEGIN {
+			mail_transaction_log_file_archive(file,
+				t_strconcat(file->filepath, ".2", NULL));
+		} T_END;
+	}
+
 	i_assert(!need_lock || file->locked);
 	return 1;
 }
@@ -868,6 +1002,31 @@ int mail_transaction_log_file_create(struct mail_transaction_log_file *file,
 	return ret;
 }
 
+/* Returns 1 if ok or the file isn't an archive, 0 if the archive is
+   corrupted, -1 if it can't be read. */
+static int
+mail_transaction_log_file_open_archive(struct mail_transaction_log_file *file)
+{
+	struct mail_index *index = file->log->index;
+	const char *error;
+	int ret;
+
+	if (file->archive != NULL)
+		mail_transaction_log_archive_free(&file->archive);
+	ret = mail_transaction_log_archive_open(file->fd, file->filepath,
+						index->log_archive_handler,
+						&file->archive, &error);
+	if (ret < 0) {
+		mail_index_set_error(index, "%s", error);
+		return ret == -2 ? 0 : -1;
+	}
+	if (ret > 0) {
+		file->last_size =
+			mail_transaction_log_archive_get_size(file->archive);
+	}
+	return 1;
+}
+
 int mail_transaction_log_file_open(struct mail_transaction_log_file *file)
 {
 	struct mail_index *index = file->log->index;
@@ -903,7 +1062,12 @@ int mail_transaction_log_file_open(struct mail_transaction_log_file *file)
 			   also possible that hit a race condition where .log
 			   and .log.2 are linked. */
 			return 0;
-		} else {
+		} else if ((ret = mail_transaction_log_file_open_archive(
+						file)) < 0) {
+			/* compressed .log.2 that we can't read. it's not
+			   corrupted though, so don't delete it. */
+			return 0;
+		} else if (ret > 0) {
 			ret = mail_transaction_log_file_read_hdr(file,
 								 ignore_estale);
 		}
@@ -1435,7 +1599,13 @@ mail_transaction_log_file_insert_read(struct mail_transaction_log_file *file,
 	buffer_copy(file->buffer, size, file->buffer, 0, (size_t)-1);
 
 	data = buffer_get_space_unsafe(file->buffer, 0, size);
-	ret = pread_full(file->fd, data, size, offset);
+	if (file->archive == NULL)
+		ret = pread_full(file->fd, data, size, offset);
+	else {
+		ret = log_file_pread(file, data, size, offset);
+		if (ret > 0)
+			ret = (size_t)ret == size ? 1 : 0;
+	}
 	if (ret > 0) {
 		/* success */
 		file->buffer_offset -= size;
@@ -1470,7 +1640,7 @@ mail_transaction_log_file_read_more(struct mail_transaction_log_file *file)
 
 	do {
 		data = buffer_append_space_unsafe(file->buffer, LOG_PREFETCH);
-		ret = pread(file->fd, data, LOG_PREFETCH, read_offset);
+		ret = log_file_pread(file, data, LOG_PREFETCH, read_offset);
 		if (ret > 0)
 			read_offset += ret;
 
@@ -1744,7 +1914,8 @@ int mail_transaction_log_file_map(struct mail_transaction_log_file *file,
 		start_offset = file->sync_offset;
 	}
 
-	if ((file->log->index->flags & MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE) == 0)
+	if ((file->log->index->flags & MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE) == 0 &&
+	    file->archive == NULL)
 		ret = mail_transaction_log_file_map_mmap(file, start_offset);
 	else {
 		mail_transaction_log_file_munmap(file);
@@ -1786,6 +1957,8 @@ void mail_transaction_log_file_move_to_memory(struct mail_transaction_log_file
 		(void)mail_transaction_log_file_read(file, 0, FALSE);
 	}
 	file->last_size = 0;
+	if (file->archive != NULL)
+		mail_transaction_log_archive_free(&file->archive);
 
 	if (close(file->fd) < 0)
 		log_file_set_syscall_error(file, "close()");
@@ -5,6 +5,7 @@
 #include "mail-transaction-log.h"
 
 struct dotlock_settings;
+struct mail_transaction_log_archive;
 
 /* Synchronization can take a while sometimes, especially when copying lots of
    mails. */
@@ -40,6 +41,8 @@ struct mail_transaction_log_file {
 
 	char *filepath;
 	int fd;
+	/* non-NULL if this is a compressed .log.2 */
+	struct mail_transaction_log_archive *archive;
 
 	ino_t st_ino;
 	dev_t st_dev;
@@ -79,6 +82,9 @@ struct mail_transaction_log_file {
 	unsigned int locked:1;
 	unsigned int locked_sync_offset_updated:1;
 	unsigned int corrupted:1;
+	/* .log.2 was rotated from this file's predecessor and should be
+	   compressed after this file is unlocked */
+	unsigned int archive_pending:1;
 };
 
 struct mail_transaction_log {
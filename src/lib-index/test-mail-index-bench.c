@@ -0,0 +1,571 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "strnum.h"
+#include "ioloop.h"
+#include "hostpid.h"
+#include "time-util.h"
+#include "json-parser.h"
+#include "unlink-directory.h"
+#include "mail-index.h"
+#include "mail-cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/* Generates a synthetic index with the wanted messages count, flag
+   distribution, keywords and cache fields, and measures the time taken by
+   the common index operations on it. The results are written to stdout as
+   JSON, so they can be compared between index format or locking changes.
+   With "-m flags" only the "STORE 1:* +FLAGS \Seen" style flag updates are
+   measured. */
+
+#define BENCH_INDEX_PREFIX "dovecot.index"
+#define BENCH_CACHE_FIELD_VALUE "0123456789abcdef0123456789abcdef"
+
+struct bench_settings {
+	const char *dir;
+	unsigned int messages_count;
+	unsigned int iterations;
+	unsigned int seen_pct, deleted_pct, flagged_pct;
+	unsigned int keywords_count, keyword_pct;
+	unsigned int cache_fields_count;
+	unsigned int append_count;
+	unsigned int seed;
+	bool flags_only;
+};
+
+struct bench_result {
+	const char *name;
+	unsigned int count;
+	unsigned long long total_usecs, min_usecs, max_usecs;
+};
+
+struct bench_context {
+	pool_t pool;
+	const struct bench_settings *set;
+	struct mail_index *index;
+	struct mail_keywords **keywords;
+	struct mail_cache_field *cache_fields;
+	ARRAY(struct bench_result) results;
+};
+
+static struct timeval bench_tv_start;
+
+static void bench_start(void)
+{
+	if (gettimeofday(&bench_tv_start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+}
+
+static void bench_stop(struct bench_context *ctx, const char *name)
+{
+	struct bench_result *results, *result = NULL;
+	struct timeval tv_end;
+	unsigned long long usecs;
+	unsigned int i, count;
+
+	if (gettimeofday(&tv_end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = timeval_diff_usecs(&tv_end, &bench_tv_start);
+
+	results = array_get_modifiable(&ctx->results, &count);
+	for (i = 0; i < count; i++) {
+		if (strcmp(results[i].name, name) == 0) {
+			result = &results[i];
+			break;
+		}
+	}
+	if (result == NULL) {
+		result = array_append_space(&ctx->results);
+		result->name = name;
+		result->min_usecs = usecs;
+	}
+	result->count++;
+	result->total_usecs += usecs;
+	if (usecs < result->min_usecs)
+		result->min_usecs = usecs;
+	if (usecs > result->max_usecs)
+		result->max_usecs = usecs;
+}
+
+static bool bench_random_pct(unsigned int pct)
+{
+	return (unsigned int)(rand() % 100) < pct;
+}
+
+static void bench_index_error(struct mail_index *index, const char *func)
+{
+	i_fatal("%s() failed: %s", func, mail_index_get_error_message(index));
+}
+
+static void bench_index_alloc(struct bench_context *ctx)
+{
+	ctx->index = mail_index_alloc(ctx->set->dir, BENCH_INDEX_PREFIX);
+	mail_index_set_fsync_mode(ctx->index, FSYNC_MODE_NEVER, 0);
+}
+
+static void bench_cache_fields_register(struct bench_context *ctx)
+{
+	struct mail_cache *cache = mail_index_get_cache(ctx->index);
+
+	mail_cache_register_fields(cache, ctx->cache_fields,
+				   ctx->set->cache_fields_count);
+}
+
+static void bench_keywords_init(struct bench_context *ctx)
+{
+	const char *names[2] = { NULL, NULL };
+	unsigned int i;
+
+	for (i = 0; i < ctx->set->keywords_count; i++) {
+		names[0] = t_strdup_printf("keyword%u", i);
+		ctx->keywords[i] = mail_index_keywords_create(ctx->index, names);
+	}
+}
+
+static void bench_keywords_deinit(struct bench_context *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->set->keywords_count; i++)
+		mail_index_keywords_unref(&ctx->keywords[i]);
+}
+
+static void bench_sync(struct bench_context *ctx)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+
+	if (mail_index_sync_begin(ctx->index, &sync_ctx, &view, &trans, 0) < 0)
+		bench_index_error(ctx->index, "mail_index_sync_begin");
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		bench_index_error(ctx->index, "mail_index_sync_commit");
+}
+
+static void
+bench_append_messages(struct bench_context *ctx, unsigned int count)
+{
+	const struct bench_settings *set = ctx->set;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_transaction_ctx *cache_trans;
+	const struct mail_index_header *hdr;
+	enum mail_flags flags;
+	uint32_t seq, uid_validity = ioloop_time;
+	unsigned int i, j;
+
+	view = mail_index_view_open(ctx->index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(ctx->index),
+					  view);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+
+	hdr = mail_index_get_header(view);
+	if (hdr->uid_validity == 0) {
+		mail_index_update_header(trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+	}
+
+	for (i = 0; i < count; i++) {
+		mail_index_append(trans, hdr->next_uid + i, &seq);
+
+		flags = 0;
+		if (bench_random_pct(set->seen_pct))
+			flags |= MAIL_SEEN;
+		if (bench_random_pct(set->deleted_pct))
+			flags |= MAIL_DELETED;
+		if (bench_random_pct(set->flagged_pct))
+			flags |= MAIL_FLAGGED;
+		if (flags != 0)
+			mail_index_update_flags(trans, seq, MODIFY_REPLACE, flags);
+
+		for (j = 0; j < set->keywords_count; j++) {
+			if (bench_random_pct(set->keyword_pct)) {
+				mail_index_update_keywords(trans, seq,
+							   MODIFY_ADD,
+							   ctx->keywords[j]);
+			}
+		}
+		for (j = 0; j < set->cache_fields_count; j++) {
+			mail_cache_add(cache_trans, seq,
+				       ctx->cache_fields[j].idx,
+				       BENCH_CACHE_FIELD_VALUE,
+				       strlen(BENCH_CACHE_FIELD_VALUE));
+		}
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		bench_index_error(ctx->index, "mail_index_transaction_commit");
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	bench_sync(ctx);
+}
+
+static void bench_generate(struct bench_context *ctx)
+{
+	const struct bench_settings *set = ctx->set;
+	unsigned int i;
+
+	srand(set->seed);
+
+	ctx->cache_fields = p_new(ctx->pool, struct mail_cache_field,
+				  I_MAX(set->cache_fields_count, 1));
+	for (i = 0; i < set->cache_fields_count; i++) {
+		ctx->cache_fields[i].name =
+			p_strdup_printf(ctx->pool, "bench.field%u", i);
+		ctx->cache_fields[i].type = MAIL_CACHE_FIELD_STRING;
+		ctx->cache_fields[i].decision = MAIL_CACHE_DECISION_YES;
+	}
+
+	bench_start();
+	bench_index_alloc(ctx);
+	if (mail_index_open_or_create(ctx->index,
+				      MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		bench_index_error(ctx->index, "mail_index_open_or_create");
+	bench_cache_fields_register(ctx);
+
+	ctx->keywords = p_new(ctx->pool, struct mail_keywords *,
+			      I_MAX(set->keywords_count, 1));
+	bench_keywords_init(ctx);
+
+	bench_append_messages(ctx, set->messages_count);
+	bench_stop(ctx, "generate");
+
+	bench_keywords_deinit(ctx);
+	mail_index_close(ctx->index);
+	mail_index_free(&ctx->index);
+}
+
+static void bench_open(struct bench_context *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->set->iterations; i++) {
+		bench_index_alloc(ctx);
+		bench_start();
+		if (mail_index_open(ctx->index, 0) <= 0)
+			bench_index_error(ctx->index, "mail_index_open");
+		bench_stop(ctx, "index_open");
+		mail_index_close(ctx->index);
+		mail_index_free(&ctx->index);
+	}
+}
+
+static void
+bench_update_random_flags(struct bench_context *ctx)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, messages_count;
+	unsigned int i, count;
+
+	view = mail_index_view_open(ctx->index);
+	messages_count = mail_index_view_get_messages_count(view);
+	count = I_MAX(messages_count / 100, 1);
+
+	trans = mail_index_transaction_begin(view, 0);
+	for (i = 0; i < count; i++) {
+		seq = rand() % messages_count + 1;
+		mail_index_update_flags(trans, seq, MODIFY_REPLACE,
+					rand() % 2 == 0 ? MAIL_SEEN : 0);
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		bench_index_error(ctx->index, "mail_index_transaction_commit");
+	mail_index_view_close(&view);
+}
+
+static void bench_index_sync(struct bench_context *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->set->iterations; i++) {
+		bench_update_random_flags(ctx);
+		bench_start();
+		bench_sync(ctx);
+		bench_stop(ctx, "index_sync");
+	}
+}
+
+static void bench_view_sync(struct bench_context *ctx)
+{
+	struct mail_index_view *view;
+	struct mail_index_view_sync_ctx *sync_ctx;
+	struct mail_index_view_sync_rec sync_rec;
+	bool delayed_expunges;
+	unsigned int i;
+
+	view = mail_index_view_open(ctx->index);
+	for (i = 0; i < ctx->set->iterations; i++) {
+		bench_update_random_flags(ctx);
+		bench_start();
+		sync_ctx = mail_index_view_sync_begin(view, 0);
+		while (mail_index_view_sync_next(sync_ctx, &sync_rec)) ;
+		if (mail_index_view_sync_commit(&sync_ctx,
+						&delayed_expunges) < 0)
+			bench_index_error(ctx->index, "mail_index_view_sync_commit");
+		bench_stop(ctx, "view_sync");
+	}
+	mail_index_view_close(&view);
+}
+
+static void
+bench_flag_update_all(struct bench_context *ctx, const char *name,
+		      enum modify_type modify_type, enum mail_flags flags)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+
+	bench_start();
+	view = mail_index_view_open(ctx->index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_flags_range(trans, 1,
+		mail_index_view_get_messages_count(view), modify_type, flags);
+	if (mail_index_transaction_commit(&trans) < 0)
+		bench_index_error(ctx->index, "mail_index_transaction_commit");
+	mail_index_view_close(&view);
+	bench_sync(ctx);
+	bench_stop(ctx, name);
+}
+
+static void bench_flag_updates(struct bench_context *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->set->iterations; i++) {
+		/* flags with counters in the index header */
+		bench_flag_update_all(ctx, "flag_update_seen",
+				      MODIFY_ADD, MAIL_SEEN);
+		bench_flag_update_all(ctx, "flag_update_seen",
+				      MODIFY_REMOVE, MAIL_SEEN);
+		bench_flag_update_all(ctx, "flag_update_deleted",
+				      MODIFY_ADD, MAIL_DELETED);
+		bench_flag_update_all(ctx, "flag_update_deleted",
+				      MODIFY_REMOVE, MAIL_DELETED);
+		/* flags without counters */
+		bench_flag_update_all(ctx, "flag_update_flagged",
+				      MODIFY_ADD, MAIL_FLAGGED);
+		bench_flag_update_all(ctx, "flag_update_flagged",
+				      MODIFY_REMOVE, MAIL_FLAGGED);
+	}
+}
+
+static void bench_cache_lookup(struct bench_context *ctx)
+{
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	buffer_t *buf;
+	uint32_t seq, messages_count;
+	unsigned int i, j;
+
+	if (ctx->set->cache_fields_count == 0)
+		return;
+
+	buf = buffer_create_dynamic(default_pool, 128);
+	view = mail_index_view_open(ctx->index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(ctx->index),
+					  view);
+	messages_count = mail_index_view_get_messages_count(view);
+	for (i = 0; i < ctx->set->iterations; i++) {
+		bench_start();
+		for (seq = 1; seq <= messages_count; seq++) {
+			for (j = 0; j < ctx->set->cache_fields_count; j++) {
+				buffer_set_used_size(buf, 0);
+				if (mail_cache_lookup_field(cache_view, buf, seq,
+						ctx->cache_fields[j].idx) < 0) {
+					bench_index_error(ctx->index,
+						"mail_cache_lookup_field");
+				}
+			}
+		}
+		bench_stop(ctx, "cache_lookup_all");
+	}
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	buffer_free(&buf);
+}
+
+static void bench_append(struct bench_context *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->set->iterations; i++) {
+		bench_start();
+		bench_append_messages(ctx, ctx->set->append_count);
+		bench_stop(ctx, "transaction_append");
+	}
+}
+
+static void bench_results_print(struct bench_context *ctx)
+{
+	const struct bench_settings *set = ctx->set;
+	const struct bench_result *result;
+	string_t *str = t_str_new(1024);
+
+	str_printfa(str, "{\"messages\":%u,\"iterations\":%u,"
+		    "\"seen_pct\":%u,\"deleted_pct\":%u,\"flagged_pct\":%u,"
+		    "\"keywords\":%u,\"keyword_pct\":%u,\"cache_fields\":%u,"
+		    "\"append_count\":%u,\"seed\":%u,\"results\":{",
+		    set->messages_count, set->iterations,
+		    set->seen_pct, set->deleted_pct, set->flagged_pct,
+		    set->keywords_count, set->keyword_pct,
+		    set->cache_fields_count, set->append_count, set->seed);
+	array_foreach(&ctx->results, result) {
+		if (result != array_idx(&ctx->results, 0))
+			str_append_c(str, ',');
+		str_append_c(str, '"');
+		json_append_escaped(str, result->name);
+		str_printfa(str, "\":{\"count\":%u,\"total_usecs\":%llu,"
+			    "\"avg_usecs\":%llu,\"min_usecs\":%llu,"
+			    "\"max_usecs\":%llu}", result->count,
+			    result->total_usecs,
+			    result->total_usecs / result->count,
+			    result->min_usecs, result->max_usecs);
+	}
+	str_append(str, "}}\n");
+	fwrite(str_data(str), 1, str_len(str), stdout);
+}
+
+static void ATTR_NORETURN usage(void)
+{
+	i_fatal("Usage: test-mail-index-bench [-n <messages>] "
+		"[-i <iterations>] [-s <seen%%>] [-d <deleted%%>] "
+		"[-f <flagged%%>] [-k <keywords>] [-K <keyword%%>] "
+		"[-c <cache fields>] [-a <appends>] [-r <seed>] [-D <dir>] "
+		"[-m all|flags]");
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_settings set;
+	struct bench_context ctx;
+	struct ioloop *ioloop;
+	bool keep_dir = FALSE;
+	int c;
+
+	lib_init();
+	ioloop = io_loop_create();
+
+	memset(&set, 0, sizeof(set));
+	set.messages_count = 100000;
+	set.iterations = 10;
+	set.seen_pct = 90;
+	set.deleted_pct = 1;
+	set.flagged_pct = 5;
+	set.keywords_count = 5;
+	set.keyword_pct = 10;
+	set.cache_fields_count = 5;
+	set.append_count = 100;
+	set.seed = 1;
+
+	while ((c = getopt(argc, argv, "n:i:s:d:f:k:K:c:a:r:D:m:")) > 0) {
+		switch (c) {
+		case 'n':
+			if (str_to_uint(optarg, &set.messages_count) < 0)
+				usage();
+			break;
+		case 'i':
+			if (str_to_uint(optarg, &set.iterations) < 0)
+				usage();
+			break;
+		case 's':
+			if (str_to_uint(optarg, &set.seen_pct) < 0)
+				usage();
+			break;
+		case 'd':
+			if (str_to_uint(optarg, &set.deleted_pct) < 0)
+				usage();
+			break;
+		case 'f':
+			if (str_to_uint(optarg, &set.flagged_pct) < 0)
+				usage();
+			break;
+		case 'k':
+			if (str_to_uint(optarg, &set.keywords_count) < 0)
+				usage();
+			break;
+		case 'K':
+			if (str_to_uint(optarg, &set.keyword_pct) < 0)
+				usage();
+			break;
+		case 'c':
+			if (str_to_uint(optarg, &set.cache_fields_count) < 0)
+				usage();
+			break;
+		case 'a':
+			if (str_to_uint(optarg, &set.append_count) < 0)
+				usage();
+			break;
+		case 'r':
+			if (str_to_uint(optarg, &set.seed) < 0)
+				usage();
+			break;
+		case 'D':
+			set.dir = optarg;
+			keep_dir = TRUE;
+			break;
+		case 'm':
+			if (strcmp(optarg, "flags") == 0)
+				set.flags_only = TRUE;
+			else if (strcmp(optarg, "all") != 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (set.messages_count == 0 || set.iterations == 0)
+		usage();
+
+	if (set.dir == NULL)
+		set.dir = t_strdup_printf("/tmp/dovecot-index-bench.%s", my_pid);
+	if (mkdir(set.dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", set.dir);
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.pool = pool_alloconly_create("index bench", 1024);
+	ctx.set = &set;
+	i_array_init(&ctx.results, 8);
+
+	bench_generate(&ctx);
+
+	if (!set.flags_only)
+		bench_open(&ctx);
+
+	bench_index_alloc(&ctx);
+	if (mail_index_open(ctx.index, 0) <= 0)
+		bench_index_error(ctx.index, "mail_index_open");
+	bench_cache_fields_register(&ctx);
+	bench_keywords_init(&ctx);
+	if (!set.flags_only) {
+		bench_index_sync(&ctx);
+		bench_view_sync(&ctx);
+		bench_cache_lookup(&ctx);
+		bench_append(&ctx);
+	}
+	bench_flag_updates(&ctx);
+
+	bench_keywords_deinit(&ctx);
+	mail_index_close(ctx.index);
+	mail_index_free(&ctx.index);
+
+	bench_results_print(&ctx);
+
+	if (!keep_dir &&
+	    unlink_directory(set.dir, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_error("unlink_directory(%s) failed: %m", set.dir);
+
+	array_free(&ctx.results);
+	pool_unref(&ctx.pool);
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
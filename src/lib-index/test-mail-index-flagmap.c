@@ -0,0 +1,217 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+
+#include <stdlib.h>
+
+#define TEST_RECORDS_COUNT 257
+#define TEST_KEYWORDS_COUNT 16
+
+struct test_record {
+	struct mail_index_record rec;
+	uint8_t keywords[TEST_KEYWORDS_COUNT / 8];
+};
+
+bool mail_index_map_get_ext_idx(struct mail_index_map *map ATTR_UNUSED,
+				uint32_t ext_id, uint32_t *idx_r)
+{
+	*idx_r = ext_id;
+	return TRUE;
+}
+
+static struct mail_index_map *test_map_init(void)
+{
+	struct mail_index_map *map;
+	struct mail_index_ext *ext;
+	struct test_record *recs;
+	unsigned int i;
+
+	map = t_new(struct mail_index_map, 1);
+	map->index = t_new(struct mail_index, 1);
+	map->hdr.record_size = sizeof(struct test_record);
+	map->rec_map = t_new(struct mail_index_record_map, 1);
+	map->rec_map->records_count = TEST_RECORDS_COUNT;
+	map->hdr.messages_count = TEST_RECORDS_COUNT;
+
+	recs = t_new(struct test_record, TEST_RECORDS_COUNT + 1);
+	for (i = 0; i < TEST_RECORDS_COUNT; i++) {
+		recs[i].rec.uid = i + 1;
+		recs[i].rec.flags = rand() % 64;
+		recs[i].keywords[0] = rand() % 256;
+		recs[i].keywords[1] = rand() % 256;
+	}
+	map->rec_map->records = recs;
+
+	t_array_init(&map->extensions, 1);
+	ext = array_append_space(&map->extensions);
+	ext->record_offset = offsetof(struct test_record, keywords);
+	ext->record_size = sizeof(recs[0].keywords);
+
+	/* file keyword index -> index keyword index */
+	t_array_init(&map->keyword_idx_map, TEST_KEYWORDS_COUNT);
+	for (i = 0; i < TEST_KEYWORDS_COUNT; i++)
+		array_append(&map->keyword_idx_map, &i, 1);
+	return map;
+}
+
+static bool
+test_record_has_keyword(struct mail_index_map *map, uint32_t seq,
+			unsigned int file_idx)
+{
+	const struct test_record *rec =
+		(const void *)MAIL_INDEX_REC_AT_SEQ(map, seq);
+
+	return (rec->keywords[file_idx / 8] & (1 << (file_idx % 8))) != 0;
+}
+
+static bool
+test_filter_match(struct mail_index_map *map, uint32_t seq,
+		  const struct mail_index_flag_filter *filter)
+{
+	const struct mail_index_record *rec = MAIL_INDEX_REC_AT_SEQ(map, seq);
+	unsigned int i;
+	bool match;
+
+	match = (rec->flags & filter->flags) == filter->flags;
+	for (i = 0; filter->keywords != NULL && i < filter->keywords->count; i++) {
+		if (!test_record_has_keyword(map, seq, filter->keywords->idx[i]))
+			match = FALSE;
+	}
+	return match != filter->match_not;
+}
+
+static bool
+test_lookup_verify(struct mail_index_map *map, uint32_t seq1, uint32_t seq2,
+		   const struct mail_index_flag_filter *filters,
+		   unsigned int filters_count)
+{
+	ARRAY_TYPE(seq_range) seqs;
+	uint32_t seq;
+	unsigned int i;
+	bool match, ret = TRUE;
+
+	t_array_init(&seqs, 32);
+	if (!mail_index_map_flagmap_lookup(map, seq1, seq2, filters,
+					   filters_count, &seqs))
+		return FALSE;
+
+	for (seq = 1; seq <= map->rec_map->records_count; seq++) {
+		match = seq >= seq1 && seq <= seq2;
+		for (i = 0; i < filters_count && match; i++)
+			match = test_filter_match(map, seq, &filters[i]);
+		if (match != seq_range_exists(&seqs, seq))
+			ret = FALSE;
+	}
+	return ret;
+}
+
+static struct mail_keywords *test_keywords(unsigned int idx)
+{
+	struct mail_keywords *keywords;
+
+	keywords = t_malloc0(sizeof(*keywords));
+	keywords->count = 1;
+	keywords->idx[0] = idx;
+	return keywords;
+}
+
+static void test_mail_index_flagmap_lookup(void)
+{
+	struct mail_index_map *map;
+	struct mail_index_flag_filter filters[3];
+	unsigned int i;
+
+	test_begin("mail index flagmap lookup");
+	map = test_map_init();
+
+	memset(filters, 0, sizeof(filters));
+	filters[0].flags = MAIL_SEEN;
+	test_assert(test_lookup_verify(map, 1, TEST_RECORDS_COUNT, filters, 1));
+	test_assert(test_lookup_verify(map, 5, 5, filters, 1));
+	test_assert(test_lookup_verify(map, 63, 129, filters, 1));
+
+	filters[0].flags = MAIL_SEEN | MAIL_FLAGGED;
+	filters[0].match_not = TRUE;
+	test_assert(test_lookup_verify(map, 2, TEST_RECORDS_COUNT-1, filters, 1));
+
+	filters[0].flags = MAIL_DELETED;
+	filters[0].match_not = FALSE;
+	filters[1].keywords = test_keywords(3);
+	filters[2].keywords = test_keywords(12);
+	filters[2].match_not = TRUE;
+	for (i = 0; i < 20; i++) {
+		uint32_t seq1 = rand() % TEST_RECORDS_COUNT + 1;
+		uint32_t seq2 = seq1 + rand() % (TEST_RECORDS_COUNT - seq1 + 1);
+
+		test_assert(test_lookup_verify(map, seq1, seq2, filters, 3));
+	}
+	mail_index_map_flagmap_free(&map->rec_map->flagmap);
+	test_end();
+}
+
+static void test_mail_index_flagmap_update(void)
+{
+	struct mail_index_map *map;
+	struct mail_index_flag_filter filters[2];
+	struct test_record *rec;
+	uint32_t seq;
+
+	test_begin("mail index flagmap update");
+	map = test_map_init();
+
+	memset(filters, 0, sizeof(filters));
+	filters[0].flags = MAIL_ANSWERED;
+	filters[1].keywords = test_keywords(9);
+	test_assert(test_lookup_verify(map, 1, TEST_RECORDS_COUNT, filters, 2));
+
+	/* flag updates spanning several words */
+	for (seq = 10; seq <= 200; seq++)
+		MAIL_INDEX_REC_AT_SEQ(map, seq)->flags |= MAIL_ANSWERED;
+	mail_index_map_flagmap_update_flags(map, 10, 200, MAIL_ANSWERED, 0);
+	for (seq = 60; seq <= 70; seq++)
+		MAIL_INDEX_REC_AT_SEQ(map, seq)->flags &= ~MAIL_ANSWERED;
+	mail_index_map_flagmap_update_flags(map, 60, 70, 0, MAIL_ANSWERED);
+	test_assert(test_lookup_verify(map, 1, TEST_RECORDS_COUNT, filters, 2));
+
+	/* keyword updates */
+	for (seq = 100; seq <= 130; seq++) {
+		rec = (void *)MAIL_INDEX_REC_AT_SEQ(map, seq);
+		rec->keywords[1] |= 1 << (9 % 8);
+	}
+	mail_index_map_flagmap_update_keyword(map, 9, 100, 130, TRUE);
+	test_assert(test_lookup_verify(map, 1, TEST_RECORDS_COUNT, filters, 2));
+
+	for (seq = 1; seq <= 128; seq++) {
+		rec = (void *)MAIL_INDEX_REC_AT_SEQ(map, seq);
+		memset(rec->keywords, 0, sizeof(rec->keywords));
+	}
+	mail_index_map_flagmap_reset_keywords(map, 1, 128);
+	test_assert(test_lookup_verify(map, 1, TEST_RECORDS_COUNT, filters, 2));
+
+	/* appends crossing a word boundary */
+	map->rec_map->records_count--;
+	mail_index_map_flagmap_free(&map->rec_map->flagmap);
+	test_assert(test_lookup_verify(map, 1, TEST_RECORDS_COUNT-1, filters, 2));
+	map->rec_map->records_count++;
+	mail_index_map_flagmap_append(map);
+	test_assert(test_lookup_verify(map, 1, TEST_RECORDS_COUNT, filters, 2));
+
+	/* a mismatching records_count makes it rebuild the bitmaps */
+	map->rec_map->records_count -= 10;
+	test_assert(test_lookup_verify(map, 1, TEST_RECORDS_COUNT-10, filters, 2));
+	mail_index_map_flagmap_free(&map->rec_map->flagmap);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_index_flagmap_lookup,
+		test_mail_index_flagmap_update,
+		NULL
+	};
+	return test_run(test_functions);
+}
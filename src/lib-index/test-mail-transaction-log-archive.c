@@ -0,0 +1,254 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "write-full.h"
+#include "read-full.h"
+#include "test-common.h"
+#include "compression.h"
+#include "mail-transaction-log-archive.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define TEST_LOG_PATH ".test-log-archive.log"
+#define TEST_ARCHIVE_PATH ".test-log-archive.log.2"
+#define TEST_LOG_SIZE (MAIL_TRANSACTION_LOG_ARCHIVE_BLOCK_SIZE*3 + 1234)
+
+static unsigned char test_data[TEST_LOG_SIZE];
+
+static int test_open_file(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	return fd;
+}
+
+static int test_create_log(void)
+{
+	unsigned int i;
+	int fd;
+
+	/* semi-compressible data */
+	for (i = 0; i < TEST_LOG_SIZE; i++)
+		test_data[i] = rand() % 3 == 0 ? rand() % 4 : (int)i;
+	test_data[0] = 1;
+
+	fd = test_open_file(TEST_LOG_PATH);
+	if (write_full(fd, test_data, sizeof(test_data)) < 0)
+		i_fatal("write(%s) failed: %m", TEST_LOG_PATH);
+	return fd;
+}
+
+static void
+test_archive_read(struct mail_transaction_log_archive *archive,
+		  uoff_t offset, size_t size)
+{
+	static unsigned char buf[TEST_LOG_SIZE];
+	size_t expected_size;
+	ssize_t ret;
+
+	i_assert(size <= sizeof(buf));
+	expected_size = offset >= TEST_LOG_SIZE ? 0 :
+		I_MIN(size, TEST_LOG_SIZE - offset);
+
+	ret = mail_transaction_log_archive_pread(archive, buf, size, offset);
+	test_assert(ret == (ssize_t)expected_size);
+	if (ret > 0)
+		test_assert(memcmp(buf, test_data + offset, ret) == 0);
+}
+
+static void
+test_mail_transaction_log_archive_handler(const struct compression_handler *handler)
+{
+	struct mail_transaction_log_archive *archive;
+	const char *error;
+	unsigned int i;
+	int log_fd, fd;
+
+	test_begin(t_strdup_printf("mail transaction log archive %s",
+				   handler->name));
+	log_fd = test_create_log();
+	fd = test_open_file(TEST_ARCHIVE_PATH);
+	test_assert(mail_transaction_log_archive_write(log_fd, TEST_LOG_SIZE, fd,
+		handler, 6, &error) == 0);
+
+	test_assert(mail_transaction_log_archive_open(fd, TEST_ARCHIVE_PATH,
+		handler, &archive, &error) == 1);
+	test_assert(mail_transaction_log_archive_get_size(archive) == TEST_LOG_SIZE);
+
+	/* whole file, block boundaries and reads past EOF */
+	test_archive_read(archive, 0, TEST_LOG_SIZE - 1);
+	test_archive_read(archive, TEST_LOG_SIZE - 1, 1);
+	test_archive_read(archive, MAIL_TRANSACTION_LOG_ARCHIVE_BLOCK_SIZE - 10, 20);
+	test_archive_read(archive, TEST_LOG_SIZE - 100, 1000);
+	test_archive_read(archive, TEST_LOG_SIZE, 10);
+	for (i = 0; i < 50; i++)
+		test_archive_read(archive, rand() % TEST_LOG_SIZE, rand() % 10000);
+	mail_transaction_log_archive_free(&archive);
+
+	/* a plain log file isn't an archive */
+	test_assert(mail_transaction_log_archive_open(log_fd, TEST_LOG_PATH,
+		handler, &archive, &error) == 0);
+
+	i_close_fd(&fd);
+	i_close_fd(&log_fd);
+	test_end();
+}
+
+static void test_mail_transaction_log_archive(void)
+{
+	unsigned int i;
+
+	for (i = 0; compression_handlers[i].name != NULL; i++) {
+		const struct compression_handler *handler =
+			&compression_handlers[i];
+
+		/* raw deflate streams don't have an end marker, so they
+		   can't be used for archiving */
+		if (handler->is_compressed != NULL &&
+		    handler->create_ostream != NULL) T_BEGIN {
+			test_mail_transaction_log_archive_handler(handler);
+		} T_END;
+	}
+}
+
+static void test_mail_transaction_log_archive_wrong_handler(void)
+{
+	const struct compression_handler *gz, *bz2;
+	struct mail_transaction_log_archive *archive;
+	const char *error;
+	int log_fd, fd;
+
+	gz = compression_lookup_handler("gz");
+	bz2 = compression_lookup_handler("bz2");
+	if (gz == NULL || gz->create_ostream == NULL || bz2 == NULL)
+		return;
+
+	test_begin("mail transaction log archive wrong handler");
+	log_fd = test_create_log();
+	fd = test_open_file(TEST_ARCHIVE_PATH);
+	test_assert(mail_transaction_log_archive_write(log_fd, TEST_LOG_SIZE, fd,
+		gz, 6, &error) == 0);
+	test_assert(mail_transaction_log_archive_open(fd, TEST_ARCHIVE_PATH,
+		bz2, &archive, &error) == -1);
+	test_assert(mail_transaction_log_archive_open(fd, TEST_ARCHIVE_PATH,
+		NULL, &archive, &error) == -1);
+	i_close_fd(&fd);
+	i_close_fd(&log_fd);
+	test_end();
+}
+
+static void
+test_archive_corrupt(int fd, const struct compression_handler *handler,
+		     uoff_t offset, const void *data, size_t size)
+{
+	struct mail_transaction_log_archive_header orig_hdr;
+	struct mail_transaction_log_archive *archive;
+	uint64_t orig_offset;
+	const char *error;
+
+	if (pread_full(fd, &orig_hdr, sizeof(orig_hdr), 0) <= 0 ||
+	    pread_full(fd, &orig_offset, sizeof(orig_offset), offset) <= 0)
+		i_fatal("pread(%s) failed: %m", TEST_ARCHIVE_PATH);
+	if (pwrite_full(fd, data, size, offset) < 0)
+		i_fatal("pwrite(%s) failed: %m", TEST_ARCHIVE_PATH);
+	test_assert(mail_transaction_log_archive_open(fd, TEST_ARCHIVE_PATH,
+		handler, &archive, &error) == -2);
+	if (pwrite_full(fd, &orig_hdr, sizeof(orig_hdr), 0) < 0 ||
+	    pwrite_full(fd, &orig_offset, sizeof(orig_offset), offset) < 0)
+		i_fatal("pwrite(%s) failed: %m", TEST_ARCHIVE_PATH);
+}
+
+static void test_mail_transaction_log_archive_corrupted(void)
+{
+	const struct compression_handler *gz;
+	struct mail_transaction_log_archive *archive;
+	struct stat st;
+	const char *error;
+	uint64_t offset64;
+	uint32_t value32;
+	uoff_t offsets_pos;
+	int log_fd, fd;
+
+	gz = compression_lookup_handler("gz");
+	if (gz == NULL || gz->create_ostream == NULL)
+		return;
+
+	test_begin("mail transaction log archive corrupted");
+	log_fd = test_create_log();
+	fd = test_open_file(TEST_ARCHIVE_PATH);
+	test_assert(mail_transaction_log_archive_write(log_fd, TEST_LOG_SIZE, fd,
+		gz, 6, &error) == 0);
+	offsets_pos = sizeof(struct mail_transaction_log_archive_header);
+
+	/* broken header fields */
+	value32 = 0;
+	test_archive_corrupt(fd, gz, offsetof(struct mail_transaction_log_archive_header,
+		block_size), &value32, sizeof(value32));
+	value32 = (uint32_t)-1;
+	test_archive_corrupt(fd, gz, offsetof(struct mail_transaction_log_archive_header,
+		block_size), &value32, sizeof(value32));
+	test_archive_corrupt(fd, gz, offsetof(struct mail_transaction_log_archive_header,
+		blocks_count), &value32, sizeof(value32));
+	offset64 = (uint64_t)-1;
+	test_archive_corrupt(fd, gz, offsetof(struct mail_transaction_log_archive_header,
+		uncompressed_size), &offset64, sizeof(offset64));
+	offset64 = TEST_LOG_SIZE + MAIL_TRANSACTION_LOG_ARCHIVE_BLOCK_SIZE;
+	test_archive_corrupt(fd, gz, offsetof(struct mail_transaction_log_archive_header,
+		uncompressed_size), &offset64, sizeof(offset64));
+
+	/* block offsets outside the file */
+	offset64 = 0;
+	test_archive_corrupt(fd, gz, offsets_pos, &offset64, sizeof(offset64));
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", TEST_ARCHIVE_PATH);
+	offset64 = st.st_size + 1;
+	test_archive_corrupt(fd, gz, offsets_pos + 4*sizeof(uint64_t),
+			     &offset64, sizeof(offset64));
+
+	/* still fine after the restores */
+	test_assert(mail_transaction_log_archive_open(fd, TEST_ARCHIVE_PATH,
+		gz, &archive, &error) == 1);
+	mail_transaction_log_archive_free(&archive);
+
+	/* truncated in the middle of the block table */
+	if (ftruncate(fd, offsets_pos + 2*sizeof(uint64_t)) < 0)
+		i_fatal("ftruncate(%s) failed: %m", TEST_ARCHIVE_PATH);
+	test_assert(mail_transaction_log_archive_open(fd, TEST_ARCHIVE_PATH,
+		gz, &archive, &error) == -2);
+
+	/* truncated in the middle of the blocks */
+	test_assert(mail_transaction_log_archive_write(log_fd, TEST_LOG_SIZE, fd,
+		gz, 6, &error) == 0);
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", TEST_ARCHIVE_PATH);
+	if (ftruncate(fd, st.st_size - 10) < 0)
+		i_fatal("ftruncate(%s) failed: %m", TEST_ARCHIVE_PATH);
+	test_assert(mail_transaction_log_archive_open(fd, TEST_ARCHIVE_PATH,
+		gz, &archive, &error) == -2);
+
+	i_close_fd(&fd);
+	i_close_fd(&log_fd);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_transaction_log_archive,
+		test_mail_transaction_log_archive_wrong_handler,
+		test_mail_transaction_log_archive_corrupted,
+		NULL
+	};
+	int ret;
+
+	ret = test_run(test_functions);
+	(void)unlink(TEST_LOG_PATH);
+	(void)unlink(TEST_ARCHIVE_PATH);
+	return ret;
+}
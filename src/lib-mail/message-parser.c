@@ -251,6 +251,29 @@ boundary_line_find(struct message_parser_ctx *ctx,
 	return 1;
 }
 
+static const unsigned char *
+boundary_line_next(const unsigned char *cur, const unsigned char *end)
+{
+	const unsigned char *p;
+
+	/* Return the beginning of the next line that may be a boundary line.
+	   Only lines beginning with '-' can be, and '-' is rare in most
+	   message bodies (base64 never contains it), so it's a lot faster to
+	   let memchr() look for it than to go through the data line by line.
+	   The caller guarantees that cur[-1] is accessible. */
+	while ((p = memchr(cur, '-', end - cur)) != NULL) {
+		if (p[-1] == '\n')
+			return p;
+		cur = p + 1;
+	}
+	/* the last line may still be too short to know */
+	if (cur < end && end[-2] == '\n')
+		return end - 1;
+	if (end[-1] == '\n')
+		return end;
+	return NULL;
+}
+
 static int parse_next_mime_header_init(struct message_parser_ctx *ctx,
 				       struct message_block *block_r)
 {
@@ -353,7 +376,7 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 				       struct message_block *block_r)
 {
 	struct message_boundary *boundary = NULL;
-	const unsigned char *data, *cur, *next, *end;
+	const unsigned char *data, *cur, *line, *end;
 	size_t boundary_start;
 	int ret;
 	bool full;
@@ -376,14 +399,12 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 	i_assert(block_r->size > 0);
 	boundary_start = 0;
 
-	/* skip to beginning of the next line. the first line was
+	/* check only the lines that may be boundaries. the first line was
 	   handled already. */
-	cur = data; end = data + block_r->size;
-	while ((next = memchr(cur, '\n', end - cur)) != NULL) {
-		cur = next + 1;
-
-		boundary_start = next - data;
-		if (next > data && next[-1] == '\r')
+	cur = data + 1; end = data + block_r->size;
+	while ((line = boundary_line_next(cur, end)) != NULL) {
+		boundary_start = (line - 1) - data;
+		if (line - 1 > data && line[-2] == '\r')
 			boundary_start--;
 
 		if (boundary_start != 0) {
@@ -392,21 +413,25 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 			full = FALSE;
 		}
 
-		ret = boundary_line_find(ctx, cur, end - cur, full, &boundary);
+		ret = boundary_line_find(ctx, line, end - line, full, &boundary);
 		if (ret >= 0) {
 			/* found / need more data */
 			if (ret == 0 && boundary_start == 0)
-				ctx->want_count += cur - block_r->data;
+				ctx->want_count += line - block_r->data;
 			break;
 		}
+		if (line == end)
+			break;
+		cur = line + 1;
 	}
 
-	if (next != NULL) {
+	if (line != NULL && ret >= 0) {
 		/* found / need more data */
-		i_assert(ret >= 0);
 		i_assert(!(ret == 0 && full));
-	} else if (boundary_start == 0) {
-		/* no linefeeds in this block. we can just skip it. */
+	} else if (boundary_start == 0 || line != NULL ||
+		   memchr(cur, '\n', end - cur) != NULL) {
+		/* none of the lines in this block can be boundaries.
+		   we can just skip it. */
 		ret = 0;
 		if (block_r->data[block_r->size-1] == '\r' && !ctx->eof) {
 			/* this may be the beginning of the \r\n--boundary */
@@ -414,8 +439,10 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 		}
 		boundary_start = block_r->size;
 	} else {
-		/* the boundary wasn't found from this data block,
-		   we'll need more data. */
+		/* the last line began with "--", but didn't match any of
+		   the boundaries yet. it may still be a boundary that is
+		   longer than what we have in this data block, so we'll need
+		   more data. */
 		ret = 0;
 		ctx->want_count = (block_r->size - boundary_start) + 1;
 	}
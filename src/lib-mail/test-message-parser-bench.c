@@ -0,0 +1,219 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "base64.h"
+#include "istream.h"
+#include "time-util.h"
+#include "message-parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+/* Measures message_parser throughput for generated multipart-heavy
+   messages. Usage:
+   test-message-parser-bench [<iterations> [<messages per corpus>]] */
+
+#define DEFAULT_ITERATIONS 20
+#define DEFAULT_MESSAGES_COUNT 50
+
+struct bench_corpus {
+	const char *name;
+	void (*generate)(string_t *dest, unsigned int msgnum);
+};
+
+static void gen_text_lines(string_t *dest, unsigned int lines,
+			   unsigned int dash_lines_per_100)
+{
+	unsigned int i, j, len;
+
+	for (i = 0; i < lines; i++) {
+		if ((unsigned int)rand() % 100 < dash_lines_per_100) {
+			/* signature separators, quoted boundaries, ASCII art */
+			str_append(dest, "-- ");
+		}
+		len = 20 + rand() % 50;
+		for (j = 0; j < len; j++)
+			str_append_c(dest, j % 6 == 5 ? ' ' : 'a' + rand() % 26);
+		str_append(dest, "\r\n");
+	}
+}
+
+static void gen_base64(string_t *dest, size_t size)
+{
+	buffer_t *src = buffer_create_dynamic(pool_datastack_create(), size);
+	string_t *encoded = t_str_new(MAX_BASE64_ENCODED_SIZE(size));
+	const unsigned char *p;
+	size_t i, left;
+
+	for (i = 0; i < size; i++)
+		buffer_append_c(src, rand() & 0xff);
+	base64_encode(src->data, src->used, encoded);
+
+	p = str_data(encoded);
+	for (left = str_len(encoded); left > 0; ) {
+		i = I_MIN(left, 76);
+		str_append_n(dest, p, i);
+		str_append(dest, "\r\n");
+		p += i; left -= i;
+	}
+}
+
+static void gen_headers(string_t *dest, unsigned int msgnum)
+{
+	str_printfa(dest,
+		"From: sender%u@example.com\r\n"
+		"To: rcpt@example.com\r\n"
+		"Subject: benchmark message %u\r\n"
+		"Message-ID: <%u.bench@example.com>\r\n"
+		"MIME-Version: 1.0\r\n", msgnum, msgnum, msgnum);
+}
+
+static void gen_attachments(string_t *dest, unsigned int msgnum)
+{
+	unsigned int i, count = 2 + rand() % 4;
+
+	gen_headers(dest, msgnum);
+	str_printfa(dest, "Content-Type: multipart/mixed; "
+		    "boundary=\"=_mixed_%u\"\r\n\r\n"
+		    "This is a multi-part message in MIME format.\r\n", msgnum);
+	str_printfa(dest, "\r\n--=_mixed_%u\r\n"
+		    "Content-Type: text/plain; charset=utf-8\r\n\r\n", msgnum);
+	gen_text_lines(dest, 30, 1);
+	for (i = 0; i < count; i++) {
+		str_printfa(dest, "\r\n--=_mixed_%u\r\n"
+			    "Content-Type: application/octet-stream\r\n"
+			    "Content-Transfer-Encoding: base64\r\n"
+			    "Content-Disposition: attachment; "
+			    "filename=\"file%u.bin\"\r\n\r\n", msgnum, i);
+		gen_base64(dest, 16*1024 + rand() % (128*1024));
+	}
+	str_printfa(dest, "\r\n--=_mixed_%u--\r\n", msgnum);
+}
+
+static void gen_nested(string_t *dest, unsigned int msgnum)
+{
+	unsigned int i, count = 20 + rand() % 20;
+
+	gen_headers(dest, msgnum);
+	str_printfa(dest, "Content-Type: multipart/mixed; "
+		    "boundary=\"=_outer_%u\"\r\n\r\n", msgnum);
+	for (i = 0; i < count; i++) {
+		str_printfa(dest, "--=_outer_%u\r\n"
+			    "Content-Type: multipart/alternative; "
+			    "boundary=\"=_alt_%u_%u\"\r\n\r\n", msgnum, msgnum, i);
+		str_printfa(dest, "--=_alt_%u_%u\r\n"
+			    "Content-Type: text/plain\r\n\r\n", msgnum, i);
+		gen_text_lines(dest, 10 + rand() % 40, 2);
+		str_printfa(dest, "--=_alt_%u_%u\r\n"
+			    "Content-Type: text/html\r\n\r\n", msgnum, i);
+		gen_text_lines(dest, 20 + rand() % 80, 0);
+		str_printfa(dest, "--=_alt_%u_%u--\r\n", msgnum, i);
+	}
+	str_printfa(dest, "--=_outer_%u--\r\n", msgnum);
+}
+
+static void gen_digest(string_t *dest, unsigned int msgnum)
+{
+	unsigned int i, count = 30 + rand() % 30;
+
+	/* mailing list digest with lots of quoted text and dash lines */
+	gen_headers(dest, msgnum);
+	str_printfa(dest, "Content-Type: multipart/digest; "
+		    "boundary=\"----------digest%u\"\r\n\r\n", msgnum);
+	for (i = 0; i < count; i++) {
+		str_printfa(dest, "------------digest%u\r\n\r\n", msgnum);
+		gen_headers(dest, i);
+		str_append(dest, "\r\n");
+		gen_text_lines(dest, 20 + rand() % 60, 10);
+		str_append(dest, "--\r\nlist signature\r\n");
+	}
+	str_printfa(dest, "------------digest%u--\r\n", msgnum);
+}
+
+static const struct bench_corpus corpora[] = {
+	{ "attachments", gen_attachments },
+	{ "nested", gen_nested },
+	{ "digest", gen_digest }
+};
+
+static void parse_message(const unsigned char *data, size_t size)
+{
+	struct message_parser_ctx *parser;
+	struct message_block block;
+	struct message_part *parts;
+	struct istream *input;
+	pool_t pool;
+	int ret;
+
+	pool = pool_alloconly_create("message parser bench", 10240);
+	input = i_stream_create_from_data(data, size);
+	parser = message_parser_init(pool, input, 0, 0);
+	while ((ret = message_parser_parse_next_block(parser, &block)) > 0) ;
+	i_assert(ret < 0);
+	if (message_parser_deinit(&parser, &parts) < 0)
+		i_fatal("message_parser_deinit() failed");
+	i_stream_unref(&input);
+	pool_unref(&pool);
+}
+
+static void bench_corpus(const struct bench_corpus *corpus,
+			 unsigned int iterations, unsigned int messages_count)
+{
+	ARRAY(string_t *) msgs;
+	string_t *const *msgp;
+	struct timeval tv_start, tv_end;
+	unsigned long long usecs, total_size = 0;
+	unsigned int i;
+
+	srand(1);
+	i_array_init(&msgs, messages_count);
+	for (i = 0; i < messages_count; i++) {
+		string_t *msg = str_new(default_pool, 1024*64);
+
+		T_BEGIN {
+			corpus->generate(msg, i);
+		} T_END;
+		total_size += str_len(msg);
+		array_append(&msgs, &msg, 1);
+	}
+
+	if (gettimeofday(&tv_start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	for (i = 0; i < iterations; i++) {
+		array_foreach(&msgs, msgp)
+			parse_message(str_data(*msgp), str_len(*msgp));
+	}
+	if (gettimeofday(&tv_end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = timeval_diff_usecs(&tv_end, &tv_start);
+
+	printf("%-12s %6llu kB: %7llu usecs per iteration, %6llu MB/s\n",
+	       corpus->name, total_size / 1024, usecs / iterations,
+	       usecs == 0 ? 0 : total_size * iterations / usecs);
+
+	array_foreach(&msgs, msgp) {
+		string_t *msg = *msgp;
+		str_free(&msg);
+	}
+	array_free(&msgs);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, iterations, messages_count;
+
+	lib_init();
+	iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+	messages_count = argc > 2 ? atoi(argv[2]) : DEFAULT_MESSAGES_COUNT;
+	if (iterations == 0 || messages_count == 0)
+		i_fatal("Usage: %s [<iterations> [<messages per corpus>]]", argv[0]);
+
+	for (i = 0; i < N_ELEMENTS(corpora); i++)
+		bench_corpus(&corpora[i], iterations, messages_count);
+	lib_deinit();
+	return 0;
+}
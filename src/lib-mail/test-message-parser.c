@@ -38,6 +38,28 @@ static const char test_msg[] =
 "\n";
 #define TEST_MSG_LEN (sizeof(test_msg)-1)
 
+static const char test_msg_dashes[] =
+"Content-Type: multipart/mixed; boundary=\"a\"\n"
+"\n"
+"--a\n"
+"Content-Type: multipart/alternative; boundary=\"ab\"\n"
+"\n"
+"--ab\n"
+"\n"
+"-- \n"
+"--\n"
+"-\n"
+"---ab\n"
+"--ab\n"
+"\n"
+"body-text\r\n"
+"--ab--\n"
+"--a\n"
+"\n"
+"--b\n"
+"--a--\n";
+#define TEST_MSG_DASHES_LEN (sizeof(test_msg_dashes)-1)
+
 static bool msg_parts_cmp(struct message_part *p1, struct message_part *p2)
 {
 	while (p1 != NULL || p2 != NULL) {
@@ -128,10 +150,63 @@ static void test_message_parser_small_blocks(void)
 	test_end();
 }
 
+static void test_message_parser_dash_lines(void)
+{
+	struct message_parser_ctx *parser;
+	struct istream *input;
+	struct message_part *parts, *parts2, *part;
+	struct message_block block;
+	unsigned int i;
+	pool_t pool;
+	int ret;
+
+	test_begin("message parser dash lines");
+	pool = pool_alloconly_create("message parser", 10240);
+	input = test_istream_create(test_msg_dashes);
+
+	parser = message_parser_init(pool, input, 0, 0);
+	while ((ret = message_parser_parse_next_block(parser, &block)) > 0) ;
+	test_assert(ret < 0);
+	test_assert(message_parser_deinit(&parser, &parts) == 0);
+
+	test_assert(parts->children_count == 4);
+	part = parts->children;
+	test_assert(part->children_count == 2);
+	test_assert(part->children->body_size.physical_size == 14);
+	test_assert(part->children->body_size.lines == 3);
+	test_assert(part->children->next->body_size.physical_size == 9);
+	test_assert(part->children->next->body_size.virtual_size == 9);
+	part = part->next;
+	test_assert(part != NULL && part->next == NULL);
+	test_assert(part->body_size.physical_size == 3);
+
+	/* parsing in small blocks */
+	i_stream_seek(input, 0);
+	test_istream_set_allow_eof(input, FALSE);
+
+	parser = message_parser_init(pool, input, 0, 0);
+	for (i = 1; i <= TEST_MSG_DASHES_LEN+1; i++) {
+		test_istream_set_size(input, i);
+		if (i > TEST_MSG_DASHES_LEN)
+			test_istream_set_allow_eof(input, TRUE);
+		while ((ret = message_parser_parse_next_block(parser,
+							      &block)) > 0) ;
+		test_assert((ret == 0 && i <= TEST_MSG_DASHES_LEN) ||
+			    (ret < 0 && i > TEST_MSG_DASHES_LEN));
+	}
+	test_assert(message_parser_deinit(&parser, &parts2) == 0);
+	test_assert(msg_parts_cmp(parts, parts2));
+
+	i_stream_unref(&input);
+	pool_unref(&pool);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*test_functions[])(void) = {
 		test_message_parser_small_blocks,
+		test_message_parser_dash_lines,
 		NULL
 	};
 	return test_run(test_functions);
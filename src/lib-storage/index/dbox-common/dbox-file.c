@@ -783,3 +783,21 @@ int dbox_file_unlink(struct dbox_file *file)
 	}
 	return 1;
 }
+
+void dbox_file_readahead(const char *path)
+{
+/* HAVE_POSIX_FADVISE alone isn't enough for CentOS 4.9 */
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	int fd, ret;
+
+	/* errors are reported when the file is actually opened */
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	if ((ret = posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED)) != 0) {
+		errno = ret;
+		i_error("posix_fadvise(%s) failed: %m", path);
+	}
+	i_close_fd(&fd);
+#endif
+}
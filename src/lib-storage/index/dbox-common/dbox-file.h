@@ -199,6 +199,9 @@ int dbox_file_fix(struct dbox_file *file, uoff_t start_offset);
 /* Delete the given dbox file. Returns 1 if deleted, 0 if file wasn't found
    or -1 if error. */
 int dbox_file_unlink(struct dbox_file *file);
+/* Tell the OS to start reading the given file into memory. Index rebuilding
+   uses this to read the next files while the current one is being parsed. */
+void dbox_file_readahead(const char *path);
 
 /* Fill dbox_message_header with given size. */
 void dbox_msg_header_fill(struct dbox_message_header *dbox_msg_hdr,
@@ -19,6 +19,9 @@ struct dbox_save_context;
 
 /* Delete temp files having ctime older than this. */
 #define DBOX_TMP_DELETE_SECS (36*60*60)
+/* When rebuilding indexes, start reading this many files ahead of the one
+   that is currently being parsed. */
+#define DBOX_REBUILD_READAHEAD_FILES 16
 
 /* Flag specifies if the message should be in primary or alternative storage */
 #define DBOX_INDEX_FLAG_ALT MAIL_INDEX_MAIL_FLAG_BACKEND
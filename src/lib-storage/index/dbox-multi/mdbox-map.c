@@ -6,6 +6,7 @@
 #include "ostream.h"
 #include "mkdir-parents.h"
 #include "unlink-old-files.h"
+#include "mail-transaction-log.h"
 #include "mailbox-list-private.h"
 #include "mdbox-storage.h"
 #include "mdbox-file.h"
@@ -27,6 +28,7 @@ struct mdbox_map_transaction_context {
 
 	unsigned int changed:1;
 	unsigned int committed:1;
+	unsigned int refcount_increased:1;
 };
 
 static int mdbox_map_generate_uid_validity(struct mdbox_map *map);
@@ -417,13 +419,29 @@ int mdbox_map_get_file_msgs(struct mdbox_map *map, uint32_t file_id,
 	return 0;
 }
 
+static int
+mdbox_map_zero_ref_file_cmp(const struct mdbox_map_zero_ref_file *f1,
+			    const struct mdbox_map_zero_ref_file *f2)
+{
+	if (f1->zero_ref_size > f2->zero_ref_size)
+		return -1;
+	if (f1->zero_ref_size < f2->zero_ref_size)
+		return 1;
+	return f1->file_id < f2->file_id ? -1 :
+		(f1->file_id > f2->file_id ? 1 : 0);
+}
+
 int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
-				 ARRAY_TYPE(seq_range) *file_ids_r)
+				 ARRAY_TYPE(mdbox_map_zero_ref_file) *files_r)
 {
 	const struct mail_index_header *hdr;
 	const struct mdbox_map_mail_index_record *rec;
+	struct mdbox_map_zero_ref_file *file;
+	/* file_id => files_r index + 1 */
+	HASH_TABLE(void *, void *) file_idx;
 	const uint16_t *ref16_p;
 	const void *data;
+	void *value;
 	uint32_t seq;
 	bool expunged;
 	int ret;
@@ -435,6 +453,7 @@ int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
 	if (mdbox_map_refresh(map) < 0)
 		return -1;
 
+	hash_table_create_direct(&file_idx, default_pool, 0);
 	hdr = mail_index_get_header(map->view);
 	for (seq = 1; seq <= hdr->messages_count; seq++) {
 		mail_index_lookup_ext(map->view, seq, map->ref_ext_id,
@@ -447,11 +466,24 @@ int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
 
 		mail_index_lookup_ext(map->view, seq, map->map_ext_id,
 				      &data, &expunged);
-		if (data != NULL && !expunged) {
-			rec = data;
-			seq_range_array_add(file_ids_r, rec->file_id);
+		if (data == NULL || expunged)
+			continue;
+		rec = data;
+
+		value = hash_table_lookup(file_idx, POINTER_CAST(rec->file_id));
+		if (value != NULL) {
+			file = array_idx_modifiable(files_r,
+				POINTER_CAST_TO(value, unsigned int) - 1);
+		} else {
+			file = array_append_space(files_r);
+			file->file_id = rec->file_id;
+			hash_table_insert(file_idx, POINTER_CAST(rec->file_id),
+					  POINTER_CAST(array_count(files_r)));
 		}
+		file->zero_ref_size += rec->size;
 	}
+	hash_table_destroy(&file_idx);
+	array_sort(files_r, mdbox_map_zero_ref_file_cmp);
 	return 0;
 }
 
@@ -464,6 +496,45 @@ struct mdbox_map_atomic_context *mdbox_map_atomic_begin(struct mdbox_map *map)
 	return atomic;
 }
 
+static bool
+mdbox_map_log_has_only_refcount_decrements(struct mdbox_map *map,
+					   uint32_t seq1, uoff_t offset1,
+					   uint32_t seq2, uoff_t offset2)
+{
+	struct mail_transaction_log_view *log_view;
+	const struct mail_transaction_header *hdr;
+	const struct mail_transaction_ext_atomic_inc *rec, *end;
+	const void *data;
+	const char *reason;
+	bool reset, ret = TRUE;
+
+	log_view = mail_transaction_log_view_open(map->index->log);
+	if (mail_transaction_log_view_set(log_view, seq1, offset1,
+					  seq2, offset2, &reset, &reason) <= 0) {
+		mail_transaction_log_view_close(&log_view);
+		return FALSE;
+	}
+	while (ret && mail_transaction_log_view_next(log_view, &hdr, &data) > 0) {
+		switch (hdr->type & MAIL_TRANSACTION_TYPE_MASK) {
+		case MAIL_TRANSACTION_BOUNDARY:
+		case MAIL_TRANSACTION_EXT_INTRO:
+			break;
+		case MAIL_TRANSACTION_EXT_ATOMIC_INC:
+			end = CONST_PTR_OFFSET(data, hdr->size);
+			for (rec = data; rec < end; rec++) {
+				if (rec->diff >= 0)
+					ret = FALSE;
+			}
+			break;
+		default:
+			ret = FALSE;
+			break;
+		}
+	}
+	mail_transaction_log_view_close(&log_view);
+	return ret;
+}
+
 static void
 mdbox_map_sync_handle(struct mdbox_map *map,
 		      struct mail_index_sync_ctx *sync_ctx)
@@ -473,7 +544,9 @@ mdbox_map_sync_handle(struct mdbox_map *map,
 	uoff_t offset1, offset2;
 
 	mail_index_sync_get_offsets(sync_ctx, &seq1, &offset1, &seq2, &offset2);
-	if (offset1 != offset2 || seq1 != seq2) {
+	if ((offset1 != offset2 || seq1 != seq2) &&
+	    !mdbox_map_log_has_only_refcount_decrements(map, seq1, offset1,
+							seq2, offset2)) {
 		/* something had crashed. need a full resync. */
 		i_warning("mdbox %s: Inconsistency in map index "
 			  "(%u,%"PRIuUOFF_T" != %u,%"PRIuUOFF_T")",
@@ -604,6 +677,23 @@ int mdbox_map_transaction_commit(struct mdbox_map_transaction_context *ctx)
 	return 0;
 }
 
+int mdbox_map_transaction_commit_unlocked(struct mdbox_map_transaction_context *ctx)
+{
+	i_assert(!ctx->committed);
+	i_assert(!ctx->refcount_increased);
+
+	ctx->committed = TRUE;
+	if (!ctx->changed)
+		return 0;
+
+	if (mail_index_transaction_commit(&ctx->trans) < 0) {
+		mail_storage_set_internal_error(MAP_STORAGE(ctx->atomic->map));
+		mail_index_reset_error(ctx->atomic->map->index);
+		return -1;
+	}
+	return 0;
+}
+
 void mdbox_map_transaction_free(struct mdbox_map_transaction_context **_ctx)
 {
 	struct mdbox_map_transaction_context *ctx = *_ctx;
@@ -642,6 +732,8 @@ int mdbox_map_update_refcount(struct mdbox_map_transaction_context *ctx,
 	mail_index_lookup_ext(map->view, seq, map->ref_ext_id, &data, NULL);
 	old_diff = data == NULL ? 0 : *((const uint16_t *)data);
 	ctx->changed = TRUE;
+	if (diff > 0)
+		ctx->refcount_increased = TRUE;
 	new_diff = mail_index_atomic_inc_ext(ctx->trans, seq,
 					     map->ref_ext_id, diff);
 	if (old_diff + new_diff < 0) {
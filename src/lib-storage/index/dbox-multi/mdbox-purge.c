@@ -6,6 +6,7 @@
 #include "ostream.h"
 #include "str.h"
 #include "hash.h"
+#include "time-util.h"
 #include "dbox-attachment.h"
 #include "mdbox-storage.h"
 #include "mdbox-storage-rebuild.h"
@@ -14,6 +15,7 @@
 #include "mdbox-sync.h"
 
 #include <stdlib.h>
+#include <unistd.h>
 #include <dirent.h>
 
 /*
@@ -42,6 +44,8 @@ struct mdbox_purge_context {
 	ARRAY_TYPE(seq_range) primary_file_ids;
 	/* list of file_ids that we need to purge */
 	ARRAY_TYPE(seq_range) purge_file_ids;
+	/* files with zero refcount messages, most reclaimable bytes first */
+	ARRAY_TYPE(mdbox_map_zero_ref_file) zero_ref_files;
 
 	/* uint32_t map_uid => enum mdbox_msg_action action */
 	HASH_TABLE(void *, void *) altmoves;
@@ -49,6 +53,13 @@ struct mdbox_purge_context {
 
 	struct mdbox_map_atomic_context *atomic;
 	struct mdbox_map_append_context *append_ctx;
+
+	struct timeval start_time;
+	/* bytes read and written so far */
+	uoff_t io_bytes;
+	/* bytes freed from the storage so far */
+	uoff_t reclaimed_bytes;
+	unsigned int purged_files;
 };
 
 static int mdbox_map_file_msg_offset_cmp(const struct mdbox_map_file_msg *m1,
@@ -183,17 +194,78 @@ mdbox_purge_want_altpath(struct mdbox_purge_context *ctx,
 	return action == MDBOX_MSG_ACTION_MOVE_TO_ALT;
 }
 
+static off_t
+mdbox_purge_copy_range(struct dbox_file *file,
+		       struct dbox_file_append_context *out_file_append,
+		       struct ostream *output, uoff_t msg_size)
+{
+	struct dbox_file *out_file = out_file_append->file;
+	struct istream *input;
+	struct ostream *copy_output;
+	off_t fd_offset, ret;
+	int read_errno, write_errno;
+
+	/* the message is copied with a separate stream, which can clone the
+	   range with copy_file_range(). the shared output can't do that,
+	   because it's also used for saving new mails. write its buffer
+	   first and remember the fd's position, which the shared output
+	   expects to stay unchanged. */
+	if (o_stream_nfinish(output) < 0) {
+		mail_storage_set_critical(&file->storage->storage,
+			"write(%s) failed: %m", out_file->cur_path);
+		return -1;
+	}
+	if ((fd_offset = lseek(out_file->fd, 0, SEEK_CUR)) < 0 ||
+	    lseek(out_file->fd, (off_t)output->offset, SEEK_SET) < 0) {
+		mail_storage_set_critical(&file->storage->storage,
+			"lseek(%s) failed: %m", out_file->cur_path);
+		return -1;
+	}
+
+	input = i_stream_create_limit(file->input, msg_size);
+	copy_output = o_stream_create_fd_file_copy(out_file->fd,
+						   output->offset, FALSE);
+	ret = o_stream_send_istream(copy_output, input);
+	read_errno = input->stream_errno;
+	i_stream_unref(&input);
+	write_errno = o_stream_nfinish(copy_output) < 0 ? errno : 0;
+	o_stream_destroy(&copy_output);
+
+	if (lseek(out_file->fd, fd_offset, SEEK_SET) < 0) {
+		mail_storage_set_critical(&file->storage->storage,
+			"lseek(%s) failed: %m", out_file->cur_path);
+		return -1;
+	}
+	if (read_errno != 0) {
+		errno = read_errno;
+		mail_storage_set_critical(&file->storage->storage,
+			"read(%s) failed: %m", file->cur_path);
+		return -1;
+	}
+	if (write_errno != 0) {
+		errno = write_errno;
+		mail_storage_set_critical(&file->storage->storage,
+			"write(%s) failed: %m", out_file->cur_path);
+		return -1;
+	}
+	/* continue the shared output after the copied message */
+	if (o_stream_seek(output, output->offset + ret) < 0) {
+		mail_storage_set_critical(&file->storage->storage,
+			"lseek(%s) failed: %m", out_file->cur_path);
+		return -1;
+	}
+	return ret;
+}
+
 static int
 mdbox_purge_save_msg(struct mdbox_purge_context *ctx, struct dbox_file *file,
 		     const struct mdbox_map_file_msg *msg)
 {
 	struct dbox_file_append_context *out_file_append;
-	struct istream *input;
 	struct ostream *output;
 	enum mdbox_map_append_flags append_flags;
 	uoff_t msg_size;
 	off_t ret;
-	int read_errno;
 
 	if (ctx->append_ctx == NULL)
 		ctx->append_ctx = mdbox_map_append_begin(ctx->atomic);
@@ -207,23 +279,9 @@ mdbox_purge_save_msg(struct mdbox_purge_context *ctx, struct dbox_file *file,
 
 	i_assert(file != out_file_append->file);
 
-	input = i_stream_create_limit(file->input, msg_size);
-	ret = o_stream_send_istream(output, input);
-	read_errno = input->stream_errno;
-	i_stream_unref(&input);
-
-	if (read_errno != 0) {
-		errno = read_errno;
-		mail_storage_set_critical(&file->storage->storage,
-			"read(%s) failed: %m", file->cur_path);
+	if ((ret = mdbox_purge_copy_range(file, out_file_append, output,
+					  msg_size)) < 0)
 		return -1;
-	}
-	if (o_stream_nfinish(output) < 0) {
-		mail_storage_set_critical(&file->storage->storage,
-					  "write(%s) failed: %m",
-					  out_file_append->file->cur_path);
-		return -1;
-	}
 	if (ret != (off_t)msg_size) {
 		i_assert(ret < (off_t)msg_size);
 		i_assert(i_stream_is_eof(file->input));
@@ -305,7 +363,7 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 	ARRAY_TYPE(mail_attachment_extref) ext_refs;
 	pool_t ext_refs_pool;
 	unsigned int i, count;
-	uoff_t offset;
+	uoff_t offset, copied_size = 0;
 	int ret;
 
 	i_assert(ctx->atomic == NULL);
@@ -378,6 +436,7 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 			if (ret <= 0)
 				break;
 			array_append(&copied_map_uids, &msgs[i].map_uid, 1);
+			copied_size += file->input->v_offset - offset;
 		}
 		offset = file->input->v_offset;
 	}
@@ -431,6 +490,9 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 		(void)dbox_file_unlink(file);
 		if (mdbox_map_remove_file_id(ctx->storage->map, file_id) < 0)
 			ret = -1;
+		ctx->io_bytes += st.st_size + copied_size;
+		ctx->reclaimed_bytes += st.st_size - copied_size;
+		ctx->purged_files++;
 	} else {
 		dbox_file_unlock(file);
 	}
@@ -481,7 +543,10 @@ mdbox_purge_alloc(struct mdbox_storage *storage)
 	ctx->lowest_primary_file_id = (uint32_t)-1;
 	i_array_init(&ctx->primary_file_ids, 64);
 	i_array_init(&ctx->purge_file_ids, 64);
+	i_array_init(&ctx->zero_ref_files, 64);
 	hash_table_create_direct(&ctx->altmoves, pool, 0);
+	if (gettimeofday(&ctx->start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
 	return ctx;
 }
 
@@ -494,6 +559,7 @@ static void mdbox_purge_free(struct mdbox_purge_context **_ctx)
 	hash_table_destroy(&ctx->altmoves);
 	array_free(&ctx->primary_file_ids);
 	array_free(&ctx->purge_file_ids);
+	array_free(&ctx->zero_ref_files);
 	pool_unref(&ctx->pool);
 }
 
@@ -649,19 +715,81 @@ static int mdbox_altmove_add_files(struct mdbox_purge_context *ctx)
 	return ret;
 }
 
+static long long mdbox_purge_get_elapsed_usecs(struct mdbox_purge_context *ctx)
+{
+	struct timeval now;
+
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	return timeval_diff_usecs(&now, &ctx->start_time);
+}
+
+static void mdbox_purge_throttle(struct mdbox_purge_context *ctx)
+{
+	uoff_t io_limit = ctx->storage->set->mdbox_purge_io_limit;
+	long long elapsed_usecs, wanted_usecs;
+
+	if (io_limit == 0)
+		return;
+
+	/* sleep until the average I/O rate is within the limit */
+	wanted_usecs = ctx->io_bytes / io_limit * 1000000 +
+		ctx->io_bytes % io_limit * 1000000 / io_limit;
+	while ((elapsed_usecs = mdbox_purge_get_elapsed_usecs(ctx)) <
+	       wanted_usecs)
+		usleep(I_MIN(wanted_usecs - elapsed_usecs, 1000000));
+}
+
+static int
+mdbox_purge_file_id(struct mdbox_purge_context *ctx, uint32_t file_id)
+{
+	struct mdbox_storage *storage = ctx->storage;
+	struct dbox_file *file;
+	bool deleted;
+	int ret = 0;
+
+	file = mdbox_file_init(storage, file_id);
+	if (dbox_file_open(file, &deleted) > 0 && !deleted) {
+		if (mdbox_file_purge(ctx, file, file_id) < 0)
+			ret = -1;
+	} else {
+		if (mdbox_map_remove_file_id(storage->map, file_id) < 0)
+			ret = -1;
+	}
+	dbox_file_unref(&file);
+	mdbox_purge_throttle(ctx);
+	return ret;
+}
+
+static void mdbox_purge_log_stats(struct mdbox_purge_context *ctx)
+{
+	long long elapsed_msecs;
+
+	if (ctx->purged_files == 0)
+		return;
+
+	elapsed_msecs = mdbox_purge_get_elapsed_usecs(ctx) / 1000;
+	i_info("mdbox %s: Purged %u files, freed %"PRIuUOFF_T" bytes "
+	       "in %lld.%03lld secs (%"PRIuUOFF_T" bytes/sec)",
+	       ctx->storage->storage_dir, ctx->purged_files,
+	       ctx->reclaimed_bytes, elapsed_msecs / 1000,
+	       elapsed_msecs % 1000,
+	       (uoff_t)(ctx->reclaimed_bytes * 1000 /
+			I_MAX(elapsed_msecs, 1)));
+}
+
 int mdbox_purge(struct mail_storage *_storage)
 {
 	struct mdbox_storage *storage = (struct mdbox_storage *)_storage;
 	struct mdbox_purge_context *ctx;
-	struct dbox_file *file;
+	const struct mdbox_map_zero_ref_file *zero_ref_file;
 	struct seq_range_iter iter;
 	unsigned int i = 0;
 	uint32_t file_id;
-	bool deleted;
 	int ret;
 
 	ctx = mdbox_purge_alloc(storage);
-	ret = mdbox_map_get_zero_ref_files(storage->map, &ctx->purge_file_ids);
+	ret = mdbox_map_get_zero_ref_files(storage->map, &ctx->zero_ref_files);
 	if (storage->alt_storage_dir != NULL) {
 		if (mdbox_purge_get_primary_files(ctx) < 0)
 			ret = -1;
@@ -672,19 +800,26 @@ int mdbox_purge(struct mail_storage *_storage)
 		}
 	}
 
+	/* purge first the files that free the most space, so that if the
+	   purging is stopped (or it fails) the most important work has
+	   already been done. the next purge continues with what's left. */
+	array_foreach(&ctx->zero_ref_files, zero_ref_file) {
+		if (ret != 0)
+			break;
+		T_BEGIN {
+			ret = mdbox_purge_file_id(ctx, zero_ref_file->file_id);
+		} T_END;
+		seq_range_array_remove(&ctx->purge_file_ids,
+				       zero_ref_file->file_id);
+	}
+
+	/* then the files that only need altmoving */
 	seq_range_array_iter_init(&iter, &ctx->purge_file_ids); i = 0;
 	while (ret == 0 &&
 	       seq_range_array_iter_nth(&iter, i++, &file_id)) T_BEGIN {
-		file = mdbox_file_init(storage, file_id);
-		if (dbox_file_open(file, &deleted) > 0 && !deleted) {
-			if (mdbox_file_purge(ctx, file, file_id) < 0)
-				ret = -1;
-		} else {
-			if (mdbox_map_remove_file_id(storage->map, file_id) < 0)
-				ret = -1;
-		}
-		dbox_file_unref(&file);
+		ret = mdbox_purge_file_id(ctx, file_id);
 	} T_END;
+	mdbox_purge_log_stats(ctx);
 	mdbox_purge_free(&ctx);
 
 	if (storage->corrupted) {
@@ -16,6 +16,8 @@ static const struct setting_define mdbox_setting_defines[] = {
 	DEF(SET_BOOL, mdbox_purge_preserve_alt),
 	DEF(SET_SIZE, mdbox_rotate_size),
 	DEF(SET_TIME, mdbox_rotate_interval),
+	DEF(SET_SIZE, mdbox_purge_io_limit),
+	DEF(SET_BOOL, mdbox_unlocked_expunge),
 
 	SETTING_DEFINE_LIST_END
 };
@@ -24,7 +26,9 @@ static const struct mdbox_settings mdbox_default_settings = {
 	.mdbox_preallocate_space = FALSE,
 	.mdbox_purge_preserve_alt = FALSE,
 	.mdbox_rotate_size = 2*1024*1024,
-	.mdbox_rotate_interval = 0
+	.mdbox_rotate_interval = 0,
+	.mdbox_purge_io_limit = 0,
+	.mdbox_unlocked_expunge = FALSE
 };
 
 static const struct setting_parser_info mdbox_setting_parser_info = {
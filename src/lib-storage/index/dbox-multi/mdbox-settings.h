@@ -6,6 +6,8 @@ struct mdbox_settings {
 	bool mdbox_purge_preserve_alt;
 	uoff_t mdbox_rotate_size;
 	unsigned int mdbox_rotate_interval;
+	uoff_t mdbox_purge_io_limit;
+	bool mdbox_unlocked_expunge;
 };
 
 const struct setting_parser_info *mdbox_get_setting_parser_info(void);
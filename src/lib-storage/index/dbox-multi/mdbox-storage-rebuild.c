@@ -20,6 +20,12 @@
 #include <dirent.h>
 #include <unistd.h>
 
+#define MDBOX_REBUILD_PROGRESS_INTERVAL_SECS 10
+
+struct mdbox_rebuild_file {
+	const char *dir, *fname;
+};
+
 struct mdbox_rebuild_msg {
 	struct mdbox_rebuild_msg *guid_hash_next;
 
@@ -51,6 +57,7 @@ struct mdbox_storage_rebuild_context {
 	HASH_TABLE(uint8_t *, struct mdbox_rebuild_msg *) guid_hash;
 	ARRAY(struct mdbox_rebuild_msg *) msgs;
 	ARRAY_TYPE(seq_range) seen_file_ids;
+	ARRAY(struct mdbox_rebuild_file) files;
 
 	uint32_t rebuild_count;
 	uint32_t highest_file_id;
@@ -79,6 +86,7 @@ mdbox_storage_rebuild_init(struct mdbox_storage *storage,
 			  guid_128_hash, guid_128_cmp);
 	i_array_init(&ctx->msgs, 512);
 	i_array_init(&ctx->seen_file_ids, 128);
+	i_array_init(&ctx->files, 512);
 
 	ctx->storage->rebuilding_storage = TRUE;
 	return ctx;
@@ -94,6 +102,7 @@ mdbox_storage_rebuild_deinit(struct mdbox_storage_rebuild_context *ctx)
 	hash_table_destroy(&ctx->guid_hash);
 	pool_unref(&ctx->pool);
 	array_free(&ctx->seen_file_ids);
+	array_free(&ctx->files);
 	array_free(&ctx->msgs);
 	i_free(ctx);
 }
@@ -857,6 +866,7 @@ static int
 mdbox_storage_rebuild_scan_dir(struct mdbox_storage_rebuild_context *ctx,
 			       const char *storage_dir, bool alt)
 {
+	struct mdbox_rebuild_file *file;
 	DIR *dir;
 	struct dirent *d;
 	int ret = 0;
@@ -870,13 +880,17 @@ mdbox_storage_rebuild_scan_dir(struct mdbox_storage_rebuild_context *ctx,
 			"opendir(%s) failed: %m", storage_dir);
 		return -1;
 	}
-	for (errno = 0; (d = readdir(dir)) != NULL && ret == 0; errno = 0) {
+	/* only list the files here. they're read afterwards, so that the
+	   following files can be read ahead while parsing the current one. */
+	for (errno = 0; (d = readdir(dir)) != NULL; errno = 0) {
 		if (strncmp(d->d_name, MDBOX_MAIL_FILE_PREFIX,
-			    strlen(MDBOX_MAIL_FILE_PREFIX)) == 0) T_BEGIN {
-			ret = rebuild_add_file(ctx, storage_dir, d->d_name);
-		} T_END;
+			    strlen(MDBOX_MAIL_FILE_PREFIX)) == 0) {
+			file = array_append_space(&ctx->files);
+			file->dir = storage_dir;
+			file->fname = p_strdup(ctx->pool, d->d_name);
+		}
 	}
-	if (ret == 0 && errno != 0) {
+	if (errno != 0) {
 		mail_storage_set_critical(&ctx->storage->storage.storage,
 			"readdir(%s) failed: %m", storage_dir);
 		ret = -1;
@@ -889,6 +903,36 @@ mdbox_storage_rebuild_scan_dir(struct mdbox_storage_rebuild_context *ctx,
 	return ret;
 }
 
+static int
+mdbox_storage_rebuild_scan_files(struct mdbox_storage_rebuild_context *ctx)
+{
+	const struct mdbox_rebuild_file *files;
+	unsigned int i, count, readahead_idx = 0;
+	time_t now, last_progress = time(NULL);
+	int ret = 0;
+
+	files = array_get(&ctx->files, &count);
+	for (i = 0; i < count && ret == 0; i++) T_BEGIN {
+		for (; readahead_idx < count &&
+		       readahead_idx <= i + DBOX_REBUILD_READAHEAD_FILES;
+		     readahead_idx++) {
+			dbox_file_readahead(t_strdup_printf("%s/%s",
+				files[readahead_idx].dir,
+				files[readahead_idx].fname));
+		}
+		ret = rebuild_add_file(ctx, files[i].dir, files[i].fname);
+
+		now = time(NULL);
+		if (now - last_progress >= MDBOX_REBUILD_PROGRESS_INTERVAL_SECS) {
+			i_info("mdbox %s: rebuilding indexes: "
+			       "%u/%u files scanned",
+			       ctx->storage->storage_dir, i + 1, count);
+			last_progress = now;
+		}
+	} T_END;
+	return ret;
+}
+
 static int mdbox_storage_rebuild_scan(struct mdbox_storage_rebuild_context *ctx)
 {
 	const void *data;
@@ -935,6 +979,8 @@ static int mdbox_storage_rebuild_scan(struct mdbox_storage_rebuild_context *ctx)
 				ctx->storage->alt_storage_dir, TRUE) < 0)
 			return -1;
 	}
+	if (mdbox_storage_rebuild_scan_files(ctx) < 0)
+		return -1;
 
 	if (rebuild_apply_map(ctx) < 0 ||
 	    rebuild_mailboxes(ctx) < 0 ||
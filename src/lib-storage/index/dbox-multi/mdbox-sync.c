@@ -10,6 +10,18 @@
 
    If something crashes after 2 but before 4 is finished, tail != head and
    reader can do a full resync to figure out what got broken.
+
+   With mdbox_unlocked_expunge=yes the map isn't locked for expunging:
+
+   1. Expunge messages from mailbox index and unlock it.
+   2. Write map UID refcount decrements to map index without locking it.
+
+   The mailbox must be unlocked first, because saving locks the map before
+   the mailbox. The next process that locks the map sees tail != head, but
+   since there are only refcount decrements it knows they came from here and
+   not from a crash. If something crashes between 1 and 2, the refcounts are
+   left too high and the mails are only freed by a storage rebuild, but
+   nothing gets lost.
 */
 
 #include "lib.h"
@@ -132,6 +144,7 @@ static int mdbox_sync_index(struct mdbox_sync_context *ctx)
 	const struct mail_index_header *hdr;
 	struct mail_index_sync_rec sync_rec;
 	uint32_t seq1, seq2;
+	bool unlocked_expunge;
 	int ret = 0;
 
 	hdr = mail_index_get_header(ctx->sync_view);
@@ -159,7 +172,9 @@ static int mdbox_sync_index(struct mdbox_sync_context *ctx)
 	}
 
 	/* handle syncing records without map being locked. */
-	if (mdbox_map_atomic_is_locked(ctx->atomic)) {
+	unlocked_expunge = !mdbox_map_atomic_is_locked(ctx->atomic) &&
+		mail_index_sync_has_expunges(ctx->index_sync_ctx);
+	if (mdbox_map_atomic_is_locked(ctx->atomic) || unlocked_expunge) {
 		ctx->map_trans = mdbox_map_transaction_begin(ctx->atomic, FALSE);
 		i_array_init(&ctx->expunged_seqs, 64);
 	}
@@ -183,6 +198,15 @@ static int mdbox_sync_index(struct mdbox_sync_context *ctx)
 			mdbox_map_atomic_set_failed(ctx->atomic);
 		mdbox_map_transaction_free(&ctx->map_trans);
 		array_free(&ctx->expunged_seqs);
+	} else if (unlocked_expunge) {
+		/* write changes to mailbox index. the refcount changes are
+		   written after the mailbox is unlocked in
+		   mdbox_sync_finish() */
+		if (ret == 0)
+			ret = dbox_sync_mark_expunges(ctx);
+		if (ret < 0)
+			mdbox_map_transaction_free(&ctx->map_trans);
+		array_free(&ctx->expunged_seqs);
 	}
 
 	if (box->v.sync_notify != NULL)
@@ -212,6 +236,7 @@ static int mdbox_sync_try_begin(struct mdbox_sync_context *ctx,
 	}
 
 	if (!mdbox_map_atomic_is_locked(ctx->atomic) &&
+	    !mbox->storage->set->mdbox_unlocked_expunge &&
 	    mail_index_sync_has_expunges(ctx->index_sync_ctx)) {
 		/* we have expunges, so we need to write to map.
 		   it needs to be locked before mailbox index. */
@@ -313,6 +338,15 @@ int mdbox_sync_finish(struct mdbox_sync_context **_ctx, bool success)
 		mail_index_sync_rollback(&ctx->index_sync_ctx);
 	}
 
+	if (ctx->map_trans != NULL) {
+		/* the expunges were already committed to mailbox index */
+		if (mdbox_map_transaction_commit_unlocked(ctx->map_trans) < 0) {
+			/* let the rebuild fix the refcounts */
+			mdbox_storage_set_corrupted(ctx->mbox->storage);
+			ret = -1;
+		}
+		mdbox_map_transaction_free(&ctx->map_trans);
+	}
 	i_free(ctx);
 	return ret;
 }
@@ -0,0 +1,191 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "mail-index.h"
+#include "mail-storage-private.h"
+#include "mdbox-storage.h"
+#include "mdbox-map-private.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#define TEST_MAIL_COUNT 3
+
+static struct test_mail_storage_ctx *test_ctx;
+static unsigned int test_error_count;
+
+static const char *const test_unlocked_expunge_input[] = {
+	"mdbox_unlocked_expunge=yes",
+	NULL
+};
+
+static void ATTR_FORMAT(2, 0)
+test_error_counter(const struct failure_context *ctx ATTR_UNUSED,
+		   const char *format ATTR_UNUSED, va_list args ATTR_UNUSED)
+{
+	test_error_count++;
+}
+
+static failure_callback_t *test_expect_errors(void)
+{
+	failure_callback_t *fatal, *error, *info, *debug;
+
+	i_get_failure_handlers(&fatal, &error, &info, &debug);
+	i_set_error_handler(test_error_counter);
+	test_error_count = 0;
+	return error;
+}
+
+static struct mailbox *test_mailbox_init(void)
+{
+	struct test_mail_storage_settings set;
+	struct mailbox *box;
+	unsigned int i;
+
+	memset(&set, 0, sizeof(set));
+	set.driver = "mdbox";
+	set.extra_input = test_unlocked_expunge_input;
+	test_mail_storage_init_user(test_ctx, &set);
+
+	box = test_mail_storage_mailbox_create(test_ctx, "INBOX");
+	for (i = 1; i <= TEST_MAIL_COUNT; i++) {
+		(void)test_mail_storage_save(box,
+			t_strdup_printf("Subject: m%u\n", i), "body\n");
+	}
+	return box;
+}
+
+static void test_mailbox_deinit(struct mailbox **box)
+{
+	mailbox_free(box);
+	test_mail_storage_deinit_user(test_ctx);
+}
+
+static void test_mailbox_expunge(struct mailbox *box, uint32_t uid)
+{
+	struct mailbox_transaction_context *t;
+	struct mail *mail;
+
+	t = mailbox_transaction_begin(box, 0);
+	mail = mail_alloc(t, 0, NULL);
+	if (!mail_set_uid(mail, uid))
+		i_fatal("mail_set_uid(%u) failed", uid);
+	mail_expunge(mail);
+	mail_free(&mail);
+	if (mailbox_transaction_commit(&t) < 0)
+		i_fatal("mailbox_transaction_commit() failed");
+	if (mailbox_sync(box, 0) < 0)
+		i_fatal("mailbox_sync() failed");
+}
+
+static uint16_t test_map_get_refcount(struct mdbox_map *map, uint32_t seq)
+{
+	struct mdbox_map_mail_index_record rec;
+	uint16_t refcount;
+
+	if (mdbox_map_lookup_seq_full(map, seq, &rec, &refcount) < 0)
+		i_fatal("mdbox_map_lookup_seq_full(%u) failed", seq);
+	return refcount;
+}
+
+static bool test_map_has_pending_changes(struct mdbox_map *map)
+{
+	const struct mail_index_header *hdr;
+
+	if (mdbox_map_refresh(map) < 0)
+		i_fatal("mdbox_map_refresh() failed");
+	hdr = mail_index_get_header(map->view);
+	return hdr->log_file_tail_offset != hdr->log_file_head_offset;
+}
+
+static int test_map_lock(struct mdbox_map *map)
+{
+	struct mdbox_map_atomic_context *atomic;
+	int ret;
+
+	atomic = mdbox_map_atomic_begin(map);
+	ret = mdbox_map_atomic_lock(atomic);
+	mdbox_map_atomic_set_success(atomic);
+	if (mdbox_map_atomic_finish(&atomic) < 0)
+		ret = -1;
+	return ret;
+}
+
+static void test_mdbox_map_unlocked_expunge(void)
+{
+	struct mailbox *box;
+	struct mdbox_storage *storage;
+	uint32_t rebuild_count;
+
+	test_begin("mdbox map unlocked expunge");
+	box = test_mailbox_init();
+	storage = (struct mdbox_storage *)box->storage;
+	rebuild_count = mdbox_map_get_rebuild_count(storage->map);
+
+	test_mailbox_expunge(box, 1);
+	test_mailbox_expunge(box, 2);
+
+	/* the decrements are in the map's log, but not yet synced by a
+	   locked sync */
+	test_assert(test_map_has_pending_changes(storage->map));
+	test_assert(test_map_lock(storage->map) == 0);
+	test_assert(!storage->corrupted);
+	test_assert(mdbox_map_get_rebuild_count(storage->map) == rebuild_count);
+
+	test_assert(mdbox_map_refresh(storage->map) == 0);
+	test_assert(test_map_get_refcount(storage->map, 1) == 0);
+	test_assert(test_map_get_refcount(storage->map, 2) == 0);
+	test_assert(test_map_get_refcount(storage->map, 3) == 1);
+
+	test_mailbox_deinit(&box);
+	test_end();
+}
+
+static void test_mdbox_map_unlocked_expunge_invalid_tail(void)
+{
+	failure_callback_t *orig_error;
+	struct mailbox *box;
+	struct mdbox_storage *storage;
+	struct mdbox_map *map;
+	struct mail_index_transaction *t;
+
+	test_begin("mdbox map unlocked expunge with invalid tail");
+	box = test_mailbox_init();
+	storage = (struct mdbox_storage *)box->storage;
+	map = storage->map;
+
+	test_mailbox_expunge(box, 1);
+
+	/* add a refcount increment after the decrement without locking
+	   the map. this isn't something that unlocked expunging writes, so
+	   it must still be treated as a crash. */
+	test_assert(mdbox_map_refresh(map) == 0);
+	t = mail_index_transaction_begin(map->view,
+					 MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	mail_index_atomic_inc_ext(t, 3, map->ref_ext_id, 1);
+	if (mail_index_transaction_commit(&t) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+
+	orig_error = test_expect_errors();
+	(void)test_map_lock(map);
+	i_set_error_handler(orig_error);
+	test_assert(test_error_count > 0);
+	test_assert(storage->corrupted);
+
+	/* closing the mailbox rebuilds the storage */
+	orig_error = test_expect_errors();
+	test_mailbox_deinit(&box);
+	i_set_error_handler(orig_error);
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*test_functions[])(void) = {
+		test_mdbox_map_unlocked_expunge,
+		test_mdbox_map_unlocked_expunge_invalid_tail,
+		NULL
+	};
+
+	test_ctx = test_mail_storage_init(&argc, &argv);
+	return test_run(test_functions);
+}
@@ -9,6 +9,8 @@
 #include "sdbox-file.h"
 #include "mail-copy.h"
 
+#include <unistd.h>
+
 static int
 sdbox_file_copy_attachments(struct sdbox_file *src_file,
 			    struct sdbox_file *dest_file)
@@ -81,6 +83,26 @@ sdbox_file_copy_attachments(struct sdbox_file *src_file,
 	return ret;
 }
 
+static int
+sdbox_copy_clone(struct mailbox *dest_box, struct dbox_file *dest_file,
+		 const char *src_path, const char *dest_path)
+{
+	int fd, ret;
+
+	fd = dest_file->storage->v.file_create_fd(dest_file, dest_path, TRUE);
+	if (fd == -1)
+		return -1;
+	ret = mail_storage_copy_file(dest_box, src_path, fd, dest_path);
+	if (close(fd) < 0) {
+		mail_storage_set_critical(dest_box->storage,
+			"close(%s) failed: %m", dest_path);
+		ret = -1;
+	}
+	if (ret <= 0)
+		(void)unlink(dest_path);
+	return ret;
+}
+
 static int
 sdbox_copy_hardlink(struct mail_save_context *_ctx, struct mail *mail)
 {
@@ -115,10 +137,18 @@ sdbox_copy_hardlink(struct mail_save_context *_ctx, struct mail *mail)
 		}
 		ret = nfs_safe_link(src_path, dest_path, FALSE);
 	}
-	if (ret < 0) {
-		if (ECANTLINK(errno))
-			ret = 0;
-		else if (errno == ENOENT) {
+	if (ret < 0 && ECANTLINK(errno)) {
+		/* hard linking isn't possible, but the file can still be
+		   copied as-is. this allows the filesystem to clone it. */
+		ret = sdbox_copy_clone(_ctx->transaction->box, dest_file,
+				       src_path, dest_path);
+		if (ret <= 0) {
+			dbox_file_unref(&src_file);
+			dbox_file_unref(&dest_file);
+			return ret;
+		}
+	} else if (ret < 0) {
+		if (errno == ENOENT) {
 			/* try if the fallback copying code can still
 			   read the file (the mail could still have the
 			   stream open) */
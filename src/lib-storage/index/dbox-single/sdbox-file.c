@@ -320,7 +320,7 @@ int sdbox_file_move(struct dbox_file *file, bool alt_path)
 	if (out_fd == -1)
 		return -1;
 
-	output = o_stream_create_fd_file(out_fd, 0, FALSE);
+	output = o_stream_create_fd_file_copy(out_fd, 0, FALSE);
 	i_stream_seek(file->input, 0);
 	while ((ret = o_stream_send_istream(output, file->input)) > 0) ;
 	if (o_stream_nfinish(output) < 0) {
@@ -74,9 +74,6 @@ sdbox_sync_add_file(struct index_rebuild_context *ctx,
 	uint32_t uid;
 	int ret;
 
-	if (strncmp(fname, SDBOX_MAIL_FILE_PREFIX,
-		    strlen(SDBOX_MAIL_FILE_PREFIX)) != 0)
-		return 0;
 	fname += strlen(SDBOX_MAIL_FILE_PREFIX);
 
 	if (str_to_uint32(fname, &uid) < 0 || uid == 0) {
@@ -97,8 +94,12 @@ static int sdbox_sync_index_rebuild_dir(struct index_rebuild_context *ctx,
 					const char *path, bool primary)
 {
 	struct mail_storage *storage = ctx->box->storage;
+	ARRAY_TYPE(const_string) fnames;
+	const char *const *fnamep;
+	pool_t pool;
 	DIR *dir;
 	struct dirent *d;
+	unsigned int i, count, readahead_idx = 0;
 	int ret = 0;
 
 	dir = opendir(path);
@@ -115,13 +116,17 @@ static int sdbox_sync_index_rebuild_dir(struct index_rebuild_context *ctx,
 			"opendir(%s) failed: %m", path);
 		return -1;
 	}
-	do {
-		errno = 0;
-		if ((d = readdir(dir)) == NULL)
-			break;
-
-		ret = sdbox_sync_add_file(ctx, d->d_name, primary);
-	} while (ret >= 0);
+	/* list the files first, so that the following files can be read
+	   ahead while parsing the current one. */
+	pool = pool_alloconly_create("sdbox rebuild files", 1024);
+	p_array_init(&fnames, pool, 64);
+	for (errno = 0; (d = readdir(dir)) != NULL; errno = 0) {
+		if (strncmp(d->d_name, SDBOX_MAIL_FILE_PREFIX,
+			    strlen(SDBOX_MAIL_FILE_PREFIX)) == 0) {
+			const char *fname = p_strdup(pool, d->d_name);
+			array_append(&fnames, &fname, 1);
+		}
+	}
 	if (errno != 0) {
 		mail_storage_set_critical(storage,
 			"readdir(%s) failed: %m", path);
@@ -133,6 +138,18 @@ static int sdbox_sync_index_rebuild_dir(struct index_rebuild_context *ctx,
 			"closedir(%s) failed: %m", path);
 		ret = -1;
 	}
+
+	fnamep = array_get(&fnames, &count);
+	for (i = 0; i < count && ret == 0; i++) T_BEGIN {
+		for (; readahead_idx < count &&
+		       readahead_idx <= i + DBOX_REBUILD_READAHEAD_FILES;
+		     readahead_idx++) {
+			dbox_file_readahead(t_strdup_printf("%s/%s", path,
+							    fnamep[readahead_idx]));
+		}
+		ret = sdbox_sync_add_file(ctx, fnamep[i], primary);
+	} T_END;
+	pool_unref(&pool);
 	return ret;
 }
 
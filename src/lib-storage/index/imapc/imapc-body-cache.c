@@ -0,0 +1,354 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "str.h"
+#include "strnum.h"
+#include "istream.h"
+#include "ostream.h"
+#include "mkdir-parents.h"
+#include "safe-mkstemp.h"
+#include "imapc-storage.h"
+#include "imapc-body-cache.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <utime.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define IMAPC_BODY_CACHE_DIR_NAME "dovecot.imapc-bodies"
+#define IMAPC_BODY_CACHE_TEMP_PREFIX ".temp."
+/* When the cache becomes full, delete mails until it's this full */
+#define IMAPC_BODY_CACHE_CLEAN_PERCENTAGE 90
+/* Delete temp files left behind by crashed processes after this many
+   seconds */
+#define IMAPC_BODY_CACHE_TEMP_STALE_SECS (60*60)
+
+struct imapc_body_cache {
+	struct mail_storage *storage;
+	char *name, *dir;
+	uoff_t max_size;
+
+	/* (uoff_t)-1 until the directory has been scanned */
+	uoff_t cur_size;
+	unsigned int hits, misses;
+};
+
+struct imapc_body_cache_file {
+	const char *fname;
+	time_t mtime;
+	uoff_t size;
+};
+ARRAY_DEFINE_TYPE(imapc_body_cache_file, struct imapc_body_cache_file);
+
+struct imapc_body_cache *imapc_body_cache_init(struct imapc_mailbox *mbox)
+{
+	const char *index_dir;
+
+	if (mbox->storage->set->imapc_body_cache_size == 0)
+		return NULL;
+	if (mailbox_get_path_to(&mbox->box, MAILBOX_LIST_PATH_TYPE_INDEX,
+				&index_dir) <= 0)
+		return NULL;
+
+	return imapc_body_cache_init_dir(mbox->box.storage, mbox->box.vname,
+		t_strconcat(index_dir, "/", IMAPC_BODY_CACHE_DIR_NAME, NULL),
+		mbox->storage->set->imapc_body_cache_size);
+}
+
+struct imapc_body_cache *
+imapc_body_cache_init_dir(struct mail_storage *storage, const char *name,
+			  const char *dir, uoff_t max_size)
+{
+	struct imapc_body_cache *cache;
+
+	cache = i_new(struct imapc_body_cache, 1);
+	cache->storage = storage;
+	cache->name = i_strdup(name);
+	cache->dir = i_strdup(dir);
+	cache->max_size = max_size;
+	cache->cur_size = (uoff_t)-1;
+	return cache;
+}
+
+void imapc_body_cache_deinit(struct imapc_body_cache **_cache)
+{
+	struct imapc_body_cache *cache = *_cache;
+
+	*_cache = NULL;
+
+	if (cache->storage->set->mail_debug &&
+	    cache->hits + cache->misses > 0) {
+		i_debug("imapc %s: Body cache hits=%u misses=%u (%u%% hit rate)",
+			cache->name, cache->hits, cache->misses,
+			cache->hits * 100 / (cache->hits + cache->misses));
+	}
+	i_free(cache->name);
+	i_free(cache->dir);
+	i_free(cache);
+}
+
+static const char *
+imapc_body_cache_get_path(struct imapc_body_cache *cache,
+			  uint32_t uid_validity, uint32_t uid)
+{
+	return t_strdup_printf("%s/%u.%u", cache->dir, uid_validity, uid);
+}
+
+int imapc_body_cache_open(struct imapc_body_cache *cache,
+			  uint32_t uid_validity, uint32_t uid)
+{
+	const char *path;
+	int fd;
+
+	path = imapc_body_cache_get_path(cache, uid_validity, uid);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			mail_storage_set_critical(cache->storage,
+				"open(%s) failed: %m", path);
+		}
+		cache->misses++;
+		return -1;
+	}
+	/* the mtime is used to find the least recently used mails */
+	if (utime(path, NULL) < 0 && errno != ENOENT) {
+		mail_storage_set_critical(cache->storage,
+			"utime(%s) failed: %m", path);
+	}
+	cache->hits++;
+	return fd;
+}
+
+static int
+imapc_body_cache_file_cmp(const struct imapc_body_cache_file *f1,
+			  const struct imapc_body_cache_file *f2)
+{
+	if (f1->mtime < f2->mtime)
+		return -1;
+	if (f1->mtime > f2->mtime)
+		return 1;
+	return 0;
+}
+
+static void
+imapc_body_cache_clean_temp(struct imapc_body_cache *cache, const char *fname)
+{
+	const char *path;
+	struct stat st;
+
+	path = t_strconcat(cache->dir, "/", fname, NULL);
+	if (stat(path, &st) < 0) {
+		if (errno != ENOENT) {
+			mail_storage_set_critical(cache->storage,
+				"stat(%s) failed: %m", path);
+		}
+		return;
+	}
+	if (st.st_mtime > ioloop_time - IMAPC_BODY_CACHE_TEMP_STALE_SECS) {
+		/* may still be written by another process */
+		return;
+	}
+	if (unlink(path) < 0 && errno != ENOENT) {
+		mail_storage_set_critical(cache->storage,
+			"unlink(%s) failed: %m", path);
+	}
+}
+
+static int
+imapc_body_cache_scan(struct imapc_body_cache *cache, uint32_t uid_validity,
+		      ARRAY_TYPE(imapc_body_cache_file) *files)
+{
+	struct imapc_body_cache_file *file;
+	DIR *dir;
+	struct dirent *d;
+	struct stat st;
+	const char *path;
+	uint32_t file_uid_validity;
+	int ret = 0;
+
+	cache->cur_size = 0;
+	dir = opendir(cache->dir);
+	if (dir == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		mail_storage_set_critical(cache->storage,
+			"opendir(%s) failed: %m", cache->dir);
+		return -1;
+	}
+	for (errno = 0; (d = readdir(dir)) != NULL; errno = 0) {
+		if (strncmp(d->d_name, IMAPC_BODY_CACHE_TEMP_PREFIX,
+			    strlen(IMAPC_BODY_CACHE_TEMP_PREFIX)) == 0) {
+			imapc_body_cache_clean_temp(cache, d->d_name);
+			continue;
+		}
+		if (d->d_name[0] == '.')
+			continue;
+		path = t_strconcat(cache->dir, "/", d->d_name, NULL);
+		if (str_to_uint32(t_strcut(d->d_name, '.'),
+				  &file_uid_validity) < 0 ||
+		    file_uid_validity != uid_validity) {
+			/* UIDVALIDITY changed, these can never be used */
+			if (unlink(path) < 0 && errno != ENOENT) {
+				mail_storage_set_critical(cache->storage,
+					"unlink(%s) failed: %m", path);
+			}
+			continue;
+		}
+		if (stat(path, &st) < 0) {
+			if (errno != ENOENT) {
+				mail_storage_set_critical(cache->storage,
+					"stat(%s) failed: %m", path);
+			}
+			continue;
+		}
+		cache->cur_size += st.st_size;
+
+		file = array_append_space(files);
+		file->fname = t_strdup(d->d_name);
+		file->mtime = st.st_mtime;
+		file->size = st.st_size;
+	}
+	if (errno != 0) {
+		mail_storage_set_critical(cache->storage,
+			"readdir(%s) failed: %m", cache->dir);
+		ret = -1;
+	}
+	if (closedir(dir) < 0) {
+		mail_storage_set_critical(cache->storage,
+			"closedir(%s) failed: %m", cache->dir);
+		ret = -1;
+	}
+	return ret;
+}
+
+static void
+imapc_body_cache_clean(struct imapc_body_cache *cache, uint32_t uid_validity)
+{
+	ARRAY_TYPE(imapc_body_cache_file) files;
+	const struct imapc_body_cache_file *file;
+	const char *path;
+	uoff_t wanted_size;
+
+	t_array_init(&files, 128);
+	if (imapc_body_cache_scan(cache, uid_validity, &files) < 0)
+		return;
+
+	wanted_size = cache->max_size / 100 * IMAPC_BODY_CACHE_CLEAN_PERCENTAGE;
+	if (cache->cur_size <= cache->max_size)
+		return;
+
+	array_sort(&files, imapc_body_cache_file_cmp);
+	array_foreach(&files, file) {
+		if (cache->cur_size <= wanted_size)
+			break;
+		path = t_strconcat(cache->dir, "/", file->fname, NULL);
+		if (unlink(path) < 0 && errno != ENOENT) {
+			mail_storage_set_critical(cache->storage,
+				"unlink(%s) failed: %m", path);
+			continue;
+		}
+		cache->cur_size -= file->size;
+	}
+}
+
+static int
+imapc_body_cache_write(struct imapc_body_cache *cache, const char *path,
+		       struct istream *input, uoff_t *size_r)
+{
+	struct ostream *output;
+	string_t *temp_path;
+	int fd, ret = 0;
+
+	temp_path = t_str_new(256);
+	str_printfa(temp_path, "%s/"IMAPC_BODY_CACHE_TEMP_PREFIX, cache->dir);
+	fd = safe_mkstemp_hostpid(temp_path, 0600, (uid_t)-1, (gid_t)-1);
+	if (fd == -1 && errno == ENOENT) {
+		if (mkdir_parents(cache->dir, 0700) < 0 && errno != EEXIST) {
+			mail_storage_set_critical(cache->storage,
+				"mkdir_parents(%s) failed: %m", cache->dir);
+			return -1;
+		}
+		str_truncate(temp_path, 0);
+		str_printfa(temp_path, "%s/"IMAPC_BODY_CACHE_TEMP_PREFIX,
+			    cache->dir);
+		fd = safe_mkstemp_hostpid(temp_path, 0600,
+					  (uid_t)-1, (gid_t)-1);
+	}
+	if (fd == -1) {
+		mail_storage_set_critical(cache->storage,
+			"safe_mkstemp(%s) failed: %m", str_c(temp_path));
+		return -1;
+	}
+
+	output = o_stream_create_fd_file(fd, 0, FALSE);
+	o_stream_cork(output);
+	if (o_stream_send_istream(output, input) < 0 ||
+	    input->stream_errno != 0) {
+		if (input->stream_errno != 0) {
+			mail_storage_set_critical(cache->storage,
+				"read(%s) failed: %s", i_stream_get_name(input),
+				i_stream_get_error(input));
+		}
+		ret = -1;
+	}
+	if (o_stream_nfinish(output) < 0) {
+		mail_storage_set_critical(cache->storage,
+			"write(%s) failed: %s", str_c(temp_path),
+			o_stream_get_error(output));
+		ret = -1;
+	}
+	*size_r = output->offset;
+	o_stream_destroy(&output);
+	if (close(fd) < 0) {
+		mail_storage_set_critical(cache->storage,
+			"close(%s) failed: %m", str_c(temp_path));
+		ret = -1;
+	}
+
+	if (ret == 0 && rename(str_c(temp_path), path) < 0) {
+		mail_storage_set_critical(cache->storage,
+			"rename(%s, %s) failed: %m", str_c(temp_path), path);
+		ret = -1;
+	}
+	if (ret < 0) {
+		if (unlink(str_c(temp_path)) < 0 && errno != ENOENT) {
+			mail_storage_set_critical(cache->storage,
+				"unlink(%s) failed: %m", str_c(temp_path));
+		}
+	}
+	return ret;
+}
+
+void imapc_body_cache_add(struct imapc_body_cache *cache,
+			  uint32_t uid_validity, uint32_t uid,
+			  struct istream *input)
+{
+	uoff_t old_offset = input->v_offset, size;
+	const char *path;
+	int ret;
+
+	if (i_stream_get_size(input, TRUE, &size) > 0 &&
+	    size > cache->max_size) {
+		/* would never fit */
+		return;
+	}
+
+	T_BEGIN {
+		if (cache->cur_size == (uoff_t)-1)
+			imapc_body_cache_clean(cache, uid_validity);
+
+		path = imapc_body_cache_get_path(cache, uid_validity, uid);
+		ret = imapc_body_cache_write(cache, path, input, &size);
+		i_stream_seek(input, old_offset);
+
+		if (ret == 0) {
+			cache->cur_size += size;
+			if (cache->cur_size > cache->max_size)
+				imapc_body_cache_clean(cache, uid_validity);
+		}
+	} T_END;
+}
@@ -0,0 +1,31 @@
+#ifndef IMAPC_BODY_CACHE_H
+#define IMAPC_BODY_CACHE_H
+
+/* Local on-disk cache of message bodies fetched from the remote server. The
+   bodies are stored to the mailbox's index directory, so this works only if
+   the imapc indexes aren't in memory. The mails are keyed by
+   UIDVALIDITY/UID, and the least recently used mails are deleted when the
+   cache grows larger than imapc_body_cache_size. Each mailbox has its own
+   cache, so the size limit applies separately to each mailbox. */
+
+struct mail_storage;
+struct imapc_mailbox;
+
+/* Returns NULL if body caching isn't enabled for the mailbox. */
+struct imapc_body_cache *imapc_body_cache_init(struct imapc_mailbox *mbox);
+/* Create a cache to the given directory. Errors are set to the storage. */
+struct imapc_body_cache *
+imapc_body_cache_init_dir(struct mail_storage *storage, const char *name,
+			  const char *dir, uoff_t max_size);
+void imapc_body_cache_deinit(struct imapc_body_cache **cache);
+
+/* Open the cached mail body. Returns fd, or -1 if the mail isn't cached. */
+int imapc_body_cache_open(struct imapc_body_cache *cache,
+			  uint32_t uid_validity, uint32_t uid);
+/* Add the mail body to cache. The input stream is read until EOF and then
+   seeked back to its original offset. */
+void imapc_body_cache_add(struct imapc_body_cache *cache,
+			  uint32_t uid_validity, uint32_t uid,
+			  struct istream *input);
+
+#endif
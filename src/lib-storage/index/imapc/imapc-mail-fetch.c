@@ -13,6 +13,7 @@
 #include "imapc-client.h"
 #include "imapc-mail.h"
 #include "imapc-storage.h"
+#include "imapc-body-cache.h"
 
 static void
 imapc_mail_fetch_callback(const struct imapc_command_reply *reply,
@@ -165,6 +166,30 @@ imapc_mail_delayed_send_or_merge(struct imapc_mail *mail, string_t *str)
 	}
 }
 
+static bool imapc_mail_body_cache_get(struct imapc_mail *mail)
+{
+	struct imapc_mailbox *mbox =
+		(struct imapc_mailbox *)mail->imail.mail.mail.box;
+	int fd;
+
+	if (mbox->body_cache == NULL || mbox->sync_uid_validity == 0 ||
+	    mail->imail.data.stream != NULL || mail->header_fetched ||
+	    IMAPC_BOX_HAS_FEATURE(mbox, IMAPC_FEATURE_ZIMBRA_WORKAROUNDS))
+		return FALSE;
+
+	fd = imapc_body_cache_open(mbox->body_cache, mbox->sync_uid_validity,
+				   mail->imail.mail.mail.uid);
+	if (fd == -1)
+		return FALSE;
+
+	mail->fd = fd;
+	mail->imail.data.stream = i_stream_create_fd(mail->fd, 0, FALSE);
+	mail->header_fetched = TRUE;
+	mail->body_fetched = TRUE;
+	imapc_mail_init_stream(mail);
+	return TRUE;
+}
+
 static int
 imapc_mail_send_fetch(struct mail *_mail, enum mail_fetch_field fields,
 		      const char *const *headers)
@@ -183,6 +208,11 @@ imapc_mail_send_fetch(struct mail *_mail, enum mail_fetch_field fields,
 	fields &= ~mail->fetching_fields;
 	if (headers_have_subset(mail->fetching_headers, headers))
 		headers = NULL;
+	if ((fields & (MAIL_FETCH_STREAM_HEADER | MAIL_FETCH_STREAM_BODY)) != 0 &&
+	    !_mail->saving && imapc_mail_body_cache_get(mail)) {
+		/* the whole mail was found from the local body cache */
+		fields &= ~(MAIL_FETCH_STREAM_HEADER | MAIL_FETCH_STREAM_BODY);
+	}
 	if (fields == 0 && headers == NULL)
 		return mail->fetch_sent ? 0 : 1;
 
@@ -584,6 +614,18 @@ imapc_fetch_stream(struct imapc_mail *mail,
 		mail->header_fetched = TRUE;
 	mail->body_fetched = have_body;
 
+	if (have_header && have_body && hdr_stream == NULL) {
+		struct imapc_mailbox *mbox =
+			(struct imapc_mailbox *)imail->mail.mail.box;
+
+		if (mbox->body_cache != NULL && mbox->sync_uid_validity != 0) {
+			imapc_body_cache_add(mbox->body_cache,
+					     mbox->sync_uid_validity,
+					     imail->mail.mail.uid,
+					     imail->data.stream);
+		}
+	}
+
 	if (hdr_stream != NULL) {
 		struct istream *inputs[3];
 
@@ -65,7 +65,8 @@ static void imapc_mail_failed(struct mail *mail, const char *field)
 
 	if (mail->expunged || imapc_mail_is_expunged(mail)) {
 		mail_set_expunged(mail);
-	} else if (!imapc_client_mailbox_is_opened(mbox->client_box)) {
+	} else if (!imapc_client_mailbox_is_opened(mbox->client_box) &&
+		   !imapc_client_mailbox_is_unselected(mbox->client_box)) {
 		/* we've already logged a disconnection error */
 		mail_storage_set_internal_error(mail->box->storage);
 	} else {
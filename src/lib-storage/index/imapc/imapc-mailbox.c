@@ -571,6 +571,19 @@ imapc_resp_text_uidnext(const struct imapc_untagged_reply *reply,
 	mbox->sync_uid_next = uid_next;
 }
 
+static void
+imapc_resp_text_highestmodseq(const struct imapc_untagged_reply *reply,
+			      struct imapc_mailbox *mbox)
+{
+	uint64_t highest_modseq;
+
+	if (mbox == NULL ||
+	    str_to_uint64(reply->resp_text_value, &highest_modseq) < 0)
+		return;
+
+	mbox->sync_highest_modseq = highest_modseq;
+}
+
 static void
 imapc_resp_text_permanentflags(const struct imapc_untagged_reply *reply,
 			       struct imapc_mailbox *mbox)
@@ -639,6 +652,8 @@ void imapc_mailbox_register_callbacks(struct imapc_mailbox *mbox)
 					 imapc_resp_text_uidvalidity);
 	imapc_mailbox_register_resp_text(mbox, "UIDNEXT",
 					 imapc_resp_text_uidnext);
+	imapc_mailbox_register_resp_text(mbox, "HIGHESTMODSEQ",
+					 imapc_resp_text_highestmodseq);
 	imapc_mailbox_register_resp_text(mbox, "PERMANENTFLAGS",
 					 imapc_resp_text_permanentflags);
 }
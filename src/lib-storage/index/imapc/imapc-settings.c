@@ -29,6 +29,8 @@ static const struct setting_define imapc_setting_defines[] = {
 	DEF(SET_STR, imapc_rawlog_dir),
 	DEF(SET_STR, imapc_list_prefix),
 	DEF(SET_TIME, imapc_max_idle_time),
+	DEF(SET_UINT, imapc_max_connections),
+	DEF(SET_SIZE, imapc_body_cache_size),
 
 	DEF(SET_STR, pop3_deleted_flag),
 
@@ -51,6 +53,8 @@ static const struct imapc_settings imapc_default_settings = {
 	.imapc_rawlog_dir = "",
 	.imapc_list_prefix = "",
 	.imapc_max_idle_time = 60*29,
+	.imapc_max_connections = 0,
+	.imapc_body_cache_size = 0,
 
 	.pop3_deleted_flag = ""
 };
@@ -28,6 +28,8 @@ struct imapc_settings {
 	const char *imapc_rawlog_dir;
 	const char *imapc_list_prefix;
 	unsigned int imapc_max_idle_time;
+	unsigned int imapc_max_connections;
+	uoff_t imapc_body_cache_size;
 
 	const char *pop3_deleted_flag;
 
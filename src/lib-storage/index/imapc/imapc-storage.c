@@ -15,6 +15,7 @@
 #include "imapc-sync.h"
 #include "imapc-settings.h"
 #include "imapc-storage.h"
+#include "imapc-body-cache.h"
 
 #define DNS_CLIENT_SOCKET_NAME "dns-client"
 
@@ -252,6 +253,7 @@ int imapc_storage_client_create(struct mail_namespace *ns,
 	}
 	set.sasl_mechanisms = imapc_set->imapc_sasl_mechanisms;
 	set.max_idle_time = imapc_set->imapc_max_idle_time;
+	set.max_connections = imapc_set->imapc_max_connections;
 	set.dns_client_socket_path = *ns->user->set->base_dir == '\0' ? "" :
 		t_strconcat(ns->user->set->base_dir, "/",
 			    DNS_CLIENT_SOCKET_NAME, NULL);
@@ -463,6 +465,106 @@ static void imapc_mailbox_reopen(void *context)
 		imapc_sync_mailbox_reopened(mbox);
 }
 
+static bool imapc_mailbox_reselect_msgmap_is_valid(struct imapc_mailbox *mbox)
+{
+	if (mbox->reselect_msg_count == 0) {
+		/* nothing in the msgmap could have been expunged */
+		return TRUE;
+	}
+	if (mbox->exists_count < mbox->reselect_msg_count ||
+	    mbox->sync_uid_next < mbox->reselect_msg_uid_next)
+		return FALSE;
+	/* the new messages have UIDs >= reselect_msg_uid_next, so if there
+	   are as many new messages as there are new UIDs, none of the old
+	   messages could have been expunged. */
+	return mbox->exists_count - mbox->reselect_msg_count ==
+		mbox->sync_uid_next - mbox->reselect_msg_uid_next;
+}
+
+static void
+imapc_mailbox_reselect_callback(const struct imapc_command_reply *reply,
+				void *context)
+{
+	struct imapc_mailbox *mbox = context;
+	struct imapc_msgmap *msgmap =
+		imapc_client_mailbox_get_msgmap(mbox->client_box);
+	bool uid_next_received = TRUE;
+
+	i_assert(mbox->storage->reopen_count > 0);
+	mbox->storage->reopen_count--;
+	if (mbox->sync_uid_next == 0) {
+		/* server didn't send UIDNEXT */
+		mbox->sync_uid_next = mbox->reselect_sync_uid_next;
+		uid_next_received = FALSE;
+	}
+
+	if (reply->state != IMAPC_COMMAND_STATE_OK) {
+		mail_storage_set_critical(mbox->box.storage,
+			"imapc: Reselecting mailbox '%s' failed: %s",
+			mbox->box.name, reply->text_full);
+		imapc_client_mailbox_reconnect(mbox->client_box);
+	} else if (mbox->sync_uid_validity == mbox->reselect_uid_validity &&
+		   mbox->reselect_highest_modseq != 0 &&
+		   mbox->sync_highest_modseq == mbox->reselect_highest_modseq) {
+		/* CONDSTORE: nothing changed while another mailbox was
+		   selected */
+	} else if (mbox->sync_uid_validity == mbox->reselect_uid_validity &&
+		   uid_next_received &&
+		   imapc_mailbox_reselect_msgmap_is_valid(mbox)) {
+		/* nothing was expunged, but flags may have changed */
+		mbox->sync_fetch_first_uid = 1;
+	} else {
+		/* messages may have been expunged or UIDVALIDITY changed,
+		   so the msgmap can't be trusted anymore. re-fetch
+		   everything. */
+		mbox->initial_sync_done = FALSE;
+		mbox->prev_skipped_rseq = 0;
+		mbox->prev_skipped_uid = 0;
+		mbox->sync_fetch_first_uid = 1;
+		imapc_msgmap_reset(msgmap);
+		if (mbox->syncing)
+			imapc_sync_mailbox_reopened(mbox);
+	}
+	imapc_client_stop(mbox->storage->client->client);
+}
+
+static void imapc_mailbox_reselect(void *context)
+{
+	struct imapc_mailbox *mbox = context;
+	struct imapc_msgmap *msgmap =
+		imapc_client_mailbox_get_msgmap(mbox->client_box);
+	struct imapc_command *cmd;
+	enum imapc_capability capa;
+	const char *params;
+
+	/* another mailbox sharing the connection was selected after us.
+	   remember the current state, so the SELECT reply shows whether the
+	   msgmap is still valid. */
+	mbox->reselect_uid_validity = mbox->sync_uid_validity;
+	mbox->reselect_sync_uid_next = mbox->sync_uid_next;
+	mbox->reselect_msg_count = imapc_msgmap_count(msgmap);
+	mbox->reselect_msg_uid_next = imapc_msgmap_uidnext(msgmap);
+	mbox->reselect_highest_modseq = mbox->sync_highest_modseq;
+	mbox->sync_uid_next = 0;
+	mbox->sync_highest_modseq = 0;
+
+	cmd = imapc_client_mailbox_cmd(mbox->client_box,
+				       imapc_mailbox_reselect_callback, mbox);
+	imapc_command_set_flags(cmd, IMAPC_COMMAND_FLAG_SELECT);
+	/* with CONDSTORE the server sends HIGHESTMODSEQ, which tells if
+	   anything changed since the previous SELECT */
+	capa = imapc_client_get_capabilities(mbox->storage->client->client);
+	params = (capa & IMAPC_CAPABILITY_CONDSTORE) != 0 ? " (CONDSTORE)" : "";
+	if (imapc_mailbox_want_examine(mbox)) {
+		imapc_command_sendf(cmd, "EXAMINE %s%1s",
+				    mbox->box.name, params);
+	} else {
+		imapc_command_sendf(cmd, "SELECT %s%1s",
+				    mbox->box.name, params);
+	}
+	mbox->storage->reopen_count++;
+}
+
 static void
 imapc_mailbox_open_callback(const struct imapc_command_reply *reply,
 			    void *context)
@@ -519,6 +621,8 @@ int imapc_mailbox_select(struct imapc_mailbox *mbox)
 		imapc_client_mailbox_open(mbox->storage->client->client, mbox);
 	imapc_client_mailbox_set_reopen_cb(mbox->client_box,
 					   imapc_mailbox_reopen, mbox);
+	imapc_client_mailbox_set_reselect_cb(mbox->client_box,
+					     imapc_mailbox_reselect, mbox);
 
 	imapc_mailbox_get_extensions(mbox);
 
@@ -564,6 +668,7 @@ static int imapc_mailbox_open(struct mailbox *box)
 		mailbox_close(box);
 		return -1;
 	}
+	mbox->body_cache = imapc_body_cache_init(mbox);
 	return 0;
 }
 
@@ -599,6 +704,8 @@ static void imapc_mailbox_close(struct mailbox *box)
 	if (mbox->to_idle_check != NULL)
 		timeout_remove(&mbox->to_idle_check);
 	imapc_mail_cache_free(&mbox->prev_mail_cache);
+	if (mbox->body_cache != NULL)
+		imapc_body_cache_deinit(&mbox->body_cache);
 	index_storage_mailbox_close(box);
 }
 
@@ -952,7 +1059,8 @@ static bool imapc_is_inconsistent(struct mailbox *box)
 		return TRUE;
 
 	return mbox->client_box == NULL ? FALSE :
-		!imapc_client_mailbox_is_opened(mbox->client_box);
+		!imapc_client_mailbox_is_opened(mbox->client_box) &&
+		!imapc_client_mailbox_is_unselected(mbox->client_box);
 }
 
 struct mail_storage imapc_storage = {
@@ -115,15 +115,25 @@ struct imapc_mailbox {
 	uint32_t sync_next_rseq;
 	uint32_t exists_count;
 	uint32_t min_append_uid;
+	/* HIGHESTMODSEQ from the latest SELECT/EXAMINE, 0 if unknown */
+	uint64_t sync_highest_modseq;
 	char *sync_gmail_pop3_search_tag;
 
 	/* keep the previous fetched message body cached,
 	   mainly for partial IMAP fetches */
 	struct imapc_mail_cache prev_mail_cache;
+	/* local on-disk cache of fetched message bodies, or NULL if
+	   imapc_body_cache_size isn't set */
+	struct imapc_body_cache *body_cache;
 
 	uint32_t prev_skipped_rseq, prev_skipped_uid;
 	struct imapc_sync_context *sync_ctx;
 
+	/* state before SELECTing the mailbox again in a shared connection */
+	uint32_t reselect_uid_validity, reselect_sync_uid_next;
+	uint32_t reselect_msg_count, reselect_msg_uid_next;
+	uint64_t reselect_highest_modseq;
+
 	const char *guid_fetch_field_name;
 	struct imapc_search_context *search_ctx;
 
@@ -0,0 +1,182 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "mail-namespace.h"
+#include "mail-storage-private.h"
+#include "imapc-body-cache.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#define TEST_BODY "body of the mail\n"
+#define TEST_FILE_SIZE 400
+#define TEST_CACHE_SIZE 1000
+
+static struct test_mail_storage_ctx *test_ctx;
+
+static struct imapc_body_cache *test_body_cache_init(const char **dir_r)
+{
+	struct mail_storage *storage;
+
+	test_mail_storage_init_user(test_ctx, NULL);
+	storage = mail_namespace_find_inbox(test_ctx->user->namespaces)->storage;
+	*dir_r = t_strconcat(test_ctx->home_root, "/bodies", NULL);
+	return imapc_body_cache_init_dir(storage, "INBOX", *dir_r,
+					 TEST_CACHE_SIZE);
+}
+
+static void test_body_cache_deinit(struct imapc_body_cache **cache)
+{
+	imapc_body_cache_deinit(cache);
+	test_mail_storage_deinit_user(test_ctx);
+}
+
+static void
+test_body_cache_add(struct imapc_body_cache *cache, uint32_t uid_validity,
+		    uint32_t uid, const void *data, size_t size)
+{
+	struct istream *input;
+
+	input = i_stream_create_from_data(data, size);
+	imapc_body_cache_add(cache, uid_validity, uid, input);
+	i_stream_unref(&input);
+}
+
+static void
+test_write_file(const char *dir, const char *fname, size_t size, time_t mtime)
+{
+	struct utimbuf ut;
+	const char *path;
+	void *data;
+	int fd;
+
+	path = t_strconcat(dir, "/", fname, NULL);
+	data = t_malloc0(size);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write_full(fd, data, size) < 0)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+
+	ut.actime = ut.modtime = mtime;
+	if (utime(path, &ut) < 0)
+		i_fatal("utime(%s) failed: %m", path);
+}
+
+static bool test_file_exists(const char *dir, const char *fname)
+{
+	struct stat st;
+
+	return stat(t_strconcat(dir, "/", fname, NULL), &st) == 0;
+}
+
+static void test_imapc_body_cache_add(void)
+{
+	struct imapc_body_cache *cache;
+	struct istream *input;
+	const char *dir;
+	char buf[sizeof(TEST_BODY)];
+	void *large_body;
+	int fd;
+
+	test_begin("imapc body cache add");
+	cache = test_body_cache_init(&dir);
+
+	/* not cached yet */
+	test_assert(imapc_body_cache_open(cache, 1, 1) == -1);
+
+	/* the input stream is seeked back after it's been cached */
+	input = i_stream_create_from_data(TEST_BODY, strlen(TEST_BODY));
+	imapc_body_cache_add(cache, 1, 1, input);
+	test_assert(input->v_offset == 0);
+	i_stream_unref(&input);
+
+	fd = imapc_body_cache_open(cache, 1, 1);
+	test_assert(fd != -1);
+	if (fd != -1) {
+		/* the whole body and nothing more */
+		test_assert(read_full(fd, buf, sizeof(buf)) == 0);
+		test_assert(memcmp(buf, TEST_BODY, strlen(TEST_BODY)) == 0);
+		i_close_fd(&fd);
+	}
+	/* a different UIDVALIDITY isn't found */
+	test_assert(imapc_body_cache_open(cache, 2, 1) == -1);
+
+	/* a body that could never fit isn't cached */
+	large_body = t_malloc0(TEST_CACHE_SIZE + 1);
+	test_body_cache_add(cache, 1, 2, large_body, TEST_CACHE_SIZE + 1);
+	test_assert(imapc_body_cache_open(cache, 1, 2) == -1);
+
+	test_body_cache_deinit(&cache);
+	test_end();
+}
+
+static void test_imapc_body_cache_clean(void)
+{
+	struct imapc_body_cache *cache;
+	struct utimbuf ut;
+	const char *dir;
+	void *body;
+	int fd;
+
+	test_begin("imapc body cache clean");
+	cache = test_body_cache_init(&dir);
+	if (mkdir(dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", dir);
+	test_write_file(dir, "1.1", TEST_FILE_SIZE, ioloop_time - 300);
+	test_write_file(dir, "1.2", TEST_FILE_SIZE, ioloop_time - 200);
+	test_write_file(dir, "1.3", TEST_FILE_SIZE, ioloop_time - 100);
+	test_write_file(dir, "2.5", TEST_FILE_SIZE, ioloop_time);
+	test_write_file(dir, ".temp.old", 1, ioloop_time - 2*60*60);
+	test_write_file(dir, ".temp.new", 1, ioloop_time);
+
+	/* the first add scans the directory: the old UIDVALIDITY's and the
+	   stale temp files are deleted and the oldest mails are deleted until
+	   the cache fits. the mail added after that drops the next oldest. */
+	body = t_malloc0(TEST_FILE_SIZE);
+	test_body_cache_add(cache, 1, 4, body, TEST_FILE_SIZE);
+	test_assert(!test_file_exists(dir, "2.5"));
+	test_assert(!test_file_exists(dir, ".temp.old"));
+	test_assert(test_file_exists(dir, ".temp.new"));
+	test_assert(!test_file_exists(dir, "1.1"));
+	test_assert(!test_file_exists(dir, "1.2"));
+	test_assert(test_file_exists(dir, "1.3"));
+	test_assert(test_file_exists(dir, "1.4"));
+
+	/* opening a mail makes it the most recently used */
+	fd = imapc_body_cache_open(cache, 1, 3);
+	test_assert(fd != -1);
+	if (fd != -1)
+		i_close_fd(&fd);
+	ut.actime = ut.modtime = ioloop_time - 50;
+	if (utime(t_strconcat(dir, "/1.4", NULL), &ut) < 0)
+		i_fatal("utime() failed: %m");
+	test_body_cache_add(cache, 1, 5, body, TEST_FILE_SIZE);
+	test_assert(test_file_exists(dir, "1.3"));
+	test_assert(!test_file_exists(dir, "1.4"));
+	test_assert(test_file_exists(dir, "1.5"));
+
+	test_body_cache_deinit(&cache);
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*test_functions[])(void) = {
+		test_imapc_body_cache_add,
+		test_imapc_body_cache_clean,
+		NULL
+	};
+
+	test_ctx = test_mail_storage_init(&argc, &argv);
+	return test_run(test_functions);
+}
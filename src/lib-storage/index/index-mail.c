@@ -6,6 +6,7 @@
 #include "ioloop.h"
 #include "istream.h"
 #include "str.h"
+#include "time-util.h"
 #include "message-date.h"
 #include "message-part-serialize.h"
 #include "message-parser.h"
@@ -19,6 +20,11 @@
 #include "index-mail.h"
 
 #include <fcntl.h>
+#include <unistd.h>
+
+/* If the first byte of a prefetched mail can be read faster than this, its
+   data is assumed to have already been in memory. */
+#define INDEX_MAIL_PREFETCH_HIT_MAX_USECS 500
 
 #define BODY_SNIPPET_ALGO_V1 "1"
 #define BODY_SNIPPET_MAX_CHARS 100
@@ -1791,6 +1797,44 @@ bool index_mail_prefetch(struct mail *_mail)
 	return !mail->data.prefetch_sent;
 }
 
+int index_mail_prefetch_wait(struct mail *_mail)
+{
+	struct index_mail *mail = (struct index_mail *)_mail;
+	struct timeval start_time, end_time;
+	unsigned char c;
+	bool hit;
+	int fd;
+
+	if (mail->data.prefetch_pending)
+		return 0;
+	/* nothing was prefetched, so there's nothing to measure either */
+	if (!mail->data.prefetch_sent || mail->data.stream == NULL)
+		return -1;
+	fd = i_stream_get_fd(mail->data.stream);
+	if (fd == -1)
+		return -1;
+
+	/* the mail is going to be read next anyway, so reading its first
+	   byte costs nothing extra. if it's slow, the prefetch hadn't
+	   finished yet. */
+	if (gettimeofday(&start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	if (pread(fd, &c, 1, 0) < 0) {
+		i_error("pread(%s) failed: %m",
+			i_stream_get_name(mail->data.stream));
+	}
+	if (gettimeofday(&end_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+
+	hit = timeval_diff_usecs(&end_time, &start_time) <
+		INDEX_MAIL_PREFETCH_HIT_MAX_USECS;
+	if (hit)
+		_mail->transaction->stats.prefetch_hit_count++;
+	else
+		_mail->transaction->stats.prefetch_miss_count++;
+	return hit ? 1 : 0;
+}
+
 bool index_mail_set_uid(struct mail *_mail, uint32_t uid)
 {
 	struct index_mail *mail = (struct index_mail *)_mail;
@@ -128,6 +128,9 @@ struct index_mail_data {
 	unsigned int initialized_wrapper_stream:1;
 	unsigned int destroy_callback_set:1;
 	unsigned int prefetch_sent:1;
+	/* prefetch was sent to a remote server, but its reply hasn't been
+	   received yet */
+	unsigned int prefetch_pending:1;
 	unsigned int header_parser_initialized:1;
 };
 
@@ -170,6 +173,12 @@ void index_mail_set_seq(struct mail *mail, uint32_t seq, bool saving);
 bool index_mail_set_uid(struct mail *mail, uint32_t uid);
 void index_mail_set_uid_cache_updates(struct mail *mail, bool set);
 bool index_mail_prefetch(struct mail *mail);
+/* Wait for the prefetched mail's data to become available. Returns 1 if it
+   was already read into memory, 0 if the prefetch hadn't finished, -1 if
+   nothing was prefetched for the mail (e.g. it was fully cached or it
+   doesn't have a file). Only 1 and 0 are counted in the transaction's
+   stats. */
+int index_mail_prefetch_wait(struct mail *mail);
 void index_mail_add_temp_wanted_fields(struct mail *mail,
 				       enum mail_fetch_field fields,
 				       struct mailbox_header_lookup_ctx *headers);
@@ -0,0 +1,454 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* Persistent search result cache. The results of searches are saved to
+   dovecot.index.search together with the mailbox's highest modseq and
+   next_uid at the time of the search. When the same search is done again,
+   the messages that didn't match then and haven't changed since can be
+   skipped. The rest are searched normally. The changed messages are read
+   from the transaction log, so if it no longer contains all the changes
+   the cache isn't used. This works only for search args that depend on the
+   message's immutable data and its flags/keywords, which are tracked by
+   modseqs. Modseqs must already be enabled for the mailbox.
+
+   The file format is:
+
+   2 <uid validity>
+   <modseq> TAB <next uid> TAB <last update time> TAB <uid set> TAB
+     <search args>
+
+   The most recently updated searches are first in the file. */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "ostream.h"
+#include "str.h"
+#include "strescape.h"
+#include "safe-mkstemp.h"
+#include "imap-seqset.h"
+#include "imap-util.h"
+#include "mail-index-private.h"
+#include "mail-index-modseq.h"
+#include "mail-search.h"
+#include "index-storage.h"
+#include "index-search-private.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define INDEX_SEARCH_CACHE_SUFFIX ".search"
+#define INDEX_SEARCH_CACHE_VERSION 2
+#define INDEX_SEARCH_CACHE_MAX_ENTRIES 32
+
+struct index_search_cache_entry {
+	uint64_t modseq;
+	uint32_t next_uid;
+	time_t last_update;
+	const char *uidset;
+	const char *key;
+};
+ARRAY_DEFINE_TYPE(index_search_cache_entry, struct index_search_cache_entry);
+
+struct index_search_cache {
+	char *key;
+	uint32_t uid_validity;
+	/* highest modseq and next_uid of the view when the search was
+	   started */
+	uint64_t modseq;
+	uint32_t next_uid;
+
+	/* the result found from the cache file */
+	uint64_t entry_modseq;
+	uint32_t entry_next_uid;
+	ARRAY_TYPE(seq_range) entry_uids;
+
+	ARRAY_TYPE(seq_range) result_uids;
+	unsigned int finished:1;
+};
+
+static bool
+search_cache_args_are_cacheable(const struct mail_search_arg *arg,
+				bool *have_nonindex_args)
+{
+	for (; arg != NULL; arg = arg->next) {
+		if (arg->fuzzy || arg->match_always || arg->nonmatch_always)
+			return FALSE;
+
+		switch (arg->type) {
+		case SEARCH_OR:
+		case SEARCH_SUB:
+			if (!search_cache_args_are_cacheable(arg->value.subargs,
+							     have_nonindex_args))
+				return FALSE;
+			break;
+		case SEARCH_ALL:
+		case SEARCH_UIDSET:
+		case SEARCH_KEYWORDS:
+			break;
+		case SEARCH_FLAGS:
+			/* \Recent flag changes don't update modseqs */
+			if ((arg->value.flags & MAIL_RECENT) != 0)
+				return FALSE;
+			break;
+		case SEARCH_BEFORE:
+		case SEARCH_ON:
+		case SEARCH_SINCE:
+			/* OLDER/YOUNGER are relative to the current time */
+			if ((arg->value.search_flags &
+			     MAIL_SEARCH_ARG_FLAG_USE_TZ) != 0)
+				return FALSE;
+			*have_nonindex_args = TRUE;
+			break;
+		case SEARCH_SMALLER:
+		case SEARCH_LARGER:
+		case SEARCH_HEADER:
+		case SEARCH_HEADER_ADDRESS:
+		case SEARCH_HEADER_COMPRESS_LWSP:
+		case SEARCH_BODY:
+		case SEARCH_TEXT:
+		case SEARCH_GUID:
+			*have_nonindex_args = TRUE;
+			break;
+		default:
+			/* sequences, modseqs, threads, etc. */
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static const char *index_search_cache_get_path(struct mailbox *box)
+{
+	return t_strconcat(box->index->filepath,
+			   INDEX_SEARCH_CACHE_SUFFIX, NULL);
+}
+
+static int
+search_cache_parse_entry(const char *line,
+			 struct index_search_cache_entry *entry_r)
+{
+	const char *const *args = t_strsplit_tabescaped(line);
+
+	if (str_array_length(args) != 5 ||
+	    str_to_uint64(args[0], &entry_r->modseq) < 0 ||
+	    str_to_uint32(args[1], &entry_r->next_uid) < 0 ||
+	    str_to_time(args[2], &entry_r->last_update) < 0)
+		return -1;
+	entry_r->uidset = args[3];
+	entry_r->key = args[4];
+	return 0;
+}
+
+/* Returns 1 if the file was read, 0 if it doesn't exist or it's unusable,
+   -1 on error. */
+static int
+search_cache_read(struct mailbox *box, uint32_t uid_validity,
+		  ARRAY_TYPE(index_search_cache_entry) *entries)
+{
+	struct index_search_cache_entry entry;
+	struct istream *input;
+	const char *path, *line;
+	uint32_t version, file_uid_validity;
+	int fd, ret = 1;
+
+	path = index_search_cache_get_path(box);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		mail_storage_set_critical(box->storage,
+					  "open(%s) failed: %m", path);
+		return -1;
+	}
+
+	input = i_stream_create_fd(fd, (size_t)-1, FALSE);
+	line = i_stream_read_next_line(input);
+	if (line == NULL ||
+	    sscanf(line, "%u %u", &version, &file_uid_validity) != 2 ||
+	    version != INDEX_SEARCH_CACHE_VERSION ||
+	    file_uid_validity != uid_validity)
+		ret = 0;
+	while (ret > 0 && (line = i_stream_read_next_line(input)) != NULL) {
+		if (search_cache_parse_entry(t_strdup(line), &entry) < 0) {
+			/* broken, ignore the rest of the file */
+			break;
+		}
+		array_append(entries, &entry, 1);
+	}
+	if (input->stream_errno != 0) {
+		mail_storage_set_critical(box->storage,
+					  "read(%s) failed: %s", path,
+					  i_stream_get_error(input));
+		ret = -1;
+	}
+	i_stream_destroy(&input);
+	i_close_fd(&fd);
+	return ret;
+}
+
+static void
+search_cache_add_check_seqs(struct index_search_context *ctx,
+			    const ARRAY_TYPE(seq_range) *uids,
+			    ARRAY_TYPE(seq_range) *check_seqs)
+{
+	const struct seq_range *range;
+	uint32_t seq1, seq2;
+
+	array_foreach(uids, range) {
+		mail_index_lookup_seq_range(ctx->view, range->seq1, range->seq2,
+					    &seq1, &seq2);
+		if (seq1 != 0)
+			seq_range_array_add_range(check_seqs, seq1, seq2);
+	}
+}
+
+static void
+search_cache_apply(struct index_search_context *ctx,
+		   const struct index_search_cache_entry *entry)
+{
+	struct index_search_cache *cache = ctx->cache;
+	ARRAY_TYPE(seq_range) check_uids, check_seqs;
+
+	t_array_init(&check_uids, 64);
+	if (entry->uidset[0] != '\0' &&
+	    imap_seq_set_nostar_parse(entry->uidset, &check_uids) < 0)
+		return;
+	/* messages that have changed after the cached search. this also
+	   includes expunges, but they don't matter. */
+	if (entry->modseq < cache->modseq &&
+	    !mailbox_get_changed_uids(ctx->box, entry->modseq, &check_uids))
+		return;
+
+	i_array_init(&cache->entry_uids, 64);
+	if (entry->uidset[0] != '\0')
+		(void)imap_seq_set_nostar_parse(entry->uidset, &cache->entry_uids);
+	cache->entry_modseq = entry->modseq;
+	cache->entry_next_uid = entry->next_uid;
+
+	/* check the messages that matched the last time, have changed or
+	   are new. the rest didn't match and still don't. */
+	if (entry->next_uid < cache->next_uid) {
+		seq_range_array_add_range(&check_uids, entry->next_uid,
+					  cache->next_uid - 1);
+	}
+	t_array_init(&check_seqs, array_count(&check_uids) + 1);
+	search_cache_add_check_seqs(ctx, &check_uids, &check_seqs);
+
+	if (ctx->have_flag_seqs)
+		seq_range_array_intersect(&ctx->flag_seqs, &check_seqs);
+	else {
+		i_array_init(&ctx->flag_seqs, array_count(&check_seqs) + 1);
+		array_append_array(&ctx->flag_seqs, &check_seqs);
+		ctx->have_flag_seqs = TRUE;
+	}
+}
+
+void index_search_cache_init(struct index_search_context *ctx)
+{
+	struct mailbox *box = ctx->box;
+	struct mail_search_args *args = ctx->mail_ctx.args;
+	struct index_search_cache *cache;
+	const struct mail_index_header *hdr;
+	string_t *key;
+	const char *error;
+	bool have_nonindex_args = FALSE;
+
+	if (!box->storage->set->mail_search_result_cache ||
+	    mail_index_is_in_memory(box->index))
+		return;
+	/* the cache relies on modseqs to find the changed messages. don't
+	   enable them here, since that makes all the following changes more
+	   expensive. */
+	if (!mail_index_have_modseq_tracking(box->index))
+		return;
+	/* private flags don't have modseqs in the shared index and
+	   uncommitted flag changes don't have modseqs at all */
+	if (mailbox_get_private_flags_mask(box) != 0 ||
+	    mail_index_transaction_has_changes(ctx->mail_ctx.transaction->itrans))
+		return;
+	/* searches that can be answered from the index alone are fast
+	   enough already */
+	if (!search_cache_args_are_cacheable(args->args, &have_nonindex_args) ||
+	    !have_nonindex_args)
+		return;
+
+	key = t_str_new(128);
+	if (!mail_search_args_to_imap(key, args->args, &error))
+		return;
+
+	hdr = mail_index_get_header(ctx->view);
+	cache = ctx->cache = i_new(struct index_search_cache, 1);
+	cache->key = i_strdup(str_c(key));
+	cache->uid_validity = hdr->uid_validity;
+	cache->next_uid = hdr->next_uid;
+	cache->modseq = mail_index_modseq_get_highest(ctx->view);
+	i_array_init(&cache->result_uids, 64);
+}
+
+static void search_cache_free(struct index_search_cache **_cache)
+{
+	struct index_search_cache *cache = *_cache;
+
+	*_cache = NULL;
+	if (array_is_created(&cache->entry_uids))
+		array_free(&cache->entry_uids);
+	array_free(&cache->result_uids);
+	i_free(cache->key);
+	i_free(cache);
+}
+
+void index_search_cache_start(struct index_search_context *ctx)
+{
+	struct index_search_cache *cache = ctx->cache;
+	ARRAY_TYPE(index_search_cache_entry) entries;
+	const struct index_search_cache_entry *entry;
+
+	if (cache == NULL)
+		return;
+	if (ctx->mail_ctx.no_result_cache) {
+		search_cache_free(&ctx->cache);
+		return;
+	}
+
+	T_BEGIN {
+		t_array_init(&entries, 8);
+		if (search_cache_read(ctx->box, cache->uid_validity,
+				      &entries) > 0) {
+			array_foreach(&entries, entry) {
+				if (strcmp(entry->key, cache->key) != 0)
+					continue;
+				if (entry->modseq <= cache->modseq &&
+				    entry->next_uid <= cache->next_uid)
+					search_cache_apply(ctx, entry);
+				break;
+			}
+		}
+	} T_END;
+}
+
+void index_search_cache_add_match(struct index_search_context *ctx,
+				  uint32_t uid)
+{
+	if (ctx->cache != NULL)
+		seq_range_array_add(&ctx->cache->result_uids, uid);
+}
+
+void index_search_cache_finish(struct index_search_context *ctx)
+{
+	if (ctx->cache != NULL)
+		ctx->cache->finished = TRUE;
+}
+
+static bool search_cache_result_changed(struct index_search_cache *cache)
+{
+	if (!array_is_created(&cache->entry_uids))
+		return TRUE;
+	if (cache->entry_modseq != cache->modseq ||
+	    cache->entry_next_uid != cache->next_uid)
+		return TRUE;
+	return !array_cmp(&cache->entry_uids, &cache->result_uids);
+}
+
+static void
+search_cache_write_entries(struct ostream *output,
+			   struct index_search_cache *cache,
+			   const ARRAY_TYPE(index_search_cache_entry) *entries)
+{
+	const struct index_search_cache_entry *entry;
+	unsigned int count = 1;
+	string_t *str = t_str_new(256);
+
+	str_printfa(str, "%u %u\n", INDEX_SEARCH_CACHE_VERSION,
+		    cache->uid_validity);
+	str_printfa(str, "%llu\t%u\t%ld\t",
+		    (unsigned long long)cache->modseq, cache->next_uid,
+		    (long)ioloop_time);
+	imap_write_seq_range(str, &cache->result_uids);
+	str_append_c(str, '\t');
+	str_append_tabescaped(str, cache->key);
+	str_append_c(str, '\n');
+	o_stream_nsend(output, str_data(str), str_len(str));
+
+	array_foreach(entries, entry) {
+		if (count == INDEX_SEARCH_CACHE_MAX_ENTRIES)
+			break;
+		if (strcmp(entry->key, cache->key) == 0)
+			continue;
+
+		str_truncate(str, 0);
+		str_printfa(str, "%llu\t%u\t%ld\t%s\t",
+			    (unsigned long long)entry->modseq, entry->next_uid,
+			    (long)entry->last_update, entry->uidset);
+		str_append_tabescaped(str, entry->key);
+		str_append_c(str, '\n');
+		o_stream_nsend(output, str_data(str), str_len(str));
+		count++;
+	}
+}
+
+static void search_cache_write(struct mailbox *box,
+			       struct index_search_cache *cache)
+{
+	struct mail_index *index = box->index;
+	ARRAY_TYPE(index_search_cache_entry) entries;
+	struct ostream *output;
+	const char *path, *temp_path;
+	string_t *str;
+	int fd, ret = 0;
+
+	/* other processes may have written their searches meanwhile */
+	t_array_init(&entries, 8);
+	if (search_cache_read(box, cache->uid_validity, &entries) < 0)
+		return;
+
+	path = index_search_cache_get_path(box);
+	str = t_str_new(256);
+	str_append(str, path);
+	fd = safe_mkstemp_hostpid_group(str, index->mode, index->gid,
+					index->gid_origin);
+	temp_path = str_c(str);
+	if (fd == -1) {
+		mail_storage_set_critical(box->storage,
+			"safe_mkstemp_hostpid(%s) failed: %m", temp_path);
+		return;
+	}
+
+	output = o_stream_create_fd(fd, 0, FALSE);
+	o_stream_cork(output);
+	search_cache_write_entries(output, cache, &entries);
+	if (o_stream_nfinish(output) < 0) {
+		mail_storage_set_critical(box->storage,
+			"write(%s) failed: %m", temp_path);
+		ret = -1;
+	}
+	o_stream_destroy(&output);
+	if (close(fd) < 0) {
+		mail_storage_set_critical(box->storage,
+			"close(%s) failed: %m", temp_path);
+		ret = -1;
+	} else if (ret == 0 && rename(temp_path, path) < 0) {
+		mail_storage_set_critical(box->storage,
+			"rename(%s, %s) failed: %m", temp_path, path);
+		ret = -1;
+	}
+	if (ret < 0)
+		(void)unlink(temp_path);
+}
+
+void index_search_cache_deinit(struct index_search_context *ctx)
+{
+	struct index_search_cache *cache = ctx->cache;
+
+	if (cache == NULL)
+		return;
+
+	if (cache->finished && !ctx->failed &&
+	    !ctx->mail_ctx.no_result_cache &&
+	    !ctx->mail_ctx.seen_lost_data &&
+	    search_cache_result_changed(cache)) T_BEGIN {
+		search_cache_write(ctx->box, cache);
+	} T_END;
+	search_cache_free(&ctx->cache);
+}
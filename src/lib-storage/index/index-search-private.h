@@ -16,13 +16,22 @@ struct index_search_context {
 	struct mailbox_header_lookup_ctx *extra_wanted_headers;
 
 	uint32_t seq1, seq2;
+	/* messages that may match the flag/keyword args and the cached
+	   search result */
+	ARRAY_TYPE(seq_range) flag_seqs;
+	unsigned int flag_seqs_idx;
 	struct mail *cur_mail;
 	struct index_mail *cur_imail;
 	struct mail_thread_context *thread_ctx;
+	struct index_search_cache *cache;
 
 	ARRAY(struct mail *) mails;
 	unsigned int unused_mail_idx;
 	unsigned int max_mails;
+	/* number of mails currently prefetched ahead, adjusted between 2 and
+	   max_mails depending on whether the prefetches finish in time */
+	unsigned int prefetch_depth;
+	unsigned int prefetch_hits_in_row;
 
 	struct timeval search_start_time, last_notify;
 	struct timeval last_nonblock_timeval;
@@ -32,9 +41,23 @@ struct index_search_context {
 	unsigned int sorted:1;
 	unsigned int have_seqsets:1;
 	unsigned int have_index_args:1;
+	unsigned int have_flag_seqs:1;
 	unsigned int have_mailbox_args:1;
 };
 
 struct mail *index_search_get_mail(struct index_search_context *ctx);
 
+/* Prepare using the persistent search result cache for the search. */
+void index_search_cache_init(struct index_search_context *ctx);
+/* Look up the search from the cache. Messages that didn't match the cached
+   result and haven't changed since it was saved are skipped. Called before
+   the first message is searched. */
+void index_search_cache_start(struct index_search_context *ctx);
+void index_search_cache_add_match(struct index_search_context *ctx,
+				  uint32_t uid);
+/* All the messages have been searched. */
+void index_search_cache_finish(struct index_search_context *ctx);
+/* Save the search result to the cache if the search was finished. */
+void index_search_cache_deinit(struct index_search_context *ctx);
+
 #endif
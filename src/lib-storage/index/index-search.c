@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "ioloop.h"
 #include "array.h"
+#include "bsearch-insert-pos.h"
 #include "istream.h"
 #include "utc-offset.h"
 #include "str.h"
@@ -32,6 +33,8 @@
 #define SEARCH_COST_KBYTE 15ULL
 #define SEARCH_COST_CACHE 1ULL
 
+#define SEARCH_PREFETCH_MIN_DEPTH 2
+
 #define SEARCH_MIN_NONBLOCK_USECS 200000
 #define SEARCH_MAX_NONBLOCK_USECS 250000
 #define SEARCH_INITIAL_MAX_COST 30000
@@ -1044,6 +1047,92 @@ static void search_get_seqset(struct index_search_context *ctx,
 	}
 }
 
+static void search_init_flag_seqs(struct index_search_context *ctx,
+				  struct mail_search_arg *args)
+{
+	ARRAY(struct mail_index_flag_filter) filters;
+	struct mail_index_flag_filter *filter;
+	enum mail_flags pvt_flags_mask;
+
+	if (ctx->seq1 > ctx->seq2)
+		return;
+
+	/* The root level args are ANDed together, so all the flag and
+	   keyword args there can be looked up from the index's flag bitmaps
+	   at once. The per-message checks are still done, but only for the
+	   messages that can match. */
+	pvt_flags_mask = mailbox_get_private_flags_mask(ctx->box);
+	t_array_init(&filters, 8);
+	for (; args != NULL; args = args->next) {
+		switch (args->type) {
+		case SEARCH_FLAGS:
+			/* recent flag isn't stored in the index and private
+			   flags are in a different index */
+			if ((args->value.flags &
+			     (MAIL_RECENT | pvt_flags_mask)) != 0)
+				continue;
+			filter = array_append_space(&filters);
+			filter->flags = args->value.flags;
+			break;
+		case SEARCH_KEYWORDS:
+			if (args->value.keywords == NULL)
+				continue;
+			filter = array_append_space(&filters);
+			filter->keywords = args->value.keywords;
+			break;
+		default:
+			continue;
+		}
+		filter->match_not = args->match_not;
+	}
+	if (array_count(&filters) == 0)
+		return;
+
+	i_array_init(&ctx->flag_seqs, 64);
+	if (!mail_index_lookup_seqs_by_flags(ctx->view, ctx->seq1, ctx->seq2,
+					     array_idx(&filters, 0),
+					     array_count(&filters),
+					     &ctx->flag_seqs)) {
+		array_free(&ctx->flag_seqs);
+		return;
+	}
+	ctx->have_flag_seqs = TRUE;
+}
+
+static int search_flag_seqs_bsearch_cmp(const uint32_t *seq,
+					const struct seq_range *range)
+{
+	if (*seq < range->seq1)
+		return -1;
+	if (*seq > range->seq2)
+		return 1;
+	return 0;
+}
+
+static void search_skip_flag_nonmatches(struct index_search_context *ctx)
+{
+	const struct seq_range *range;
+	unsigned int count;
+	uint32_t seq = ctx->mail_ctx.seq;
+
+	range = array_get(&ctx->flag_seqs, &count);
+	if (ctx->flag_seqs_idx > 0 &&
+	    range[ctx->flag_seqs_idx-1].seq2 >= seq) {
+		/* virtual mailbox searches may move backwards */
+		(void)array_bsearch_insert_pos(&ctx->flag_seqs, &seq,
+					       search_flag_seqs_bsearch_cmp,
+					       &ctx->flag_seqs_idx);
+	}
+	while (ctx->flag_seqs_idx < count &&
+	       range[ctx->flag_seqs_idx].seq2 < seq)
+		ctx->flag_seqs_idx++;
+
+	if (ctx->flag_seqs_idx == count)
+		ctx->mail_ctx.seq = ctx->seq2 + 1;
+	else if (seq < range[ctx->flag_seqs_idx].seq1)
+		ctx->mail_ctx.seq = range[ctx->flag_seqs_idx].seq1;
+}
+
 static int search_build_subthread(struct mail_thread_iterate_context *iter,
 				  ARRAY_TYPE(seq_range) *uids)
 {
@@ -1211,10 +1300,15 @@ index_storage_search_init(struct mailbox_transaction_context *t,
 	ctx->view = t->view;
 	ctx->mail_ctx.args = args;
 	ctx->mail_ctx.sort_program = index_sort_program_init(t, sort_program);
+	if (ctx->mail_ctx.sort_program != NULL && args->sort_limit != 0) {
+		index_sort_program_set_limit(ctx->mail_ctx.sort_program,
+					     args->sort_limit);
+	}
 
 	ctx->max_mails = t->box->storage->set->mail_prefetch_count + 1;
 	if (ctx->max_mails == 0)
 		ctx->max_mails = UINT_MAX;
+	ctx->prefetch_depth = I_MIN(ctx->max_mails, SEARCH_PREFETCH_MIN_DEPTH);
 	ctx->next_time_check_cost = SEARCH_INITIAL_MAX_COST;
 	if (gettimeofday(&ctx->last_nonblock_timeval, NULL) < 0)
 		i_fatal("gettimeofday() failed: %m");
@@ -1247,6 +1341,12 @@ index_storage_search_init(struct mailbox_transaction_context *t,
 
 	search_get_seqset(ctx, status.messages, args->args);
 	(void)mail_search_args_foreach(args->args, search_init_arg, ctx);
+	if (ctx->have_index_args) T_BEGIN {
+		search_init_flag_seqs(ctx, args->args);
+	} T_END;
+	T_BEGIN {
+		index_search_cache_init(ctx);
+	} T_END;
 
 	/* Need to reset results for match_always cases */
 	mail_search_args_reset(ctx->mail_ctx.args->args, FALSE);
@@ -1283,6 +1383,9 @@ int index_storage_search_deinit(struct mail_search_context *_ctx)
 		index_sort_program_deinit(&ctx->mail_ctx.sort_program);
 	if (ctx->thread_ctx != NULL)
 		mail_thread_deinit(&ctx->thread_ctx);
+	index_search_cache_deinit(ctx);
+	if (array_is_created(&ctx->flag_seqs))
+		array_free(&ctx->flag_seqs);
 	array_free(&ctx->mail_ctx.results);
 	array_free(&ctx->mail_ctx.module_contexts);
 
@@ -1587,7 +1690,7 @@ struct mail *index_search_get_mail(struct index_search_context *ctx)
 	struct mail *const *mails, *mail;
 	unsigned int count;
 
-	if (ctx->unused_mail_idx == ctx->max_mails)
+	if (ctx->unused_mail_idx >= ctx->prefetch_depth)
 		return NULL;
 
 	mails = array_get(&ctx->mails, &count);
@@ -1605,6 +1708,26 @@ struct mail *index_search_get_mail(struct index_search_context *ctx)
 	return mail;
 }
 
+static void
+search_prefetch_update_depth(struct index_search_context *ctx, bool hit)
+{
+	if (!hit) {
+		/* the mail's data wasn't read yet when we needed it, so
+		   the reads' latency isn't hidden. prefetch further ahead. */
+		ctx->prefetch_hits_in_row = 0;
+		if (ctx->prefetch_depth < ctx->max_mails / 2)
+			ctx->prefetch_depth *= 2;
+		else
+			ctx->prefetch_depth = ctx->max_mails;
+	} else if (++ctx->prefetch_hits_in_row >= ctx->prefetch_depth) {
+		/* prefetching is keeping up. see if fewer open mails are
+		   enough. */
+		ctx->prefetch_hits_in_row = 0;
+		if (ctx->prefetch_depth > SEARCH_PREFETCH_MIN_DEPTH)
+			ctx->prefetch_depth--;
+	}
+}
+
 static int search_more_with_prefetching(struct index_search_context *ctx,
 					struct mail **mail_r)
 {
@@ -1657,6 +1780,9 @@ static int search_more_with_prefetching(struct index_search_context *ctx,
 		array_delete(&ctx->mails, 0, 1);
 		array_append(&ctx->mails, mail_r, 1);
 	}
+	ret = index_mail_prefetch_wait(*mail_r);
+	if (ret >= 0)
+		search_prefetch_update_depth(ctx, ret > 0);
 	index_mail_update_access_parts_post(*mail_r);
 	return 1;
 }
@@ -1700,6 +1826,10 @@ static int search_more(struct index_search_context *ctx,
 			break;
 		}
 	}
+	if (ret > 0)
+		index_search_cache_add_match(ctx, (*mail_r)->uid);
+	else if (ret < 0 && !ctx->mail_ctx.args->stop_on_nonmatch)
+		index_search_cache_finish(ctx);
 	return ret;
 }
 
@@ -1762,10 +1892,13 @@ bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 
 	if (_ctx->seq == 0) {
 		/* first time */
+		index_search_cache_start(ctx);
 		_ctx->seq = ctx->seq1;
 	} else {
 		_ctx->seq++;
 	}
+	if (ctx->have_flag_seqs)
+		search_skip_flag_nonmatches(ctx);
 
 	if (!ctx->have_seqsets && !ctx->have_index_args &&
 	    _ctx->update_result == NULL) {
@@ -1796,6 +1929,8 @@ bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 
 		/* doesn't, try next one */
 		_ctx->seq++;
+		if (ctx->have_flag_seqs)
+			search_skip_flag_nonmatches(ctx);
 		mail_search_args_reset(ctx->mail_ctx.args->args, FALSE);
 	}
 
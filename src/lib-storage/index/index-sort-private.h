@@ -12,6 +12,8 @@ struct mail_search_sort_program {
 			      struct mail *mail);
 	void (*sort_list_finish)(struct mail_search_sort_program *program);
 	void *context;
+	/* keep only this many first sorted mails (0 = all) */
+	unsigned int limit;
 
 	ARRAY_TYPE(uint32_t) seqs;
 	unsigned int iter_idx;
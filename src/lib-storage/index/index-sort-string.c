@@ -509,9 +509,10 @@ index_sort_add_ids_range(struct sort_string_context *ctx,
 {
 
 	struct mail_sort_node *nodes;
-	unsigned int i, count, rightmost_idx, skip;
+	unsigned int i, count, rightmost_idx, skip, prev_old_idx;
 	const char *left_str = NULL, *right_str = NULL, *str = NULL;
 	uint32_t left_sort_id, right_sort_id, diff;
+	uint32_t old_sort_id, prev_old_sort_id, right_old_sort_id;
 	bool no_left_str = FALSE, no_right_str = FALSE;
 	int ret;
 
@@ -595,12 +596,15 @@ index_sort_add_ids_range(struct sort_string_context *ctx,
 		}
 		left_idx++;
 	}
+	right_old_sort_id = 0;
 	if (nodes[right_idx].sort_id != 0 && !no_right_str) {
 		right_str = index_sort_get_string(ctx, right_idx,
 						  nodes[right_idx].seq);
 		if (right_str == &expunged_msg) {
 			/* not equivalent with any message */
 			right_str = NULL;
+		} else {
+			right_old_sort_id = nodes[right_idx].sort_id;
 		}
 		right_idx--;
 	}
@@ -609,8 +613,51 @@ index_sort_add_ids_range(struct sort_string_context *ctx,
 	/* give (new) sort IDs to all nodes in left_idx..right_idx range.
 	   divide the available space so that each message gets an equal sized
 	   share. some messages' sort strings may be equivalent, so give them
-	   the same sort IDs. */
+	   the same sort IDs.
+
+	   the nodes that already had sort IDs are in the correct order
+	   relative to each others, so their strings don't need to be looked
+	   up unless they're next to a new node. this way renumbering doesn't
+	   read the sort strings of all the renumbered messages. */
+	prev_old_sort_id = 0;
+	prev_old_idx = left_idx;
 	for (i = left_idx; i <= right_idx; i++) {
+		old_sort_id = nodes[i].sort_id_changed ? 0 : nodes[i].sort_id;
+		if (old_sort_id != 0 && (prev_old_sort_id != 0 ||
+					 (i == left_idx && left_str == NULL))) {
+			/* previous node was also an existing one (or there
+			   is no previous node) */
+			if (old_sort_id == prev_old_sort_id)
+				nodes[i].sort_id = left_sort_id;
+			else if (old_sort_id == right_old_sort_id) {
+				nodes[i].sort_id = right_sort_id;
+				left_sort_id = right_sort_id;
+			} else {
+				skip = (right_sort_id - left_sort_id) /
+					(right_idx - i + 2);
+				if (skip == 0)
+					return -1;
+				left_sort_id += skip;
+				i_assert(left_sort_id < right_sort_id);
+				nodes[i].sort_id = left_sort_id;
+			}
+			nodes[i].sort_id_changed = TRUE;
+			prev_old_sort_id = old_sort_id;
+			prev_old_idx = i;
+			/* the string is looked up later if needed */
+			left_str = NULL;
+			str = NULL;
+			continue;
+		}
+		if (prev_old_sort_id != 0 && left_str == NULL) {
+			/* previous node's string is needed now */
+			left_str = index_sort_get_string(ctx, prev_old_idx,
+						nodes[prev_old_idx].seq);
+			if (left_str == &expunged_msg)
+				left_str = NULL;
+		}
+		prev_old_sort_id = 0;
+
 		str = index_sort_get_string(ctx, i, nodes[i].seq);
 		if (str == &expunged_msg) {
 			/* it doesn't really matter what we give to this
@@ -650,9 +697,21 @@ index_sort_add_ids_range(struct sort_string_context *ctx,
 			left_str = str;
 		}
 		nodes[i].sort_id_changed = TRUE;
+		if (old_sort_id != 0) {
+			/* an existing node next to a new one. the following
+			   existing nodes can again be renumbered without
+			   looking up their strings. */
+			prev_old_sort_id = old_sort_id;
+			prev_old_idx = i;
+			left_str = str;
+		}
 	}
-	i_assert(str != NULL);
 
+	if (str == NULL) {
+		/* the last node was an existing one. it sorts before the
+		   right side node, since it had a smaller sort ID. */
+		return 0;
+	}
 	return right_str == NULL || strcmp(str, right_str) < 0 ||
 		(strcmp(str, right_str) == 0 &&
 		 nodes[i-1].sort_id == right_sort_id) ? 0 : -1;
@@ -786,7 +845,12 @@ void index_sort_list_finish_string(struct mail_search_sort_program *program)
 	static_zero_cmp_context = ctx;
 	if (array_count(&ctx->zero_nodes) == 0) {
 		/* fast path: we have all sort IDs */
-		array_sort(&ctx->nonzero_nodes, sort_node_cmp);
+		if (program->limit != 0) {
+			array_sort_partial(&ctx->nonzero_nodes, program->limit,
+					   sort_node_cmp);
+		} else {
+			array_sort(&ctx->nonzero_nodes, sort_node_cmp);
+		}
 
 		nodes = array_get(&ctx->nonzero_nodes, &count);
 		if (!array_is_created(&program->seqs))
@@ -852,6 +916,8 @@ void index_sort_list_finish_string(struct mail_search_sort_program *program)
 			if (nodes[i].wanted) {
 				seq = nodes[i].seq;
 				array_append(&program->seqs, &seq, 1);
+				if (array_count(&program->seqs) == program->limit)
+					break;
 			}
 		}
 		pool_unref(&ctx->sort_string_pool);
@@ -158,7 +158,10 @@ index_sort_list_finish_date(struct mail_search_sort_program *program)
 {
 	ARRAY_TYPE(mail_sort_node_date) *nodes = program->context;
 
-	array_sort(nodes, sort_node_date_cmp);
+	if (program->limit != 0)
+		array_sort_partial(nodes, program->limit, sort_node_date_cmp);
+	else
+		array_sort(nodes, sort_node_date_cmp);
 	memcpy(&program->seqs, nodes, sizeof(program->seqs));
 	i_free(nodes);
 	program->context = NULL;
@@ -184,7 +187,10 @@ index_sort_list_finish_size(struct mail_search_sort_program *program)
 {
 	ARRAY_TYPE(mail_sort_node_size) *nodes = program->context;
 
-	array_sort(nodes, sort_node_size_cmp);
+	if (program->limit != 0)
+		array_sort_partial(nodes, program->limit, sort_node_size_cmp);
+	else
+		array_sort(nodes, sort_node_size_cmp);
 	memcpy(&program->seqs, nodes, sizeof(program->seqs));
 	i_free(nodes);
 	program->context = NULL;
@@ -213,7 +219,10 @@ index_sort_list_finish_float(struct mail_search_sort_program *program)
 	/* NOTE: higher relevancy is returned first, unlike with all
 	   other number based sort keys, so temporarily reverse the search */
 	static_node_cmp_context.reverse = !static_node_cmp_context.reverse;
-	array_sort(nodes, sort_node_float_cmp);
+	if (program->limit != 0)
+		array_sort_partial(nodes, program->limit, sort_node_float_cmp);
+	else
+		array_sort(nodes, sort_node_float_cmp);
 	static_node_cmp_context.reverse = !static_node_cmp_context.reverse;
 
 	memcpy(&program->seqs, nodes, sizeof(program->seqs));
@@ -331,6 +340,12 @@ index_sort_program_init(struct mailbox_transaction_context *t,
 	return program;
 }
 
+void index_sort_program_set_limit(struct mail_search_sort_program *program,
+				  unsigned int limit)
+{
+	program->limit = limit;
+}
+
 void index_sort_program_deinit(struct mail_search_sort_program **_program)
 {
 	struct mail_search_sort_program *program = *_program;
@@ -7,6 +7,9 @@ struct mail_search_sort_program *
 index_sort_program_init(struct mailbox_transaction_context *t,
 			const enum mail_sort_type *sort_program);
 void index_sort_program_deinit(struct mail_search_sort_program **program);
+/* Only the first limit mails in the sort order are wanted. */
+void index_sort_program_set_limit(struct mail_search_sort_program *program,
+				  unsigned int limit);
 
 void index_sort_list_add(struct mail_search_sort_program *program,
 			 struct mail *mail);
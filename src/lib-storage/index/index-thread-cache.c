@@ -0,0 +1,376 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+/* The thread tree is saved to a file when the mailbox is closed, so that
+   the next session can continue from it instead of building the whole tree
+   again from the strmap. Messages expunged since the tree was written are
+   removed from it while the strmap is being read, and new messages are
+   added normally. The tree is verified against the strmap records by their
+   count and hash, and if they don't match the tree is simply rebuilt. */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "crc32.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "safe-mkstemp.h"
+#include "mail-index.h"
+#include "index-thread-private.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+struct mail_thread_tree_header {
+#define MAIL_THREAD_TREE_VERSION 2
+	uint8_t version;
+	/* enum mail_index_header_compat_flags */
+	uint8_t compat_flags;
+	uint16_t header_size;
+	uint32_t record_size;
+
+	uint32_t uid_validity;
+	uint32_t last_uid;
+	uint32_t first_invalid_msgid_str_idx;
+	uint32_t next_invalid_msgid_str_idx;
+	uint32_t nodes_count;
+	/* crc32 of all the records */
+	uint32_t nodes_crc32;
+
+	/* strmap records of the messages in the tree */
+	uint32_t recs_count;
+	uint32_t recs_hash;
+};
+
+enum mail_thread_tree_record_flags {
+	MAIL_THREAD_TREE_RECORD_FLAG_EXPUNGE_REBUILDS		= 0x01,
+	MAIL_THREAD_TREE_RECORD_FLAG_CHILD_UNREF_REBUILDS	= 0x02
+};
+#define MAIL_THREAD_TREE_RECORD_FLAGS_MASK \
+	(MAIL_THREAD_TREE_RECORD_FLAG_EXPUNGE_REBUILDS | \
+	 MAIL_THREAD_TREE_RECORD_FLAG_CHILD_UNREF_REBUILDS)
+/* struct mail_thread_node's parent_link_refcount is 30 bits */
+#define MAIL_THREAD_TREE_MAX_REFCOUNT 0x3fffffff
+
+/* struct mail_thread_node has bitfields, so it's not written as-is */
+struct mail_thread_tree_record {
+	uint32_t uid;
+	uint32_t parent_idx;
+	uint32_t parent_link_refcount;
+	/* enum mail_thread_tree_record_flags */
+	uint32_t flags;
+};
+
+#if !WORDS_BIGENDIAN
+#  define MAIL_THREAD_TREE_COMPAT_FLAGS MAIL_INDEX_COMPAT_LITTLE_ENDIAN
+#else
+#  define MAIL_THREAD_TREE_COMPAT_FLAGS 0
+#endif
+
+bool mail_thread_cache_has_uid(struct mail_thread_cache *cache,
+			       const struct mail_index_strmap_rec *msgid_map)
+{
+	const struct mail_thread_node *nodes;
+	unsigned int i, count;
+
+	i_assert(msgid_map->ref_index == MAIL_THREAD_NODE_REF_MSGID);
+
+	if (msgid_map->uid > cache->last_uid)
+		return FALSE;
+
+	nodes = array_get(&cache->thread_nodes, &count);
+	if (msgid_map->str_idx < count &&
+	    nodes[msgid_map->str_idx].uid == msgid_map->uid)
+		return TRUE;
+
+	/* duplicate Message-IDs were moved to invalid indexes */
+	for (i = cache->first_invalid_msgid_str_idx;
+	     i < cache->next_invalid_msgid_str_idx && i < count; i++) {
+		if (nodes[i].uid == msgid_map->uid)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+void mail_thread_cache_hash_recs(const struct mail_index_strmap_rec *recs,
+				 unsigned int count, uint32_t *hash)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		*hash ^= crc32_data(&recs[i], sizeof(recs[i]));
+}
+
+static void
+mail_thread_cache_get_recs_hash(struct mail_thread_cache *cache,
+				const ARRAY_TYPE(mail_index_strmap_rec) *msgid_map,
+				bool only_existing,
+				uint32_t *count_r, uint32_t *hash_r)
+{
+	const struct mail_index_strmap_rec *recs;
+	unsigned int i, j, count;
+
+	*count_r = 0;
+	*hash_r = 0;
+
+	recs = array_get(msgid_map, &count);
+	for (i = 0; i < count && recs[i].uid <= cache->last_uid; i = j) {
+		for (j = i + 1; j < count && recs[j].uid == recs[i].uid; j++) ;
+
+		if (only_existing && !mail_thread_cache_has_uid(cache, &recs[i]))
+			continue;
+		mail_thread_cache_hash_recs(recs + i, j - i, hash_r);
+		*count_r += j - i;
+	}
+}
+
+static int
+mail_thread_cache_read_hdr(const struct mail_thread_tree_header *hdr,
+			   uoff_t file_size, uint32_t uid_validity,
+			   uint32_t next_uid, const char **error_r)
+{
+	if (hdr->header_size < sizeof(*hdr) ||
+	    hdr->record_size != sizeof(struct mail_thread_tree_record)) {
+		*error_r = "Invalid header_size or record_size";
+		return -1;
+	}
+	if (file_size != hdr->header_size +
+	    (uoff_t)hdr->nodes_count * hdr->record_size) {
+		*error_r = t_strdup_printf(
+			"File size %"PRIuUOFF_T" doesn't match nodes_count=%u",
+			file_size, hdr->nodes_count);
+		return -1;
+	}
+	if (hdr->uid_validity != uid_validity) {
+		/* mailbox was recreated, not really corrupted */
+		return 0;
+	}
+	if (hdr->last_uid >= next_uid) {
+		*error_r = t_strdup_printf("last_uid %u >= next_uid %u",
+					   hdr->last_uid, next_uid);
+		return -1;
+	}
+	if (hdr->first_invalid_msgid_str_idx == 0 ||
+	    hdr->first_invalid_msgid_str_idx > hdr->next_invalid_msgid_str_idx ||
+	    (hdr->first_invalid_msgid_str_idx != hdr->next_invalid_msgid_str_idx &&
+	     hdr->next_invalid_msgid_str_idx > hdr->nodes_count)) {
+		*error_r = t_strdup_printf(
+			"Invalid msgid_str_idx range %u..%u",
+			hdr->first_invalid_msgid_str_idx,
+			hdr->next_invalid_msgid_str_idx);
+		return -1;
+	}
+	return 1;
+}
+
+static int
+mail_thread_cache_import_nodes(struct mail_thread_cache *cache,
+			       const struct mail_thread_tree_header *hdr,
+			       const struct mail_thread_tree_record *recs,
+			       const char **error_r)
+{
+	struct mail_thread_node *node;
+	uint32_t i;
+
+	if (crc32_data(recs, hdr->nodes_count * sizeof(*recs)) !=
+	    hdr->nodes_crc32) {
+		*error_r = "Records don't match nodes_crc32";
+		return -1;
+	}
+
+	array_clear(&cache->thread_nodes);
+	for (i = 0; i < hdr->nodes_count; i++) {
+		if (recs[i].uid > hdr->last_uid ||
+		    recs[i].parent_idx >= hdr->nodes_count ||
+		    recs[i].parent_idx >= hdr->first_invalid_msgid_str_idx ||
+		    recs[i].parent_link_refcount > MAIL_THREAD_TREE_MAX_REFCOUNT ||
+		    (recs[i].flags & ~MAIL_THREAD_TREE_RECORD_FLAGS_MASK) != 0) {
+			*error_r = t_strdup_printf("Invalid node %u", i);
+			array_clear(&cache->thread_nodes);
+			return -1;
+		}
+		node = array_append_space(&cache->thread_nodes);
+		node->uid = recs[i].uid;
+		node->parent_idx = recs[i].parent_idx;
+		node->parent_link_refcount = recs[i].parent_link_refcount;
+		node->expunge_rebuilds = (recs[i].flags &
+			MAIL_THREAD_TREE_RECORD_FLAG_EXPUNGE_REBUILDS) != 0;
+		node->child_unref_rebuilds = (recs[i].flags &
+			MAIL_THREAD_TREE_RECORD_FLAG_CHILD_UNREF_REBUILDS) != 0;
+	}
+	return 0;
+}
+
+int mail_thread_cache_read_file(struct mail_thread_cache *cache,
+				const char *path, uint32_t uid_validity,
+				uint32_t next_uid, const char **error_r)
+{
+	struct mail_thread_tree_header hdr;
+	struct mail_thread_tree_record *recs;
+	struct stat st;
+	size_t size;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		*error_r = t_strdup_printf("open(%s) failed: %m", path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	ret = pread_full(fd, &hdr, sizeof(hdr), 0);
+	if (ret < 0) {
+		*error_r = t_strdup_printf("read(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	if (ret == 0) {
+		*error_r = "File too small";
+		i_close_fd(&fd);
+		return -2;
+	}
+	if (hdr.version != MAIL_THREAD_TREE_VERSION ||
+	    hdr.compat_flags != MAIL_THREAD_TREE_COMPAT_FLAGS) {
+		/* old version or written on a different architecture,
+		   rebuild it */
+		i_close_fd(&fd);
+		return 0;
+	}
+	ret = mail_thread_cache_read_hdr(&hdr, st.st_size, uid_validity,
+					 next_uid, error_r);
+	if (ret <= 0) {
+		i_close_fd(&fd);
+		return ret < 0 ? -2 : 0;
+	}
+
+	/* file size was verified above, so this can't overflow */
+	size = hdr.nodes_count * sizeof(*recs);
+	recs = i_malloc(I_MAX(size, 1));
+	ret = size == 0 ? 1 : pread_full(fd, recs, size, hdr.header_size);
+	if (ret < 0)
+		*error_r = t_strdup_printf("read(%s) failed: %m", path);
+	else if (ret == 0) {
+		*error_r = "File shrank while reading";
+		ret = -2;
+	} else if (mail_thread_cache_import_nodes(cache, &hdr, recs,
+						  error_r) < 0)
+		ret = -2;
+	i_free(recs);
+	i_close_fd(&fd);
+	if (ret < 0)
+		return ret;
+
+	cache->last_uid = hdr.last_uid;
+	cache->first_invalid_msgid_str_idx = hdr.first_invalid_msgid_str_idx;
+	cache->next_invalid_msgid_str_idx = hdr.next_invalid_msgid_str_idx;
+	cache->tree_recs_count = hdr.recs_count;
+	cache->tree_recs_hash = hdr.recs_hash;
+	cache->tree_loaded = TRUE;
+	cache->tree_changed = FALSE;
+	return 1;
+}
+
+bool mail_thread_cache_verify(struct mail_thread_cache *cache,
+			      const ARRAY_TYPE(mail_index_strmap_rec) *msgid_map)
+{
+	uint32_t recs_count, recs_hash;
+
+	/* all the messages in msgid_map up to last_uid must be in the tree
+	   with the same string indexes as when it was written */
+	mail_thread_cache_get_recs_hash(cache, msgid_map, FALSE,
+					&recs_count, &recs_hash);
+	return recs_count == cache->tree_recs_count &&
+		recs_hash == cache->tree_recs_hash;
+}
+
+static void
+mail_thread_cache_export_nodes(struct mail_thread_cache *cache,
+			       buffer_t *dest)
+{
+	const struct mail_thread_node *nodes;
+	struct mail_thread_tree_record rec;
+	unsigned int i, count;
+
+	nodes = array_get(&cache->thread_nodes, &count);
+	for (i = 0; i < count; i++) {
+		memset(&rec, 0, sizeof(rec));
+		rec.uid = nodes[i].uid;
+		rec.parent_idx = nodes[i].parent_idx;
+		rec.parent_link_refcount = nodes[i].parent_link_refcount;
+		if (nodes[i].expunge_rebuilds)
+			rec.flags |= MAIL_THREAD_TREE_RECORD_FLAG_EXPUNGE_REBUILDS;
+		if (nodes[i].child_unref_rebuilds)
+			rec.flags |= MAIL_THREAD_TREE_RECORD_FLAG_CHILD_UNREF_REBUILDS;
+		buffer_append(dest, &rec, sizeof(rec));
+	}
+}
+
+int mail_thread_cache_write_file(struct mail_thread_cache *cache,
+				 const ARRAY_TYPE(mail_index_strmap_rec) *msgid_map,
+				 const char *path, uint32_t uid_validity,
+				 mode_t mode, gid_t gid, const char *gid_origin,
+				 const char **error_r)
+{
+	struct mail_thread_tree_header hdr;
+	const char *temp_path;
+	buffer_t *recs;
+	string_t *str;
+	int fd, ret = 0;
+
+	recs = buffer_create_dynamic(default_pool,
+		array_count(&cache->thread_nodes) *
+		sizeof(struct mail_thread_tree_record) + 1);
+	mail_thread_cache_export_nodes(cache, recs);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.version = MAIL_THREAD_TREE_VERSION;
+	hdr.compat_flags = MAIL_THREAD_TREE_COMPAT_FLAGS;
+	hdr.header_size = sizeof(hdr);
+	hdr.record_size = sizeof(struct mail_thread_tree_record);
+	hdr.uid_validity = uid_validity;
+	hdr.last_uid = cache->last_uid;
+	hdr.first_invalid_msgid_str_idx = cache->first_invalid_msgid_str_idx;
+	hdr.next_invalid_msgid_str_idx = cache->next_invalid_msgid_str_idx;
+	hdr.nodes_count = array_count(&cache->thread_nodes);
+	hdr.nodes_crc32 = crc32_data(recs->data, recs->used);
+	mail_thread_cache_get_recs_hash(cache, msgid_map, TRUE,
+					&hdr.recs_count, &hdr.recs_hash);
+
+	str = t_str_new(256);
+	str_append(str, path);
+	fd = safe_mkstemp_hostpid_group(str, mode, gid, gid_origin);
+	temp_path = str_c(str);
+	if (fd == -1) {
+		*error_r = t_strdup_printf(
+			"safe_mkstemp_hostpid(%s) failed: %m", temp_path);
+		buffer_free(&recs);
+		return -1;
+	}
+
+	if (write_full(fd, &hdr, sizeof(hdr)) < 0 ||
+	    write_full(fd, recs->data, recs->used) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %m", temp_path);
+		ret = -1;
+	}
+	buffer_free(&recs);
+	if (close(fd) < 0) {
+		*error_r = t_strdup_printf("close(%s) failed: %m", temp_path);
+		ret = -1;
+	} else if (ret == 0 && rename(temp_path, path) < 0) {
+		*error_r = t_strdup_printf("rename(%s, %s) failed: %m",
+					   temp_path, path);
+		ret = -1;
+	}
+	if (ret < 0)
+		(void)unlink(temp_path);
+	else
+		cache->tree_changed = FALSE;
+	return ret;
+}
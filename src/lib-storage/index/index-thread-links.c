@@ -153,6 +153,7 @@ void mail_thread_add(struct mail_thread_cache *cache,
 	i_assert(cache->last_uid <= msgid_map->uid);
 
 	cache->last_uid = msgid_map->uid;
+	cache->tree_changed = TRUE;
 
 	idx = thread_msg_add(cache, msgid_map->uid, msgid_map->str_idx);
 	parent_idx = thread_link_references(cache, msgid_map->uid,
@@ -216,6 +217,7 @@ bool mail_thread_remove(struct mail_thread_cache *cache,
 		/* this catches the duplicate message-id case */
 		return FALSE;
 	}
+	cache->tree_changed = TRUE;
 	i_assert(node->uid == msgid_map->uid);
 
 	/* update link refcounts */
@@ -5,7 +5,13 @@
 #include "mail-thread.h"
 #include "mail-index-strmap.h"
 
+struct mail;
+struct mailbox;
+
 #define MAIL_THREAD_INDEX_SUFFIX ".thread"
+/* The thread tree built from the strmap is saved to this file, so it
+   needs to be updated only with the changes since the last save. */
+#define MAIL_THREAD_TREE_INDEX_SUFFIX ".thread.tree"
 
 /* After initially building the index, assign first_invalid_msgid_idx to
    the next unused index + SKIP_COUNT. When more messages are added and
@@ -56,6 +62,16 @@ struct mail_thread_cache {
 
 	/* indexed by mail_index_strmap_rec.str_idx */
 	ARRAY_TYPE(mail_thread_node) thread_nodes;
+
+	/* number of strmap records and their hash for the messages in the
+	   tree read from the tree index. used to verify that the strmap
+	   hasn't been renumbered since the tree was written. */
+	uint32_t tree_recs_count, tree_recs_hash;
+	/* thread_nodes were read from the tree index, but they haven't been
+	   attached to a search result yet */
+	unsigned int tree_loaded:1;
+	/* thread_nodes have changed since they were read/written */
+	unsigned int tree_changed:1;
 };
 
 static inline uint32_t crc32_str_nonzero(const char *str)
@@ -79,4 +95,24 @@ mail_thread_iterate_init_full(struct mail_thread_cache *cache,
 
 void index_thread_mailbox_opened(struct mailbox *box);
 
+bool mail_thread_cache_has_uid(struct mail_thread_cache *cache,
+			       const struct mail_index_strmap_rec *msgid_map);
+void mail_thread_cache_hash_recs(const struct mail_index_strmap_rec *recs,
+				 unsigned int count, uint32_t *hash);
+/* Read the tree from path. Returns 1 if the tree was read, 0 if it doesn't
+   exist or it was written for an older mailbox or by an incompatible
+   version, -1 if I/O error, -2 if the file is corrupted. */
+int mail_thread_cache_read_file(struct mail_thread_cache *cache,
+				const char *path, uint32_t uid_validity,
+				uint32_t next_uid, const char **error_r);
+/* Verify that the read tree matches the strmap records. */
+bool mail_thread_cache_verify(struct mail_thread_cache *cache,
+			      const ARRAY_TYPE(mail_index_strmap_rec) *msgid_map);
+/* Write the tree atomically to path. Returns 0 if ok, -1 if failed. */
+int mail_thread_cache_write_file(struct mail_thread_cache *cache,
+				 const ARRAY_TYPE(mail_index_strmap_rec) *msgid_map,
+				 const char *path, uint32_t uid_validity,
+				 mode_t mode, gid_t gid, const char *gid_origin,
+				 const char **error_r);
+
 #endif
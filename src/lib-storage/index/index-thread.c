@@ -14,6 +14,7 @@
 #include "index-thread-private.h"
 
 #include <stdlib.h>
+#include <unistd.h>
 
 #define MAIL_THREAD_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, mail_thread_storage_module)
@@ -45,6 +46,10 @@ struct mail_thread_mailbox {
 
 	/* set only temporarily while needed */
 	struct mail_thread_context *ctx;
+
+	/* the tree read from the tree index has been verified to match
+	   msgid_map */
+	unsigned int tree_verified:1;
 };
 
 static MODULE_CONTEXT_DEFINE_INIT(mail_thread_storage_module,
@@ -158,6 +163,89 @@ mail_thread_hash_rec_cmp(const struct mail_index_strmap_rec *rec1,
 	return ret;
 }
 
+static bool mail_thread_search_args_is_all(struct mail_search_args *args)
+{
+	return args->args != NULL && args->args->next == NULL &&
+		args->args->type == SEARCH_ALL && !args->args->match_not;
+}
+
+static void mail_thread_tree_drop(struct mail_thread_cache *cache)
+{
+	cache->tree_loaded = FALSE;
+	cache->last_uid = 0;
+	array_clear(&cache->thread_nodes);
+}
+
+static const char *mail_thread_tree_get_path(struct mailbox *box)
+{
+	return t_strconcat(box->index->filepath,
+			   MAIL_THREAD_TREE_INDEX_SUFFIX, NULL);
+}
+
+static int mail_thread_tree_read(struct mailbox *box,
+				 struct mail_thread_cache *cache)
+{
+	const struct mail_index_header *hdr;
+	const char *path, *error;
+	int ret;
+
+	path = mail_thread_tree_get_path(box);
+	hdr = mail_index_get_header(box->view);
+	ret = mail_thread_cache_read_file(cache, path, hdr->uid_validity,
+					  hdr->next_uid, &error);
+	if (ret == -1)
+		mail_storage_set_critical(box->storage, "%s", error);
+	else if (ret == -2) {
+		mail_storage_set_critical(box->storage,
+			"Corrupted thread tree index %s: %s", path, error);
+		/* it would be overwritten on close anyway, but don't
+		   complain about it again if that doesn't happen */
+		if (unlink(path) < 0 && errno != ENOENT) {
+			mail_storage_set_critical(box->storage,
+				"unlink(%s) failed: %m", path);
+		}
+		ret = 0;
+	}
+	return ret;
+}
+
+static void mail_thread_tree_write(struct mailbox *box,
+				   struct mail_thread_cache *cache,
+				   const ARRAY_TYPE(mail_index_strmap_rec) *msgid_map)
+{
+	struct mail_index *index = box->index;
+	const char *error;
+
+	if (mail_thread_cache_write_file(cache, msgid_map,
+			mail_thread_tree_get_path(box),
+			mail_index_get_header(box->view)->uid_validity,
+			index->mode, index->gid, index->gid_origin,
+			&error) < 0)
+		mail_storage_set_critical(box->storage, "%s", error);
+}
+
+static void
+mail_thread_strmap_expunge(const struct mail_index_strmap_rec *recs,
+			   unsigned int count, void *context)
+{
+	struct mail_thread_mailbox *tbox = context;
+	struct mail_thread_cache *cache = tbox->cache;
+	unsigned int idx = 0;
+
+	if (!cache->tree_loaded ||
+	    !mail_thread_cache_has_uid(cache, recs)) {
+		/* not in the tree, or already removed (e.g. the strmap is
+		   being read again) */
+		return;
+	}
+	if (!mail_thread_remove(cache, recs, &idx)) {
+		mail_thread_tree_drop(cache);
+		return;
+	}
+	cache->tree_recs_count -= count;
+	mail_thread_cache_hash_recs(recs, count, &cache->tree_recs_hash);
+}
+
 static void mail_thread_strmap_remap(const uint32_t *idx_map,
 				     unsigned int old_count,
 				     unsigned int new_count, void *context)
@@ -169,12 +257,18 @@ static void mail_thread_strmap_remap(const uint32_t *idx_map,
 	struct mail_thread_node *node;
 	unsigned int i, nodes_count, max, new_first_invalid, invalid_count;
 
-	if (cache->search_result == NULL)
+	if (cache->search_result == NULL && !cache->tree_loaded)
 		return;
 
 	if (new_count == 0) {
 		/* strmap was reset, we'll need to rebuild thread */
-		mailbox_search_result_free(&cache->search_result);
+		if (cache->search_result != NULL)
+			mailbox_search_result_free(&cache->search_result);
+		else if (tbox->tree_verified) {
+			/* the tree is verified only after the strmap is
+			   read, so a reset before that is harmless */
+			mail_thread_tree_drop(cache);
+		}
 		return;
 	}
 
@@ -317,6 +411,12 @@ static int mail_thread_index_map_build(struct mail_thread_context *ctx)
 						    mail_thread_strmap_remap,
 						    tbox, &tbox->msgid_map,
 						    &tbox->msgid_hash);
+		if (!mail_index_is_in_memory(ctx->box->index) &&
+		    mail_thread_search_args_is_all(ctx->search_args) &&
+		    mail_thread_tree_read(ctx->box, tbox->cache) > 0) {
+			mail_index_strmap_view_set_expunge_callback(
+				tbox->strmap_view, mail_thread_strmap_expunge);
+		}
 	}
 
 	headers_ctx = mailbox_header_lookup_init(ctx->box, wanted_headers);
@@ -325,6 +425,14 @@ static int mail_thread_index_map_build(struct mail_thread_context *ctx)
 	/* add all missing UIDs */
 	ctx->strmap_sync = mail_index_strmap_view_sync_init(tbox->strmap_view,
 							    &last_uid);
+	if (tbox->cache->tree_loaded && !tbox->tree_verified) {
+		/* expunged messages were removed from the tree while reading
+		   the strmap. the rest of it must match now. */
+		if (mail_thread_cache_verify(tbox->cache, tbox->msgid_map))
+			tbox->tree_verified = TRUE;
+		else
+			mail_thread_tree_drop(tbox->cache);
+	}
 	mailbox_get_seq_range(ctx->box, last_uid + 1, (uint32_t)-1,
 			      &seq1, &seq2);
 	if (seq1 == 0) {
@@ -514,11 +622,19 @@ static void mail_thread_cache_sync_add(struct mail_thread_mailbox *tbox,
 		return;
 	}
 
-	cache->last_uid = 0;
-	cache->first_invalid_msgid_str_idx = cache->next_invalid_msgid_str_idx =
-		mail_index_strmap_view_get_highest_idx(tbox->strmap_view) + 1 +
-		THREAD_INVALID_MSGID_STR_IDX_SKIP_COUNT;
-	array_clear(&cache->thread_nodes);
+	if (!cache->tree_loaded) {
+		cache->last_uid = 0;
+		cache->first_invalid_msgid_str_idx =
+			cache->next_invalid_msgid_str_idx =
+			mail_index_strmap_view_get_highest_idx(tbox->strmap_view) +
+			1 + THREAD_INVALID_MSGID_STR_IDX_SKIP_COUNT;
+		array_clear(&cache->thread_nodes);
+	} else {
+		/* continue from the tree read from the tree index. it
+		   already contains all the messages up to last_uid. */
+		cache->tree_loaded = FALSE;
+		tbox->tree_verified = FALSE;
+	}
 
 	cache->search_result =
 		mailbox_search_result_save(search_ctx,
@@ -531,6 +647,8 @@ static void mail_thread_cache_sync_add(struct mail_thread_mailbox *tbox,
 	i_assert(msgid_map[count].uid == 0);
 	i = 0;
 	while (i < count && mailbox_search_next(search_ctx, &mail)) {
+		if (mail->uid <= cache->last_uid)
+			continue;
 		while (msgid_map[i].uid < mail->uid)
 			i++;
 		i_assert(i < count);
@@ -618,13 +736,22 @@ mail_thread_iterate_init(struct mail_thread_context *ctx,
 static void mail_thread_mailbox_close(struct mailbox *box)
 {
 	struct mail_thread_mailbox *tbox = MAIL_THREAD_CONTEXT(box);
+	struct mail_thread_cache *cache = tbox->cache;
 
 	i_assert(tbox->ctx == NULL);
 
+	if (cache->search_result != NULL && cache->tree_changed &&
+	    mail_thread_search_args_is_all(cache->search_result->search_args) &&
+	    !mail_index_is_in_memory(box->index))
+		mail_thread_tree_write(box, cache, tbox->msgid_map);
+	if (cache->tree_loaded)
+		mail_thread_tree_drop(cache);
+	tbox->tree_verified = FALSE;
+
 	if (tbox->strmap_view != NULL)
 		mail_index_strmap_view_close(&tbox->strmap_view);
-	if (tbox->cache->search_result != NULL)
-		mailbox_search_result_free(&tbox->cache->search_result);
+	if (cache->search_result != NULL)
+		mailbox_search_result_free(&cache->search_result);
 	tbox->module_ctx.super.close(box);
 }
 
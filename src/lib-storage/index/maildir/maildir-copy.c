@@ -17,7 +17,9 @@
 #include <sys/stat.h>
 
 struct hardlink_ctx {
+	struct maildir_mailbox *dest_mbox;
 	const char *dest_path;
+	int dest_fd;
 	unsigned int success:1;
 };
 
@@ -56,6 +58,74 @@ static int do_hardlink(struct maildir_mailbox *mbox, const char *path,
 	return 1;
 }
 
+static int do_copy_file(struct maildir_mailbox *mbox ATTR_UNUSED,
+			const char *path, struct hardlink_ctx *ctx)
+{
+	int ret;
+
+	ret = mail_storage_copy_file(&ctx->dest_mbox->box, path,
+				     ctx->dest_fd, ctx->dest_path);
+	if (ret > 0)
+		ctx->success = TRUE;
+	return ret;
+}
+
+static int do_link_or_copy(struct maildir_mailbox *mbox, const char *path,
+			   struct hardlink_ctx *ctx)
+{
+	return ctx->dest_fd == -1 ? do_hardlink(mbox, path, ctx) :
+		do_copy_file(mbox, path, ctx);
+}
+
+static int
+maildir_copy_do(struct maildir_mailbox *src_mbox, struct mail *mail,
+		struct hardlink_ctx *do_ctx)
+{
+	const char *path;
+
+	if (src_mbox != NULL) {
+		/* maildir */
+		return maildir_file_do(src_mbox, mail->uid,
+				       do_link_or_copy, do_ctx);
+	} else {
+		/* raw / lda */
+		if (mail_get_special(mail, MAIL_FETCH_UIDL_FILE_NAME,
+				     &path) < 0 || *path == '\0')
+			return 0;
+		return do_link_or_copy(do_ctx->dest_mbox, path, do_ctx);
+	}
+}
+
+static int
+maildir_copy_clone(struct maildir_mailbox *src_mbox, struct mail *mail,
+		   struct hardlink_ctx *do_ctx, const char **dest_fname_r)
+{
+	struct maildir_mailbox *dest_mbox = do_ctx->dest_mbox;
+	const char *tmpdir;
+	int ret;
+
+	tmpdir = t_strconcat(mailbox_get_path(&dest_mbox->box), "/tmp", NULL);
+	do_ctx->dest_fd = maildir_create_tmp(dest_mbox, tmpdir, dest_fname_r);
+	if (do_ctx->dest_fd == -1)
+		return -1;
+	do_ctx->dest_path = t_strdup_printf("%s/%s", tmpdir, *dest_fname_r);
+
+	ret = maildir_copy_do(src_mbox, mail, do_ctx);
+	if (close(do_ctx->dest_fd) < 0) {
+		mail_storage_set_critical(&dest_mbox->storage->storage,
+			"close(%s) failed: %m", do_ctx->dest_path);
+		ret = -1;
+	}
+	if (ret <= 0 || !do_ctx->success) {
+		if (unlink(do_ctx->dest_path) < 0 && errno != ENOENT) {
+			mail_storage_set_critical(&dest_mbox->storage->storage,
+				"unlink(%s) failed: %m", do_ctx->dest_path);
+		}
+		do_ctx->success = FALSE;
+	}
+	return ret < 0 ? -1 : 0;
+}
+
 static int
 maildir_copy_hardlink(struct mail_save_context *ctx, struct mail *mail)
 {
@@ -64,7 +134,7 @@ maildir_copy_hardlink(struct mail_save_context *ctx, struct mail *mail)
 	struct maildir_mailbox *src_mbox;
 	struct maildir_filename *mf;
 	struct hardlink_ctx do_ctx;
-	const char *path, *guid, *dest_fname;
+	const char *guid, *dest_fname;
 	uoff_t vsize, size;
 	enum mail_lookup_abort old_abort;
 
@@ -80,31 +150,31 @@ maildir_copy_hardlink(struct mail_save_context *ctx, struct mail *mail)
 
 	/* hard link to tmp/ with a newly generated filename and later when we
 	   have uidlist locked, move it to new/cur. */
-	dest_fname = maildir_filename_generate();
 	memset(&do_ctx, 0, sizeof(do_ctx));
-	do_ctx.dest_path =
-		t_strdup_printf("%s/tmp/%s", mailbox_get_path(&dest_mbox->box),
-				dest_fname);
-	if (src_mbox != NULL) {
-		/* maildir */
-		if (maildir_file_do(src_mbox, mail->uid,
-				    do_hardlink, &do_ctx) < 0)
+	do_ctx.dest_mbox = dest_mbox;
+	do_ctx.dest_fd = -1;
+	if (dest_mbox->storage->set->maildir_copy_with_hardlinks &&
+	    mail_storage_copy_can_use_hardlink(mail->box, &dest_mbox->box)) {
+		dest_fname = maildir_filename_generate();
+		do_ctx.dest_path = t_strdup_printf("%s/tmp/%s",
+			mailbox_get_path(&dest_mbox->box), dest_fname);
+		if (maildir_copy_do(src_mbox, mail, &do_ctx) < 0)
 			return -1;
-	} else {
-		/* raw / lda */
-		if (mail_get_special(mail, MAIL_FETCH_UIDL_FILE_NAME,
-				     &path) < 0 || *path == '\0')
-			return 0;
-		if (do_hardlink(dest_mbox, path, &do_ctx) < 0)
+	}
+	if (!do_ctx.success) {
+		/* hard linking isn't possible, but the file can still be
+		   copied as-is. this allows the filesystem to clone it. */
+		if (maildir_copy_clone(src_mbox, mail, &do_ctx,
+				       &dest_fname) < 0)
 			return -1;
 	}
 
 	if (!do_ctx.success) {
-		/* couldn't copy with hardlinking, fallback to copying */
+		/* couldn't copy the file, fallback to saving the mail */
 		return 0;
 	}
 
-	/* hardlinked to tmp/, treat as normal copied mail */
+	/* linked/cloned to tmp/, treat as normal copied mail */
 	mf = maildir_save_add(ctx, dest_fname, mail);
 	if (mail_get_special(mail, MAIL_FETCH_GUID, &guid) == 0) {
 		if (*guid != '\0')
@@ -131,8 +201,7 @@ int maildir_copy(struct mail_save_context *ctx, struct mail *mail)
 
 	i_assert((_t->flags & MAILBOX_TRANSACTION_FLAG_EXTERNAL) != 0);
 
-	if (mbox->storage->set->maildir_copy_with_hardlinks &&
-	    mail_storage_copy_can_use_hardlink(mail->box, &mbox->box)) {
+	if (mail_storage_copy_can_use_file_copy(mail->box, &mbox->box)) {
 		T_BEGIN {
 			ret = maildir_copy_hardlink(ctx, mail);
 		} T_END;
@@ -142,7 +211,7 @@ int maildir_copy(struct mail_save_context *ctx, struct mail *mail)
 			return ret > 0 ? 0 : -1;
 		}
 
-		/* non-fatal hardlinking failure, try the slow way */
+		/* non-fatal hardlinking/copying failure, try the slow way */
 	}
 
 	return mail_storage_copy(ctx, mail);
@@ -14,6 +14,8 @@
 static const struct setting_define maildir_setting_defines[] = {
 	DEF(SET_BOOL, maildir_copy_with_hardlinks),
 	DEF(SET_BOOL, maildir_very_dirty_syncs),
+	DEF(SET_BOOL, maildir_incremental_syncs),
+	DEF(SET_BOOL, maildir_binary_uidlist),
 	DEF(SET_BOOL, maildir_broken_filename_sizes),
 	DEF(SET_BOOL, maildir_empty_new),
 
@@ -23,6 +25,8 @@ static const struct setting_define maildir_setting_defines[] = {
 static const struct maildir_settings maildir_default_settings = {
 	.maildir_copy_with_hardlinks = TRUE,
 	.maildir_very_dirty_syncs = FALSE,
+	.maildir_incremental_syncs = FALSE,
+	.maildir_binary_uidlist = FALSE,
 	.maildir_broken_filename_sizes = FALSE,
 	.maildir_empty_new = FALSE
 };
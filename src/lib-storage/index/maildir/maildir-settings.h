@@ -4,6 +4,8 @@
 struct maildir_settings {
 	bool maildir_copy_with_hardlinks;
 	bool maildir_very_dirty_syncs;
+	bool maildir_incremental_syncs;
+	bool maildir_binary_uidlist;
 	bool maildir_broken_filename_sizes;
 	bool maildir_empty_new;
 };
@@ -79,6 +79,7 @@ struct maildir_mailbox {
 	/* maildir sync: */
 	struct maildir_uidlist *uidlist;
 	struct maildir_keywords *keywords;
+	struct maildir_sync_journal *sync_journal;
 
 	struct maildir_index_header maildir_hdr;
 	uint32_t maildir_ext_id;
@@ -113,6 +114,10 @@ bool maildir_is_backend_readonly(struct maildir_mailbox *mbox);
 
 struct mail_save_context *
 maildir_save_alloc(struct mailbox_transaction_context *_t);
+/* Create a new file with a unique filename to the given tmp/ directory.
+   Returns the fd, or -1 on error. */
+int maildir_create_tmp(struct maildir_mailbox *mbox, const char *dir,
+		       const char **fname_r);
 int maildir_save_begin(struct mail_save_context *ctx, struct istream *input);
 int maildir_save_continue(struct mail_save_context *ctx);
 int maildir_save_finish(struct mail_save_context *ctx);
@@ -0,0 +1,291 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "llist.h"
+#include "fd-close-on-exec.h"
+#include "fd-set-nonblock.h"
+#include "maildir-sync-journal.h"
+
+#ifdef HAVE_INOTIFY_INIT
+
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define MAILDIR_SYNC_JOURNAL_BUFLEN (32*1024)
+/* After this many changes a scan is probably about as fast, so stop
+   recording them. */
+#define MAILDIR_SYNC_JOURNAL_MAX_CHANGES 10000
+
+#define MAILDIR_SYNC_JOURNAL_MASK \
+	(IN_CREATE | IN_DELETE | IN_MOVE | IN_DELETE_SELF | IN_MOVE_SELF | \
+	 IN_ONLYDIR)
+
+struct maildir_sync_journal {
+	struct maildir_sync_journal *prev, *next;
+
+	char *dir;
+	int wd;
+
+	pool_t pool;
+	HASH_TABLE(const char *, void *) names;
+	ARRAY(struct maildir_sync_journal_change) changes;
+
+	unsigned int lost_changes:1;
+};
+
+/* All the journals share the same inotify fd, because the number of inotify
+   instances per user is quite limited. */
+static int journal_inotify_fd = -1;
+static struct maildir_sync_journal *journals = NULL;
+
+static void maildir_sync_journal_clear_changes(struct maildir_sync_journal *journal)
+{
+	array_clear(&journal->changes);
+	hash_table_clear(journal->names, TRUE);
+	p_clear(journal->pool);
+}
+
+static void
+maildir_sync_journal_add_change(struct maildir_sync_journal *journal,
+				const char *fname, bool exists)
+{
+	struct maildir_sync_journal_change *change;
+	const char *key;
+	void *value;
+	unsigned int idx;
+
+	if (journal->lost_changes)
+		return;
+
+	value = hash_table_lookup(journal->names, fname);
+	if (value != NULL) {
+		idx = POINTER_CAST_TO(value, unsigned int) - 1;
+		change = array_idx_modifiable(&journal->changes, idx);
+		change->exists = exists;
+		return;
+	}
+	if (array_count(&journal->changes) >= MAILDIR_SYNC_JOURNAL_MAX_CHANGES) {
+		journal->lost_changes = TRUE;
+		maildir_sync_journal_clear_changes(journal);
+		return;
+	}
+
+	key = p_strdup(journal->pool, fname);
+	change = array_append_space(&journal->changes);
+	change->fname = key;
+	change->exists = exists;
+	hash_table_insert(journal->names, key,
+			  POINTER_CAST(array_count(&journal->changes)));
+}
+
+static void
+maildir_sync_journal_event(struct maildir_sync_journal *journal,
+			   const struct inotify_event *event)
+{
+	if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF |
+			    IN_UNMOUNT | IN_IGNORED)) != 0) {
+		/* the directory itself went away */
+		if ((event->mask & IN_IGNORED) != 0)
+			journal->wd = -1;
+		journal->lost_changes = TRUE;
+		maildir_sync_journal_clear_changes(journal);
+		return;
+	}
+	if (event->len == 0 || event->name[0] == '.' ||
+	    event->name[0] == '\0') {
+		/* temporary/hidden files are skipped by scanning also */
+		return;
+	}
+	maildir_sync_journal_add_change(journal, event->name,
+		(event->mask & (IN_CREATE | IN_MOVED_TO)) != 0);
+}
+
+static void maildir_sync_journal_lose_all(void)
+{
+	struct maildir_sync_journal *journal;
+
+	for (journal = journals; journal != NULL; journal = journal->next) {
+		journal->lost_changes = TRUE;
+		maildir_sync_journal_clear_changes(journal);
+	}
+}
+
+static void maildir_sync_journal_read_events(void)
+{
+	struct maildir_sync_journal *journal;
+	const struct inotify_event *event;
+	unsigned char event_buf[MAILDIR_SYNC_JOURNAL_BUFLEN];
+	ssize_t ret, pos;
+
+	for (;;) {
+		ret = read(journal_inotify_fd, event_buf, sizeof(event_buf));
+		if (ret <= 0) {
+			if (ret < 0 && errno != EAGAIN) {
+				i_error("read(inotify) failed: %m");
+				maildir_sync_journal_lose_all();
+			}
+			break;
+		}
+
+		for (pos = 0; pos < ret; ) {
+			if ((size_t)(ret - pos) < sizeof(*event))
+				break;
+
+			event = (const struct inotify_event *)(event_buf + pos);
+			pos += sizeof(*event) + event->len;
+
+			if ((event->mask & IN_Q_OVERFLOW) != 0) {
+				maildir_sync_journal_lose_all();
+				continue;
+			}
+			/* the same directory may be watched by multiple
+			   journals, which then share the same wd */
+			for (journal = journals; journal != NULL;
+			     journal = journal->next) {
+				if (journal->wd == event->wd)
+					maildir_sync_journal_event(journal, event);
+			}
+		}
+	}
+}
+
+static bool maildir_sync_journal_add_watch(struct maildir_sync_journal *journal)
+{
+	journal->wd = inotify_add_watch(journal_inotify_fd, journal->dir,
+					MAILDIR_SYNC_JOURNAL_MASK);
+	if (journal->wd == -1) {
+		if (errno != ENOENT && errno != ESTALE && errno != ENOSPC) {
+			i_error("inotify_add_watch(%s) failed: %m",
+				journal->dir);
+		}
+		return FALSE;
+	}
+	return TRUE;
+}
+
+struct maildir_sync_journal *maildir_sync_journal_init(const char *dir)
+{
+	struct maildir_sync_journal *journal;
+
+	if (journal_inotify_fd == -1) {
+		journal_inotify_fd = inotify_init();
+		if (journal_inotify_fd == -1) {
+			if (errno != EMFILE && errno != ENOSYS)
+				i_error("inotify_init() failed: %m");
+			return NULL;
+		}
+		fd_close_on_exec(journal_inotify_fd, TRUE);
+		fd_set_nonblock(journal_inotify_fd, TRUE);
+	}
+
+	journal = i_new(struct maildir_sync_journal, 1);
+	journal->dir = i_strdup(dir);
+	if (!maildir_sync_journal_add_watch(journal)) {
+		i_free(journal->dir);
+		i_free(journal);
+		if (journals == NULL)
+			i_close_fd(&journal_inotify_fd);
+		return NULL;
+	}
+	journal->pool = pool_alloconly_create("maildir sync journal", 1024);
+	hash_table_create(&journal->names, default_pool, 0, str_hash, strcmp);
+	i_array_init(&journal->changes, 32);
+	/* nothing is known about the changes before the first reset */
+	journal->lost_changes = TRUE;
+	DLLIST_PREPEND(&journals, journal);
+	return journal;
+}
+
+void maildir_sync_journal_deinit(struct maildir_sync_journal **_journal)
+{
+	struct maildir_sync_journal *journal = *_journal, *j;
+
+	*_journal = NULL;
+
+	DLLIST_REMOVE(&journals, journal);
+	if (journal->wd != -1) {
+		for (j = journals; j != NULL; j = j->next) {
+			if (j->wd == journal->wd)
+				break;
+		}
+		if (j == NULL &&
+		    inotify_rm_watch(journal_inotify_fd, journal->wd) < 0 &&
+		    errno != EINVAL)
+			i_error("inotify_rm_watch(%s) failed: %m", journal->dir);
+	}
+	if (journals == NULL)
+		i_close_fd(&journal_inotify_fd);
+
+	hash_table_destroy(&journal->names);
+	array_free(&journal->changes);
+	pool_unref(&journal->pool);
+	i_free(journal->dir);
+	i_free(journal);
+}
+
+void maildir_sync_journal_reset(struct maildir_sync_journal *journal)
+{
+	maildir_sync_journal_read_events();
+	maildir_sync_journal_clear_changes(journal);
+	journal->lost_changes = journal->wd == -1 &&
+		!maildir_sync_journal_add_watch(journal);
+}
+
+bool maildir_sync_journal_refresh(struct maildir_sync_journal *journal)
+{
+	maildir_sync_journal_read_events();
+	return !journal->lost_changes;
+}
+
+const struct maildir_sync_journal_change *
+maildir_sync_journal_get_changes(struct maildir_sync_journal *journal,
+				 unsigned int *count_r)
+{
+	i_assert(!journal->lost_changes);
+
+	return array_get(&journal->changes, count_r);
+}
+
+void maildir_sync_journal_clear(struct maildir_sync_journal *journal)
+{
+	maildir_sync_journal_clear_changes(journal);
+}
+
+#else
+
+struct maildir_sync_journal *
+maildir_sync_journal_init(const char *dir ATTR_UNUSED)
+{
+	return NULL;
+}
+
+void maildir_sync_journal_deinit(struct maildir_sync_journal **journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void maildir_sync_journal_reset(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+bool maildir_sync_journal_refresh(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+const struct maildir_sync_journal_change *
+maildir_sync_journal_get_changes(struct maildir_sync_journal *journal ATTR_UNUSED,
+				 unsigned int *count_r ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void maildir_sync_journal_clear(struct maildir_sync_journal *journal ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+#endif
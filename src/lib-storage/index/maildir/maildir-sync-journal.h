@@ -0,0 +1,37 @@
+#ifndef MAILDIR_SYNC_JOURNAL_H
+#define MAILDIR_SYNC_JOURNAL_H
+
+/* The journal records the names of files added to and removed from a
+   directory using inotify, so that a long-running process can sync only the
+   changed files instead of scanning the whole cur/ directory. */
+
+struct maildir_sync_journal;
+
+struct maildir_sync_journal_change {
+	const char *fname;
+	/* TRUE if the file was added, FALSE if it was removed */
+	bool exists;
+};
+
+/* Start recording changes to the directory. Returns NULL if it's not
+   possible. */
+struct maildir_sync_journal *maildir_sync_journal_init(const char *dir);
+void maildir_sync_journal_deinit(struct maildir_sync_journal **journal);
+
+/* Forget all the changes recorded so far. This is called just before the
+   whole directory is scanned. */
+void maildir_sync_journal_reset(struct maildir_sync_journal *journal);
+/* Read the pending changes. Returns TRUE if the journal contains all the
+   changes since the last reset, FALSE if some of them may have been lost and
+   the directory needs to be scanned. */
+bool maildir_sync_journal_refresh(struct maildir_sync_journal *journal);
+
+/* Returns the changed files. Each filename is returned only once with its
+   latest state. */
+const struct maildir_sync_journal_change *
+maildir_sync_journal_get_changes(struct maildir_sync_journal *journal,
+				 unsigned int *count_r);
+/* Forget the changes returned by maildir_sync_journal_get_changes(). */
+void maildir_sync_journal_clear(struct maildir_sync_journal *journal);
+
+#endif
@@ -182,6 +182,7 @@
 #include "maildir-uidlist.h"
 #include "maildir-filename.h"
 #include "maildir-sync.h"
+#include "maildir-sync-journal.h"
 
 #include <stdio.h>
 #include <stddef.h>
@@ -597,6 +598,88 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 		(move_count <= MAILDIR_RENAME_RESCAN_COUNT || final ? 0 : 1);
 }
 
+static void maildir_sync_journal_prepare(struct maildir_sync_context *ctx)
+{
+	struct maildir_mailbox *mbox = ctx->mbox;
+
+	if (ctx->partial) {
+		/* the scan won't notice removed files */
+		return;
+	}
+	if (mbox->sync_journal == NULL) {
+		/* start the journal only when the mailbox is synced again,
+		   i.e. when it's kept open by a long-running process. inotify
+		   doesn't see changes done by other NFS clients. */
+		if (!mbox->synced ||
+		    !mbox->storage->set->maildir_incremental_syncs ||
+		    mbox->storage->storage.set->mail_nfs_storage)
+			return;
+		mbox->sync_journal = maildir_sync_journal_init(ctx->cur_dir);
+		if (mbox->sync_journal == NULL)
+			return;
+	}
+	maildir_sync_journal_reset(mbox->sync_journal);
+}
+
+static int
+maildir_sync_cur_changes(struct maildir_sync_context *ctx,
+			 const struct stat *cur_st)
+{
+	struct maildir_mailbox *mbox = ctx->mbox;
+	const struct maildir_sync_journal_change *changes;
+	enum maildir_uidlist_rec_flag flags;
+	const char *fname;
+	unsigned int i, count;
+	uint32_t uid;
+	int ret = 1;
+
+	mbox->maildir_hdr.cur_check_time = time(NULL);
+	mbox->maildir_hdr.cur_mtime = cur_st->st_mtime;
+	mbox->maildir_hdr.cur_mtime_nsecs = ST_MTIME_NSEC(*cur_st);
+
+	/* add the new filenames first, so that the files whose flags were
+	   changed are found with their new names below */
+	changes = maildir_sync_journal_get_changes(mbox->sync_journal, &count);
+	for (i = 0; i < count && ret > 0; i++) {
+		if (!changes[i].exists)
+			continue;
+		if (changes[i].fname[0] == MAILDIR_INFO_SEP) {
+			/* don't even try to use file with empty base name */
+			if (maildir_rename_empty_basename(ctx, ctx->cur_dir,
+							  changes[i].fname) < 0)
+				ret = -1;
+			continue;
+		}
+		/* a full scan treats the files missing from uidlist as
+		   recent, but partial syncs don't */
+		flags = maildir_uidlist_get_full_filename(mbox->uidlist,
+							  changes[i].fname) == NULL ?
+			MAILDIR_UIDLIST_REC_FLAG_RECENT : 0;
+		ret = maildir_uidlist_sync_next(ctx->uidlist_sync_ctx,
+						changes[i].fname, flags);
+		if (((i + 1) % MAILDIR_SLOW_CHECK_COUNT) == 0)
+			maildir_sync_notify(ctx);
+	}
+	if (ret < 0)
+		return -1;
+
+	/* the files whose latest name was removed are gone */
+	for (i = 0; i < count; i++) {
+		if (changes[i].exists)
+			continue;
+		fname = maildir_uidlist_get_full_filename(mbox->uidlist,
+							  changes[i].fname);
+		if (fname != NULL && strcmp(fname, changes[i].fname) == 0 &&
+		    maildir_uidlist_get_uid(mbox->uidlist, fname, &uid) &&
+		    uid != (uint32_t)-1) {
+			maildir_uidlist_sync_remove(ctx->uidlist_sync_ctx,
+						    changes[i].fname);
+		}
+	}
+	maildir_sync_journal_clear(mbox->sync_journal);
+	return 0;
+}
+
 static void maildir_sync_get_header(struct maildir_mailbox *mbox)
 {
 	const void *data;
@@ -801,9 +884,10 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 {
 	enum maildir_uidlist_sync_flags sync_flags;
 	enum maildir_uidlist_rec_flag flags;
-	bool new_changed, cur_changed, lock_failure;
+	bool new_changed, cur_changed, lock_failure, incremental = FALSE;
 	const char *fname;
 	enum maildir_scan_why why;
+	struct stat cur_st;
 	int ret;
 
 	*lost_files_r = FALSE;
@@ -863,7 +947,18 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 	   problem rarely happens except under high amount of modifications.
 	*/
 
-	if (!cur_changed) {
+	if (cur_changed && !forced && ctx->mbox->sync_journal != NULL) {
+		/* stat() before reading the changes, so that any later changes
+		   are noticed by the mtime check */
+		if (maildir_stat(ctx->mbox, ctx->cur_dir, &cur_st) < 0)
+			return -1;
+		incremental =
+			maildir_sync_journal_refresh(ctx->mbox->sync_journal);
+	}
+
+	if (!cur_changed || incremental) {
+		/* with an incremental sync only the changed files in cur/
+		   are looked at and the removed ones are dropped explicitly */
 		ctx->partial = TRUE;
 		sync_flags = MAILDIR_UIDLIST_SYNC_PARTIAL;
 	} else {
@@ -908,8 +1003,11 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 		}
 	}
 	ctx->locked = maildir_uidlist_is_locked(ctx->mbox->uidlist);
-	if (!ctx->locked)
+	if (!ctx->locked) {
 		ctx->partial = TRUE;
+		/* new files can't be added without the lock */
+		incremental = FALSE;
+	}
 
 	if (!ctx->mbox->syncing_commit && (ctx->locked || lock_failure)) {
 		if (maildir_sync_index_begin(ctx->mbox, ctx,
@@ -933,7 +1031,11 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 		if (ret < 0)
 			return -1;
 
-		if (cur_changed) {
+		if (incremental) {
+			if (maildir_sync_cur_changes(ctx, &cur_st) < 0)
+				return -1;
+		} else if (cur_changed) {
+			maildir_sync_journal_prepare(ctx);
 			if (maildir_scan_dir(ctx, FALSE, TRUE, why) < 0)
 				return -1;
 		}
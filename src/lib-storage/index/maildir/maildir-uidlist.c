@@ -22,6 +22,26 @@
    entry: <uid> [<key><value> ...] :<filename>
 
    See enum maildir_uidlist_*_ext_key for used keys.
+
+   --
+
+   Version 4 format is a binary format that is used when
+   maildir_binary_uidlist=yes. It can be read without parsing each line
+   separately, and it's still appended to the same way as the v3 format.
+   Integers are in the CPU's byte order, which is marked in the header.
+   A file written with the other byte order is byte-swapped while reading
+   and then recreated. The format is:
+
+   header: struct maildir_uidlist_bin_header
+           <header extensions, in the v3 format>\0 (padded to 32 bits)
+   block:  struct maildir_uidlist_bin_block
+           struct maildir_uidlist_bin_rec[rec_count] (sorted by UID)
+           <string heap> (padded to 32 bits)
+
+   The string heap contains the base filenames (<filename>\0) and record
+   extensions (<key><value>\0[<key><value>\0 ...]\0). A new block is
+   appended for each group of newly added records. Reading the v3 format
+   and writing the v4 format (or the other way around) converts the file.
 */
 
 #include "lib.h"
@@ -30,6 +50,8 @@
 #include "istream.h"
 #include "ostream.h"
 #include "str.h"
+#include "read-full.h"
+#include "mmap-util.h"
 #include "file-dotlock.h"
 #include "nfs-workarounds.h"
 #include "eacces-error.h"
@@ -46,8 +68,16 @@
 #define UIDLIST_ESTALE_RETRY_COUNT NFS_ESTALE_RETRY_COUNT
 
 #define UIDLIST_VERSION 3
+#define UIDLIST_BIN_VERSION 4
 #define UIDLIST_COMPRESS_PERCENTAGE 75
 
+/* v4 files begin with this, so text format parsers fail with
+   "Unsupported version 4" */
+#define UIDLIST_BIN_PREFIX "4 \n"
+#define UIDLIST_BIN_PREFIX_LEN 3
+#define UIDLIST_BIN_ALIGN(size) \
+	(((size) + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1))
+
 #define UIDLIST_IS_LOCKED(uidlist) \
 	((uidlist)->lock_count > 0)
 
@@ -59,6 +89,39 @@ struct maildir_uidlist_rec {
 };
 ARRAY_DEFINE_TYPE(maildir_uidlist_rec_p, struct maildir_uidlist_rec *);
 
+enum maildir_uidlist_bin_compat_flags {
+	MAILDIR_UIDLIST_BIN_COMPAT_BIG_ENDIAN	= 0x01
+};
+#ifdef WORDS_BIGENDIAN
+#  define UIDLIST_BIN_COMPAT_FLAGS MAILDIR_UIDLIST_BIN_COMPAT_BIG_ENDIAN
+#else
+#  define UIDLIST_BIN_COMPAT_FLAGS 0
+#endif
+
+struct maildir_uidlist_bin_header {
+	unsigned char prefix[UIDLIST_BIN_PREFIX_LEN];
+	uint8_t compat_flags; /* enum maildir_uidlist_bin_compat_flags */
+	/* size of the header, including the extensions and padding */
+	uint32_t hdr_size;
+	uint32_t uid_validity;
+	uint32_t next_uid;
+	guid_128_t mailbox_guid;
+};
+
+struct maildir_uidlist_bin_block {
+	uint32_t rec_count;
+	/* size of the string heap after the records, including padding */
+	uint32_t strings_size;
+};
+
+struct maildir_uidlist_bin_rec {
+	uint32_t uid;
+	/* offsets to the block's string heap */
+	uint32_t filename_offset;
+	/* (uint32_t)-1 if there are no extensions */
+	uint32_t ext_offset;
+};
+
 HASH_TABLE_DEFINE_TYPE(path_to_maildir_uidlist_rec,
 		       char *, struct maildir_uidlist_rec *);
 
@@ -86,7 +149,7 @@ struct maildir_uidlist {
 	unsigned int uid_validity, next_uid, prev_read_uid, last_seen_uid;
 	unsigned int hdr_next_uid;
 	unsigned int read_records_count, read_line_count;
-	uoff_t last_read_offset;
+	uoff_t last_read_offset, read_bin_offset;
 	string_t *hdr_extensions;
 
 	guid_128_t mailbox_guid;
@@ -100,6 +163,12 @@ struct maildir_uidlist {
 	unsigned int unsorted:1;
 	unsigned int have_mailbox_guid:1;
 	unsigned int opened_readonly:1;
+	/* write v4 format when recreating the file */
+	unsigned int binary:1;
+	/* records read from v4 file haven't been added to files hash yet */
+	unsigned int files_unindexed:1;
+	/* v4 file was written with the other byte order */
+	unsigned int bin_swapped:1;
 };
 
 struct maildir_uidlist_sync_ctx {
@@ -276,6 +345,7 @@ struct maildir_uidlist *maildir_uidlist_init(struct maildir_mailbox *mbox)
 			  maildir_filename_base_cmp);
 	uidlist->next_uid = 1;
 	uidlist->hdr_extensions = str_new(default_pool, 128);
+	uidlist->binary = mbox->storage->set->maildir_binary_uidlist;
 
 	uidlist->dotlock_settings.use_io_notify = TRUE;
 	uidlist->dotlock_settings.use_excl_lock =
@@ -318,6 +388,7 @@ static void maildir_uidlist_reset(struct maildir_uidlist *uidlist)
 
 	hash_table_clear(uidlist->files, FALSE);
 	array_clear(&uidlist->records);
+	uidlist->files_unindexed = FALSE;
 }
 
 void maildir_uidlist_deinit(struct maildir_uidlist **_uidlist)
@@ -347,6 +418,30 @@ static int maildir_uid_cmp(struct maildir_uidlist_rec *const *rec1,
 		(*rec1)->uid > (*rec2)->uid ? 1 : 0;
 }
 
+static unsigned int
+maildir_uidlist_get_version(struct maildir_uidlist *uidlist)
+{
+	return uidlist->binary ? UIDLIST_BIN_VERSION : UIDLIST_VERSION;
+}
+
+static uint32_t
+maildir_uidlist_bin32(const struct maildir_uidlist *uidlist, uint32_t value)
+{
+	if (!uidlist->bin_swapped)
+		return value;
+	return (value >> 24) | ((value >> 8) & 0xff00) |
+		((value << 8) & 0xff0000) | (value << 24);
+}
+
+static const char *maildir_uidlist_get_read_pos(struct maildir_uidlist *uidlist)
+{
+	if (uidlist->version == UIDLIST_BIN_VERSION) {
+		return t_strdup_printf("offset %"PRIuUOFF_T,
+				       uidlist->read_bin_offset);
+	}
+	return t_strdup_printf("line %u", uidlist->read_line_count);
+}
+
 static void ATTR_FORMAT(2, 3)
 maildir_uidlist_set_corrupted(struct maildir_uidlist *uidlist,
 			      const char *fmt, ...)
@@ -358,12 +453,12 @@ maildir_uidlist_set_corrupted(struct maildir_uidlist *uidlist,
 	if (uidlist->retry_rewind) {
 		mail_storage_set_critical(storage,
 			"Broken or unexpectedly changed file %s "
-			"line %u: %s - re-reading from beginning",
-			uidlist->path, uidlist->read_line_count,
+			"%s: %s - re-reading from beginning",
+			uidlist->path, maildir_uidlist_get_read_pos(uidlist),
 			t_strdup_vprintf(fmt, args));
 	} else {
-		mail_storage_set_critical(storage, "Broken file %s line %u: %s",
-			uidlist->path, uidlist->read_line_count,
+		mail_storage_set_critical(storage, "Broken file %s %s: %s",
+			uidlist->path, maildir_uidlist_get_read_pos(uidlist),
 			t_strdup_vprintf(fmt, args));
 	}
 	va_end(args);
@@ -374,11 +469,15 @@ static void maildir_uidlist_update_hdr(struct maildir_uidlist *uidlist,
 {
 	struct maildir_index_header *mhdr = uidlist->mhdr;
 
-	if (mhdr->uidlist_mtime == 0 && uidlist->version != UIDLIST_VERSION) {
-		/* upgrading from older verson. don't update the
-		   uidlist times until it uses the new format */
+	if (uidlist->version != maildir_uidlist_get_version(uidlist) ||
+	    uidlist->bin_swapped) {
+		/* convert to the wanted format */
 		uidlist->recreate = TRUE;
-		return;
+		if (mhdr->uidlist_mtime == 0) {
+			/* upgrading from older verson. don't update the
+			   uidlist times until it uses the new format */
+			return;
+		}
 	}
 	mhdr->uidlist_mtime = st->st_mtime;
 	mhdr->uidlist_mtime_nsecs = ST_MTIME_NSEC(*st);
@@ -408,6 +507,43 @@ maildir_uidlist_records_array_delete(struct maildir_uidlist *uidlist,
 	return idx;
 }
 
+static void maildir_uidlist_files_index(struct maildir_uidlist *uidlist)
+{
+	struct maildir_uidlist_rec *const *recs, *old_rec;
+	unsigned int i, count;
+
+	if (!uidlist->files_unindexed)
+		return;
+	uidlist->files_unindexed = FALSE;
+
+	recs = array_get(&uidlist->records, &count);
+	for (i = 0; i < count; i++) {
+		old_rec = hash_table_lookup(uidlist->files, recs[i]->filename);
+		if (old_rec != NULL && old_rec != recs[i]) {
+			/* the same as a duplicate line in v3 format. keep
+			   the newer UID. */
+			i_warning("%s: Duplicate file entry: %s (uid %u -> %u)",
+				  uidlist->path, recs[i]->filename,
+				  old_rec->uid, recs[i]->uid);
+			(void)maildir_uidlist_records_array_delete(uidlist,
+								   old_rec);
+			uidlist->change_counter++;
+			uidlist->recreate = TRUE;
+			recs = array_get(&uidlist->records, &count);
+			i--;
+		}
+		hash_table_insert(uidlist->files, recs[i]->filename, recs[i]);
+	}
+}
+
+static struct maildir_uidlist_rec *
+maildir_uidlist_files_lookup(struct maildir_uidlist *uidlist,
+			     const char *filename)
+{
+	maildir_uidlist_files_index(uidlist);
+	return hash_table_lookup(uidlist->files, filename);
+}
+
 static bool
 maildir_uidlist_read_extended(struct maildir_uidlist *uidlist,
 			      const char **line_p,
@@ -449,11 +585,67 @@ maildir_uidlist_read_extended(struct maildir_uidlist *uidlist,
 	return TRUE;
 }
 
+static bool
+maildir_uidlist_add_read_rec(struct maildir_uidlist *uidlist,
+			     struct maildir_uidlist_rec *rec)
+{
+	struct maildir_uidlist_rec *old_rec, *const *recs;
+	unsigned int count;
+
+	old_rec = hash_table_lookup(uidlist->files, rec->filename);
+	if (old_rec == NULL) {
+		/* no conflicts */
+	} else if (old_rec->uid == rec->uid) {
+		/* most likely this is a record we saved ourself, but couldn't
+		   update last_seen_uid because uidlist wasn't refreshed while
+		   it was locked.
+
+		   another possibility is a duplicate file record. currently
+		   it would be a bug, but not that big of a deal. also perhaps
+		   in future such duplicate lines could be used to update
+		   extended fields. so just let it through anyway.
+
+		   we'll waste a bit of memory here by allocating the record
+		   twice, but that's not really a problem.  */
+		rec->filename = old_rec->filename;
+		hash_table_insert(uidlist->files, rec->filename, rec);
+		uidlist->unsorted = TRUE;
+		return TRUE;
+	} else {
+		/* This can happen if expunged file is moved back and the file
+		   was appended to uidlist. */
+		i_warning("%s: Duplicate file entry at %s: "
+			  "%s (uid %u -> %u)%s",
+			  uidlist->path, maildir_uidlist_get_read_pos(uidlist),
+			  rec->filename, old_rec->uid, rec->uid,
+			  uidlist->retry_rewind ?
+			  " - retrying by re-reading from beginning" : "");
+		if (uidlist->retry_rewind)
+			return FALSE;
+		/* Delete the old UID */
+		(void)maildir_uidlist_records_array_delete(uidlist, old_rec);
+		/* Replace the old record with this new one */
+		*old_rec = *rec;
+		rec = old_rec;
+		uidlist->recreate = TRUE;
+	}
+
+	recs = array_get(&uidlist->records, &count);
+	if (count > 0 && recs[count-1]->uid > rec->uid) {
+		/* we most likely have some records in the array that we saved
+		   ourself without refreshing uidlist */
+		uidlist->unsorted = TRUE;
+	}
+
+	hash_table_insert(uidlist->files, rec->filename, rec);
+	array_append(&uidlist->records, &rec, 1);
+	return TRUE;
+}
+
 static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 				 const char *line)
 {
-	struct maildir_uidlist_rec *rec, *old_rec, *const *recs;
-	unsigned int count;
+	struct maildir_uidlist_rec *rec;
 	uint32_t uid;
 
 	uid = 0;
@@ -522,54 +714,8 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 		return FALSE;
 	}
 
-	old_rec = hash_table_lookup(uidlist->files, line);
-	if (old_rec == NULL) {
-		/* no conflicts */
-	} else if (old_rec->uid == uid) {
-		/* most likely this is a record we saved ourself, but couldn't
-		   update last_seen_uid because uidlist wasn't refreshed while
-		   it was locked.
-
-		   another possibility is a duplicate file record. currently
-		   it would be a bug, but not that big of a deal. also perhaps
-		   in future such duplicate lines could be used to update
-		   extended fields. so just let it through anyway.
-
-		   we'll waste a bit of memory here by allocating the record
-		   twice, but that's not really a problem.  */
-		rec->filename = old_rec->filename;
-		hash_table_insert(uidlist->files, rec->filename, rec);
-		uidlist->unsorted = TRUE;
-		return TRUE;
-	} else {
-		/* This can happen if expunged file is moved back and the file
-		   was appended to uidlist. */
-		i_warning("%s: Duplicate file entry at line %u: "
-			  "%s (uid %u -> %u)%s",
-			  uidlist->path, uidlist->read_line_count, line,
-			  old_rec->uid, uid, uidlist->retry_rewind ?
-			  " - retrying by re-reading from beginning" : "");
-		if (uidlist->retry_rewind)
-			return FALSE;
-		/* Delete the old UID */
-		(void)maildir_uidlist_records_array_delete(uidlist, old_rec);
-		/* Replace the old record with this new one */
-		*old_rec = *rec;
-		rec = old_rec;
-		uidlist->recreate = TRUE;
-	}
-
-	recs = array_get(&uidlist->records, &count);
-	if (count > 0 && recs[count-1]->uid > uid) {
-		/* we most likely have some records in the array that we saved
-		   ourself without refreshing uidlist */
-		uidlist->unsorted = TRUE;
-	}
-
 	rec->filename = p_strdup(uidlist->record_pool, line);
-	hash_table_insert(uidlist->files, rec->filename, rec);
-	array_append(&uidlist->records, &rec, 1);
-	return TRUE;
+	return maildir_uidlist_add_read_rec(uidlist, rec);
 }
 
 static int
@@ -618,6 +764,31 @@ maildir_uidlist_read_v3_header(struct maildir_uidlist *uidlist,
 	return 0;
 }
 
+static int
+maildir_uidlist_set_header(struct maildir_uidlist *uidlist,
+			   uint32_t uid_validity, uint32_t next_uid)
+{
+	if (uid_validity == 0 || next_uid == 0) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Broken header (uidvalidity = %u, next_uid=%u)",
+			uid_validity, next_uid);
+		return 0;
+	}
+
+	if (uid_validity == uidlist->uid_validity &&
+	    next_uid < uidlist->hdr_next_uid) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"next_uid header was lowered (%u -> %u)",
+			uidlist->hdr_next_uid, next_uid);
+		return 0;
+	}
+
+	uidlist->uid_validity = uid_validity;
+	uidlist->next_uid = next_uid;
+	uidlist->hdr_next_uid = next_uid;
+	return 1;
+}
+
 static int maildir_uidlist_read_header(struct maildir_uidlist *uidlist,
 				       struct istream *input)
 {
@@ -639,6 +810,7 @@ static int maildir_uidlist_read_header(struct maildir_uidlist *uidlist,
 	}
 
 	uidlist->version = *line - '0';
+	uidlist->bin_swapped = FALSE;
 	line += 2;
 
 	switch (uidlist->version) {
@@ -664,25 +836,196 @@ static int maildir_uidlist_read_header(struct maildir_uidlist *uidlist,
 		return 0;
 	}
 
-	if (uid_validity == 0 || next_uid == 0) {
+	return maildir_uidlist_set_header(uidlist, uid_validity, next_uid);
+}
+
+static bool
+maildir_uidlist_bin_ext_is_valid(const char *heap, uint32_t heap_size,
+				 uint32_t offset)
+{
+	const char *p, *end = heap + heap_size;
+
+	if (offset >= heap_size)
+		return FALSE;
+
+	/* the heap is known to end with NUL */
+	p = heap + offset;
+	while (*p != '\0') {
+		if (!MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p))
+			return FALSE;
+		p += strlen(p) + 1;
+		if (p >= end)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static int
+maildir_uidlist_read_bin_header(struct maildir_uidlist *uidlist,
+				const unsigned char *data, size_t size)
+{
+	const struct maildir_uidlist_bin_header *hdr =
+		(const struct maildir_uidlist_bin_header *)data;
+	unsigned int uid_validity = 0, next_uid = 0;
+	uint32_t hdr_size;
+	const char *ext;
+	int ret;
+
+	uidlist->version = UIDLIST_BIN_VERSION;
+	uidlist->read_bin_offset = 0;
+
+	if (size < sizeof(*hdr)) {
+		maildir_uidlist_set_corrupted(uidlist, "Header too small");
+		return 0;
+	}
+	if ((hdr->compat_flags & ~MAILDIR_UIDLIST_BIN_COMPAT_BIG_ENDIAN) != 0) {
+		/* written by a newer version. it may still be usable by it,
+		   so don't treat it as broken. */
+		mail_storage_set_critical(uidlist->box->storage,
+			"%s: Unsupported compat flags 0x%x",
+			uidlist->path, hdr->compat_flags);
+		return -1;
+	}
+	uidlist->bin_swapped = hdr->compat_flags != UIDLIST_BIN_COMPAT_FLAGS;
+
+	hdr_size = maildir_uidlist_bin32(uidlist, hdr->hdr_size);
+	if (hdr_size <= sizeof(*hdr) || hdr_size > size ||
+	    hdr_size % sizeof(uint32_t) != 0) {
 		maildir_uidlist_set_corrupted(uidlist,
-			"Broken header (uidvalidity = %u, next_uid=%u)",
-			uid_validity, next_uid);
+			"Invalid header size %u", hdr_size);
 		return 0;
 	}
 
-	if (uid_validity == uidlist->uid_validity &&
-	    next_uid < uidlist->hdr_next_uid) {
+	ext = (const char *)(hdr + 1);
+	if (memchr(ext, '\0', hdr_size - sizeof(*hdr)) == NULL) {
 		maildir_uidlist_set_corrupted(uidlist,
-			"next_uid header was lowered (%u -> %u)",
-			uidlist->hdr_next_uid, next_uid);
+			"Header extensions not NUL-terminated");
 		return 0;
 	}
+	T_BEGIN {
+		ret = maildir_uidlist_read_v3_header(uidlist, ext,
+						     &uid_validity, &next_uid);
+	} T_END;
+	if (ret < 0)
+		return 0;
 
-	uidlist->uid_validity = uid_validity;
-	uidlist->next_uid = next_uid;
-	uidlist->hdr_next_uid = next_uid;
-	return 1;
+	memcpy(uidlist->mailbox_guid, hdr->mailbox_guid,
+	       sizeof(uidlist->mailbox_guid));
+	uidlist->have_mailbox_guid = TRUE;
+	return maildir_uidlist_set_header(uidlist,
+		maildir_uidlist_bin32(uidlist, hdr->uid_validity),
+		maildir_uidlist_bin32(uidlist, hdr->next_uid));
+}
+
+static bool
+maildir_uidlist_read_bin_block(struct maildir_uidlist *uidlist,
+			       const struct maildir_uidlist_bin_block *block)
+{
+	uint32_t rec_count = maildir_uidlist_bin32(uidlist, block->rec_count);
+	uint32_t strings_size =
+		maildir_uidlist_bin32(uidlist, block->strings_size);
+	const struct maildir_uidlist_bin_rec *brecs =
+		(const struct maildir_uidlist_bin_rec *)(block + 1);
+	const char *strings = (const char *)(brecs + rec_count);
+	struct maildir_uidlist_rec *recs, *rec, *const *old_recs;
+	char *heap;
+	unsigned int i, first, count, old_count;
+	uint32_t uid, filename_offset, ext_offset;
+	bool add_to_hash;
+
+	if (strings_size % sizeof(uint32_t) != 0 ||
+	    (rec_count > 0 && (strings_size == 0 ||
+	     strings[strings_size-1] != '\0'))) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Broken string heap (size %u)", strings_size);
+		return FALSE;
+	}
+
+	/* the UIDs must be verified for all records, but only the records
+	   we haven't seen yet need to be looked at any further */
+	first = rec_count;
+	for (i = 0; i < rec_count; i++) {
+		uid = maildir_uidlist_bin32(uidlist, brecs[i].uid);
+		if (uid == 0 || uid >= (uint32_t)-1) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid UID %u", uid);
+			return FALSE;
+		}
+		if (uid <= uidlist->prev_read_uid) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"UIDs not ordered (%u >= %u)",
+				uid, uidlist->prev_read_uid);
+			return FALSE;
+		}
+		uidlist->prev_read_uid = uid;
+		if (first == rec_count && uid > uidlist->last_seen_uid)
+			first = i;
+	}
+	uidlist->read_records_count += rec_count;
+	if (first == rec_count)
+		return TRUE;
+	uidlist->last_seen_uid = uidlist->prev_read_uid;
+
+	/* add the records to the files hash only if it's already being used.
+	   otherwise it's filled once something needs it. */
+	old_recs = array_get(&uidlist->records, &old_count);
+	add_to_hash = !uidlist->files_unindexed && old_count > 0;
+	if (old_count > 0 && old_recs[old_count-1]->uid >
+	    maildir_uidlist_bin32(uidlist, brecs[first].uid))
+		uidlist->unsorted = TRUE;
+
+	/* the filenames and extensions are used directly from a copy of the
+	   string heap */
+	heap = p_malloc(uidlist->record_pool, strings_size);
+	memcpy(heap, strings, strings_size);
+	count = rec_count - first;
+	recs = p_new(uidlist->record_pool, struct maildir_uidlist_rec, count);
+
+	for (i = 0; i < count; i++) {
+		const struct maildir_uidlist_bin_rec *brec = &brecs[first + i];
+
+		rec = &recs[i];
+		rec->uid = maildir_uidlist_bin32(uidlist, brec->uid);
+		rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+
+		filename_offset =
+			maildir_uidlist_bin32(uidlist, brec->filename_offset);
+		if (filename_offset >= strings_size ||
+		    heap[filename_offset] == '\0') {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid filename offset %u for UID %u",
+				filename_offset, rec->uid);
+			return FALSE;
+		}
+		rec->filename = heap + filename_offset;
+		if (strchr(rec->filename, '/') != NULL) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Broken filename for UID %u: %s",
+				rec->uid, rec->filename);
+			return FALSE;
+		}
+
+		ext_offset = maildir_uidlist_bin32(uidlist, brec->ext_offset);
+		if (ext_offset != (uint32_t)-1) {
+			if (!maildir_uidlist_bin_ext_is_valid(heap,
+					strings_size, ext_offset)) {
+				maildir_uidlist_set_corrupted(uidlist,
+					"Invalid extensions for UID %u",
+					rec->uid);
+				return FALSE;
+			}
+			rec->extensions = (unsigned char *)heap + ext_offset;
+		}
+
+		if (add_to_hash) {
+			if (!maildir_uidlist_add_read_rec(uidlist, rec))
+				return FALSE;
+		} else {
+			array_append(&uidlist->records, &rec, 1);
+			uidlist->files_unindexed = TRUE;
+		}
+	}
+	return TRUE;
 }
 
 static void maildir_uidlist_records_sort_by_uid(struct maildir_uidlist *uidlist)
@@ -691,18 +1034,213 @@ static void maildir_uidlist_records_sort_by_uid(struct maildir_uidlist *uidlist)
 	uidlist->unsorted = FALSE;
 }
 
+static void
+maildir_uidlist_read_finish(struct maildir_uidlist *uidlist, int ret,
+			    uint32_t orig_uid_validity, uint32_t orig_next_uid)
+{
+	struct mail_storage *storage = uidlist->box->storage;
+
+	if (uidlist->unsorted) {
+		uidlist->recreate_on_change = TRUE;
+		maildir_uidlist_records_sort_by_uid(uidlist);
+	}
+	if (uidlist->next_uid <= uidlist->prev_read_uid)
+		uidlist->next_uid = uidlist->prev_read_uid + 1;
+	if (ret > 0 && uidlist->uid_validity != orig_uid_validity &&
+	    orig_uid_validity != 0) {
+		uidlist->recreate = TRUE;
+	} else if (ret > 0 && uidlist->next_uid < orig_next_uid) {
+		mail_storage_set_critical(storage,
+			"%s: next_uid was lowered (%u -> %u, hdr=%u)",
+			uidlist->path, orig_next_uid,
+			uidlist->next_uid, uidlist->hdr_next_uid);
+		uidlist->recreate = TRUE;
+		uidlist->next_uid = orig_next_uid;
+	}
+}
+
 static int
-maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
-			    bool *retry_r, bool try_retry)
+maildir_uidlist_read_text(struct maildir_uidlist *uidlist, int fd,
+			  uoff_t last_read_offset, uoff_t *read_offset_r,
+			  bool *retry_r, bool try_retry)
 {
 	struct mail_storage *storage = uidlist->box->storage;
 	const char *line;
 	uint32_t orig_next_uid, orig_uid_validity;
 	struct istream *input;
+	int ret;
+
+	/* duplicates are checked while reading */
+	maildir_uidlist_files_index(uidlist);
+
+	input = i_stream_create_fd(fd, (size_t)-1, FALSE);
+	i_stream_seek(input, last_read_offset);
+
+	orig_uid_validity = uidlist->uid_validity;
+	orig_next_uid = uidlist->next_uid;
+	ret = input->v_offset != 0 ? 1 :
+		maildir_uidlist_read_header(uidlist, input);
+	if (ret > 0) {
+		uidlist->prev_read_uid = 0;
+		uidlist->change_counter++;
+		uidlist->retry_rewind = last_read_offset != 0 && try_retry;
+
+		ret = 1;
+		while ((line = i_stream_read_next_line(input)) != NULL) {
+			uidlist->read_records_count++;
+			uidlist->read_line_count++;
+			if (!maildir_uidlist_next(uidlist, line)) {
+				if (!uidlist->retry_rewind)
+					ret = 0;
+				else {
+					ret = -1;
+					*retry_r = TRUE;
+				}
+				break;
+			}
+                }
+		uidlist->retry_rewind = FALSE;
+		if (input->stream_errno != 0)
+                        ret = -1;
+		maildir_uidlist_read_finish(uidlist, ret, orig_uid_validity,
+					    orig_next_uid);
+	}
+
+	if (ret < 0 && !*retry_r) {
+                /* I/O error */
+                if (input->stream_errno == ESTALE && try_retry)
+			*retry_r = TRUE;
+		else {
+			errno = input->stream_errno;
+			mail_storage_set_critical(storage,
+				"read(%s) failed: %m", uidlist->path);
+		}
+	}
+	*read_offset_r = input->v_offset;
+	i_stream_destroy(&input);
+	return ret;
+}
+
+static int
+maildir_uidlist_read_bin(struct maildir_uidlist *uidlist, int fd,
+			 const struct stat *st, uoff_t last_read_offset,
+			 uoff_t *read_offset_r, bool *retry_r, bool try_retry)
+{
+	struct mail_storage *storage = uidlist->box->storage;
+	const struct maildir_uidlist_bin_block *block;
+	uint32_t orig_next_uid, orig_uid_validity;
+	const unsigned char *data;
+	void *mmap_base = NULL;
+	unsigned char *buf = NULL;
+	size_t size, pos, block_size;
+	uint32_t rec_count, strings_size;
+	int ret;
+
+	*read_offset_r = last_read_offset;
+	size = st->st_size;
+	if (last_read_offset >= size)
+		return 1;
+
+	if (!storage->set->mmap_disable) {
+		mmap_base = mmap_ro_file(fd, &size);
+		if (mmap_base == MAP_FAILED) {
+			if (errno == ESTALE && try_retry) {
+				*retry_r = TRUE;
+				return -1;
+			}
+			mail_storage_set_critical(storage,
+				"mmap(%s) failed: %m", uidlist->path);
+			return -1;
+		}
+		data = mmap_base;
+	} else {
+		/* only the unread part is needed */
+		buf = i_malloc(size);
+		ret = pread_full(fd, buf + last_read_offset,
+				 size - last_read_offset, last_read_offset);
+		if (ret <= 0) {
+			i_free(buf);
+			if (ret < 0 && errno == ESTALE && try_retry) {
+				*retry_r = TRUE;
+				return -1;
+			}
+			if (ret == 0)
+				errno = ESTALE;
+			mail_storage_set_critical(storage,
+				"read(%s) failed: %m", uidlist->path);
+			return -1;
+		}
+		data = buf;
+	}
+
+	orig_uid_validity = uidlist->uid_validity;
+	orig_next_uid = uidlist->next_uid;
+	ret = last_read_offset != 0 ? 1 :
+		maildir_uidlist_read_bin_header(uidlist, data, size);
+	if (ret > 0) {
+		uidlist->prev_read_uid = 0;
+		uidlist->change_counter++;
+		uidlist->retry_rewind = last_read_offset != 0 && try_retry;
+
+		pos = last_read_offset != 0 ? last_read_offset :
+			maildir_uidlist_bin32(uidlist,
+				((const struct maildir_uidlist_bin_header *)data)->hdr_size);
+		while (size - pos >= sizeof(*block)) {
+			uidlist->read_bin_offset = pos;
+			block = CONST_PTR_OFFSET(data, pos);
+			rec_count = maildir_uidlist_bin32(uidlist,
+							  block->rec_count);
+			strings_size = maildir_uidlist_bin32(uidlist,
+							     block->strings_size);
+
+			/* stop at a block that isn't fully written yet */
+			block_size = size - pos - sizeof(*block);
+			if (rec_count > block_size /
+			    sizeof(struct maildir_uidlist_bin_rec))
+				break;
+			block_size -= rec_count *
+				sizeof(struct maildir_uidlist_bin_rec);
+			if (strings_size > block_size)
+				break;
+			block_size = sizeof(*block) + rec_count *
+				sizeof(struct maildir_uidlist_bin_rec) +
+				strings_size;
+
+			if (!maildir_uidlist_read_bin_block(uidlist, block)) {
+				if (!uidlist->retry_rewind)
+					ret = 0;
+				else {
+					ret = -1;
+					*retry_r = TRUE;
+				}
+				break;
+			}
+			pos += block_size;
+		}
+		*read_offset_r = pos;
+		uidlist->retry_rewind = FALSE;
+		maildir_uidlist_read_finish(uidlist, ret, orig_uid_validity,
+					    orig_next_uid);
+	}
+
+	if (mmap_base != NULL) {
+		if (munmap(mmap_base, size) < 0)
+			i_error("munmap(%s) failed: %m", uidlist->path);
+	}
+	i_free(buf);
+	return ret;
+}
+
+static int
+maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
+			    bool *retry_r, bool try_retry)
+{
+	struct mail_storage *storage = uidlist->box->storage;
+	unsigned char prefix[UIDLIST_BIN_PREFIX_LEN];
 	struct stat st;
-	uoff_t last_read_offset;
+	uoff_t last_read_offset, read_offset;
 	int fd, ret;
-	bool readonly = FALSE;
+	bool readonly = FALSE, binary;
 
 	*retry_r = FALSE;
 
@@ -750,6 +1288,22 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 		return -1;
 	}
 
+	if (last_read_offset != 0)
+		binary = uidlist->version == UIDLIST_BIN_VERSION;
+	else if ((ret = pread_full(fd, prefix, sizeof(prefix), 0)) < 0) {
+		i_close_fd(&fd);
+		if (errno == ESTALE && try_retry) {
+			*retry_r = TRUE;
+			return -1;
+		}
+		mail_storage_set_critical(storage,
+			"read(%s) failed: %m", uidlist->path);
+		return -1;
+	} else {
+		binary = ret > 0 && memcmp(prefix, UIDLIST_BIN_PREFIX,
+					   sizeof(prefix)) == 0;
+	}
+
 	if (uidlist->record_pool == NULL) {
 		uidlist->record_pool =
 			pool_alloconly_create(MEMPOOL_GROWING
@@ -758,53 +1312,14 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 							    st.st_size/8));
 	}
 
-	input = i_stream_create_fd(fd, (size_t)-1, FALSE);
-	i_stream_seek(input, last_read_offset);
-
-	orig_uid_validity = uidlist->uid_validity;
-	orig_next_uid = uidlist->next_uid;
-	ret = input->v_offset != 0 ? 1 :
-		maildir_uidlist_read_header(uidlist, input);
-	if (ret > 0) {
-		uidlist->prev_read_uid = 0;
-		uidlist->change_counter++;
-		uidlist->retry_rewind = last_read_offset != 0 && try_retry;
-
-		ret = 1;
-		while ((line = i_stream_read_next_line(input)) != NULL) {
-			uidlist->read_records_count++;
-			uidlist->read_line_count++;
-			if (!maildir_uidlist_next(uidlist, line)) {
-				if (!uidlist->retry_rewind)
-					ret = 0;
-				else {
-					ret = -1;
-					*retry_r = TRUE;
-				}
-				break;
-			}
-                }
-		uidlist->retry_rewind = FALSE;
-		if (input->stream_errno != 0)
-                        ret = -1;
-
-		if (uidlist->unsorted) {
-			uidlist->recreate_on_change = TRUE;
-			maildir_uidlist_records_sort_by_uid(uidlist);
-		}
-		if (uidlist->next_uid <= uidlist->prev_read_uid)
-			uidlist->next_uid = uidlist->prev_read_uid + 1;
-		if (ret > 0 && uidlist->uid_validity != orig_uid_validity &&
-		    orig_uid_validity != 0) {
-			uidlist->recreate = TRUE;
-		} else if (ret > 0 && uidlist->next_uid < orig_next_uid) {
-			mail_storage_set_critical(storage,
-				"%s: next_uid was lowered (%u -> %u, hdr=%u)",
-				uidlist->path, orig_next_uid,
-				uidlist->next_uid, uidlist->hdr_next_uid);
-			uidlist->recreate = TRUE;
-			uidlist->next_uid = orig_next_uid;
-		}
+	if (binary) {
+		ret = maildir_uidlist_read_bin(uidlist, fd, &st,
+					       last_read_offset, &read_offset,
+					       retry_r, try_retry);
+	} else {
+		ret = maildir_uidlist_read_text(uidlist, fd, last_read_offset,
+						&read_offset,
+						retry_r, try_retry);
 	}
 
         if (ret == 0) {
@@ -812,27 +1327,20 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
                 (void)unlink(uidlist->path);
         } else if (ret > 0) {
                 /* success */
-		if (readonly)
+		if (readonly || uidlist->bin_swapped) {
+			/* appends can't be written to this file */
 			uidlist->recreate_on_change = TRUE;
+		}
 		uidlist->fd = fd;
 		uidlist->fd_dev = st.st_dev;
 		uidlist->fd_ino = st.st_ino;
 		uidlist->fd_size = st.st_size;
-		uidlist->last_read_offset = input->v_offset;
+		uidlist->last_read_offset = read_offset;
 		maildir_uidlist_update_hdr(uidlist, &st);
-        } else if (!*retry_r) {
-                /* I/O error */
-                if (input->stream_errno == ESTALE && try_retry)
-			*retry_r = TRUE;
-		else {
-			errno = input->stream_errno;
-			mail_storage_set_critical(storage,
-				"read(%s) failed: %m", uidlist->path);
-		}
+        } else {
 		uidlist->last_read_offset = 0;
 	}
 
-	i_stream_destroy(&input);
 	if (ret <= 0) {
 		if (close(fd) < 0) {
 			mail_storage_set_critical(storage,
@@ -1232,50 +1740,40 @@ maildir_uidlist_generate_uid_validity(struct maildir_uidlist *uidlist)
 		maildir_get_uidvalidity_next(uidlist->box->list);
 }
 
-static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
-				    const char *path, unsigned int first_idx,
-				    uoff_t *file_size_r)
+static void
+maildir_uidlist_write_text_header(struct maildir_uidlist *uidlist,
+				  struct ostream *output)
+{
+	string_t *str = t_str_new(256);
+
+	str_printfa(str, "%u %c%u %c%u %c%s", uidlist->version,
+		    MAILDIR_UIDLIST_HDR_EXT_UID_VALIDITY,
+		    uidlist->uid_validity,
+		    MAILDIR_UIDLIST_HDR_EXT_NEXT_UID,
+		    uidlist->next_uid,
+		    MAILDIR_UIDLIST_HDR_EXT_GUID,
+		    guid_128_to_string(uidlist->mailbox_guid));
+	if (str_len(uidlist->hdr_extensions) > 0) {
+		str_append_c(str, ' ');
+		str_append_str(str, uidlist->hdr_extensions);
+	}
+	str_append_c(str, '\n');
+	o_stream_nsend(output, str_data(str), str_len(str));
+}
+
+static void
+maildir_uidlist_write_text_records(struct maildir_uidlist *uidlist,
+				   struct ostream *output,
+				   unsigned int first_idx)
 {
-	struct mail_storage *storage = uidlist->box->storage;
 	struct maildir_uidlist_iter_ctx *iter;
-	struct ostream *output;
 	struct maildir_uidlist_rec *rec;
 	string_t *str;
 	const unsigned char *p;
 	const char *strp;
 	unsigned int len;
 
-	i_assert(fd != -1);
-
-	output = o_stream_create_fd_file(fd, (uoff_t)-1, FALSE);
-	o_stream_cork(output);
 	str = t_str_new(512);
-
-	if (output->offset == 0) {
-		i_assert(first_idx == 0);
-		uidlist->version = UIDLIST_VERSION;
-
-		if (uidlist->uid_validity == 0)
-			maildir_uidlist_generate_uid_validity(uidlist);
-		if (!uidlist->have_mailbox_guid)
-			guid_128_generate(uidlist->mailbox_guid);
-
-		i_assert(uidlist->next_uid > 0);
-		str_printfa(str, "%u %c%u %c%u %c%s", uidlist->version,
-			    MAILDIR_UIDLIST_HDR_EXT_UID_VALIDITY,
-			    uidlist->uid_validity,
-			    MAILDIR_UIDLIST_HDR_EXT_NEXT_UID,
-			    uidlist->next_uid,
-			    MAILDIR_UIDLIST_HDR_EXT_GUID,
-			    guid_128_to_string(uidlist->mailbox_guid));
-		if (str_len(uidlist->hdr_extensions) > 0) {
-			str_append_c(str, ' ');
-			str_append_str(str, uidlist->hdr_extensions);
-		}
-		str_append_c(str, '\n');
-		o_stream_nsend(output, str_data(str), str_len(str));
-	}
-
 	iter = maildir_uidlist_iter_init(uidlist);
 	i_assert(first_idx <= array_count(&uidlist->records));
 	iter->next += first_idx;
@@ -1303,6 +1801,145 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 		o_stream_nsend(output, str_data(str), str_len(str));
 	}
 	maildir_uidlist_iter_deinit(&iter);
+}
+
+static void
+maildir_uidlist_write_bin_padding(struct ostream *output, size_t size)
+{
+	static const unsigned char zeros[UIDLIST_BIN_ALIGN(1)] = { 0, };
+
+	if (UIDLIST_BIN_ALIGN(size) != size)
+		o_stream_nsend(output, zeros, UIDLIST_BIN_ALIGN(size) - size);
+}
+
+static void
+maildir_uidlist_write_bin_header(struct maildir_uidlist *uidlist,
+				 struct ostream *output)
+{
+	struct maildir_uidlist_bin_header hdr;
+	size_t ext_size;
+
+	/* header extensions are kept in the v3 format */
+	ext_size = str_len(uidlist->hdr_extensions) + 1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.prefix, UIDLIST_BIN_PREFIX, sizeof(hdr.prefix));
+	hdr.compat_flags = UIDLIST_BIN_COMPAT_FLAGS;
+	hdr.hdr_size = sizeof(hdr) + UIDLIST_BIN_ALIGN(ext_size);
+	hdr.uid_validity = uidlist->uid_validity;
+	hdr.next_uid = uidlist->next_uid;
+	memcpy(hdr.mailbox_guid, uidlist->mailbox_guid,
+	       sizeof(hdr.mailbox_guid));
+
+	o_stream_nsend(output, &hdr, sizeof(hdr));
+	o_stream_nsend(output, str_c(uidlist->hdr_extensions), ext_size);
+	maildir_uidlist_write_bin_padding(output, ext_size);
+}
+
+static size_t maildir_uidlist_rec_get_ext_size(const unsigned char *extensions)
+{
+	const unsigned char *p;
+
+	if (extensions == NULL)
+		return 0;
+	for (p = extensions; *p != '\0'; p += strlen((const char *)p) + 1)
+		i_assert(MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p));
+	return p - extensions + 1;
+}
+
+static void
+maildir_uidlist_write_bin_records(struct maildir_uidlist *uidlist,
+				  struct ostream *output,
+				  unsigned int first_idx)
+{
+	struct maildir_uidlist_rec *const *recs;
+	struct maildir_uidlist_bin_block block;
+	struct maildir_uidlist_bin_rec brec;
+	unsigned int i, count;
+	size_t strings_size, ext_size;
+	uint32_t offset;
+
+	recs = array_get(&uidlist->records, &count);
+	i_assert(first_idx <= count);
+	if (first_idx == count)
+		return;
+
+	/* the base filenames are written without the :2,<flags> part */
+	strings_size = 0;
+	for (i = first_idx; i < count; i++) {
+		strings_size += strcspn(recs[i]->filename, ":") + 1 +
+			maildir_uidlist_rec_get_ext_size(recs[i]->extensions);
+	}
+	memset(&block, 0, sizeof(block));
+	block.rec_count = count - first_idx;
+	block.strings_size = UIDLIST_BIN_ALIGN(strings_size);
+	o_stream_nsend(output, &block, sizeof(block));
+
+	memset(&brec, 0, sizeof(brec));
+	for (i = first_idx, offset = 0; i < count; i++) {
+		i_assert(recs[i]->uid != (uint32_t)-1);
+
+		brec.uid = recs[i]->uid;
+		brec.filename_offset = offset;
+		offset += strcspn(recs[i]->filename, ":") + 1;
+		ext_size = maildir_uidlist_rec_get_ext_size(recs[i]->extensions);
+		if (ext_size == 0)
+			brec.ext_offset = (uint32_t)-1;
+		else {
+			brec.ext_offset = offset;
+			offset += ext_size;
+		}
+		o_stream_nsend(output, &brec, sizeof(brec));
+	}
+	i_assert(offset == strings_size);
+
+	for (i = first_idx; i < count; i++) {
+		uidlist->read_records_count++;
+		o_stream_nsend(output, recs[i]->filename,
+			       strcspn(recs[i]->filename, ":"));
+		o_stream_nsend(output, "", 1);
+		if (recs[i]->extensions != NULL) {
+			o_stream_nsend(output, recs[i]->extensions,
+				maildir_uidlist_rec_get_ext_size(recs[i]->extensions));
+		}
+	}
+	maildir_uidlist_write_bin_padding(output, strings_size);
+}
+
+static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
+				    const char *path, unsigned int first_idx,
+				    uoff_t *file_size_r)
+{
+	struct mail_storage *storage = uidlist->box->storage;
+	struct ostream *output;
+
+	i_assert(fd != -1);
+
+	output = o_stream_create_fd_file(fd, (uoff_t)-1, FALSE);
+	o_stream_cork(output);
+
+	if (output->offset == 0) {
+		i_assert(first_idx == 0);
+		uidlist->version = maildir_uidlist_get_version(uidlist);
+		uidlist->bin_swapped = FALSE;
+
+		if (uidlist->uid_validity == 0)
+			maildir_uidlist_generate_uid_validity(uidlist);
+		if (!uidlist->have_mailbox_guid)
+			guid_128_generate(uidlist->mailbox_guid);
+
+		i_assert(uidlist->next_uid > 0);
+		if (uidlist->version == UIDLIST_BIN_VERSION)
+			maildir_uidlist_write_bin_header(uidlist, output);
+		else
+			maildir_uidlist_write_text_header(uidlist, output);
+	}
+
+	/* appends are written in the format the file already has */
+	if (uidlist->version == UIDLIST_BIN_VERSION)
+		maildir_uidlist_write_bin_records(uidlist, output, first_idx);
+	else
+		maildir_uidlist_write_text_records(uidlist, output, first_idx);
 
 	if (o_stream_nfinish(output) < 0) {
 		mail_storage_set_critical(storage, "write(%s) failed: %m", path);
@@ -1348,6 +1985,7 @@ maildir_uidlist_records_drop_expunges(struct maildir_uidlist *uidlist)
 		mail_index_view_close(&view);
 		return;
 	}
+	maildir_uidlist_files_index(uidlist);
 
 	i_array_init(&new_records, hdr->messages_count + 64);
 	recs = array_get(&uidlist->records, &count);
@@ -1515,8 +2153,9 @@ static bool maildir_uidlist_want_recreate(struct maildir_uidlist_sync_ctx *ctx)
 
 	if (ctx->finish_change_counter != uidlist->change_counter)
 		return TRUE;
-	if (uidlist->fd == -1 || uidlist->version != UIDLIST_VERSION ||
-	    !uidlist->have_mailbox_guid)
+	if (uidlist->fd == -1 ||
+	    uidlist->version != maildir_uidlist_get_version(uidlist) ||
+	    uidlist->bin_swapped || !uidlist->have_mailbox_guid)
 		return TRUE;
 	return maildir_uidlist_want_compress(ctx);
 }
@@ -1674,7 +2313,7 @@ maildir_uidlist_sync_next_partial(struct maildir_uidlist_sync_ctx *ctx,
 	unsigned int count;
 
 	/* we'll update uidlist directly */
-	rec = hash_table_lookup(uidlist->files, filename);
+	rec = maildir_uidlist_files_lookup(uidlist, filename);
 	if (rec == NULL) {
 		/* doesn't exist in uidlist */
 		if (!ctx->locked) {
@@ -1795,7 +2434,7 @@ int maildir_uidlist_sync_next_uid(struct maildir_uidlist_sync_ctx *ctx,
 		rec->flags &= ~(MAILDIR_UIDLIST_REC_FLAG_NEW_DIR |
 				MAILDIR_UIDLIST_REC_FLAG_MOVED);
 	} else {
-		old_rec = hash_table_lookup(uidlist->files, filename);
+		old_rec = maildir_uidlist_files_lookup(uidlist, filename);
 		i_assert(old_rec != NULL || UIDLIST_IS_LOCKED(uidlist));
 
 		rec = p_new(ctx->record_pool, struct maildir_uidlist_rec, 1);
@@ -1836,7 +2475,7 @@ void maildir_uidlist_sync_remove(struct maildir_uidlist_sync_ctx *ctx,
 	i_assert(ctx->partial);
 	i_assert(ctx->uidlist->locked_refresh);
 
-	rec = hash_table_lookup(ctx->uidlist->files, filename);
+	rec = maildir_uidlist_files_lookup(ctx->uidlist, filename);
 	i_assert(rec != NULL);
 	i_assert(rec->uid != (uint32_t)-1);
 
@@ -1884,7 +2523,7 @@ bool maildir_uidlist_get_uid(struct maildir_uidlist *uidlist,
 {
 	struct maildir_uidlist_rec *rec;
 
-	rec = hash_table_lookup(uidlist->files, filename);
+	rec = maildir_uidlist_files_lookup(uidlist, filename);
 	if (rec == NULL)
 		return FALSE;
 
@@ -1897,7 +2536,7 @@ void maildir_uidlist_update_fname(struct maildir_uidlist *uidlist,
 {
 	struct maildir_uidlist_rec *rec;
 
-	rec = hash_table_lookup(uidlist->files, filename);
+	rec = maildir_uidlist_files_lookup(uidlist, filename);
 	if (rec == NULL)
 		return;
 
@@ -1912,7 +2551,7 @@ maildir_uidlist_get_full_filename(struct maildir_uidlist *uidlist,
 {
 	struct maildir_uidlist_rec *rec;
 
-	rec = hash_table_lookup(uidlist->files, filename);
+	rec = maildir_uidlist_files_lookup(uidlist, filename);
 	return rec == NULL ? NULL : rec->filename;
 }
 
@@ -1981,6 +2620,7 @@ static void maildir_uidlist_swap(struct maildir_uidlist_sync_ctx *ctx)
 	hash_table_destroy(&uidlist->files);
 	uidlist->files = ctx->files;
 	memset(&ctx->files, 0, sizeof(ctx->files));
+	uidlist->files_unindexed = FALSE;
 
 	if (uidlist->record_pool != NULL)
 		pool_unref(&uidlist->record_pool);
@@ -2067,7 +2707,7 @@ void maildir_uidlist_add_flags(struct maildir_uidlist *uidlist,
 {
 	struct maildir_uidlist_rec *rec;
 
-	rec = hash_table_lookup(uidlist->files, filename);
+	rec = maildir_uidlist_files_lookup(uidlist, filename);
 	i_assert(rec != NULL);
 
 	rec->flags |= flags;
@@ -0,0 +1,271 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "write-full.h"
+#include "mail-storage-private.h"
+#include "maildir-storage.h"
+#include "maildir-sync-journal.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define TEST_INOTIFY_MAX_QUEUED_EVENTS_PATH \
+	"/proc/sys/fs/inotify/max_queued_events"
+
+static struct test_mail_storage_ctx *test_ctx;
+
+static const char *const test_incremental_input[] = {
+	"maildir_incremental_syncs=yes",
+	NULL
+};
+
+static const char *test_cur_path(struct mailbox *box, const char *fname)
+{
+	return t_strconcat(mailbox_get_path(box), "/cur/", fname, NULL);
+}
+
+static void test_cur_add(struct mailbox *box, const char *fname,
+			 const char *subject)
+{
+	const char *path = test_cur_path(box, fname);
+	const char *msg;
+	int fd;
+
+	msg = t_strdup_printf("Subject: %s\n\nbody\n", subject);
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write_full(fd, msg, strlen(msg)) < 0)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static void test_cur_rename(struct mailbox *box, const char *old_fname,
+			    const char *new_fname)
+{
+	const char *old_path = test_cur_path(box, old_fname);
+	const char *new_path = test_cur_path(box, new_fname);
+
+	if (rename(old_path, new_path) < 0)
+		i_fatal("rename(%s, %s) failed: %m", old_path, new_path);
+}
+
+static void test_cur_unlink(struct mailbox *box, const char *fname)
+{
+	const char *path = test_cur_path(box, fname);
+
+	if (unlink(path) < 0)
+		i_fatal("unlink(%s) failed: %m", path);
+}
+
+/* Returns the mailbox's messages as subject/flags list */
+static const char *test_mailbox_get_mails(struct mailbox *box)
+{
+	struct mailbox_transaction_context *t;
+	struct mailbox_status status;
+	struct mail *mail;
+	const char *subject;
+	string_t *str;
+	uint32_t seq;
+
+	if (mailbox_sync(box, 0) < 0)
+		return NULL;
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+
+	str = t_str_new(64);
+	t = mailbox_transaction_begin(box, 0);
+	mail = mail_alloc(t, 0, NULL);
+	for (seq = 1; seq <= status.messages; seq++) {
+		mail_set_seq(mail, seq);
+		if (str_len(str) > 0)
+			str_append_c(str, ',');
+		if (mail_get_first_header(mail, "Subject", &subject) <= 0)
+			subject = "?";
+		str_append(str, subject);
+		if ((mail_get_flags(mail) & MAIL_SEEN) != 0)
+			str_append(str, "/S");
+	}
+	mail_free(&mail);
+	(void)mailbox_transaction_commit(&t);
+	return str_c(str);
+}
+
+static struct maildir_sync_journal *test_mailbox_journal(struct mailbox *box)
+{
+	struct maildir_sync_journal *journal =
+		((struct maildir_mailbox *)box)->sync_journal;
+
+#ifdef HAVE_INOTIFY_INIT
+	test_assert(journal != NULL);
+#endif
+	return journal;
+}
+
+static struct mailbox *test_mailbox_init(void)
+{
+	struct test_mail_storage_settings set;
+	struct mailbox *box;
+
+	memset(&set, 0, sizeof(set));
+	set.driver = "maildir";
+	set.extra_input = test_incremental_input;
+	test_mail_storage_init_user(test_ctx, &set);
+
+	box = test_mail_storage_mailbox_create(test_ctx, "INBOX");
+	test_cur_add(box, "1.m1.test:2,", "m1");
+	test_cur_add(box, "2.m2.test:2,", "m2");
+	test_assert(strcmp(test_mailbox_get_mails(box), "m1,m2") == 0);
+	/* the journal is started by the next full scan of cur/ */
+	test_cur_add(box, "3.m3.test:2,", "m3");
+	test_assert(strcmp(test_mailbox_get_mails(box), "m1,m2,m3") == 0);
+	return box;
+}
+
+static void test_mailbox_deinit(struct mailbox **box)
+{
+	mailbox_free(box);
+	test_mail_storage_deinit_user(test_ctx);
+}
+
+static bool test_journal_has_change(struct maildir_sync_journal *journal,
+				    const char *fname, bool exists)
+{
+	const struct maildir_sync_journal_change *changes;
+	unsigned int i, count;
+
+	changes = maildir_sync_journal_get_changes(journal, &count);
+	for (i = 0; i < count; i++) {
+		if (strcmp(changes[i].fname, fname) == 0)
+			return changes[i].exists == exists;
+	}
+	return FALSE;
+}
+
+static void test_maildir_sync_journal_changes(void)
+{
+	struct maildir_sync_journal *journal;
+	struct mailbox *box;
+
+	test_begin("maildir sync journal changes");
+	box = test_mailbox_init();
+	journal = test_mailbox_journal(box);
+	if (journal == NULL) {
+		test_mailbox_deinit(&box);
+		test_end();
+		return;
+	}
+
+	/* add */
+	test_cur_add(box, "4.m4.test:2,", "m4");
+	test_assert(maildir_sync_journal_refresh(journal));
+	test_assert(test_journal_has_change(journal, "4.m4.test:2,", TRUE));
+	test_assert(strcmp(test_mailbox_get_mails(box), "m1,m2,m3,m4") == 0);
+
+	/* rename to change flags */
+	test_cur_rename(box, "2.m2.test:2,", "2.m2.test:2,S");
+	test_assert(maildir_sync_journal_refresh(journal));
+	test_assert(test_journal_has_change(journal, "2.m2.test:2,", FALSE));
+	test_assert(test_journal_has_change(journal, "2.m2.test:2,S", TRUE));
+	test_assert(strcmp(test_mailbox_get_mails(box), "m1,m2/S,m3,m4") == 0);
+
+	/* unlink */
+	test_cur_unlink(box, "1.m1.test:2,");
+	test_assert(maildir_sync_journal_refresh(journal));
+	test_assert(test_journal_has_change(journal, "1.m1.test:2,", FALSE));
+	test_assert(strcmp(test_mailbox_get_mails(box), "m2/S,m3,m4") == 0);
+
+	/* all of them at once, including a file that is added and removed
+	   between syncs */
+	test_cur_add(box, "5.m5.test:2,", "m5");
+	test_cur_add(box, "6.m6.test:2,", "m6");
+	test_cur_rename(box, "3.m3.test:2,", "3.m3.test:2,S");
+	test_cur_unlink(box, "4.m4.test:2,");
+	test_cur_unlink(box, "6.m6.test:2,");
+	test_assert(maildir_sync_journal_refresh(journal));
+	test_assert(test_journal_has_change(journal, "6.m6.test:2,", FALSE));
+	test_assert(strcmp(test_mailbox_get_mails(box), "m2/S,m3/S,m5") == 0);
+
+	/* the incremental syncs consumed the changes */
+	test_assert(maildir_sync_journal_refresh(journal));
+	test_assert(!test_journal_has_change(journal, "5.m5.test:2,", TRUE));
+
+	test_mailbox_deinit(&box);
+	test_end();
+}
+
+static unsigned int test_inotify_max_queued_events(void)
+{
+	char buf[32];
+	unsigned int value;
+	FILE *f;
+
+	f = fopen(TEST_INOTIFY_MAX_QUEUED_EVENTS_PATH, "r");
+	if (f == NULL)
+		return 0;
+	if (fgets(buf, sizeof(buf), f) == NULL ||
+	    str_to_uint(t_strcut(buf, '\n'), &value) < 0)
+		value = 0;
+	fclose(f);
+	return value;
+}
+
+static void test_maildir_sync_journal_overflow(void)
+{
+	struct maildir_sync_journal *journal;
+	struct mailbox *box;
+	unsigned int i, max_events;
+
+	test_begin("maildir sync journal overflow");
+	max_events = test_inotify_max_queued_events();
+	if (max_events == 0 || max_events > 1024*1024) {
+		/* can't overflow the queue in a reasonable time */
+		test_end();
+		return;
+	}
+	box = test_mailbox_init();
+	journal = test_mailbox_journal(box);
+	if (journal == NULL) {
+		test_mailbox_deinit(&box);
+		test_end();
+		return;
+	}
+
+	test_cur_add(box, "4.m4.test:2,", "m4");
+	test_cur_rename(box, "2.m2.test:2,", "2.m2.test:2,S");
+	/* overflow the inotify queue with a hidden file, which is otherwise
+	   ignored by both the journal and the scan */
+	for (i = 0; i <= max_events / 2; i++) {
+		test_cur_add(box, ".overflow", "overflow");
+		test_cur_unlink(box, ".overflow");
+	}
+	test_cur_unlink(box, "1.m1.test:2,");
+
+	/* the journal lost the changes, so cur/ is scanned fully */
+	test_assert(!maildir_sync_journal_refresh(journal));
+	test_assert(strcmp(test_mailbox_get_mails(box), "m2/S,m3,m4") == 0);
+
+	/* the scan restarted the journal */
+	test_assert(maildir_sync_journal_refresh(journal));
+	test_cur_rename(box, "3.m3.test:2,", "3.m3.test:2,S");
+	test_assert(maildir_sync_journal_refresh(journal));
+	test_assert(strcmp(test_mailbox_get_mails(box), "m2/S,m3/S,m4") == 0);
+
+	test_mailbox_deinit(&box);
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*test_functions[])(void) = {
+		test_maildir_sync_journal_changes,
+		test_maildir_sync_journal_overflow,
+		NULL
+	};
+
+	test_ctx = test_mail_storage_init(&argc, &argv);
+	return test_run(test_functions);
+}
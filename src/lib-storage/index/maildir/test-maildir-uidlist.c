@@ -0,0 +1,373 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "str.h"
+#include "istream.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "mail-storage-private.h"
+#include "maildir-uidlist.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* offsets in the binary uidlist */
+#define TEST_BIN_COMPAT_FLAGS_OFFSET 3
+#define TEST_BIN_HDR_SIZE_OFFSET 4
+#define TEST_BIN_BLOCK_SIZE 8
+#define TEST_BIN_REC_SIZE 12
+
+static struct test_mail_storage_ctx *test_ctx;
+static unsigned int test_error_count;
+static char *test_last_error;
+
+static const char *const test_binary_input[] = {
+	"maildir_binary_uidlist=yes",
+	NULL
+};
+
+static void ATTR_FORMAT(2, 0)
+test_error_counter(const struct failure_context *ctx ATTR_UNUSED,
+		   const char *format, va_list args)
+{
+	test_error_count++;
+	i_free(test_last_error);
+	test_last_error = i_strdup_vprintf(format, args);
+}
+
+static failure_callback_t *test_expect_errors(void)
+{
+	failure_callback_t *fatal, *error, *info, *debug;
+
+	i_get_failure_handlers(&fatal, &error, &info, &debug);
+	i_set_error_handler(test_error_counter);
+	test_error_count = 0;
+	return error;
+}
+
+static struct mailbox *test_mailbox_init(void)
+{
+	struct test_mail_storage_settings set;
+	struct mailbox *box;
+	unsigned int i;
+
+	memset(&set, 0, sizeof(set));
+	set.driver = "maildir";
+	set.extra_input = test_binary_input;
+	test_mail_storage_init_user(test_ctx, &set);
+
+	box = test_mail_storage_mailbox_create(test_ctx, "INBOX");
+	for (i = 1; i <= 3; i++) {
+		(void)test_mail_storage_save(box,
+			t_strdup_printf("Subject: m%u\n", i), "body\n");
+	}
+	return box;
+}
+
+static void test_mailbox_deinit(struct mailbox **box)
+{
+	mailbox_free(box);
+	test_mail_storage_deinit_user(test_ctx);
+}
+
+static const char *test_uidlist_path(struct mailbox *box)
+{
+	const char *dir;
+
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_CONTROL, &dir) <= 0)
+		i_unreached();
+	return t_strconcat(dir, "/"MAILDIR_UIDLIST_NAME, NULL);
+}
+
+static buffer_t *test_uidlist_read(struct mailbox *box)
+{
+	const char *path = test_uidlist_path(box);
+	struct stat st;
+	buffer_t *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			i_fatal("open(%s) failed: %m", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+	buf = buffer_create_dynamic(pool_datastack_create(), st.st_size);
+	if (read_full(fd, buffer_append_space_unsafe(buf, st.st_size),
+		      st.st_size) <= 0)
+		i_fatal("read(%s) failed: %m", path);
+	i_close_fd(&fd);
+	return buf;
+}
+
+static void test_uidlist_write(struct mailbox *box, const buffer_t *buf)
+{
+	const char *path = test_uidlist_path(box);
+	int fd;
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write_full(fd, buf->data, buf->used) < 0)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static uint32_t test_bin_get32(const buffer_t *buf, size_t offset)
+{
+	uint32_t value;
+
+	i_assert(offset + sizeof(value) <= buf->used);
+	memcpy(&value, CONST_PTR_OFFSET(buf->data, offset), sizeof(value));
+	return value;
+}
+
+static void test_bin_swap32(buffer_t *buf, size_t offset)
+{
+	uint32_t value = test_bin_get32(buf, offset);
+
+	value = (value >> 24) | ((value >> 8) & 0xff00) |
+		((value << 8) & 0xff0000) | (value << 24);
+	buffer_write(buf, offset, &value, sizeof(value));
+}
+
+static uint8_t test_bin_compat_flags(const buffer_t *buf)
+{
+	return ((const uint8_t *)buf->data)[TEST_BIN_COMPAT_FLAGS_OFFSET];
+}
+
+/* Convert the binary uidlist to the other byte order. */
+static void test_bin_swap(buffer_t *buf)
+{
+	size_t pos;
+	uint32_t i, rec_count, strings_size;
+	uint8_t flags;
+
+	pos = test_bin_get32(buf, TEST_BIN_HDR_SIZE_OFFSET);
+	/* hdr_size, uid_validity, next_uid */
+	for (i = 0; i < 3; i++)
+		test_bin_swap32(buf, TEST_BIN_HDR_SIZE_OFFSET + i*4);
+	flags = test_bin_compat_flags(buf) ^ 0x01;
+	buffer_write(buf, TEST_BIN_COMPAT_FLAGS_OFFSET, &flags, 1);
+
+	while (pos < buf->used) {
+		rec_count = test_bin_get32(buf, pos);
+		strings_size = test_bin_get32(buf, pos + 4);
+		for (i = 0; i < 2 + rec_count*3; i++)
+			test_bin_swap32(buf, pos + i*4);
+		pos += TEST_BIN_BLOCK_SIZE + rec_count * TEST_BIN_REC_SIZE +
+			strings_size;
+	}
+	i_assert(pos == buf->used);
+}
+
+/* Returns the mailbox's messages as uid=subject list, or NULL if the
+   mailbox can't be synced. Reading the messages requires looking up their
+   filenames from the uidlist. */
+static const char *test_mailbox_get_mails(struct mailbox *box)
+{
+	struct mailbox_transaction_context *t;
+	struct mailbox_status status;
+	struct mail *mail;
+	struct istream *input;
+	const unsigned char *data;
+	const char *p;
+	string_t *str;
+	size_t size;
+	uint32_t seq;
+
+	if (mailbox_sync(box, 0) < 0)
+		return NULL;
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+
+	str = t_str_new(64);
+	t = mailbox_transaction_begin(box, 0);
+	mail = mail_alloc(t, 0, NULL);
+	for (seq = 1; seq <= status.messages; seq++) {
+		mail_set_seq(mail, seq);
+		if (str_len(str) > 0)
+			str_append_c(str, ',');
+		str_printfa(str, "%u=", mail->uid);
+		if (mail_get_stream(mail, NULL, NULL, &input) < 0) {
+			str_append(str, "?");
+			continue;
+		}
+		i_stream_seek(input, 0);
+		while (i_stream_read(input) > 0) ;
+		data = i_stream_get_data(input, &size);
+		p = t_strndup(data, size);
+		if (strncmp(p, "Subject: ", 9) == 0)
+			str_append(str, t_strcut(p + 9, '\n'));
+	}
+	mail_free(&mail);
+	(void)mailbox_transaction_commit(&t);
+	return str_c(str);
+}
+
+static struct mailbox *test_mailbox_reopen(struct mailbox **box)
+{
+	mailbox_free(box);
+	return test_mail_storage_mailbox_create(test_ctx, "INBOX");
+}
+
+static void test_maildir_uidlist_bin_roundtrip(void)
+{
+	struct mailbox *box;
+	buffer_t *buf;
+
+	test_begin("maildir uidlist binary round trip");
+	box = test_mailbox_init();
+	buf = test_uidlist_read(box);
+	test_assert(buf != NULL && buf->used > 3 &&
+		    memcmp(buf->data, "4 \n", 3) == 0);
+
+	box = test_mailbox_reopen(&box);
+	test_assert(strcmp(test_mailbox_get_mails(box),
+			   "1=m1,2=m2,3=m3") == 0);
+	(void)test_mail_storage_save(box, "Subject: m4\n", "body\n");
+	box = test_mailbox_reopen(&box);
+	test_assert(strcmp(test_mailbox_get_mails(box),
+			   "1=m1,2=m2,3=m3,4=m4") == 0);
+	test_mailbox_deinit(&box);
+	test_end();
+}
+
+static void test_maildir_uidlist_bin_byte_order(void)
+{
+	struct mailbox *box;
+	buffer_t *buf;
+	uint8_t native_flags;
+
+	test_begin("maildir uidlist binary byte order");
+	box = test_mailbox_init();
+	buf = test_uidlist_read(box);
+	native_flags = test_bin_compat_flags(buf);
+	test_bin_swap(buf);
+	test_uidlist_write(box, buf);
+
+	/* the file written by the other byte order is read without losing
+	   the UIDs */
+	box = test_mailbox_reopen(&box);
+	test_assert(strcmp(test_mailbox_get_mails(box),
+			   "1=m1,2=m2,3=m3") == 0);
+	/* ..and it's converted instead of appended to */
+	(void)test_mail_storage_save(box, "Subject: m4\n", "body\n");
+	buf = test_uidlist_read(box);
+	test_assert(buf != NULL && test_bin_compat_flags(buf) == native_flags);
+	box = test_mailbox_reopen(&box);
+	test_assert(strcmp(test_mailbox_get_mails(box),
+			   "1=m1,2=m2,3=m3,4=m4") == 0);
+	test_mailbox_deinit(&box);
+	test_end();
+}
+
+static void test_maildir_uidlist_bin_unknown_flags(void)
+{
+	failure_callback_t *orig_error;
+	struct mailbox *box;
+	buffer_t *buf;
+	uint8_t flags = 0x80;
+
+	test_begin("maildir uidlist binary unknown compat flags");
+	box = test_mailbox_init();
+	buf = test_uidlist_read(box);
+	buffer_write(buf, TEST_BIN_COMPAT_FLAGS_OFFSET, &flags, 1);
+	test_uidlist_write(box, buf);
+
+	/* the file is an error, but it's not deleted */
+	box = test_mailbox_reopen(&box);
+	orig_error = test_expect_errors();
+	(void)test_mailbox_get_mails(box);
+	i_set_error_handler(orig_error);
+	test_assert(test_error_count > 0 &&
+		    strstr(test_last_error, "compat flags") != NULL);
+	buf = test_uidlist_read(box);
+	test_assert(buf != NULL && test_bin_compat_flags(buf) == flags);
+	test_mailbox_deinit(&box);
+	test_end();
+}
+
+static void test_maildir_uidlist_bin_truncated(void)
+{
+	failure_callback_t *orig_error;
+	struct mailbox *box;
+	buffer_t *buf;
+
+	test_begin("maildir uidlist binary truncated");
+	box = test_mailbox_init();
+
+	/* a partially written block is ignored */
+	buf = test_uidlist_read(box);
+	buffer_set_used_size(buf, buf->used - 4);
+	test_uidlist_write(box, buf);
+	box = test_mailbox_reopen(&box);
+	test_assert(strncmp(test_mailbox_get_mails(box),
+			    "1=m1,2=m2,", 10) == 0);
+
+	/* a truncated header makes the file broken */
+	buf = test_uidlist_read(box);
+	buffer_set_used_size(buf, 10);
+	test_uidlist_write(box, buf);
+	box = test_mailbox_reopen(&box);
+	orig_error = test_expect_errors();
+	(void)test_mailbox_get_mails(box);
+	i_set_error_handler(orig_error);
+	test_assert(test_error_count > 0);
+	/* the messages are still found */
+	box = test_mailbox_reopen(&box);
+	test_assert(strlen(test_mailbox_get_mails(box)) > 0);
+	test_mailbox_deinit(&box);
+	test_end();
+}
+
+static void test_maildir_uidlist_bin_corrupted(void)
+{
+	failure_callback_t *orig_error;
+	struct mailbox *box;
+	buffer_t *buf;
+	uint32_t hdr_size, offset = 0xfffffff0U;
+
+	test_begin("maildir uidlist binary corrupted");
+	box = test_mailbox_init();
+
+	/* first record's filename offset */
+	buf = test_uidlist_read(box);
+	hdr_size = test_bin_get32(buf, TEST_BIN_HDR_SIZE_OFFSET);
+	buffer_write(buf, hdr_size + TEST_BIN_BLOCK_SIZE + 4,
+		     &offset, sizeof(offset));
+	test_uidlist_write(box, buf);
+
+	box = test_mailbox_reopen(&box);
+	orig_error = test_expect_errors();
+	(void)test_mailbox_get_mails(box);
+	i_set_error_handler(orig_error);
+	test_assert(test_error_count > 0);
+	box = test_mailbox_reopen(&box);
+	test_assert(strlen(test_mailbox_get_mails(box)) > 0);
+	test_mailbox_deinit(&box);
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*test_functions[])(void) = {
+		test_maildir_uidlist_bin_roundtrip,
+		test_maildir_uidlist_bin_byte_order,
+		test_maildir_uidlist_bin_unknown_flags,
+		test_maildir_uidlist_bin_truncated,
+		test_maildir_uidlist_bin_corrupted,
+		NULL
+	};
+	int ret;
+
+	test_ctx = test_mail_storage_init(&argc, &argv);
+	ret = test_run(test_functions);
+	i_free(test_last_error);
+	return ret;
+}
@@ -787,10 +787,8 @@ int mbox_transaction_save_commit_pre(struct mail_save_context *_ctx)
 		if (ret == 0) {
 			mbox->mbox_hdr.sync_mtime = st.st_mtime;
 			mbox->mbox_hdr.sync_size = st.st_size;
-			mail_index_update_header_ext(ctx->trans,
-						     mbox->mbox_ext_idx,
-						     0, &mbox->mbox_hdr,
-						     sizeof(mbox->mbox_hdr));
+			mbox_sync_update_tail(mbox, st.st_size);
+			mbox_sync_index_update_ext_header(mbox, ctx->trans);
 		}
 	}
 
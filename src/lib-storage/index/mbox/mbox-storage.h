@@ -21,6 +21,11 @@ struct mbox_index_header {
 	uint8_t dirty_flag;
 	uint8_t unused[3];
 	guid_128_t mailbox_guid;
+	/* CRC32 of the last sync_tail_size bytes before sync_size. Used to
+	   verify that new mails were only appended to the file since the last
+	   sync. sync_tail_size=0 if it's unknown. */
+	uint32_t sync_tail_crc32;
+	uint32_t sync_tail_size;
 };
 
 struct mbox_list_index_record {
@@ -148,6 +148,9 @@ struct mbox_sync_context {
 	unsigned int ext_modified:1;
 	unsigned int index_reset:1;
 	unsigned int errors:1;
+	/* the file's tail was verified to be unchanged, so only new mails
+	   were appended to it */
+	unsigned int appends_only:1;
 };
 
 int mbox_sync_header_refresh(struct mbox_mailbox *mbox);
@@ -182,6 +185,11 @@ void mbox_sync_move_buffer(struct mbox_sync_mail_context *ctx,
 void mbox_sync_headers_add_space(struct mbox_sync_mail_context *ctx,
 				 size_t size);
 int mbox_sync_get_guid(struct mbox_mailbox *mbox);
+/* Update mbox_hdr's sync_tail_* fields for a file of given size. */
+void mbox_sync_update_tail(struct mbox_mailbox *mbox, uoff_t size);
+/* Write mbox_hdr to the index, resizing the header if needed. */
+void mbox_sync_index_update_ext_header(struct mbox_mailbox *mbox,
+				       struct mail_index_transaction *trans);
 
 int mbox_list_index_has_changed(struct mailbox *box,
 				struct mail_index_view *list_view,
@@ -39,6 +39,7 @@
 #include "istream.h"
 #include "file-set-size.h"
 #include "str.h"
+#include "crc32.h"
 #include "read-full.h"
 #include "write-full.h"
 #include "message-date.h"
@@ -56,6 +57,10 @@
 #include <utime.h>
 #include <sys/stat.h>
 
+/* How many bytes from the end of the file to checksum for detecting whether
+   the file was only appended to. */
+#define MBOX_SYNC_TAIL_SIZE 4096
+
 /* The text below was taken exactly as c-client wrote it to my mailbox,
    so it's probably copyrighted by University of Washington. */
 #define PSEUDO_MESSAGE_BODY \
@@ -965,8 +970,10 @@ static int mbox_sync_partial_seek_next(struct mbox_sync_context *sync_ctx,
 		ret = mbox_sync_seek_to_uid(sync_ctx, next_uid);
 	} else {
 		/* if there's no sync records left, we can stop. except if
-		   this is a dirty sync, check if there are new messages. */
-		if (!sync_ctx->mbox->mbox_hdr.dirty_flag)
+		   this is a dirty sync or mails were appended, check if there
+		   are new messages. */
+		if (!sync_ctx->mbox->mbox_hdr.dirty_flag &&
+		    !sync_ctx->appends_only)
 			return 0;
 
 		messages_count =
@@ -1422,9 +1429,8 @@ static int mbox_sync_handle_eof_updates(struct mbox_sync_context *sync_ctx,
 	return 0;
 }
 
-static void
-mbox_sync_index_update_ext_header(struct mbox_mailbox *mbox,
-				  struct mail_index_transaction *trans)
+void mbox_sync_index_update_ext_header(struct mbox_mailbox *mbox,
+				       struct mail_index_transaction *trans)
 {
 	const struct mailbox_update *update = mbox->sync_hdr_update;
 	const void *data;
@@ -1463,6 +1469,67 @@ static uint32_t mbox_get_uidvalidity_next(struct mailbox_list *list)
 	return mailbox_uidvalidity_next(list, path);
 }
 
+static int
+mbox_sync_tail_crc32(struct mbox_mailbox *mbox, uoff_t size,
+		     uint32_t tail_size, uint32_t *crc_r)
+{
+	unsigned char buf[MBOX_SYNC_TAIL_SIZE];
+	int ret;
+
+	i_assert(tail_size <= sizeof(buf) && tail_size <= size);
+
+	ret = pread_full(mbox->mbox_fd, buf, tail_size, size - tail_size);
+	if (ret < 0) {
+		mbox_set_syscall_error(mbox, "pread_full()");
+		return -1;
+	}
+	if (ret == 0) {
+		/* file was truncated */
+		return 0;
+	}
+	*crc_r = crc32_data(buf, tail_size);
+	return 1;
+}
+
+void mbox_sync_update_tail(struct mbox_mailbox *mbox, uoff_t size)
+{
+	struct mbox_index_header *mbox_hdr = &mbox->mbox_hdr;
+	uint32_t tail_size = I_MIN(size, MBOX_SYNC_TAIL_SIZE);
+
+	mbox_hdr->sync_tail_crc32 = 0;
+	mbox_hdr->sync_tail_size = 0;
+	if (mbox->mbox_fd == -1 || tail_size == 0) {
+		/* read-only stream or an empty file */
+		return;
+	}
+	if (mbox_sync_tail_crc32(mbox, size, tail_size,
+				 &mbox_hdr->sync_tail_crc32) > 0)
+		mbox_hdr->sync_tail_size = tail_size;
+}
+
+static bool
+mbox_sync_file_is_appended(struct mbox_sync_context *sync_ctx,
+			   const struct stat *st)
+{
+	struct mbox_mailbox *mbox = sync_ctx->mbox;
+	const struct mbox_index_header *mbox_hdr = &mbox->mbox_hdr;
+	uint32_t crc;
+
+	if (mbox_hdr->dirty_flag || mbox->mbox_fd == -1 ||
+	    mbox_hdr->sync_tail_size == 0 ||
+	    mbox_hdr->sync_tail_size > MBOX_SYNC_TAIL_SIZE ||
+	    mbox_hdr->sync_tail_size > mbox_hdr->sync_size ||
+	    (uint64_t)st->st_size <= mbox_hdr->sync_size)
+		return FALSE;
+
+	/* the file grew. if the data at the old end of file is still the
+	   same, assume that the existing mails weren't modified. */
+	if (mbox_sync_tail_crc32(mbox, mbox_hdr->sync_size,
+				 mbox_hdr->sync_tail_size, &crc) <= 0)
+		return FALSE;
+	return crc == mbox_hdr->sync_tail_crc32;
+}
+
 static int mbox_sync_update_index_header(struct mbox_sync_context *sync_ctx)
 {
 	struct mail_index_view *view;
@@ -1507,6 +1574,7 @@ static int mbox_sync_update_index_header(struct mbox_sync_context *sync_ctx)
 
 	sync_ctx->mbox->mbox_hdr.sync_mtime = st->st_mtime;
 	sync_ctx->mbox->mbox_hdr.sync_size = st->st_size;
+	mbox_sync_update_tail(sync_ctx->mbox, st->st_size);
 	mbox_sync_index_update_ext_header(sync_ctx->mbox, sync_ctx->t);
 
 	/* only reason not to have UID validity at this point is if the file
@@ -1622,6 +1690,11 @@ static int mbox_sync_do(struct mbox_sync_context *sync_ctx,
 			partial = FALSE;
 		else
 			partial = TRUE;
+	} else if (mbox_sync_file_is_appended(sync_ctx, st)) {
+		/* only new mails were appended. the existing mails don't
+		   need to be read, and the mailbox doesn't become dirty. */
+		partial = TRUE;
+		sync_ctx->appends_only = TRUE;
 	} else if ((flags & MBOX_SYNC_UNDIRTY) != 0 ||
 		   (uint64_t)st->st_size == mbox_hdr->sync_size) {
 		/* we want to do full syncing. always do this if
@@ -1661,6 +1734,7 @@ static int mbox_sync_do(struct mbox_sync_context *sync_ctx,
 
 		mbox_sync_restart(sync_ctx);
 		partial = FALSE;
+		sync_ctx->appends_only = FALSE;
 	}
 
 	if (mbox_sync_handle_eof_updates(sync_ctx, &mail_ctx) < 0)
@@ -1704,6 +1778,9 @@ int mbox_sync_header_refresh(struct mbox_mailbox *mbox)
 		return 0;
 	}
 
+	/* the header may have been written by an older version with less
+	   fields */
+	memset(&mbox->mbox_hdr, 0, sizeof(mbox->mbox_hdr));
 	memcpy(&mbox->mbox_hdr, data, I_MIN(sizeof(mbox->mbox_hdr), data_size));
 	if (mbox->mbox_broken_offsets)
 		mbox->mbox_hdr.dirty_flag = TRUE;
@@ -1,6 +1,7 @@
 /* Copyright (c) 2011-2015 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "ioloop.h"
 #include "net.h"
 #include "istream.h"
@@ -38,6 +39,13 @@ enum pop3c_client_state {
 	POP3C_CLIENT_STATE_DONE
 };
 
+struct pop3c_client_cmd {
+	pop3c_cmd_callback_t *callback;
+	void *context;
+	/* +OK reply is followed by a dot-terminated multiline reply */
+	bool reply_stream;
+};
+
 struct pop3c_client {
 	pool_t pool;
 	struct pop3c_client_settings set;
@@ -58,7 +66,8 @@ struct pop3c_client {
 	pop3c_login_callback_t *login_callback;
 	void *login_context;
 
-	unsigned int async_commands;
+	/* commands sent to server, but whose replies haven't been read yet */
+	ARRAY(struct pop3c_client_cmd *) cmd_queue;
 	const char *input_line;
 	struct istream *dot_input;
 
@@ -94,6 +103,7 @@ pop3c_client_init(const struct pop3c_client_settings *set)
 		p_strdup(pool, set->dns_client_socket_path);
 	client->set.temp_path_prefix = p_strdup(pool, set->temp_path_prefix);
 	client->set.rawlog_dir = p_strdup(pool, set->rawlog_dir);
+	p_array_init(&client->cmd_queue, pool, 16);
 
 	if (set->ssl_mode != POP3C_CLIENT_SSL_MODE_NONE) {
 		client->set.ssl_mode = set->ssl_mode;
@@ -130,10 +140,25 @@ client_login_callback(struct pop3c_client *client,
 	}
 }
 
+static void pop3c_client_abort_cmds(struct pop3c_client *client)
+{
+	struct pop3c_client_cmd *const *cmdp, *cmd;
+
+	while (array_count(&client->cmd_queue) > 0) {
+		cmdp = array_idx(&client->cmd_queue, 0);
+		cmd = *cmdp;
+		array_delete(&client->cmd_queue, 0, 1);
+		if (cmd->callback != NULL) {
+			cmd->callback(POP3C_COMMAND_STATE_DISCONNECTED,
+				      "Disconnected", NULL, cmd->context);
+		}
+		i_free(cmd);
+	}
+}
+
 static void pop3c_client_disconnect(struct pop3c_client *client)
 {
 	client->state = POP3C_CLIENT_STATE_DISCONNECTED;
-	client->async_commands = 0;
 
 	if (client->running)
 		io_loop_stop(current_ioloop);
@@ -157,6 +182,7 @@ static void pop3c_client_disconnect(struct pop3c_client *client)
 	}
 	client_login_callback(client, POP3C_COMMAND_STATE_DISCONNECTED,
 			      "Disconnected");
+	pop3c_client_abort_cmds(client);
 }
 
 void pop3c_client_deinit(struct pop3c_client **_client)
@@ -676,68 +702,6 @@ pop3c_client_read_line(struct pop3c_client *client,
 	return 0;
 }
 
-static int
-pop3c_client_flush_asyncs(struct pop3c_client *client, const char **error_r)
-{
-	const char *line;
-
-	if (client->state != POP3C_CLIENT_STATE_DONE) {
-		i_assert(client->state == POP3C_CLIENT_STATE_DISCONNECTED);
-		*error_r = "Disconnected";
-		return -1;
-	}
-
-	while (client->async_commands > 0) {
-		if (pop3c_client_read_line(client, &line, error_r) < 0)
-			return -1;
-		client->async_commands--;
-	}
-	return 0;
-}
-
-int pop3c_client_cmd_line(struct pop3c_client *client, const char *cmd,
-			  const char **reply_r)
-{
-	const char *line;
-	int ret;
-
-	if (pop3c_client_flush_asyncs(client, reply_r) < 0)
-		return -1;
-	o_stream_nsend_str(client->output, cmd);
-	if (pop3c_client_read_line(client, &line, reply_r) < 0)
-		return -1;
-	if (strncasecmp(line, "+OK", 3) == 0) {
-		*reply_r = line + 3;
-		ret = 0;
-	} else if (strncasecmp(line, "-ERR", 4) == 0) {
-		*reply_r = line + 4;
-		ret = -1;
-	} else {
-		*reply_r = line;
-		ret = -1;
-	}
-	if (**reply_r == ' ')
-		*reply_r += 1;
-	return ret;
-}
-
-void pop3c_client_cmd_line_async(struct pop3c_client *client, const char *cmd)
-{
-	const char *error;
-
-	if (client->state != POP3C_CLIENT_STATE_DONE) {
-		i_assert(client->state == POP3C_CLIENT_STATE_DISCONNECTED);
-		return;
-	}
-
-	if ((client->capabilities & POP3C_CAPABILITY_PIPELINING) == 0) {
-		if (pop3c_client_flush_asyncs(client, &error) < 0)
-			return;
-	}
-	o_stream_nsend_str(client->output, cmd);
-	client->async_commands++;
-}
-
 static int seekable_fd_callback(const char **path_r, void *context)
 {
 	struct pop3c_client *client = context;
@@ -786,17 +750,12 @@ static void pop3c_client_dot_input(struct pop3c_client *client)
 	}
 }
 
-int pop3c_client_cmd_stream(struct pop3c_client *client, const char *cmd,
-			    struct istream **input_r, const char **error_r)
+static int
+pop3c_client_read_dot_stream(struct pop3c_client *client,
+			     struct istream **input_r, const char **error_r)
 {
 	struct istream *inputs[2];
 
-	*input_r = NULL;
-
-	/* read the +OK / -ERR */
-	if (pop3c_client_cmd_line(client, cmd, error_r) < 0)
-		return -1;
-	/* read the stream */
 	inputs[0] = i_stream_create_dot(client->input, TRUE);
 	inputs[1] = NULL;
 	client->dot_input =
@@ -828,3 +787,167 @@ int pop3c_client_cmd_stream(struct pop3c_client *client, const char *cmd,
 	client->dot_input = NULL;
 	return 0;
 }
+
+static enum pop3c_command_state
+pop3c_client_parse_reply(const char *line, const char **reply_r)
+{
+	enum pop3c_command_state state;
+
+	if (strncasecmp(line, "+OK", 3) == 0) {
+		*reply_r = line + 3;
+		state = POP3C_COMMAND_STATE_OK;
+	} else if (strncasecmp(line, "-ERR", 4) == 0) {
+		*reply_r = line + 4;
+		state = POP3C_COMMAND_STATE_ERR;
+	} else {
+		*reply_r = line;
+		state = POP3C_COMMAND_STATE_ERR;
+	}
+	if (**reply_r == ' ')
+		*reply_r += 1;
+	return state;
+}
+
+static int
+pop3c_client_read_next_reply(struct pop3c_client *client, const char **error_r)
+{
+	struct pop3c_client_cmd *const *cmdp, *cmd;
+	enum pop3c_command_state state;
+	struct istream *input = NULL;
+	const char *line, *reply;
+
+	cmdp = array_idx(&client->cmd_queue, 0);
+	cmd = *cmdp;
+
+	/* if we get disconnected, the command is aborted along with all the
+	   other queued commands. so don't access it after failures. */
+	if (pop3c_client_read_line(client, &line, error_r) < 0)
+		return -1;
+	state = pop3c_client_parse_reply(line, &reply);
+	if (state == POP3C_COMMAND_STATE_OK && cmd->reply_stream) {
+		if (pop3c_client_read_dot_stream(client, &input, error_r) < 0)
+			return -1;
+	}
+
+	array_delete(&client->cmd_queue, 0, 1);
+	if (cmd->callback != NULL)
+		cmd->callback(state, reply, input, cmd->context);
+	if (input != NULL)
+		i_stream_unref(&input);
+	i_free(cmd);
+	return 0;
+}
+
+static int
+pop3c_client_flush_asyncs(struct pop3c_client *client, const char **error_r)
+{
+	if (client->state != POP3C_CLIENT_STATE_DONE) {
+		i_assert(client->state == POP3C_CLIENT_STATE_DISCONNECTED);
+		*error_r = "Disconnected";
+		return -1;
+	}
+
+	while (array_count(&client->cmd_queue) > 0) {
+		if (pop3c_client_read_next_reply(client, error_r) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int pop3c_client_cmd_line(struct pop3c_client *client, const char *cmd,
+			  const char **reply_r)
+{
+	const char *line;
+
+	if (pop3c_client_flush_asyncs(client, reply_r) < 0)
+		return -1;
+	o_stream_nsend_str(client->output, cmd);
+	if (pop3c_client_read_line(client, &line, reply_r) < 0)
+		return -1;
+	return pop3c_client_parse_reply(line, reply_r) ==
+		POP3C_COMMAND_STATE_OK ? 0 : -1;
+}
+
+static struct pop3c_client_cmd *
+pop3c_client_cmd_send_async(struct pop3c_client *client, const char *cmdline)
+{
+	struct pop3c_client_cmd *cmd;
+	const char *error;
+
+	if (client->state != POP3C_CLIENT_STATE_DONE) {
+		i_assert(client->state == POP3C_CLIENT_STATE_DISCONNECTED);
+		return NULL;
+	}
+
+	if ((client->capabilities & POP3C_CAPABILITY_PIPELINING) == 0) {
+		if (pop3c_client_flush_asyncs(client, &error) < 0)
+			return NULL;
+	}
+	o_stream_nsend_str(client->output, cmdline);
+
+	cmd = i_new(struct pop3c_client_cmd, 1);
+	array_append(&client->cmd_queue, &cmd, 1);
+	return cmd;
+}
+
+void pop3c_client_cmd_line_async(struct pop3c_client *client, const char *cmd)
+{
+	(void)pop3c_client_cmd_send_async(client, cmd);
+}
+
+struct pop3c_client_cmd *
+pop3c_client_cmd_stream_async(struct pop3c_client *client, const char *cmdline,
+			      pop3c_cmd_callback_t *callback, void *context)
+{
+	struct pop3c_client_cmd *cmd;
+
+	cmd = pop3c_client_cmd_send_async(client, cmdline);
+	if (cmd != NULL) {
+		cmd->reply_stream = TRUE;
+		cmd->callback = callback;
+		cmd->context = context;
+	}
+	return cmd;
+}
+
+void pop3c_client_cmd_wait(struct pop3c_client *client,
+			   struct pop3c_client_cmd *cmd)
+{
+	struct pop3c_client_cmd *const *cmdp;
+	const char *error;
+	bool found = TRUE;
+
+	while (found) {
+		found = FALSE;
+		array_foreach(&client->cmd_queue, cmdp) {
+			if (*cmdp == cmd) {
+				found = TRUE;
+				break;
+			}
+		}
+		if (found && pop3c_client_read_next_reply(client, &error) < 0)
+			break;
+	}
+}
+
+void pop3c_client_cmd_abort(struct pop3c_client_cmd **_cmd)
+{
+	struct pop3c_client_cmd *cmd = *_cmd;
+
+	*_cmd = NULL;
+	/* the reply still needs to be read, but it's just discarded */
+	cmd->callback = NULL;
+	cmd->context = NULL;
+}
+
+int pop3c_client_cmd_stream(struct pop3c_client *client, const char *cmd,
+			    struct istream **input_r, const char **error_r)
+{
+	*input_r = NULL;
+
+	/* read the +OK / -ERR */
+	if (pop3c_client_cmd_line(client, cmd, error_r) < 0)
+		return -1;
+	/* read the stream */
+	return pop3c_client_read_dot_stream(client, input_r, error_r);
+}
@@ -41,6 +41,10 @@ struct pop3c_client_settings {
 
 typedef void pop3c_login_callback_t(enum pop3c_command_state state,
 				    const char *reply, void *context);
+/* input is non-NULL only for successful multiline replies. */
+typedef void pop3c_cmd_callback_t(enum pop3c_command_state state,
+				  const char *reply, struct istream *input,
+				  void *context);
 
 struct pop3c_client *
 pop3c_client_init(const struct pop3c_client_settings *set);
@@ -66,4 +70,20 @@ void pop3c_client_cmd_line_async(struct pop3c_client *client, const char *cmd);
 int pop3c_client_cmd_stream(struct pop3c_client *client, const char *cmd,
 			    struct istream **input_r, const char **error_r);
 
+/* Send a command with a multiline reply without waiting for the reply. If the
+   server supports PIPELINING, multiple commands can be in flight at the same
+   time. The replies are read in order when they're waited for, and the
+   callback is called once the whole reply has been read. The callback needs
+   to reference the input stream if it wants to keep it. Returns NULL if
+   disconnected. */
+struct pop3c_client_cmd *
+pop3c_client_cmd_stream_async(struct pop3c_client *client, const char *cmd,
+			      pop3c_cmd_callback_t *callback, void *context);
+/* Wait until the command's callback has been called. */
+void pop3c_client_cmd_wait(struct pop3c_client *client,
+			   struct pop3c_client_cmd *cmd);
+/* Don't call the command's callback. Its reply is still read and discarded
+   before the following commands' replies. */
+void pop3c_client_cmd_abort(struct pop3c_client_cmd **cmd);
+
 #endif
@@ -9,6 +9,89 @@
 #include "pop3c-sync.h"
 #include "pop3c-storage.h"
 
+struct mail *
+pop3c_mail_alloc(struct mailbox_transaction_context *t,
+		 enum mail_fetch_field wanted_fields,
+		 struct mailbox_header_lookup_ctx *wanted_headers)
+{
+	struct pop3c_mail *mail;
+	pool_t pool;
+
+	pool = pool_alloconly_create("mail", 2048);
+	mail = p_new(pool, struct pop3c_mail, 1);
+	mail->imail.mail.pool = pool;
+
+	index_mail_init(&mail->imail, t, wanted_fields, wanted_headers);
+	return &mail->imail.mail.mail;
+}
+
+static void pop3c_mail_close(struct mail *_mail)
+{
+	struct pop3c_mail *mail = (struct pop3c_mail *)_mail;
+
+	if (mail->prefetch_cmd != NULL)
+		pop3c_client_cmd_abort(&mail->prefetch_cmd);
+	if (mail->prefetch_stream != NULL)
+		i_stream_unref(&mail->prefetch_stream);
+	mail->prefetch_body = FALSE;
+	index_mail_close(_mail);
+}
+
+static void
+pop3c_mail_prefetch_callback(enum pop3c_command_state state ATTR_UNUSED,
+			     const char *reply ATTR_UNUSED,
+			     struct istream *input, void *context)
+{
+	struct pop3c_mail *mail = context;
+
+	mail->prefetch_cmd = NULL;
+	mail->imail.data.prefetch_pending = FALSE;
+	/* if the command failed, it's retried (and the error is handled)
+	   when the stream is actually needed */
+	if (input != NULL) {
+		i_stream_ref(input);
+		mail->prefetch_stream = input;
+	}
+}
+
+static bool pop3c_mail_prefetch(struct mail *_mail)
+{
+	struct pop3c_mail *mail = (struct pop3c_mail *)_mail;
+	struct pop3c_mailbox *mbox = (struct pop3c_mailbox *)_mail->box;
+	struct index_mail_data *data = &mail->imail.data;
+	enum pop3c_capability capa;
+	const char *cmd;
+
+	if (data->stream != NULL || mail->prefetch_cmd != NULL ||
+	    mail->prefetch_stream != NULL ||
+	    (data->access_part & (READ_HDR | READ_BODY |
+				  PARSE_HDR | PARSE_BODY)) == 0)
+		return TRUE;
+
+	/* without PIPELINING the command would have to be waited for
+	   immediately, so there's no point in prefetching */
+	capa = pop3c_client_get_capabilities(mbox->client);
+	if ((capa & POP3C_CAPABILITY_PIPELINING) == 0)
+		return TRUE;
+
+	if ((data->access_part & (READ_BODY | PARSE_BODY)) != 0 ||
+	    (capa & POP3C_CAPABILITY_TOP) == 0) {
+		cmd = t_strdup_printf("RETR %u\r\n", _mail->seq);
+		mail->prefetch_body = TRUE;
+	} else {
+		cmd = t_strdup_printf("TOP %u 0\r\n", _mail->seq);
+	}
+	mail->prefetch_cmd =
+		pop3c_client_cmd_stream_async(mbox->client, cmd,
+					      pop3c_mail_prefetch_callback,
+					      mail);
+	if (mail->prefetch_cmd == NULL)
+		return TRUE;
+	data->prefetch_sent = TRUE;
+	data->prefetch_pending = TRUE;
+	return FALSE;
+}
+
 static int pop3c_mail_get_received_date(struct mail *_mail, time_t *date_r)
 {
 	struct pop3c_mailbox *mbox = (struct pop3c_mailbox *)_mail->box;
@@ -105,7 +188,8 @@ pop3c_mail_get_stream(struct mail *_mail, bool get_body,
 		      struct message_size *hdr_size,
 		      struct message_size *body_size, struct istream **stream_r)
 {
-	struct index_mail *mail = (struct index_mail *)_mail;
+	struct pop3c_mail *pmail = (struct pop3c_mail *)_mail;
+	struct index_mail *mail = &pmail->imail;
 	struct pop3c_mailbox *mbox = (struct pop3c_mailbox *)_mail->box;
 	enum pop3c_capability capa;
 	const char *name, *cmd, *error;
@@ -132,8 +216,27 @@ pop3c_mail_get_stream(struct mail *_mail, bool get_body,
 		} else {
 			cmd = t_strdup_printf("TOP %u 0\r\n", _mail->seq);
 		}
-		if (pop3c_client_cmd_stream(mbox->client, cmd,
-					    &input, &error) < 0) {
+		if (pmail->prefetch_cmd != NULL) {
+			/* wait for the pipelined reply */
+			pop3c_client_cmd_wait(mbox->client, pmail->prefetch_cmd);
+			if (pmail->prefetch_cmd != NULL)
+				pop3c_client_cmd_abort(&pmail->prefetch_cmd);
+		}
+		if (pmail->prefetch_stream != NULL &&
+		    !pmail->prefetch_body && get_body) {
+			/* prefetched only the header, but we need the body */
+			i_stream_unref(&pmail->prefetch_stream);
+		}
+		if (pmail->prefetch_stream != NULL) {
+			if (pmail->prefetch_body) {
+				cmd = t_strdup_printf("RETR %u\r\n",
+						      _mail->seq);
+				get_body = TRUE;
+			}
+			input = pmail->prefetch_stream;
+			pmail->prefetch_stream = NULL;
+		} else if (pop3c_client_cmd_stream(mbox->client, cmd,
+						   &input, &error) < 0) {
 			mail_storage_set_error(mbox->box.storage,
 				!pop3c_client_is_connected(mbox->client) ?
 				MAIL_ERROR_TEMP : MAIL_ERROR_EXPUNGED, error);
@@ -176,12 +279,12 @@ pop3c_mail_get_special(struct mail *_mail, enum mail_fetch_field field,
 }
 
 struct mail_vfuncs pop3c_mail_vfuncs = {
-	index_mail_close,
+	pop3c_mail_close,
 	index_mail_free,
 	index_mail_set_seq,
 	index_mail_set_uid,
 	index_mail_set_uid_cache_updates,
-	index_mail_prefetch,
+	pop3c_mail_prefetch,
 	index_mail_precache,
 	index_mail_add_temp_wanted_fields,
 
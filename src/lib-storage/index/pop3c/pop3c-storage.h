@@ -2,6 +2,7 @@
 #define POP3C_STORAGE_H
 
 #include "index-storage.h"
+#include "index-mail.h"
 
 #define POP3C_STORAGE_NAME "pop3c"
 
@@ -10,6 +11,15 @@ struct pop3c_storage {
 	const struct pop3c_settings *set;
 };
 
+struct pop3c_mail {
+	struct index_mail imail;
+
+	/* RETR/TOP command pipelined by prefetching */
+	struct pop3c_client_cmd *prefetch_cmd;
+	struct istream *prefetch_stream;
+	unsigned int prefetch_body:1;
+};
+
 struct pop3c_mailbox {
 	struct mailbox box;
 	struct pop3c_storage *storage;
@@ -31,4 +41,9 @@ struct pop3c_mailbox {
 
 extern struct mail_vfuncs pop3c_mail_vfuncs;
 
+struct mail *
+pop3c_mail_alloc(struct mailbox_transaction_context *t,
+		 enum mail_fetch_field wanted_fields,
+		 struct mailbox_header_lookup_ctx *wanted_headers);
+
 #endif
@@ -0,0 +1,418 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "array.h"
+#include "net.h"
+#include "str.h"
+#include "istream.h"
+#include "write-full.h"
+#include "pop3c-client.h"
+#include "test-common.h"
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define TEST_MAIL_COUNT 3
+
+struct test_server_conn {
+	int fd;
+	struct istream *input;
+	struct io *io;
+	/* RETR/TOP replies that haven't been sent yet */
+	ARRAY(char *) replies;
+};
+
+struct test_cmd {
+	unsigned int idx;
+	struct pop3c_client_cmd *cmd;
+
+	unsigned int callback_count;
+	enum pop3c_command_state state;
+	char *reply;
+	string_t *body;
+};
+
+static int test_server_listen_fd;
+static unsigned int test_server_port;
+static pid_t test_server_pid;
+
+static string_t *test_callback_order;
+static unsigned int test_error_count;
+
+static void test_server_send(struct test_server_conn *conn, const char *str,
+			     size_t size)
+{
+	if (write_full(conn->fd, str, size) < 0)
+		i_fatal("write() failed: %m");
+}
+
+static void test_server_send_str(struct test_server_conn *conn,
+				 const char *str)
+{
+	test_server_send(conn, str, strlen(str));
+}
+
+static void test_server_disconnect(struct test_server_conn *conn)
+{
+	char **replyp;
+
+	array_foreach_modifiable(&conn->replies, replyp)
+		i_free(*replyp);
+	array_free(&conn->replies);
+	io_remove(&conn->io);
+	i_stream_unref(&conn->input);
+	i_close_fd(&conn->fd);
+	i_free(conn);
+}
+
+static const char *test_server_get_reply(const char *cmd, const char *arg)
+{
+	unsigned int num;
+
+	if (str_to_uint(arg, &num) < 0 || num == 0 || num > TEST_MAIL_COUNT)
+		return "-ERR No such message\r\n";
+	if (strcasecmp(cmd, "TOP") == 0)
+		return t_strdup_printf("+OK\r\nSubject: m%u\r\n\r\n.\r\n", num);
+	return t_strdup_printf("+OK\r\nSubject: m%u\r\n\r\nbody %u\r\n.\r\n",
+			       num, num);
+}
+
+/* Returns FALSE if the connection was closed. */
+static bool
+test_server_command(struct test_server_conn *conn, const char *line)
+{
+	const char *const *args = t_strsplit(line, " ");
+	const char *cmd = args[0];
+	char *reply, **replies;
+	unsigned int i, count;
+
+	if (strcasecmp(cmd, "USER") == 0)
+		test_server_send_str(conn, "+OK\r\n");
+	else if (strcasecmp(cmd, "PASS") == 0)
+		test_server_send_str(conn, "+OK Logged in\r\n");
+	else if (strcasecmp(cmd, "CAPA") == 0) {
+		test_server_send_str(conn, "+OK\r\nTOP\r\nUIDL\r\n"
+				     "PIPELINING\r\n.\r\n");
+	} else if (strcasecmp(cmd, "RETR") == 0 ||
+		   strcasecmp(cmd, "TOP") == 0) {
+		/* the replies are sent only after NOOP, so the commands
+		   must have been pipelined for the client to see them */
+		reply = i_strdup(test_server_get_reply(cmd,
+				args[1] == NULL ? "" : args[1]));
+		array_append(&conn->replies, &reply, 1);
+	} else if (strcasecmp(cmd, "NOOP") == 0) {
+		replies = array_get_modifiable(&conn->replies, &count);
+		for (i = 0; i < count; i++) {
+			test_server_send_str(conn, replies[i]);
+			i_free(replies[i]);
+		}
+		array_clear(&conn->replies);
+		test_server_send_str(conn, "+OK\r\n");
+	} else if (strcasecmp(cmd, "QUIT") == 0) {
+		/* send the first reply fully, cut the second one before its
+		   body ends and disconnect with the rest in flight */
+		replies = array_get_modifiable(&conn->replies, &count);
+		if (count > 0)
+			test_server_send_str(conn, replies[0]);
+		if (count > 1) {
+			test_server_send(conn, replies[1], strlen(replies[1]) -
+					 strlen("\r\n.\r\n") - 1);
+		}
+		test_server_disconnect(conn);
+		return FALSE;
+	} else {
+		test_server_send_str(conn, "-ERR Unknown command\r\n");
+	}
+	return TRUE;
+}
+
+static void test_server_input(struct test_server_conn *conn)
+{
+	const char *line;
+	bool connected = TRUE;
+
+	while (connected &&
+	       (line = i_stream_read_next_line(conn->input)) != NULL) T_BEGIN {
+		connected = test_server_command(conn, line);
+	} T_END;
+	if (!connected)
+		return;
+	if (conn->input->eof || conn->input->stream_errno != 0)
+		test_server_disconnect(conn);
+}
+
+static void test_server_accept(void *context ATTR_UNUSED)
+{
+	struct test_server_conn *conn;
+	int fd;
+
+	fd = net_accept(test_server_listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	conn = i_new(struct test_server_conn, 1);
+	conn->fd = fd;
+	net_set_nonblock(fd, TRUE);
+	conn->input = i_stream_create_fd(fd, 1024, FALSE);
+	conn->io = io_add(fd, IO_READ, test_server_input, conn);
+	i_array_init(&conn->replies, 8);
+	test_server_send_str(conn, "+OK Ready\r\n");
+}
+
+static void test_server_run(void)
+{
+	struct ioloop *ioloop;
+	struct io *io;
+
+	ioloop = io_loop_create();
+	io = io_add(test_server_listen_fd, IO_READ, test_server_accept, NULL);
+	io_loop_run(ioloop);
+	io_remove(&io);
+	io_loop_destroy(&ioloop);
+}
+
+static struct ioloop *test_server_start(void)
+{
+	struct ip_addr ip;
+
+	if (net_addr2ip("127.0.0.1", &ip) < 0)
+		i_unreached();
+	test_server_port = 0;
+	test_server_listen_fd = net_listen(&ip, &test_server_port, 128);
+	if (test_server_listen_fd == -1)
+		i_fatal("listen(127.0.0.1) failed: %m");
+
+	switch ((test_server_pid = fork())) {
+	case -1:
+		i_fatal("fork() failed: %m");
+	case 0:
+		test_server_run();
+		_exit(0);
+	default:
+		i_close_fd(&test_server_listen_fd);
+		break;
+	}
+	return io_loop_create();
+}
+
+static void test_server_stop(struct ioloop **ioloop)
+{
+	io_loop_destroy(ioloop);
+	if (kill(test_server_pid, SIGKILL) < 0)
+		i_fatal("kill() failed: %m");
+	if (waitpid(test_server_pid, NULL, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+}
+
+static void ATTR_FORMAT(2, 0)
+test_error_counter(const struct failure_context *ctx ATTR_UNUSED,
+		   const char *format ATTR_UNUSED, va_list args ATTR_UNUSED)
+{
+	test_error_count++;
+}
+
+static failure_callback_t *test_expect_errors(void)
+{
+	failure_callback_t *fatal, *error, *info, *debug;
+
+	i_get_failure_handlers(&fatal, &error, &info, &debug);
+	i_set_error_handler(test_error_counter);
+	test_error_count = 0;
+	return error;
+}
+
+static void
+test_login_callback(enum pop3c_command_state state,
+		    const char *reply ATTR_UNUSED, void *context ATTR_UNUSED)
+{
+	test_assert(state == POP3C_COMMAND_STATE_OK);
+}
+
+static struct pop3c_client *test_client_init(void)
+{
+	struct pop3c_client_settings set;
+	struct pop3c_client *client;
+
+	memset(&set, 0, sizeof(set));
+	set.host = "127.0.0.1";
+	set.port = test_server_port;
+	set.username = "testuser";
+	set.password = "testpass";
+	set.dns_client_socket_path = "";
+	set.temp_path_prefix = "";
+	set.rawlog_dir = "";
+	client = pop3c_client_init(&set);
+
+	pop3c_client_login(client, test_login_callback, NULL);
+	pop3c_client_run(client);
+	test_assert(pop3c_client_is_connected(client));
+	test_assert((pop3c_client_get_capabilities(client) &
+		     POP3C_CAPABILITY_PIPELINING) != 0);
+	return client;
+}
+
+static void
+test_cmd_callback(enum pop3c_command_state state, const char *reply,
+		  struct istream *input, void *context)
+{
+	struct test_cmd *tcmd = context;
+	const unsigned char *data;
+	size_t size;
+
+	if (str_len(test_callback_order) > 0)
+		str_append_c(test_callback_order, ',');
+	str_printfa(test_callback_order, "%u", tcmd->idx);
+
+	tcmd->callback_count++;
+	tcmd->state = state;
+	tcmd->reply = i_strdup(reply);
+	test_assert((input != NULL) == (state == POP3C_COMMAND_STATE_OK));
+	if (input == NULL)
+		return;
+	while (i_stream_read_data(input, &data, &size, 0) > 0) {
+		str_append_n(tcmd->body, data, size);
+		i_stream_skip(input, size);
+	}
+	test_assert(input->stream_errno == 0);
+}
+
+static void
+test_cmds_send(struct pop3c_client *client, struct test_cmd *cmds,
+	       const char *const *cmdlines)
+{
+	unsigned int i;
+
+	for (i = 0; cmdlines[i] != NULL; i++) {
+		memset(&cmds[i], 0, sizeof(cmds[i]));
+		cmds[i].idx = i;
+		cmds[i].body = str_new(default_pool, 64);
+		cmds[i].cmd = pop3c_client_cmd_stream_async(client,
+			t_strconcat(cmdlines[i], "\r\n", NULL),
+			test_cmd_callback, &cmds[i]);
+		test_assert_idx(cmds[i].cmd != NULL, i);
+	}
+}
+
+static void test_cmds_free(struct test_cmd *cmds, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		str_free(&cmds[i].body);
+		i_free(cmds[i].reply);
+	}
+}
+
+static void test_pop3c_client_pipelining(void)
+{
+	static const char *const cmdlines[] = {
+		"RETR 1", "TOP 2 0", "RETR 9", "RETR 3", NULL
+	};
+	struct test_cmd cmds[N_ELEMENTS(cmdlines)-1];
+	struct ioloop *ioloop;
+	struct pop3c_client *client;
+	const char *reply;
+
+	test_begin("pop3c client pipelining");
+	test_callback_order = t_str_new(32);
+	ioloop = test_server_start();
+	client = test_client_init();
+
+	test_cmds_send(client, cmds, cmdlines);
+	/* the server replies to all of the commands after this */
+	pop3c_client_cmd_line_async(client, "NOOP\r\n");
+
+	/* waiting for a command reads the earlier replies first */
+	pop3c_client_cmd_wait(client, cmds[1].cmd);
+	test_assert(strcmp(str_c(test_callback_order), "0,1") == 0);
+	test_assert(cmds[0].state == POP3C_COMMAND_STATE_OK);
+	test_assert(strcmp(str_c(cmds[0].body),
+			   "Subject: m1\r\n\r\nbody 1\r\n") == 0);
+	test_assert(cmds[1].state == POP3C_COMMAND_STATE_OK);
+	test_assert(strcmp(str_c(cmds[1].body), "Subject: m2\r\n\r\n") == 0);
+	test_assert(cmds[2].callback_count == 0);
+
+	pop3c_client_cmd_wait(client, cmds[2].cmd);
+	test_assert(strcmp(str_c(test_callback_order), "0,1,2") == 0);
+	test_assert(cmds[2].state == POP3C_COMMAND_STATE_ERR);
+	test_assert(strcmp(cmds[2].reply, "No such message") == 0);
+
+	/* the aborted command's reply is skipped by the next command */
+	pop3c_client_cmd_abort(&cmds[3].cmd);
+	test_assert(pop3c_client_cmd_line(client, "NOOP\r\n", &reply) == 0);
+	test_assert(strcmp(str_c(test_callback_order), "0,1,2") == 0);
+	test_assert(cmds[3].callback_count == 0);
+	test_assert(pop3c_client_is_connected(client));
+
+	test_assert(cmds[0].callback_count == 1);
+	test_assert(cmds[1].callback_count == 1);
+	test_assert(cmds[2].callback_count == 1);
+
+	pop3c_client_deinit(&client);
+	test_server_stop(&ioloop);
+	test_cmds_free(cmds, N_ELEMENTS(cmds));
+	test_end();
+}
+
+static void test_pop3c_client_disconnect(void)
+{
+	static const char *const cmdlines[] = {
+		"RETR 1", "RETR 2", "RETR 3", NULL
+	};
+	struct test_cmd cmds[N_ELEMENTS(cmdlines)-1];
+	failure_callback_t *orig_error;
+	struct ioloop *ioloop;
+	struct pop3c_client *client;
+	unsigned int i;
+
+	test_begin("pop3c client disconnect with pipelined commands");
+	test_callback_order = t_str_new(32);
+	ioloop = test_server_start();
+	client = test_client_init();
+
+	test_cmds_send(client, cmds, cmdlines);
+	/* the server replies to the first command, sends half of the second
+	   reply and disconnects */
+	pop3c_client_cmd_line_async(client, "QUIT\r\n");
+
+	orig_error = test_expect_errors();
+	pop3c_client_cmd_wait(client, cmds[2].cmd);
+	i_set_error_handler(orig_error);
+	test_assert(test_error_count > 0);
+
+	test_assert(strcmp(str_c(test_callback_order), "0,1,2") == 0);
+	test_assert(cmds[0].state == POP3C_COMMAND_STATE_OK);
+	test_assert(strcmp(str_c(cmds[0].body),
+			   "Subject: m1\r\n\r\nbody 1\r\n") == 0);
+	for (i = 1; i < N_ELEMENTS(cmds); i++) {
+		test_assert_idx(cmds[i].state ==
+				POP3C_COMMAND_STATE_DISCONNECTED, i);
+		test_assert_idx(str_len(cmds[i].body) == 0, i);
+	}
+	test_assert(!pop3c_client_is_connected(client));
+	test_assert(pop3c_client_cmd_stream_async(client, "RETR 1\r\n",
+						  test_cmd_callback,
+						  &cmds[0]) == NULL);
+
+	/* deinit doesn't call the callbacks again */
+	pop3c_client_deinit(&client);
+	for (i = 0; i < N_ELEMENTS(cmds); i++)
+		test_assert_idx(cmds[i].callback_count == 1, i);
+
+	test_server_stop(&ioloop);
+	test_cmds_free(cmds, N_ELEMENTS(cmds));
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_pop3c_client_pipelining,
+		test_pop3c_client_disconnect,
+		NULL
+	};
+
+	return test_run(test_functions);
+}
@@ -0,0 +1,269 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "test-common.h"
+#include "mail-storage.h"
+#include "index-thread-private.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#define TEST_TREE_PATH ".test-thread.tree"
+#define TEST_UID_VALIDITY 12345
+#define TEST_NEXT_UID 4
+/* offsets in struct mail_thread_tree_header */
+#define TEST_HDR_VERSION_OFFSET 0
+#define TEST_HDR_LAST_UID_OFFSET 12
+#define TEST_HDR_SIZE 40
+#define TEST_RECORD_SIZE 16
+
+/* 1 <- 2 <- 3, with 3 also referencing 1 */
+static const struct mail_index_strmap_rec test_recs[] = {
+	{ 1, MAIL_THREAD_NODE_REF_MSGID, 1 },
+	{ 2, MAIL_THREAD_NODE_REF_MSGID, 2 },
+	{ 2, MAIL_THREAD_NODE_REF_INREPLYTO, 1 },
+	{ 3, MAIL_THREAD_NODE_REF_MSGID, 3 },
+	{ 3, MAIL_THREAD_NODE_REF_REFERENCES1, 1 },
+	{ 3, MAIL_THREAD_NODE_REF_REFERENCES1 + 1, 2 },
+	{ 0, 0, 0 }
+};
+
+static void test_cache_init(struct mail_thread_cache *cache)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->first_invalid_msgid_str_idx =
+		cache->next_invalid_msgid_str_idx = 10;
+	i_array_init(&cache->thread_nodes, 16);
+}
+
+static void
+test_msgid_map_init(ARRAY_TYPE(mail_index_strmap_rec) *msgid_map,
+		    unsigned int count)
+{
+	t_array_init(msgid_map, count);
+	array_append(msgid_map, test_recs, count);
+}
+
+static void test_cache_build(struct mail_thread_cache *cache)
+{
+	unsigned int idx = 0, count = N_ELEMENTS(test_recs) - 1;
+
+	test_cache_init(cache);
+	while (idx < count)
+		mail_thread_add(cache, &test_recs[idx], &idx);
+}
+
+static bool test_cache_nodes_equal(struct mail_thread_cache *cache1,
+				   struct mail_thread_cache *cache2)
+{
+	const struct mail_thread_node *nodes1, *nodes2;
+	unsigned int i, count1, count2;
+
+	nodes1 = array_get(&cache1->thread_nodes, &count1);
+	nodes2 = array_get(&cache2->thread_nodes, &count2);
+	if (count1 != count2)
+		return FALSE;
+	for (i = 0; i < count1; i++) {
+		if (nodes1[i].uid != nodes2[i].uid ||
+		    nodes1[i].parent_idx != nodes2[i].parent_idx ||
+		    nodes1[i].parent_link_refcount !=
+		    nodes2[i].parent_link_refcount ||
+		    nodes1[i].expunge_rebuilds != nodes2[i].expunge_rebuilds ||
+		    nodes1[i].child_unref_rebuilds !=
+		    nodes2[i].child_unref_rebuilds)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static int test_cache_write(struct mail_thread_cache *cache,
+			    const ARRAY_TYPE(mail_index_strmap_rec) *msgid_map)
+{
+	const char *error;
+
+	return mail_thread_cache_write_file(cache, msgid_map, TEST_TREE_PATH,
+					    TEST_UID_VALIDITY, 0600,
+					    (gid_t)-1, "test", &error);
+}
+
+static int test_cache_read(struct mail_thread_cache *cache)
+{
+	const char *error;
+
+	test_cache_init(cache);
+	return mail_thread_cache_read_file(cache, TEST_TREE_PATH,
+					   TEST_UID_VALIDITY, TEST_NEXT_UID,
+					   &error);
+}
+
+static void test_thread_cache_load(void)
+{
+	struct mail_thread_cache cache, cache2;
+	ARRAY_TYPE(mail_index_strmap_rec) msgid_map;
+	const char *error;
+
+	test_begin("thread cache load");
+	test_msgid_map_init(&msgid_map, N_ELEMENTS(test_recs) - 1);
+	test_cache_build(&cache);
+	test_assert(cache.tree_changed);
+	test_assert(test_cache_write(&cache, &msgid_map) == 0);
+	test_assert(!cache.tree_changed);
+
+	test_assert(test_cache_read(&cache2) == 1);
+	test_assert(cache2.tree_loaded && !cache2.tree_changed);
+	test_assert(cache2.last_uid == 3);
+	test_assert(cache2.first_invalid_msgid_str_idx ==
+		    cache.first_invalid_msgid_str_idx);
+	test_assert(cache2.next_invalid_msgid_str_idx ==
+		    cache.next_invalid_msgid_str_idx);
+	test_assert(test_cache_nodes_equal(&cache, &cache2));
+	test_assert(mail_thread_cache_verify(&cache2, &msgid_map));
+	array_free(&cache2.thread_nodes);
+
+	/* missing file */
+	test_assert(unlink(TEST_TREE_PATH) == 0);
+	test_cache_init(&cache2);
+	test_assert(mail_thread_cache_read_file(&cache2, TEST_TREE_PATH,
+		TEST_UID_VALIDITY, TEST_NEXT_UID, &error) == 0);
+	test_assert(!cache2.tree_loaded);
+	array_free(&cache2.thread_nodes);
+	array_free(&cache.thread_nodes);
+	test_end();
+}
+
+static void test_thread_cache_expunge(void)
+{
+	struct mail_thread_cache cache, cache2;
+	ARRAY_TYPE(mail_index_strmap_rec) msgid_map;
+	const struct mail_thread_node *node;
+	unsigned int idx = 0, expunged_idx = 3;
+	unsigned int expunged_count = N_ELEMENTS(test_recs) - 1 - expunged_idx;
+
+	test_begin("thread cache expunge");
+	test_msgid_map_init(&msgid_map, N_ELEMENTS(test_recs) - 1);
+	test_cache_build(&cache);
+	test_assert(test_cache_write(&cache, &msgid_map) == 0);
+	array_free(&cache.thread_nodes);
+
+	/* expunge uid=3 from the loaded tree, the same way as the strmap
+	   expunge callback does */
+	test_assert(test_cache_read(&cache) == 1);
+	test_assert(mail_thread_cache_has_uid(&cache, &test_recs[expunged_idx]));
+	test_assert(mail_thread_remove(&cache, &test_recs[expunged_idx], &idx));
+	cache.tree_recs_count -= expunged_count;
+	mail_thread_cache_hash_recs(&test_recs[expunged_idx], expunged_count,
+				    &cache.tree_recs_hash);
+	test_assert(!mail_thread_cache_has_uid(&cache, &test_recs[expunged_idx]));
+	node = array_idx(&cache.thread_nodes, 3);
+	test_assert(node->uid == 0);
+	node = array_idx(&cache.thread_nodes, 2);
+	test_assert(node->parent_idx == 1 && node->parent_link_refcount == 1);
+
+	/* the strmap no longer has the expunged message */
+	test_msgid_map_init(&msgid_map, expunged_idx);
+	test_assert(mail_thread_cache_verify(&cache, &msgid_map));
+
+	/* the expunge is remembered after writing */
+	test_assert(cache.tree_changed);
+	test_assert(test_cache_write(&cache, &msgid_map) == 0);
+	test_assert(test_cache_read(&cache2) == 1);
+	test_assert(test_cache_nodes_equal(&cache, &cache2));
+	test_assert(mail_thread_cache_verify(&cache2, &msgid_map));
+	array_free(&cache2.thread_nodes);
+	array_free(&cache.thread_nodes);
+	test_end();
+}
+
+static void test_thread_cache_invalidation(void)
+{
+	struct mail_thread_cache cache;
+	ARRAY_TYPE(mail_index_strmap_rec) msgid_map;
+	struct mail_index_strmap_rec *rec;
+	const char *error;
+	uint32_t value;
+	uint8_t version;
+	int fd;
+
+	test_begin("thread cache invalidation");
+	test_msgid_map_init(&msgid_map, N_ELEMENTS(test_recs) - 1);
+	test_cache_build(&cache);
+	test_assert(test_cache_write(&cache, &msgid_map) == 0);
+	array_free(&cache.thread_nodes);
+
+	/* strmap renumbered */
+	test_assert(test_cache_read(&cache) == 1);
+	rec = array_idx_modifiable(&msgid_map, 2);
+	rec->str_idx = 5;
+	test_assert(!mail_thread_cache_verify(&cache, &msgid_map));
+	rec->str_idx = 1;
+	/* messages missing from strmap */
+	test_msgid_map_init(&msgid_map, 1);
+	test_assert(!mail_thread_cache_verify(&cache, &msgid_map));
+	array_free(&cache.thread_nodes);
+
+	/* mailbox recreated */
+	test_cache_init(&cache);
+	test_assert(mail_thread_cache_read_file(&cache, TEST_TREE_PATH,
+		TEST_UID_VALIDITY + 1, TEST_NEXT_UID, &error) == 0);
+	/* UIDs in the tree don't exist in the index */
+	test_assert(mail_thread_cache_read_file(&cache, TEST_TREE_PATH,
+		TEST_UID_VALIDITY, TEST_NEXT_UID - 1, &error) == -2);
+	test_assert(!cache.tree_loaded);
+	array_free(&cache.thread_nodes);
+
+	fd = open(TEST_TREE_PATH, O_RDWR);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_TREE_PATH);
+
+	/* unknown version is silently ignored */
+	version = 1;
+	test_assert(pwrite_full(fd, &version, 1, TEST_HDR_VERSION_OFFSET) == 0);
+	test_assert(test_cache_read(&cache) == 0);
+	array_free(&cache.thread_nodes);
+	version = 2;
+	test_assert(pwrite_full(fd, &version, 1, TEST_HDR_VERSION_OFFSET) == 0);
+
+	/* broken header */
+	value = TEST_NEXT_UID;
+	test_assert(pwrite_full(fd, &value, sizeof(value),
+				TEST_HDR_LAST_UID_OFFSET) == 0);
+	test_assert(test_cache_read(&cache) == -2);
+	array_free(&cache.thread_nodes);
+	value = 3;
+	test_assert(pwrite_full(fd, &value, sizeof(value),
+				TEST_HDR_LAST_UID_OFFSET) == 0);
+
+	/* broken record */
+	value = 1000;
+	test_assert(pwrite_full(fd, &value, sizeof(value),
+				TEST_HDR_SIZE + TEST_RECORD_SIZE*2 + 4) == 0);
+	test_assert(test_cache_read(&cache) == -2);
+	test_assert(array_count(&cache.thread_nodes) == 0);
+	array_free(&cache.thread_nodes);
+
+	/* truncated */
+	test_assert(ftruncate(fd, TEST_HDR_SIZE + 10) == 0);
+	test_assert(test_cache_read(&cache) == -2);
+	array_free(&cache.thread_nodes);
+	test_assert(ftruncate(fd, 10) == 0);
+	test_assert(test_cache_read(&cache) == -2);
+	array_free(&cache.thread_nodes);
+
+	i_close_fd(&fd);
+	test_assert(unlink(TEST_TREE_PATH) == 0);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_thread_cache_load,
+		test_thread_cache_expunge,
+		test_thread_cache_invalidation,
+		NULL
+	};
+	return test_run(test_functions);
+}
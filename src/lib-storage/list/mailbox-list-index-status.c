@@ -9,15 +9,19 @@
 #define CACHED_STATUS_ITEMS \
 	(STATUS_MESSAGES | STATUS_UNSEEN | STATUS_RECENT | \
 	 STATUS_UIDNEXT | STATUS_UIDVALIDITY | STATUS_HIGHESTMODSEQ)
+#define CACHED_METADATA_ITEMS \
+	(MAILBOX_METADATA_GUID | MAILBOX_METADATA_VIRTUAL_SIZE)
 
 struct index_list_changes {
 	struct mailbox_status status;
 	guid_128_t guid;
+	struct mailbox_list_index_vsize_record vsize;
 	uint32_t seq;
 
 	bool rec_changed;
 	bool msgs_changed;
 	bool hmodseq_changed;
+	bool vsize_changed;
 };
 
 struct index_list_storage_module index_list_storage_module =
@@ -203,8 +207,37 @@ index_list_get_status(struct mailbox *box, enum mailbox_status_items items,
 	return ibox->module_ctx.super.get_status(box, items, status_r);
 }
 
+static bool
+index_list_get_cached_vsize(struct mailbox *box, struct mail_index_view *view,
+			    uint32_t seq, uoff_t *vsize_r)
+{
+	struct mailbox_list_index *ilist = INDEX_LIST_CONTEXT(box->list);
+	const struct mailbox_list_index_vsize_record *rec;
+	struct mailbox_status status;
+	const void *data;
+	bool expunged;
+
+	if (!mailbox_list_index_status(box->list, view, seq,
+				       STATUS_MESSAGES | STATUS_UIDNEXT,
+				       &status, NULL))
+		return FALSE;
+
+	mail_index_lookup_ext(view, seq, ilist->vsize_ext_id,
+			      &data, &expunged);
+	rec = data;
+	if (rec == NULL || rec->highest_uid + 1 != status.uidnext ||
+	    rec->message_count != status.messages) {
+		/* vsize hasn't been calculated for the latest messages */
+		return FALSE;
+	}
+	*vsize_r = rec->vsize;
+	return TRUE;
+}
+
 static int
-index_list_get_cached_guid(struct mailbox *box, guid_128_t guid_r)
+index_list_get_cached_metadata(struct mailbox *box,
+			       enum mailbox_metadata_items items,
+			       struct mailbox_metadata *metadata_r)
 {
 	struct mailbox_list_index *ilist = INDEX_LIST_CONTEXT(box->list);
 	struct mailbox_status status;
@@ -212,7 +245,7 @@ index_list_get_cached_guid(struct mailbox *box, guid_128_t guid_r)
 	uint32_t seq;
 	int ret;
 
-	if (ilist->syncing) {
+	if (ilist->syncing && (items & MAILBOX_METADATA_GUID) != 0) {
 		/* syncing wants to know the GUID for a new mailbox. */
 		return 0;
 	}
@@ -220,10 +253,18 @@ index_list_get_cached_guid(struct mailbox *box, guid_128_t guid_r)
 	if ((ret = index_list_open_view(box, &view, &seq)) <= 0)
 		return ret;
 
-	ret = mailbox_list_index_status(box->list, view, seq, 0,
-					&status, guid_r) ? 1 : 0;
-	if (ret > 0 && guid_128_is_empty(guid_r))
-		ret = 0;
+	ret = 1;
+	if ((items & MAILBOX_METADATA_GUID) != 0) {
+		if (!mailbox_list_index_status(box->list, view, seq, 0,
+					       &status, metadata_r->guid) ||
+		    guid_128_is_empty(metadata_r->guid))
+			ret = 0;
+	}
+	if ((items & MAILBOX_METADATA_VIRTUAL_SIZE) != 0 && ret > 0) {
+		if (!index_list_get_cached_vsize(box, view, seq,
+						 &metadata_r->virtual_size))
+			ret = 0;
+	}
 	mail_index_view_close(&view);
 	return ret;
 }
@@ -235,8 +276,9 @@ index_list_get_metadata(struct mailbox *box,
 {
 	struct index_list_mailbox *ibox = INDEX_LIST_STORAGE_CONTEXT(box);
 
-	if (items == MAILBOX_METADATA_GUID && !box->opened) {
-		if (index_list_get_cached_guid(box, metadata_r->guid) > 0)
+	if ((items & ~CACHED_METADATA_ITEMS) == 0 && items != 0 &&
+	    !box->opened) {
+		if (index_list_get_cached_metadata(box, items, metadata_r) > 0)
 			return 0;
 		/* nonsynced / error, fallback to doing it the slow way */
 	}
@@ -252,7 +294,9 @@ index_list_update_fill_changes(struct mailbox *box,
 	struct mail_index_view *view;
 	const struct mail_index_header *hdr;
 	struct mailbox_metadata metadata;
-	uint32_t seq1, seq2;
+	const void *data;
+	size_t size;
+	uint32_t seq1, seq2, vsize_ext_id;
 
 	memset(changes_r, 0, sizeof(*changes_r));
 
@@ -286,6 +330,14 @@ index_list_update_fill_changes(struct mailbox *box,
 		/* modseqs not enabled yet, but we can't return 0 */
 		changes_r->status.highest_modseq = 1;
 	}
+
+	/* the vsize is updated to the mailbox index only when it's asked for,
+	   so copy it as long as it's there. */
+	if (mail_index_ext_lookup(box->index, "hdr-vsize", &vsize_ext_id)) {
+		mail_index_get_header_ext(view, vsize_ext_id, &data, &size);
+		if (size == sizeof(changes_r->vsize))
+			memcpy(&changes_r->vsize, data, size);
+	}
 	mail_index_view_close(&view); hdr = NULL;
 
 	if (mailbox_get_metadata(box, MAILBOX_METADATA_GUID, &metadata) == 0)
@@ -300,6 +352,8 @@ index_list_has_changed(struct mailbox *box, struct mail_index_view *list_view,
 	struct mailbox_list_index *ilist = INDEX_LIST_CONTEXT(box->list);
 	struct mailbox_status old_status;
 	guid_128_t old_guid;
+	const void *data;
+	bool expunged;
 
 	memset(&old_status, 0, sizeof(old_status));
 	memset(old_guid, 0, sizeof(old_guid));
@@ -324,9 +378,6 @@ index_list_has_changed(struct mailbox *box, struct mail_index_view *list_view,
 	} else if (mail_index_have_modseq_tracking(box->index)) {
 		changes->hmodseq_changed = TRUE;
 	} else {
-		const void *data;
-		bool expunged;
-
 		mail_index_lookup_ext(list_view, changes->seq,
 				      ilist->hmodseq_ext_id, &data, &expunged);
 		changes->hmodseq_changed = data != NULL;
@@ -336,8 +387,18 @@ index_list_has_changed(struct mailbox *box, struct mail_index_view *list_view,
 	    old_status.highest_modseq != changes->status.highest_modseq)
 		changes->hmodseq_changed = TRUE;
 
+	mail_index_lookup_ext(list_view, changes->seq, ilist->vsize_ext_id,
+			      &data, &expunged);
+	if (data != NULL) {
+		changes->vsize_changed =
+			memcmp(data, &changes->vsize,
+			       sizeof(changes->vsize)) != 0;
+	} else {
+		changes->vsize_changed = changes->vsize.highest_uid != 0;
+	}
+
 	return changes->rec_changed || changes->msgs_changed ||
-		changes->hmodseq_changed;
+		changes->hmodseq_changed || changes->vsize_changed;
 }
 
 static void
@@ -382,6 +443,11 @@ index_list_update(struct mailbox *box, struct mail_index_view *list_view,
 				      ilist->hmodseq_ext_id,
 				      &changes->status.highest_modseq, NULL);
 	}
+	if (changes->vsize_changed) {
+		mail_index_update_ext(list_trans, changes->seq,
+				      ilist->vsize_ext_id,
+				      &changes->vsize, NULL);
+	}
 }
 
 static int index_list_update_mailbox(struct mailbox *box)
@@ -604,4 +670,9 @@ void mailbox_list_index_status_init_finish(struct mailbox_list *list)
 	ilist->hmodseq_ext_id =
 		mail_index_ext_register(ilist->index, "hmodseq", 0,
 					sizeof(uint64_t), sizeof(uint64_t));
+
+	ilist->vsize_ext_id =
+		mail_index_ext_register(ilist->index, "vsize", 0,
+			sizeof(struct mailbox_list_index_vsize_record),
+			sizeof(uint64_t));
 }
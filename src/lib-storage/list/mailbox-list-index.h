@@ -72,6 +72,14 @@ struct mailbox_list_index_msgs_record {
 	uint32_t uidnext;
 };
 
+/* Copy of the mailbox index's vsize header. The vsize is valid only while
+   highest_uid and message_count match the msgs record. */
+struct mailbox_list_index_vsize_record {
+	uint64_t vsize;
+	uint32_t highest_uid;
+	uint32_t message_count;
+};
+
 struct mailbox_list_index_node {
 	struct mailbox_list_index_node *parent;
 	struct mailbox_list_index_node *next;
@@ -87,7 +95,8 @@ struct mailbox_list_index {
 
 	const char *path;
 	struct mail_index *index;
-	uint32_t ext_id, msgs_ext_id, hmodseq_ext_id, subs_hdr_ext_id;
+	uint32_t ext_id, msgs_ext_id, hmodseq_ext_id, vsize_ext_id;
+	uint32_t subs_hdr_ext_id;
 	struct timeval last_refresh_timeval;
 
 	pool_t mailbox_pool;
@@ -2,9 +2,13 @@
 
 #include "lib.h"
 #include "istream.h"
+#include "ostream.h"
 #include "mail-storage-private.h"
 #include "mail-copy.h"
 
+#include <unistd.h>
+#include <fcntl.h>
+
 static void
 mail_copy_set_failed(struct mail_save_context *ctx, struct mail *mail,
 		     const char *func)
@@ -126,3 +130,65 @@ bool mail_storage_copy_can_use_hardlink(struct mailbox *src,
 		src_perm->file_create_gid == dest_perm->file_create_gid &&
 		!dest->disable_reflink_copy_to;
 }
+
+bool mail_storage_copy_can_use_file_copy(struct mailbox *src ATTR_UNUSED,
+					 struct mailbox *dest)
+{
+	/* the copy is created with dest's permissions, so unlike with hard
+	   links they don't need to match src's. the mail can't be copied as-is
+	   only if dest wants to change it while saving (e.g. compression). */
+	return !dest->disable_reflink_copy_to;
+}
+
+int mail_storage_copy_file(struct mailbox *dest, const char *src_path,
+			   int dest_fd, const char *dest_path)
+{
+	struct mail_storage *storage = dest->storage;
+	struct istream *input;
+	struct ostream *output;
+	off_t ret;
+	int fd;
+
+	fd = open(src_path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		mail_storage_set_critical(storage,
+			"open(%s) failed: %m", src_path);
+		return -1;
+	}
+
+	/* file-to-file copying uses copy_file_range(), which allows the
+	   filesystem to share the data blocks between the files */
+	input = i_stream_create_fd_autoclose(&fd, IO_BLOCK_SIZE);
+	output = o_stream_create_fd_file_copy(dest_fd, 0, FALSE);
+	while ((ret = o_stream_send_istream(output, input)) > 0) ;
+
+	if (input->stream_errno != 0) {
+		errno = input->stream_errno;
+		mail_storage_set_critical(storage,
+			"read(%s) failed: %m", src_path);
+		ret = -1;
+	} else if (o_stream_nfinish(output) < 0) {
+		if (ENOQUOTA(output->stream_errno)) {
+			mail_storage_set_error(storage, MAIL_ERROR_NOQUOTA,
+					       MAIL_ERRSTR_NO_QUOTA);
+		} else {
+			mail_storage_set_critical(storage,
+				"write(%s) failed: %s", dest_path,
+				o_stream_get_error(output));
+		}
+		ret = -1;
+	}
+	o_stream_unref(&output);
+	i_stream_unref(&input);
+
+	if (ret == 0 &&
+	    storage->set->parsed_fsync_mode != FSYNC_MODE_NEVER &&
+	    fdatasync(dest_fd) < 0) {
+		mail_storage_set_critical(storage,
+			"fdatasync(%s) failed: %m", dest_path);
+		ret = -1;
+	}
+	return ret < 0 ? -1 : 1;
+}
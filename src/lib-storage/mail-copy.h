@@ -16,5 +16,15 @@ int mail_save_copy_default_metadata(struct mail_save_context *ctx,
    (Assuming the storage itself supports this.) */
 bool mail_storage_copy_can_use_hardlink(struct mailbox *src,
 					struct mailbox *dest);
+/* Returns TRUE if mails' files can be copied as-is from src to dest with
+   mail_storage_copy_file(). */
+bool mail_storage_copy_can_use_file_copy(struct mailbox *src,
+					 struct mailbox *dest);
+/* Copy src_path's contents to the newly created dest_fd for storages that
+   couldn't hard link the file. Filesystems supporting reflinks can clone the
+   file instead of copying it. Returns 1 if ok, 0 if src_path doesn't exist,
+   -1 if error. */
+int mail_storage_copy_file(struct mailbox *dest, const char *src_path,
+			   int dest_fd, const char *dest_path);
 
 #endif
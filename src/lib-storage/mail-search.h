@@ -106,6 +106,9 @@ struct mail_search_args {
 	pool_t pool;
 	struct mailbox *box;
 	struct mail_search_arg *args;
+	/* If non-zero and the search is sorted, return only this many mails
+	   from the beginning of the sorted result. */
+	unsigned int sort_limit;
 
 	unsigned int simplified:1;
 	unsigned int have_inthreads:1;
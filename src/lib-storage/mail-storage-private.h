@@ -470,6 +470,10 @@ struct mailbox_transaction_stats {
 	unsigned long long files_read_bytes;
 	/* number of cache lookup hits */
 	unsigned long cache_hit_count;
+	/* number of prefetched mails whose data was / wasn't already in
+	   memory when they were accessed */
+	unsigned long prefetch_hit_count;
+	unsigned long prefetch_miss_count;
 };
 
 struct mail_save_private_changes {
@@ -545,6 +549,11 @@ struct mail_search_context {
 
 	unsigned int seen_lost_data:1;
 	unsigned int progress_hidden:1;
+	/* The search results depend on something else than the mailbox's
+	   contents (e.g. FTS indexes), so they must not be saved to or
+	   looked up from the persistent search result cache. Must be set
+	   before the first search_next*() call. */
+	unsigned int no_result_cache:1;
 };
 
 struct mail_save_data {
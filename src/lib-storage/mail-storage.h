@@ -610,6 +610,14 @@ bool mailbox_get_expunges(struct mailbox *box, uint64_t prev_modseq,
 bool mailbox_get_expunged_uids(struct mailbox *box, uint64_t prev_modseq,
 			       const ARRAY_TYPE(seq_range) *uids_filter,
 			       ARRAY_TYPE(seq_range) *expunged_uids);
+/* Get list of messages whose flags, keywords or modseq have changed after
+   prev_modseq, up to the last mailbox sync. This reads only the transaction
+   log, so it's much faster than looking up all the messages' modseqs. The
+   UIDs may include messages that have since been expunged. Returns TRUE if
+   ok, FALSE if the log no longer contains all the changes after prev_modseq
+   (changed_uids is then incomplete). */
+bool mailbox_get_changed_uids(struct mailbox *box, uint64_t prev_modseq,
+			      ARRAY_TYPE(seq_range) *changed_uids);
 
 /* Initialize header lookup for given headers. */
 struct mailbox_header_lookup_ctx *
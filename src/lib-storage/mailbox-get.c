@@ -226,3 +226,103 @@ bool mailbox_get_expunged_uids(struct mailbox *box, uint64_t prev_modseq,
 	return mailbox_get_expunges_full(box, prev_modseq,
 					 uids_filter, expunged_uids, NULL);
 }
+
+static void
+add_flag_updates(ARRAY_TYPE(seq_range) *changed_uids,
+		 const struct mail_transaction_flag_update *src,
+		 size_t src_size)
+{
+	const struct mail_transaction_flag_update *end;
+
+	end = src + src_size / sizeof(*src);
+	for (; src != end; src++) {
+		seq_range_array_add_range(changed_uids,
+					  src->uid1, src->uid2);
+	}
+}
+
+static void
+add_keyword_resets(ARRAY_TYPE(seq_range) *changed_uids,
+		   const struct mail_transaction_keyword_reset *src,
+		   size_t src_size)
+{
+	const struct mail_transaction_keyword_reset *end;
+
+	end = src + src_size / sizeof(*src);
+	for (; src != end; src++) {
+		seq_range_array_add_range(changed_uids,
+					  src->uid1, src->uid2);
+	}
+}
+
+static void
+add_keyword_updates(ARRAY_TYPE(seq_range) *changed_uids,
+		    const struct mail_transaction_keyword_update *rec,
+		    size_t rec_size)
+{
+	const uint32_t *uids, *end;
+	unsigned int uids_offset;
+
+	uids_offset = sizeof(*rec) + rec->name_size;
+	if ((uids_offset % 4) != 0)
+		uids_offset += 4 - (uids_offset % 4);
+
+	uids = CONST_PTR_OFFSET(rec, uids_offset);
+	end = CONST_PTR_OFFSET(rec, rec_size);
+	for (; uids < end; uids += 2)
+		seq_range_array_add_range(changed_uids, uids[0], uids[1]);
+}
+
+static void
+add_modseq_updates(ARRAY_TYPE(seq_range) *changed_uids,
+		   const struct mail_transaction_modseq_update *src,
+		   size_t src_size)
+{
+	const struct mail_transaction_modseq_update *end;
+
+	end = src + src_size / sizeof(*src);
+	for (; src != end; src++) {
+		/* uid=0 is a highest-modseq update */
+		if (src->uid != 0)
+			seq_range_array_add(changed_uids, src->uid);
+	}
+}
+
+bool mailbox_get_changed_uids(struct mailbox *box, uint64_t prev_modseq,
+			      ARRAY_TYPE(seq_range) *changed_uids)
+{
+	struct mail_transaction_log_view *log_view;
+	const struct mail_transaction_header *thdr;
+	const void *tdata;
+	uint32_t tail_seq;
+	int ret;
+
+	ret = mailbox_get_expunges_init(box, prev_modseq, &log_view, &tail_seq);
+	if (ret != 0)
+		return ret > 0;
+	if (tail_seq != 0) {
+		/* the changes have already been rotated out of the log */
+		mail_transaction_log_view_close(&log_view);
+		return FALSE;
+	}
+
+	while ((ret = mail_transaction_log_view_next(log_view,
+						     &thdr, &tdata)) > 0) {
+		switch (thdr->type & MAIL_TRANSACTION_TYPE_MASK) {
+		case MAIL_TRANSACTION_FLAG_UPDATE:
+			add_flag_updates(changed_uids, tdata, thdr->size);
+			break;
+		case MAIL_TRANSACTION_KEYWORD_UPDATE:
+			add_keyword_updates(changed_uids, tdata, thdr->size);
+			break;
+		case MAIL_TRANSACTION_KEYWORD_RESET:
+			add_keyword_resets(changed_uids, tdata, thdr->size);
+			break;
+		case MAIL_TRANSACTION_MODSEQ_UPDATE:
+			add_modseq_updates(changed_uids, tdata, thdr->size);
+			break;
+		}
+	}
+	mail_transaction_log_view_close(&log_view);
+	return ret == 0;
+}
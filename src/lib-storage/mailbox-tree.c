@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "str.h"
+#include "hash.h"
 #include "mailbox-tree.h"
 
 struct mailbox_tree_context {
@@ -13,6 +14,12 @@ struct mailbox_tree_context {
 	unsigned int node_size;
 
 	struct mailbox_node *nodes;
+	/* Mailboxes may have thousands of siblings, so don't find them by
+	   walking through the linked lists. Full path => node: */
+	HASH_TABLE(char *, struct mailbox_node *) path_hash;
+	/* parent node => its last child, for appending new children */
+	HASH_TABLE(struct mailbox_node *, struct mailbox_node *) last_child_hash;
+	struct mailbox_node *last_root_node;
 };
 
 struct mailbox_tree_iterate_context {
@@ -44,6 +51,8 @@ mailbox_tree_init_size(char separator, unsigned int mailbox_node_size)
 	tree->pool = pool_alloconly_create(MEMPOOL_GROWING"mailbox_tree", 10240);
 	tree->separator = separator;
 	tree->node_size = mailbox_node_size;
+	hash_table_create(&tree->path_hash, default_pool, 0, str_hash, strcmp);
+	hash_table_create_direct(&tree->last_child_hash, default_pool, 0);
 	return tree;
 }
 
@@ -52,14 +61,41 @@ void mailbox_tree_deinit(struct mailbox_tree_context **_tree)
 	struct mailbox_tree_context *tree = *_tree;
 
 	*_tree = NULL;
+	hash_table_destroy(&tree->path_hash);
+	hash_table_destroy(&tree->last_child_hash);
 	pool_unref(&tree->pool);
 	i_free(tree);
 }
 
+static void
+mailbox_tree_rehash_branch(struct mailbox_tree_context *tree,
+			   struct mailbox_node *node, string_t *path)
+{
+	size_t parent_len = str_len(path);
+
+	for (; node != NULL; node = node->next) {
+		str_truncate(path, parent_len);
+		if (node->parent != NULL)
+			str_append_c(path, tree->separator);
+		str_append(path, node->name);
+		hash_table_insert(tree->path_hash,
+				  p_strdup(tree->pool, str_c(path)), node);
+		mailbox_tree_rehash_branch(tree, node->children, path);
+	}
+}
+
 void mailbox_tree_set_separator(struct mailbox_tree_context *tree,
 				char separator)
 {
+	if (tree->separator == separator)
+		return;
 	tree->separator = separator;
+
+	/* the paths in the hash contain the old separator */
+	hash_table_clear(tree->path_hash, TRUE);
+	T_BEGIN {
+		mailbox_tree_rehash_branch(tree, tree->nodes, t_str_new(128));
+	} T_END;
 }
 
 void mailbox_tree_set_parents_nonexistent(struct mailbox_tree_context *tree)
@@ -70,7 +106,10 @@ void mailbox_tree_set_parents_nonexistent(struct mailbox_tree_context *tree)
 void mailbox_tree_clear(struct mailbox_tree_context *tree)
 {
 	p_clear(tree->pool);
+	hash_table_clear(tree->path_hash, TRUE);
+	hash_table_clear(tree->last_child_hash, TRUE);
 	tree->nodes = NULL;
+	tree->last_root_node = NULL;
 }
 
 pool_t mailbox_tree_get_pool(struct mailbox_tree_context *tree)
@@ -78,13 +117,42 @@ pool_t mailbox_tree_get_pool(struct mailbox_tree_context *tree)
 	return tree->pool;
 }
 
+static void
+mailbox_tree_set_last_child(struct mailbox_tree_context *tree,
+			    struct mailbox_node *parent,
+			    struct mailbox_node *node)
+{
+	if (parent == NULL)
+		tree->last_root_node = node;
+	else
+		hash_table_update(tree->last_child_hash, parent, node);
+}
+
+static void
+mailbox_tree_add_node(struct mailbox_tree_context *tree,
+		      struct mailbox_node *parent, struct mailbox_node *node,
+		      const char *path)
+{
+	struct mailbox_node *last;
+
+	last = parent == NULL ? tree->last_root_node :
+		hash_table_lookup(tree->last_child_hash, parent);
+	if (last != NULL)
+		last->next = node;
+	else if (parent == NULL)
+		tree->nodes = node;
+	else
+		parent->children = node;
+	mailbox_tree_set_last_child(tree, parent, node);
+	hash_table_insert(tree->path_hash, p_strdup(tree->pool, path), node);
+}
+
 static struct mailbox_node * ATTR_NULL(2)
 mailbox_tree_traverse(struct mailbox_tree_context *tree, const char *path,
 		      bool create, bool *created_r)
 {
-	struct mailbox_node **node, *parent;
-	const char *name;
-	string_t *str;
+	struct mailbox_node *node = NULL, *parent;
+	const char *full_path, *name, *node_path;
 
 	*created_r = FALSE;
 
@@ -96,35 +164,24 @@ mailbox_tree_traverse(struct mailbox_tree_context *tree, const char *path,
 		path = t_strdup_printf("INBOX%s", path+5);
 
 	parent = NULL;
-	node = &tree->nodes;
-
-	str = t_str_new(strlen(path)+1);
-	for (name = path;; path++) {
+	for (full_path = name = path;; path++) {
 		if (*path != tree->separator && *path != '\0')
 			continue;
 
-		str_truncate(str, 0);
-		str_append_n(str, name, (size_t) (path - name));
-		name = str_c(str);
-
 		/* find the node */
-		while (*node != NULL) {
-			if (strcmp((*node)->name, name) == 0)
-				break;
-
-			node = &(*node)->next;
-		}
-
-		if (*node == NULL) {
+		node_path = t_strdup_until(full_path, path);
+		node = hash_table_lookup(tree->path_hash, node_path);
+		if (node == NULL) {
 			/* not found, create it */
 			if (!create)
 				break;
 
-			*node = p_malloc(tree->pool, tree->node_size);
-			(*node)->parent = parent;
-			(*node)->name = p_strdup(tree->pool, name);
+			node = p_malloc(tree->pool, tree->node_size);
+			node->parent = parent;
+			node->name = p_strdup_until(tree->pool, name, path);
 			if (tree->parents_nonexistent)
-				(*node)->flags = MAILBOX_NONEXISTENT;
+				node->flags = MAILBOX_NONEXISTENT;
+			mailbox_tree_add_node(tree, parent, node, node_path);
 			tree->sorted = FALSE;
 			*created_r = TRUE;
 		}
@@ -133,12 +190,10 @@ mailbox_tree_traverse(struct mailbox_tree_context *tree, const char *path,
 			break;
 
 		name = path+1;
-
-		parent = *node;
-		node = &(*node)->children;
+		parent = node;
 	}
 
-	return *node;
+	return node;
 }
 
 struct mailbox_node *
@@ -263,24 +318,28 @@ void mailbox_tree_iterate_deinit(struct mailbox_tree_iterate_context **_ctx)
 	i_free(ctx);
 }
 
-static struct mailbox_node * ATTR_NULL(1, 2)
+static void ATTR_NULL(2)
 mailbox_tree_dup_branch(struct mailbox_tree_context *dest_tree,
 			struct mailbox_node *dest_parent,
-			const struct mailbox_node *src)
+			const struct mailbox_node *src, string_t *path)
 {
-	struct mailbox_node *node, *dest_nodes = NULL, **dest = &dest_nodes;
+	struct mailbox_node *node;
+	size_t parent_len = str_len(path);
 
 	for (; src != NULL; src = src->next) {
-		*dest = node = p_malloc(dest_tree->pool, dest_tree->node_size);
+		node = p_malloc(dest_tree->pool, dest_tree->node_size);
 		node->name = p_strdup(dest_tree->pool, src->name);
 		node->flags = src->flags;
-
 		node->parent = dest_parent;
-		node->children = mailbox_tree_dup_branch(dest_tree, node,
-							 src->children);
-		dest = &node->next;
+
+		str_truncate(path, parent_len);
+		if (dest_parent != NULL)
+			str_append_c(path, dest_tree->separator);
+		str_append(path, src->name);
+		mailbox_tree_add_node(dest_tree, dest_parent, node, str_c(path));
+
+		mailbox_tree_dup_branch(dest_tree, node, src->children, path);
 	}
-	return dest_nodes;
 }
 
 struct mailbox_tree_context *mailbox_tree_dup(struct mailbox_tree_context *src)
@@ -291,7 +350,10 @@ struct mailbox_tree_context *mailbox_tree_dup(struct mailbox_tree_context *src)
 	i_assert(src->node_size == sizeof(struct mailbox_node));
 
 	dest = mailbox_tree_init_size(src->separator, src->node_size);
-	dest->nodes = mailbox_tree_dup_branch(dest, NULL, src->nodes);
+	T_BEGIN {
+		mailbox_tree_dup_branch(dest, NULL, src->nodes,
+					t_str_new(128));
+	} T_END;
 	return dest;
 }
 
@@ -301,10 +363,12 @@ static int mailbox_node_name_cmp(struct mailbox_node *const *node1,
 	return strcmp((*node1)->name, (*node2)->name);
 }
 
-static void mailbox_tree_sort_branch(struct mailbox_node **nodes,
+static void mailbox_tree_sort_branch(struct mailbox_tree_context *tree,
+				     struct mailbox_node *parent,
+				     struct mailbox_node **nodes,
 				     ARRAY_TYPE(mailbox_node) *tmparr)
 {
-	struct mailbox_node *node, *const *nodep, **dest;
+	struct mailbox_node *node, *last = NULL, *const *nodep, **dest;
 
 	if (*nodes == NULL)
 		return;
@@ -318,14 +382,16 @@ static void mailbox_tree_sort_branch(struct mailbox_node **nodes,
 	/* update the node pointers */
 	dest = nodes;
 	array_foreach(tmparr, nodep) {
-		*dest = *nodep;
-		dest = &(*dest)->next;
+		last = *nodep;
+		*dest = last;
+		dest = &last->next;
 	}
 	*dest = NULL;
+	mailbox_tree_set_last_child(tree, parent, last);
 
 	/* sort the children */
 	for (node = *nodes; node != NULL; node = node->next)
-		mailbox_tree_sort_branch(&node->children, tmparr);
+		mailbox_tree_sort_branch(tree, node, &node->children, tmparr);
 }
 
 void mailbox_tree_sort(struct mailbox_tree_context *tree)
@@ -338,6 +404,6 @@ void mailbox_tree_sort(struct mailbox_tree_context *tree)
 		ARRAY_TYPE(mailbox_node) tmparr;
 
 		t_array_init(&tmparr, 32);
-		mailbox_tree_sort_branch(&tree->nodes, &tmparr);
+		mailbox_tree_sort_branch(tree, NULL, &tree->nodes, &tmparr);
 	} T_END;
 }
@@ -0,0 +1,82 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "istream.h"
+#include "mail-storage-private.h"
+#include "index/index-mail.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#include <fcntl.h>
+
+#define TEST_HEADERS "Subject: prefetch\n"
+#define TEST_BODY "body\n"
+
+static struct test_mail_storage_ctx *test_ctx;
+
+static bool test_mail_stream_equals(struct mail *mail, const char *data)
+{
+	struct istream *input;
+	const unsigned char *pos;
+	size_t size;
+
+	if (mail_get_stream(mail, NULL, NULL, &input) < 0)
+		return FALSE;
+	i_stream_seek(input, 0);
+	while (i_stream_read(input) > 0) ;
+	pos = i_stream_get_data(input, &size);
+	return size == strlen(data) && memcmp(pos, data, size) == 0;
+}
+
+static void test_index_mail_prefetch_wait(void)
+{
+	struct test_mail_storage_settings set;
+	struct mailbox *box;
+	struct mailbox_transaction_context *t;
+	struct mail *mail;
+
+	test_begin("index mail prefetch wait");
+	memset(&set, 0, sizeof(set));
+	set.driver = "maildir";
+	test_mail_storage_init_user(test_ctx, &set);
+	box = test_mail_storage_mailbox_create(test_ctx, "INBOX");
+	(void)test_mail_storage_save(box, TEST_HEADERS, TEST_BODY);
+
+	t = mailbox_transaction_begin(box, 0);
+	mail = mail_alloc(t, MAIL_FETCH_STREAM_HEADER |
+			  MAIL_FETCH_STREAM_BODY, NULL);
+
+	/* nothing was prefetched: not counted as a hit or a miss */
+	mail_set_seq(mail, 1);
+	test_assert(index_mail_prefetch_wait(mail) == -1);
+	test_assert(t->stats.prefetch_hit_count == 0 &&
+		    t->stats.prefetch_miss_count == 0);
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	/* prefetched: the 1 byte pread() probe is counted exactly once and
+	   it doesn't affect reading the mail */
+	mail_set_seq(mail, 1);
+	test_assert(!mail_prefetch(mail));
+	test_assert(index_mail_prefetch_wait(mail) >= 0);
+	test_assert(t->stats.prefetch_hit_count +
+		    t->stats.prefetch_miss_count == 1);
+	test_assert(test_mail_stream_equals(mail, TEST_HEADERS"\n"TEST_BODY));
+#endif
+
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&t) == 0);
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(test_ctx);
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*test_functions[])(void) = {
+		test_index_mail_prefetch_wait,
+		NULL
+	};
+
+	test_ctx = test_mail_storage_init(&argc, &argv);
+	return test_run(test_functions);
+}
@@ -0,0 +1,266 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "write-full.h"
+#include "imap-util.h"
+#include "mail-index.h"
+#include "mail-index-modseq.h"
+#include "mail-search-build.h"
+#include "mail-search-parser.h"
+#include "mail-search.h"
+#include "mail-storage-private.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#define TEST_QUERY "SUBJECT foo UNSEEN"
+
+static struct test_mail_storage_ctx *test_ctx;
+
+static const char *const test_extra_input[] = {
+	"mail_search_result_cache=yes",
+	NULL
+};
+
+static struct mailbox *test_mailbox_init(const char *name, bool modseqs)
+{
+	struct test_mail_storage_settings set;
+	struct mailbox *box;
+
+	memset(&set, 0, sizeof(set));
+	set.extra_input = test_extra_input;
+	test_mail_storage_init_user(test_ctx, &set);
+
+	box = test_mail_storage_mailbox_create(test_ctx, name);
+	if (modseqs && mailbox_enable(box, MAILBOX_FEATURE_CONDSTORE) < 0)
+		i_fatal("mailbox_enable() failed");
+	/* uids 1..4 */
+	(void)test_mail_storage_save(box, "Subject: foo\n", "body\n");
+	(void)test_mail_storage_save(box, "Subject: bar\n", "body\n");
+	(void)test_mail_storage_save(box, "Subject: foo\n", "body\n");
+	(void)test_mail_storage_save(box, "Subject: bar\n", "body\n");
+	return box;
+}
+
+static void test_mailbox_deinit(struct mailbox **box)
+{
+	mailbox_free(box);
+	test_mail_storage_deinit_user(test_ctx);
+}
+
+static const char *test_search(struct mailbox *box, bool no_result_cache)
+{
+	struct mail_search_parser *parser;
+	struct mail_search_args *args;
+	struct mailbox_transaction_context *t;
+	struct mail_search_context *ctx;
+	struct mail *mail;
+	ARRAY_TYPE(seq_range) uids;
+	const char *error, *charset = "UTF-8";
+	string_t *str;
+
+	parser = mail_search_parser_init_cmdline(t_strsplit(TEST_QUERY, " "));
+	if (mail_search_build(mail_search_register_get_imap(),
+			      parser, &charset, &args, &error) < 0)
+		i_panic("%s", error);
+	mail_search_parser_deinit(&parser);
+	mail_search_args_init(args, box, TRUE, NULL);
+
+	t_array_init(&uids, 8);
+	t = mailbox_transaction_begin(box, 0);
+	ctx = mailbox_search_init(t, args, NULL, 0, NULL);
+	ctx->no_result_cache = no_result_cache;
+	mail_search_args_unref(&args);
+	while (mailbox_search_next(ctx, &mail))
+		seq_range_array_add(&uids, mail->uid);
+	test_assert(mailbox_search_deinit(&ctx) == 0);
+	test_assert(mailbox_transaction_commit(&t) == 0);
+
+	str = t_str_new(32);
+	imap_write_seq_range(str, &uids);
+	return str_c(str);
+}
+
+static bool test_search_equals(struct mailbox *box, const char *result)
+{
+	/* the uncached search must always give the same result */
+	return strcmp(test_search(box, FALSE), result) == 0 &&
+		strcmp(test_search(box, TRUE), result) == 0;
+}
+
+static void
+test_update_flags(struct mailbox *box, uint32_t uid,
+		  enum modify_type modify_type, enum mail_flags flags)
+{
+	struct mailbox_transaction_context *t;
+	struct mail *mail;
+
+	t = mailbox_transaction_begin(box, 0);
+	mail = mail_alloc(t, 0, NULL);
+	if (!mail_set_uid(mail, uid))
+		i_fatal("uid=%u not found", uid);
+	mail_update_flags(mail, modify_type, flags);
+	mail_free(&mail);
+	if (mailbox_transaction_commit(&t) < 0 || mailbox_sync(box, 0) < 0)
+		i_fatal("flag update failed");
+}
+
+static void test_expunge(struct mailbox *box, uint32_t uid)
+{
+	struct mailbox_transaction_context *t;
+	struct mail *mail;
+
+	t = mailbox_transaction_begin(box, 0);
+	mail = mail_alloc(t, 0, NULL);
+	if (!mail_set_uid(mail, uid))
+		i_fatal("uid=%u not found", uid);
+	mail_expunge(mail);
+	mail_free(&mail);
+	if (mailbox_transaction_commit(&t) < 0 || mailbox_sync(box, 0) < 0)
+		i_fatal("expunge failed");
+}
+
+static const char *test_cache_path(struct mailbox *box)
+{
+	return t_strconcat(box->index->filepath, ".search", NULL);
+}
+
+static const char *test_cache_read(struct mailbox *box)
+{
+	const char *path = test_cache_path(box);
+	char buf[1024];
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			i_fatal("open(%s) failed: %m", path);
+		return NULL;
+	}
+	ret = read(fd, buf, sizeof(buf)-1);
+	if (ret < 0)
+		i_fatal("read(%s) failed: %m", path);
+	i_close_fd(&fd);
+	return t_strndup(buf, ret);
+}
+
+/* Replace the uidset in the cached result, so it can be seen whether the
+   search trusts it. */
+static void test_cache_set_uidset(struct mailbox *box, const char *uidset)
+{
+	const char *path = test_cache_path(box);
+	const char *const *lines, **fields;
+	string_t *str;
+	int fd;
+
+	lines = t_strsplit(test_cache_read(box), "\n");
+	i_assert(str_array_length(lines) >= 2);
+	fields = (const char **)t_strsplit(lines[1], "\t");
+	i_assert(str_array_length(fields) == 5);
+	fields[3] = uidset;
+
+	str = t_str_new(256);
+	str_printfa(str, "%s\n%s\n", lines[0],
+		    t_strarray_join(fields, "\t"));
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write_full(fd, str_data(str), str_len(str)) < 0)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static void test_search_cache_changes(void)
+{
+	struct mailbox *box;
+	const char *cache;
+
+	test_begin("search cache changes");
+	box = test_mailbox_init("INBOX", TRUE);
+
+	test_assert(test_search_equals(box, "1,3"));
+	cache = test_cache_read(box);
+	test_assert(cache != NULL && strstr(cache, "\t1,3\t") != NULL);
+	test_assert(test_search_equals(box, "1,3"));
+
+	test_update_flags(box, 1, MODIFY_ADD, MAIL_SEEN);
+	test_assert(test_search_equals(box, "3"));
+	(void)test_mail_storage_save(box, "Subject: foo\n", "body\n");
+	test_assert(test_search_equals(box, "3,5"));
+	test_expunge(box, 3);
+	test_assert(test_search_equals(box, "5"));
+	test_update_flags(box, 1, MODIFY_REMOVE, MAIL_SEEN);
+	test_assert(test_search_equals(box, "1,5"));
+	cache = test_cache_read(box);
+	test_assert(cache != NULL && strstr(cache, "\t1,5\t") != NULL);
+
+	test_mailbox_deinit(&box);
+	test_end();
+}
+
+static void test_search_cache_stale(void)
+{
+	struct mailbox *box;
+	const char *cache;
+
+	test_begin("search cache stale entries");
+	box = test_mailbox_init("INBOX", TRUE);
+	test_assert(test_search_equals(box, "1,3"));
+
+	/* messages in the cached result are still checked */
+	test_cache_set_uidset(box, "1:4");
+	test_assert(strcmp(test_search(box, FALSE), "1,3") == 0);
+
+	/* messages not in the cached result are skipped if they haven't
+	   changed. the only way to see this is to give a wrong result. */
+	test_cache_set_uidset(box, "");
+	test_assert(strcmp(test_search(box, FALSE), "") == 0);
+	/* ..but not with no_result_cache, which also doesn't update the
+	   cache */
+	cache = test_cache_read(box);
+	test_assert(strcmp(test_search(box, TRUE), "1,3") == 0);
+	test_assert(strcmp(test_cache_read(box), cache) == 0);
+
+	/* changed messages are checked, even if the change doesn't affect
+	   the search */
+	test_update_flags(box, 3, MODIFY_ADD, MAIL_FLAGGED);
+	test_assert(strcmp(test_search(box, FALSE), "3") == 0);
+	/* so are new messages */
+	(void)test_mail_storage_save(box, "Subject: foo\n", "body\n");
+	test_assert(strcmp(test_search(box, FALSE), "3,5") == 0);
+
+	test_mailbox_deinit(&box);
+	test_end();
+}
+
+static void test_search_cache_no_modseqs(void)
+{
+	struct mailbox *box;
+
+	test_begin("search cache without modseqs");
+	box = test_mailbox_init("INBOX", FALSE);
+	test_assert(test_search_equals(box, "1,3"));
+	/* modseqs aren't enabled by the cache */
+	test_assert(test_cache_read(box) == NULL);
+	test_assert(!mail_index_have_modseq_tracking(box->index));
+	test_mailbox_deinit(&box);
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*test_functions[])(void) = {
+		test_search_cache_changes,
+		test_search_cache_stale,
+		test_search_cache_no_modseqs,
+		NULL
+	};
+
+	test_ctx = test_mail_storage_init(&argc, &argv);
+	return test_run(test_functions);
+}
@@ -0,0 +1,125 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "mail-index.h"
+#include "mail-search-build.h"
+#include "mail-storage-private.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+static struct test_mail_storage_ctx *test_ctx;
+
+static void test_save_subject(struct mailbox *box, const char *subject)
+{
+	(void)test_mail_storage_save(box,
+		t_strdup_printf("Subject: %s\n", subject), "body\n");
+}
+
+/* Give the messages consecutive sort IDs, so there's no space left for
+   new messages between them. */
+static void test_set_sort_ids(struct mailbox *box, unsigned int count)
+{
+	struct mailbox_transaction_context *t;
+	uint32_t ext_id, seq, sort_id;
+
+	ext_id = mail_index_ext_register(box->index, "sort-s", 0,
+					 sizeof(uint32_t), sizeof(uint32_t));
+	t = mailbox_transaction_begin(box, 0);
+	for (seq = 1; seq <= count; seq++) {
+		sort_id = seq;
+		mail_index_update_ext(t->itrans, seq, ext_id, &sort_id, NULL);
+	}
+	if (mailbox_transaction_commit(&t) < 0 || mailbox_sync(box, 0) < 0)
+		i_fatal("Setting sort IDs failed");
+}
+
+/* Sort by subject and return the number of lookups done for the mails'
+   data. */
+static unsigned int
+test_sort_subject(struct mailbox *box, ARRAY_TYPE(uint32_t) *uids)
+{
+	static const enum mail_sort_type sort_program[] = {
+		MAIL_SORT_SUBJECT, MAIL_SORT_END
+	};
+	struct mail_search_args *args;
+	struct mailbox_transaction_context *t;
+	struct mail_search_context *ctx;
+	struct mail *mail;
+	unsigned int lookups;
+
+	args = mail_search_build_init();
+	mail_search_build_add_all(args);
+
+	t = mailbox_transaction_begin(box, 0);
+	ctx = mailbox_search_init(t, args, sort_program, 0, NULL);
+	mail_search_args_unref(&args);
+	array_clear(uids);
+	while (mailbox_search_next(ctx, &mail))
+		array_append(uids, &mail->uid, 1);
+	test_assert(mailbox_search_deinit(&ctx) == 0);
+	lookups = t->stats.cache_hit_count + t->stats.open_lookup_count;
+	test_assert(mailbox_transaction_commit(&t) == 0);
+	return lookups;
+}
+
+static unsigned int test_sort_renumber(unsigned int count)
+{
+	struct mailbox *box;
+	ARRAY_TYPE(uint32_t) uids;
+	const uint32_t *uidp;
+	unsigned int i, lookups;
+
+	test_mail_storage_init_user(test_ctx, NULL);
+	box = test_mail_storage_mailbox_create(test_ctx, "INBOX");
+	for (i = 0; i < count; i++)
+		test_save_subject(box, t_strdup_printf("s%03u", i));
+	test_set_sort_ids(box, count);
+	/* this sorts between the first and the second message */
+	test_save_subject(box, "s000a");
+
+	t_array_init(&uids, count + 1);
+	lookups = test_sort_subject(box, &uids);
+	test_assert(array_count(&uids) == count + 1);
+	uidp = array_idx(&uids, 0);
+	test_assert(uidp[0] == 1 && uidp[1] == count + 1);
+	for (i = 2; i <= count; i++)
+		test_assert(uidp[i] == i);
+
+	/* the renumbered sort IDs were written and are in the right order */
+	(void)test_sort_subject(box, &uids);
+	uidp = array_idx(&uids, 0);
+	test_assert(uidp[0] == 1 && uidp[1] == count + 1);
+	for (i = 2; i <= count; i++)
+		test_assert(uidp[i] == i);
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(test_ctx);
+	return lookups;
+}
+
+static void test_index_sort_renumber(void)
+{
+	unsigned int lookups1, lookups2;
+
+	test_begin("index sort renumber");
+	/* renumbering the existing messages' sort IDs doesn't need to look
+	   up their sort strings, except for the new message's neighbours.
+	   only finding the new message's position with a binary search
+	   grows with the number of messages. */
+	lookups1 = test_sort_renumber(16);
+	lookups2 = test_sort_renumber(128);
+	test_assert(lookups2 < lookups1 + 16);
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*test_functions[])(void) = {
+		test_index_sort_renumber,
+		NULL
+	};
+
+	test_ctx = test_mail_storage_init(&argc, &argv);
+	return test_run(test_functions);
+}
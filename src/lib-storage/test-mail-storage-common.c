@@ -0,0 +1,151 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "abspath.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "unlink-directory.h"
+#include "master-service.h"
+#include "mail-storage-service.h"
+#include "mail-user.h"
+#include "mail-namespace.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#include <sys/stat.h>
+
+struct test_mail_storage_ctx *test_mail_storage_init(int *argc, char ***argv)
+{
+	struct test_mail_storage_ctx *ctx;
+	const char *cwd;
+	pool_t pool;
+
+	/* lib_deinit() is done by test_run(), so master_service_deinit()
+	   isn't called at all and the returned context isn't freed */
+	master_service = master_service_init("test-mail-storage",
+		MASTER_SERVICE_FLAG_STANDALONE |
+		MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+		MASTER_SERVICE_FLAG_NO_SSL_INIT, argc, argv, "");
+
+	pool = pool_alloconly_create("test mail storage", 1024);
+	ctx = p_new(pool, struct test_mail_storage_ctx, 1);
+	ctx->pool = pool;
+	if (t_get_current_dir(&cwd) < 0)
+		i_fatal("getcwd() failed: %m");
+	ctx->home_root = p_strdup_printf(pool, "%s/.test-mail-storage", cwd);
+	return ctx;
+}
+
+void test_mail_storage_init_user(struct test_mail_storage_ctx *ctx,
+				 const struct test_mail_storage_settings *set)
+{
+	struct mail_storage_service_input input;
+	ARRAY_TYPE(const_string) fields;
+	const char *driver, *home, *field, *const *extra, *error;
+
+	ctx->ioloop = io_loop_create();
+	ctx->storage_service = mail_storage_service_init(master_service, NULL,
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_CHDIR |
+		MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS);
+
+	(void)unlink_directory(ctx->home_root, UNLINK_DIRECTORY_FLAG_RMDIR);
+	if (mkdir(ctx->home_root, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", ctx->home_root);
+	home = t_strconcat(ctx->home_root, "/testuser", NULL);
+	driver = set != NULL && set->driver != NULL ? set->driver : "sdbox";
+
+	t_array_init(&fields, 8);
+	field = t_strconcat("home=", home, NULL);
+	array_append(&fields, &field, 1);
+	field = t_strdup_printf("mail=%s:~/mail", driver);
+	array_append(&fields, &field, 1);
+	if (set != NULL && set->extra_input != NULL) {
+		for (extra = set->extra_input; *extra != NULL; extra++)
+			array_append(&fields, extra, 1);
+	}
+	array_append_zero(&fields);
+
+	memset(&input, 0, sizeof(input));
+	input.username = "testuser";
+	input.no_userdb_lookup = TRUE;
+	input.userdb_fields = array_idx(&fields, 0);
+	if (mail_storage_service_lookup_next(ctx->storage_service, &input,
+					     &ctx->service_user, &ctx->user,
+					     &error) < 0)
+		i_fatal("mail_storage_service_lookup_next() failed: %s", error);
+}
+
+void test_mail_storage_deinit_user(struct test_mail_storage_ctx *ctx)
+{
+	mail_user_unref(&ctx->user);
+	mail_storage_service_user_free(&ctx->service_user);
+	mail_storage_service_deinit(&ctx->storage_service);
+	io_loop_destroy(&ctx->ioloop);
+	if (unlink_directory(ctx->home_root, UNLINK_DIRECTORY_FLAG_RMDIR) < 0)
+		i_error("unlink_directory(%s) failed: %m", ctx->home_root);
+}
+
+struct mailbox *
+test_mail_storage_mailbox_create(struct test_mail_storage_ctx *ctx,
+				 const char *name)
+{
+	struct mail_namespace *ns;
+	struct mailbox *box;
+
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	box = mailbox_alloc(ns->list, name, 0);
+	if (mailbox_create(box, NULL, FALSE) < 0 &&
+	    mailbox_get_last_mail_error(box) != MAIL_ERROR_EXISTS) {
+		i_fatal("mailbox_create(%s) failed: %s", name,
+			mailbox_get_last_error(box, NULL));
+	}
+	if (mailbox_open(box) < 0) {
+		i_fatal("mailbox_open(%s) failed: %s", name,
+			mailbox_get_last_error(box, NULL));
+	}
+	return box;
+}
+
+uint32_t test_mail_storage_save(struct mailbox *box, const char *headers,
+				const char *body)
+{
+	struct mailbox_transaction_context *t;
+	struct mail_save_context *save_ctx;
+	struct mail_transaction_commit_changes changes;
+	const struct seq_range *range;
+	struct istream *input;
+	const char *msg;
+	uint32_t uid;
+
+	msg = t_strdup_printf("%s\n%s", headers, body);
+	input = i_stream_create_from_data(msg, strlen(msg));
+	t = mailbox_transaction_begin(box,
+		MAILBOX_TRANSACTION_FLAG_EXTERNAL |
+		MAILBOX_TRANSACTION_FLAG_ASSIGN_UIDS);
+	save_ctx = mailbox_save_alloc(t);
+	if (mailbox_save_begin(&save_ctx, input) < 0)
+		i_fatal("mailbox_save_begin() failed");
+	while (i_stream_read(input) > 0) {
+		if (mailbox_save_continue(save_ctx) < 0)
+			i_fatal("mailbox_save_continue() failed");
+	}
+	if (mailbox_save_finish(&save_ctx) < 0)
+		i_fatal("mailbox_save_finish() failed");
+	if (mailbox_transaction_commit_get_changes(&t, &changes) < 0) {
+		i_fatal("mailbox_transaction_commit() failed: %s",
+			mailbox_get_last_error(box, NULL));
+	}
+	i_stream_unref(&input);
+
+	i_assert(seq_range_count(&changes.saved_uids) == 1);
+	range = array_idx(&changes.saved_uids, 0);
+	uid = range->seq1;
+	pool_unref(&changes.pool);
+	/* make the new message visible in the mailbox view */
+	if (mailbox_sync(box, 0) < 0)
+		i_fatal("mailbox_sync() failed");
+	return uid;
+}
@@ -0,0 +1,43 @@
+#ifndef TEST_MAIL_STORAGE_COMMON_H
+#define TEST_MAIL_STORAGE_COMMON_H
+
+#include "mail-storage.h"
+
+/* Helpers for unit tests that need a real mail user and mailboxes. The
+   user's home is created under a temporary directory, which is removed by
+   test_mail_storage_deinit_user(). */
+
+struct test_mail_storage_ctx {
+	pool_t pool;
+	struct ioloop *ioloop;
+	struct mail_storage_service_ctx *storage_service;
+	struct mail_storage_service_user *service_user;
+	struct mail_user *user;
+	const char *home_root;
+};
+
+struct test_mail_storage_settings {
+	/* default is "sdbox" */
+	const char *driver;
+	/* NULL-terminated list of extra key=value settings */
+	const char *const *extra_input;
+};
+
+/* argc/argv are passed to master_service_init(). This must be called only
+   once, before test_run(). */
+struct test_mail_storage_ctx *test_mail_storage_init(int *argc, char ***argv);
+
+void test_mail_storage_init_user(struct test_mail_storage_ctx *ctx,
+				 const struct test_mail_storage_settings *set);
+void test_mail_storage_deinit_user(struct test_mail_storage_ctx *ctx);
+
+/* Create and open a mailbox with the given name. */
+struct mailbox *
+test_mail_storage_mailbox_create(struct test_mail_storage_ctx *ctx,
+				 const char *name);
+/* Save a message with the given headers and body. Returns the saved
+   message's UID. */
+uint32_t test_mail_storage_save(struct mailbox *box, const char *headers,
+				const char *body);
+
+#endif
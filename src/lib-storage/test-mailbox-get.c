@@ -10,6 +10,8 @@ static uint32_t expunge_uids[] = { 25, 15, 7, 3, 11, 1, 53, 33 };
 static guid_128_t mail_guids[N_ELEMENTS(expunge_uids)];
 static unsigned int expunge_idx;
 static unsigned int nonexternal_idx;
+static bool get_changes;
+static unsigned int change_idx;
 
 void mail_index_lookup_uid(struct mail_index_view *view ATTR_UNUSED,
 			   uint32_t seq, uint32_t *uid_r)
@@ -46,7 +48,10 @@ int mail_transaction_log_view_set(struct mail_transaction_log_view *view ATTR_UN
 	return 1;
 }
 
-void mail_transaction_log_view_close(struct mail_transaction_log_view **view ATTR_UNUSED) { }
+void mail_transaction_log_view_close(struct mail_transaction_log_view **view ATTR_UNUSED)
+{
+	change_idx = 0;
+}
 
 void mail_transaction_log_get_tail(struct mail_transaction_log *log ATTR_UNUSED,
 				   uint32_t *file_seq_r)
@@ -54,6 +59,66 @@ void mail_transaction_log_get_tail(struct mail_transaction_log *log ATTR_UNUSED,
 	*file_seq_r = 100;
 }
 
+static int
+test_log_view_next_change(const struct mail_transaction_header **hdr_r,
+			  const void **data_r)
+{
+	static struct mail_transaction_header hdr;
+	static struct mail_transaction_flag_update flag_update;
+	static struct mail_transaction_keyword_reset kw_reset;
+	static struct mail_transaction_modseq_update modseq_updates[2];
+	static struct mail_transaction_expunge expunge;
+	static uint32_t kw_update[2 + 4];
+	struct mail_transaction_keyword_update *kw;
+
+	memset(&hdr, 0, sizeof(hdr));
+	switch (change_idx++) {
+	case 0:
+		flag_update.uid1 = 5;
+		flag_update.uid2 = 7;
+		hdr.type = MAIL_TRANSACTION_FLAG_UPDATE;
+		hdr.size = sizeof(flag_update);
+		*data_r = &flag_update;
+		break;
+	case 1:
+		/* keyword name "foo" is padded to 4 bytes */
+		kw = (void *)kw_update;
+		kw->modify_type = MODIFY_ADD;
+		kw->name_size = 3;
+		memcpy(kw + 1, "foo", 3);
+		kw_update[2] = 10; kw_update[3] = 10;
+		kw_update[4] = 12; kw_update[5] = 13;
+		hdr.type = MAIL_TRANSACTION_KEYWORD_UPDATE;
+		hdr.size = sizeof(kw_update);
+		*data_r = kw_update;
+		break;
+	case 2:
+		kw_reset.uid1 = kw_reset.uid2 = 20;
+		hdr.type = MAIL_TRANSACTION_KEYWORD_RESET;
+		hdr.size = sizeof(kw_reset);
+		*data_r = &kw_reset;
+		break;
+	case 3:
+		/* uid=0 is the highest-modseq, not a message */
+		modseq_updates[0].uid = 0;
+		modseq_updates[1].uid = 30;
+		hdr.type = MAIL_TRANSACTION_MODSEQ_UPDATE;
+		hdr.size = sizeof(modseq_updates);
+		*data_r = modseq_updates;
+		break;
+	case 4:
+		expunge.uid1 = expunge.uid2 = 40;
+		hdr.type = MAIL_TRANSACTION_EXPUNGE | MAIL_TRANSACTION_EXTERNAL;
+		hdr.size = sizeof(expunge);
+		*data_r = &expunge;
+		break;
+	default:
+		return 0;
+	}
+	*hdr_r = &hdr;
+	return 1;
+}
+
 int mail_transaction_log_view_next(struct mail_transaction_log_view *view ATTR_UNUSED,
 				   const struct mail_transaction_header **hdr_r,
 				   const void **data_r)
@@ -62,6 +127,8 @@ int mail_transaction_log_view_next(struct mail_transaction_log_view *view ATTR_U
 	static struct mail_transaction_expunge_guid exp;
 	static struct mail_transaction_expunge old_exp;
 
+	if (get_changes)
+		return test_log_view_next_change(hdr_r, data_r);
 	if (expunge_idx == N_ELEMENTS(expunge_uids))
 		return 0;
 
@@ -141,10 +208,51 @@ static void test_mailbox_get_expunges(void)
 	test_end();
 }
 
+static void test_mailbox_get_changed_uids(void)
+{
+	struct mailbox *box;
+	ARRAY_TYPE(seq_range) changed_uids;
+	const struct seq_range *range;
+	unsigned int count;
+
+	box = t_new(struct mailbox, 1);
+	box->index = t_new(struct mail_index, 1);
+	box->view = t_new(struct mail_index_view, 1);
+
+	box->view->log_file_head_seq = 101;
+	box->view->log_file_head_offset = 1024;
+
+	test_begin("mailbox get changed uids");
+	get_changes = TRUE;
+
+	t_array_init(&changed_uids, 32);
+	test_assert(mailbox_get_changed_uids(box, 99ULL << 32, &changed_uids));
+	range = array_get(&changed_uids, &count);
+	test_assert(count == 5);
+	test_assert(range[0].seq1 == 5 && range[0].seq2 == 7);
+	test_assert(range[1].seq1 == 10 && range[1].seq2 == 10);
+	test_assert(range[2].seq1 == 12 && range[2].seq2 == 13);
+	test_assert(range[3].seq1 == 20 && range[3].seq2 == 20);
+	test_assert(range[4].seq1 == 30 && range[4].seq2 == 30);
+
+	/* the log doesn't go back this far anymore */
+	array_clear(&changed_uids);
+	test_assert(!mailbox_get_changed_uids(box, 98ULL << 32, &changed_uids));
+
+	/* nothing has changed since the head */
+	test_assert(mailbox_get_changed_uids(box, (101ULL << 32) | 1024,
+					     &changed_uids));
+	test_assert(array_count(&changed_uids) == 0);
+
+	get_changes = FALSE;
+	test_end();
+}
+
 int main(void)
 {
 	static void (*test_functions[])(void) = {
 		test_mailbox_get_expunges,
+		test_mailbox_get_changed_uids,
 		NULL
 	};
 	unsigned int i, j;
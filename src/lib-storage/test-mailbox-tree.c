@@ -0,0 +1,157 @@
+/* Copyright (c) 2015 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "test-common.h"
+#include "mailbox-tree.h"
+
+static const char *tree_get_paths(struct mailbox_tree_context *tree)
+{
+	struct mailbox_tree_iterate_context *iter;
+	const char *path;
+	string_t *str = t_str_new(128);
+
+	iter = mailbox_tree_iterate_init(tree, NULL, 0);
+	while (mailbox_tree_iterate_next(iter, &path) != NULL) {
+		if (str_len(str) > 0)
+			str_append_c(str, ' ');
+		str_append(str, path);
+	}
+	mailbox_tree_iterate_deinit(&iter);
+	return str_c(str);
+}
+
+static void test_mailbox_tree_get(void)
+{
+	struct mailbox_tree_context *tree;
+	struct mailbox_node *node, *node2;
+	bool created;
+
+	test_begin("mailbox tree get");
+	tree = mailbox_tree_init('/');
+	mailbox_tree_set_parents_nonexistent(tree);
+
+	node = mailbox_tree_get(tree, "b/c", &created);
+	test_assert(created && strcmp(node->name, "c") == 0);
+	test_assert(node->flags == 0);
+	test_assert(node->parent->flags == MAILBOX_NONEXISTENT);
+	test_assert(mailbox_tree_get(tree, "b/c", &created) == node && !created);
+	(void)mailbox_tree_get(tree, "a", &created);
+	(void)mailbox_tree_get(tree, "b/a", &created);
+	(void)mailbox_tree_get(tree, "inbox/x", &created);
+
+	/* siblings are kept in the order they were added */
+	test_assert(strcmp(tree_get_paths(tree), "b b/c b/a a INBOX INBOX/x") == 0);
+
+	test_assert(mailbox_tree_lookup(tree, "b/c") == node);
+	test_assert(mailbox_tree_lookup(tree, "b") == node->parent);
+	test_assert(mailbox_tree_lookup(tree, "b/d") == NULL);
+	test_assert(mailbox_tree_lookup(tree, "c") == NULL);
+	test_assert(mailbox_tree_lookup(tree, "a/c") == NULL);
+	node2 = mailbox_tree_lookup(tree, "Inbox/x");
+	test_assert(node2 != NULL && strcmp(node2->name, "x") == 0);
+
+	/* new nodes get appended after the sorted nodes */
+	mailbox_tree_sort(tree);
+	test_assert(strcmp(tree_get_paths(tree), "INBOX INBOX/x a b b/a b/c") == 0);
+	(void)mailbox_tree_get(tree, "b/0", &created);
+	(void)mailbox_tree_get(tree, "0", &created);
+	test_assert(strcmp(tree_get_paths(tree), "INBOX INBOX/x a b b/a b/c b/0 0") == 0);
+
+	mailbox_tree_clear(tree);
+	test_assert(mailbox_tree_lookup(tree, "b") == NULL);
+	(void)mailbox_tree_get(tree, "b", &created);
+	test_assert(created);
+	test_assert(strcmp(tree_get_paths(tree), "b") == 0);
+	mailbox_tree_deinit(&tree);
+	test_end();
+}
+
+static void test_mailbox_tree_dup(void)
+{
+	struct mailbox_tree_context *tree, *tree2;
+	bool created;
+
+	test_begin("mailbox tree dup");
+	tree = mailbox_tree_init('/');
+	(void)mailbox_tree_get(tree, "x/y/z", &created);
+	(void)mailbox_tree_get(tree, "a", &created);
+	(void)mailbox_tree_get(tree, "x/b", &created);
+
+	tree2 = mailbox_tree_dup(tree);
+	mailbox_tree_deinit(&tree);
+	test_assert(strcmp(tree_get_paths(tree2), "x x/y x/y/z x/b a") == 0);
+	test_assert(mailbox_tree_lookup(tree2, "x/y/z") != NULL);
+	(void)mailbox_tree_get(tree2, "x/y/z", &created);
+	test_assert(!created);
+	(void)mailbox_tree_get(tree2, "x/c", &created);
+	test_assert(created);
+	test_assert(strcmp(tree_get_paths(tree2), "x x/y x/y/z x/b x/c a") == 0);
+	mailbox_tree_deinit(&tree2);
+	test_end();
+}
+
+static void test_mailbox_tree_set_separator(void)
+{
+	struct mailbox_tree_context *tree;
+	bool created;
+
+	test_begin("mailbox tree set separator");
+	tree = mailbox_tree_init('/');
+	(void)mailbox_tree_get(tree, "x/y", &created);
+	mailbox_tree_set_separator(tree, '.');
+	test_assert(mailbox_tree_lookup(tree, "x/y") == NULL);
+	test_assert(mailbox_tree_lookup(tree, "x.y") != NULL);
+	(void)mailbox_tree_get(tree, "x.y", &created);
+	test_assert(!created);
+	test_assert(strcmp(tree_get_paths(tree), "x x.y") == 0);
+	mailbox_tree_deinit(&tree);
+	test_end();
+}
+
+static void test_mailbox_tree_many_siblings(void)
+{
+	struct mailbox_tree_context *tree;
+	struct mailbox_tree_iterate_context *iter;
+	struct mailbox_node *node;
+	const char *path;
+	unsigned int i;
+	bool created;
+
+	test_begin("mailbox tree many siblings");
+	tree = mailbox_tree_init('/');
+	for (i = 0; i < 100000; i++) {
+		node = mailbox_tree_get(tree, t_strdup_printf("p/%u", i),
+					&created);
+		test_assert(created);
+	}
+	for (i = 0; i < 100000; i += 7) {
+		node = mailbox_tree_lookup(tree, t_strdup_printf("p/%u", i));
+		test_assert(node != NULL &&
+			    strcmp(node->name, dec2str(i)) == 0);
+	}
+
+	i = 0;
+	iter = mailbox_tree_iterate_init(tree, mailbox_tree_lookup(tree, "p"), 0);
+	(void)mailbox_tree_iterate_next(iter, &path);
+	while (mailbox_tree_iterate_next(iter, &path) != NULL) {
+		test_assert(strcmp(path, t_strdup_printf("p/%u", i)) == 0);
+		i++;
+	}
+	mailbox_tree_iterate_deinit(&iter);
+	test_assert(i == 100000);
+	mailbox_tree_deinit(&tree);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mailbox_tree_get,
+		test_mailbox_tree_dup,
+		test_mailbox_tree_set_separator,
+		test_mailbox_tree_many_siblings,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -129,6 +129,57 @@ void array_sort_i(struct array *array, int (*cmp)(const void *, const void *))
 	      count, array->element_size, cmp);
 }
 
+static void
+array_heap_sift_down(unsigned char *data, unsigned int idx,
+		     unsigned int count, size_t size, void *tmp,
+		     int (*cmp)(const void *, const void *))
+{
+	unsigned int child;
+
+	/* the heap's top is the element that sorts last */
+	while ((child = idx*2 + 1) < count) {
+		if (child + 1 < count &&
+		    cmp(data + child*size, data + (child+1)*size) < 0)
+			child++;
+		if (cmp(data + idx*size, data + child*size) >= 0)
+			break;
+		memcpy(tmp, data + idx*size, size);
+		memcpy(data + idx*size, data + child*size, size);
+		memcpy(data + child*size, tmp, size);
+		idx = child;
+	}
+}
+
+void array_sort_partial_i(struct array *array, unsigned int limit,
+			  int (*cmp)(const void *, const void *))
+{
+	unsigned char *data;
+	unsigned int i, count;
+	size_t size = array->element_size;
+	void *tmp;
+
+	count = array_count_i(array);
+	if (limit >= count) {
+		array_sort_i(array, cmp);
+		return;
+	}
+
+	/* keep the limit first elements in a heap. replace its top whenever
+	   an element sorting before it is found. */
+	data = buffer_get_modifiable_data(array->buffer, NULL);
+	tmp = t_malloc(size);
+	for (i = limit / 2; i > 0; i--)
+		array_heap_sift_down(data, i-1, limit, size, tmp, cmp);
+	for (i = limit; i < count && limit > 0; i++) {
+		if (cmp(data + i*size, data) < 0) {
+			memcpy(data, data + i*size, size);
+			array_heap_sift_down(data, 0, limit, size, tmp, cmp);
+		}
+	}
+	buffer_set_used_size(array->buffer, limit * size);
+	qsort(data, limit, size, cmp);
+}
+
 void *array_bsearch_i(struct array *array, const void *key,
 		     int (*cmp)(const void *, const void *))
 {
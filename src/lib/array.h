@@ -337,6 +337,17 @@ void array_sort_i(struct array *array, int (*cmp)(const void *, const void *));
 						typeof(*(array)->v))), \
 		(int (*)(const void *, const void *))cmp)
 
+/* Like array_sort(), but only the first limit elements in the sort order
+   are kept in the array. This is faster than sorting everything when
+   limit is small compared to the array size. */
+void array_sort_partial_i(struct array *array, unsigned int limit,
+			  int (*cmp)(const void *, const void *));
+#define array_sort_partial(array, limit, cmp) \
+	array_sort_partial_i(&(array)->arr + \
+		CALLBACK_TYPECHECK(cmp, int (*)(typeof(*(array)->v), \
+						typeof(*(array)->v))), \
+		limit, (int (*)(const void *, const void *))cmp)
+
 void *array_bsearch_i(struct array *array, const void *key,
 		      int (*cmp)(const void *, const void *));
 #define array_bsearch(array, key, cmp) \
@@ -727,8 +727,14 @@ static off_t io_stream_sendfile(struct ostream_private *outstream,
 		offset = instream->real_stream->abs_start_offset + v_offset;
 		send_size = in_size - v_offset;
 
-		ret = safe_sendfile(foutstream->fd, in_fd, &offset,
-				    MAX_SSIZE_T(send_size));
+		if (foutstream->file) {
+			ret = safe_copy_file_range(foutstream->fd, in_fd,
+						   &offset,
+						   MAX_SSIZE_T(send_size));
+		} else {
+			ret = safe_sendfile(foutstream->fd, in_fd, &offset,
+					    MAX_SSIZE_T(send_size));
+		}
 		if (ret <= 0) {
 			if (ret == 0)
 				break;
@@ -743,9 +749,11 @@ static off_t io_stream_sendfile(struct ostream_private *outstream,
 					break;
 				}
 			}
-			if (errno == EINVAL)
+			if (errno == EINVAL && v_offset == start_offset) {
+				/* nothing was sent yet, so the caller can
+				   still fallback to copying */
 				*sendfile_not_supported_r = TRUE;
-			else {
+			} else {
 				outstream->ostream.stream_errno = errno;
 				/* close only if error wasn't because
 				   sendfile() isn't supported */
@@ -762,9 +770,8 @@ static off_t io_stream_sendfile(struct ostream_private *outstream,
 
 	i_stream_seek(instream, v_offset);
 	if (ret == 0) {
-		/* we should be at EOF. if not, write more. */
-		i_assert(!foutstream->file ||
-			 instream->v_offset - start_offset == in_size);
+		/* we should be at EOF, unless the input file was just
+		   truncated. if not, write more. */
 		if (i_stream_read(instream) > 0) {
 			if (io_stream_sendfile(outstream, instream, in_fd,
 					       sendfile_not_supported_r) < 0)
@@ -1041,3 +1048,16 @@ struct ostream *o_stream_create_fd_file_autoclose(int *fd, uoff_t offset)
 	*fd = -1;
 	return output;
 }
+
+struct ostream *
+o_stream_create_fd_file_copy(int fd, uoff_t offset, bool autoclose_fd)
+{
+	struct ostream *output;
+	struct file_ostream *fstream;
+
+	output = o_stream_create_fd_file(fd, offset, autoclose_fd);
+	fstream = (struct file_ostream *)output->real_stream;
+	/* file-to-file copies use copy_file_range() */
+	fstream->no_sendfile = !fstream->file;
+	return output;
+}
@@ -38,6 +38,12 @@ struct ostream *o_stream_create_fd_autoclose(int *fd, size_t max_buffer_size);
 struct ostream *
 o_stream_create_fd_file(int fd, uoff_t offset, bool autoclose_fd);
 struct ostream *o_stream_create_fd_file_autoclose(int *fd, uoff_t offset);
+/* Same as o_stream_create_fd_file(), but the stream is used for copying
+   files. o_stream_send_istream() from another regular file is done with
+   copy_file_range(), which allows the filesystem to share the data blocks
+   between the files. */
+struct ostream *
+o_stream_create_fd_file_copy(int fd, uoff_t offset, bool autoclose_fd);
 /* Create an output stream to a buffer. */
 struct ostream *o_stream_create_buffer(buffer_t *buf);
 /* Create an output streams that always fails the writes. */
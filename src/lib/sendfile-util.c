@@ -12,6 +12,11 @@
 #include "lib.h"
 #include "sendfile-util.h"
 
+#ifdef __linux__
+#  include <unistd.h>
+#  include <sys/syscall.h>
+#endif
+
 #ifdef HAVE_LINUX_SENDFILE
 
 #include <sys/sendfile.h>
@@ -140,3 +145,43 @@ ssize_t safe_sendfile(int out_fd ATTR_UNUSED, int in_fd ATTR_UNUSED,
 }
 
 #endif
+
+#ifdef SYS_copy_file_range
+ssize_t safe_copy_file_range(int out_fd, int in_fd, uoff_t *offset,
+			     size_t count)
+{
+	/* the kernel's loff_t is 64bit even if off_t isn't */
+	int64_t in_offset;
+	ssize_t ret;
+
+	if (count == 0)
+		return 0;
+	if (*offset >= (uoff_t)INT64_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	in_offset = (int64_t)*offset;
+	ret = syscall(SYS_copy_file_range, in_fd, &in_offset, out_fd, NULL,
+		      count, 0);
+	if (ret < 0) {
+		/* older kernel, copying across filesystems or out_fd is
+		   opened with O_APPEND. return EINVAL for all of them to
+		   make the caller fallback to a regular copy. */
+		if (errno == ENOSYS || errno == EXDEV ||
+		    errno == EOPNOTSUPP || errno == EBADF)
+			errno = EINVAL;
+		return -1;
+	}
+	*offset = (uoff_t)in_offset;
+	return ret;
+}
+#else
+ssize_t safe_copy_file_range(int out_fd ATTR_UNUSED, int in_fd ATTR_UNUSED,
+			     uoff_t *offset ATTR_UNUSED,
+			     size_t count ATTR_UNUSED)
+{
+	errno = EINVAL;
+	return -1;
+}
+#endif
@@ -5,5 +5,11 @@
    it isn't supported for some reason (out_fd isn't a socket, offset is too
    large, or there simply is no sendfile()). */
 ssize_t safe_sendfile(int out_fd, int in_fd, uoff_t *offset, size_t count);
+/* Same as safe_sendfile(), but for copying between regular files with
+   copy_file_range(). The filesystem may share the data blocks between the
+   files (reflink) instead of copying them. out_fd is written at its current
+   offset. */
+ssize_t safe_copy_file_range(int out_fd, int in_fd, uoff_t *offset,
+			     size_t count);
 
 #endif
@@ -229,11 +229,39 @@ static void test_array_cmp_str(void)
 	test_end();
 }
 
+static void test_array_sort_partial(void)
+{
+	ARRAY(int) intarr;
+	int input[100], sorted[100];
+	const int *output;
+	unsigned int i, j, limit, count;
+
+	test_begin("array_sort_partial");
+	for (i = 0; i < N_ELEMENTS(input); i++)
+		input[i] = sorted[i] = rand() % 50;
+	qsort(sorted, N_ELEMENTS(sorted), sizeof(int),
+	      (int (*)(const void *, const void *))test_int_compare);
+
+	t_array_init(&intarr, N_ELEMENTS(input));
+	for (limit = 0; limit <= N_ELEMENTS(input) + 1; limit++) {
+		array_clear(&intarr);
+		array_append(&intarr, input, N_ELEMENTS(input));
+		array_sort_partial(&intarr, limit, test_int_compare);
+
+		output = array_get(&intarr, &count);
+		test_assert_idx(count == I_MIN(limit, N_ELEMENTS(input)), limit);
+		for (j = 0; j < count; j++)
+			test_assert_idx(output[j] == sorted[j], limit);
+	}
+	test_end();
+}
+
 void test_array(void)
 {
 	test_array_count();
 	test_array_foreach();
 	test_array_reverse();
+	test_array_sort_partial();
 	test_array_cmp();
 	test_array_cmp_str();
 	test_array_swap();
@@ -4,6 +4,7 @@
 #include "str.h"
 #include "safe-mkstemp.h"
 #include "randgen.h"
+#include "istream.h"
 #include "ostream.h"
 
 #include <stdlib.h>
@@ -57,6 +58,61 @@ static void test_ostream_file_random(void)
 	i_close_fd(&fd);
 }
 
+static int test_ostream_file_create_tmp(void)
+{
+	string_t *path = t_str_new(128);
+	int fd;
+
+	fd = safe_mkstemp(path, 0600, (uid_t)-1, (gid_t)-1);
+	if (fd == -1)
+		i_fatal("safe_mkstemp(%s) failed: %m", str_c(path));
+	if (unlink(str_c(path)) < 0)
+		i_fatal("unlink(%s) failed: %m", str_c(path));
+	return fd;
+}
+
+static void test_ostream_file_send_istream_file(bool copy)
+{
+	struct istream *input, *input2;
+	struct ostream *output;
+	char buf[MAX_BUFSIZE*4], buf2[MAX_BUFSIZE*4];
+	unsigned int offset, size;
+	int in_fd, out_fd;
+
+	in_fd = test_ostream_file_create_tmp();
+	out_fd = test_ostream_file_create_tmp();
+
+	random_fill_weak(buf, sizeof(buf));
+	if (write(in_fd, buf, sizeof(buf)) != sizeof(buf))
+		i_fatal("write() failed: %m");
+
+	/* buffered data + a range of the input file + buffered data */
+	offset = rand() % MAX_BUFSIZE;
+	size = (rand() % MAX_BUFSIZE) + 1;
+	input = i_stream_create_fd(in_fd, MAX_BUFSIZE, FALSE);
+	i_stream_seek(input, offset);
+	input2 = i_stream_create_limit(input, size);
+	output = copy ? o_stream_create_fd_file_copy(out_fd, 0, FALSE) :
+		o_stream_create_fd_file(out_fd, 0, FALSE);
+	test_assert(o_stream_send(output, "header", 6) == 6);
+	test_assert(o_stream_send_istream(output, input2) == (off_t)size);
+	test_assert(input2->v_offset == size);
+	test_assert(output->offset == 6 + size);
+	test_assert(o_stream_send(output, "footer", 6) == 6);
+	test_assert(o_stream_nfinish(output) == 0);
+
+	test_assert(pread(out_fd, buf2, sizeof(buf2), 0) == (ssize_t)(size + 12));
+	test_assert(memcmp(buf2, "header", 6) == 0);
+	test_assert(memcmp(buf2 + 6, buf + offset, size) == 0);
+	test_assert(memcmp(buf2 + 6 + size, "footer", 6) == 0);
+
+	o_stream_unref(&output);
+	i_stream_unref(&input2);
+	i_stream_unref(&input);
+	i_close_fd(&in_fd);
+	i_close_fd(&out_fd);
+}
+
 void test_ostream_file(void)
 {
 	unsigned int i;
@@ -66,4 +122,16 @@ void test_ostream_file(void)
 		test_ostream_file_random();
 	} T_END;
 	test_end();
+
+	test_begin("ostream send_istream file");
+	for (i = 0; i < 10; i++) T_BEGIN {
+		test_ostream_file_send_istream_file(FALSE);
+	} T_END;
+	test_end();
+
+	test_begin("ostream send_istream file copy");
+	for (i = 0; i < 10; i++) T_BEGIN {
+		test_ostream_file_send_istream_file(TRUE);
+	} T_END;
+	test_end();
 }
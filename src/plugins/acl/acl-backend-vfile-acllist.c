@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "str.h"
+#include "hash.h"
 #include "safe-mkstemp.h"
 #include "istream.h"
 #include "ostream.h"
@@ -32,12 +33,27 @@ acllist_clear(struct acl_backend_vfile *backend, uoff_t file_size)
 			pool_alloconly_create("vfile acllist",
 					      I_MAX(file_size / 2, 128));
 		i_array_init(&backend->acllist, I_MAX(16, file_size / 60));
+		hash_table_create(&backend->acllist_hash, default_pool, 0,
+				  str_hash, strcmp);
 	} else {
+		hash_table_clear(backend->acllist_hash, TRUE);
 		p_clear(backend->acllist_pool);
 		array_clear(&backend->acllist);
 	}
 }
 
+static void
+acllist_add(struct acl_backend_vfile *backend,
+	    const struct acl_backend_vfile_acllist *acllist)
+{
+	char *name = (char *)acllist->name;
+
+	array_append(&backend->acllist, acllist, 1);
+	/* name => index+1 */
+	hash_table_update(backend->acllist_hash, name,
+			  POINTER_CAST(array_count(&backend->acllist)));
+}
+
 static bool acl_list_get_root_dir(struct acl_backend_vfile *backend,
 				  const char **root_dir_r,
 				  enum mailbox_list_path_type *type_r)
@@ -143,7 +159,7 @@ static int acl_backend_vfile_acllist_read(struct acl_backend_vfile *backend)
 			return -1;
 		}
 		acllist.name = p_strdup(backend->acllist_pool, p + 1);
-		array_append(&backend->acllist, &acllist, 1);
+		acllist_add(backend, &acllist);
 	}
 	if (input->stream_errno != 0)
 		ret = -1;
@@ -196,7 +212,7 @@ acllist_append(struct acl_backend_vfile *backend, struct ostream *output,
 
 	if (ret > 0) {
 		acllist.name = p_strdup(backend->acllist_pool, name);
-		array_append(&backend->acllist, &acllist, 1);
+		acllist_add(backend, &acllist);
 
 		T_BEGIN {
 			const char *line;
@@ -343,13 +359,13 @@ static const struct acl_backend_vfile_acllist *
 acl_backend_vfile_acllist_find(struct acl_backend_vfile *backend,
 			       const char *name)
 {
-	const struct acl_backend_vfile_acllist *acllist;
+	unsigned int idx;
 
-	array_foreach(&backend->acllist, acllist) {
-		if (strcmp(acllist->name, name) == 0)
-			return acllist;
-	}
-	return NULL;
+	if (backend->acllist_pool == NULL)
+		return NULL;
+	idx = POINTER_CAST_TO(hash_table_lookup(backend->acllist_hash, name),
+			      unsigned int);
+	return idx == 0 ? NULL : array_idx(&backend->acllist, idx-1);
 }
 
 void acl_backend_vfile_acllist_verify(struct acl_backend_vfile *backend,
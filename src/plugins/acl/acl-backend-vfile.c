@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "ioloop.h"
 #include "array.h"
+#include "hash.h"
 #include "istream.h"
 #include "nfs-workarounds.h"
 #include "mail-storage-private.h"
@@ -91,6 +92,7 @@ static void acl_backend_vfile_deinit(struct acl_backend *_backend)
 		(struct acl_backend_vfile *)_backend;
 
 	if (backend->acllist_pool != NULL) {
+		hash_table_destroy(&backend->acllist_hash);
 		array_free(&backend->acllist);
 		pool_unref(&backend->acllist_pool);
 	}
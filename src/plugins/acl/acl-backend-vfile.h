@@ -41,6 +41,8 @@ struct acl_backend_vfile {
 
 	pool_t acllist_pool;
 	ARRAY(struct acl_backend_vfile_acllist) acllist;
+	/* name => acllist index+1 */
+	HASH_TABLE(char *, void *) acllist_hash;
 
 	time_t acllist_last_check;
 	time_t acllist_mtime;
@@ -205,6 +205,8 @@ fts_mailbox_search_init(struct mailbox_transaction_context *t,
 
 	if (!fts_backend_can_lookup(flist->backend, args->args))
 		return ctx;
+	/* the results depend on the FTS index */
+	ctx->no_result_cache = TRUE;
 
 	fctx = i_new(struct fts_search_context, 1);
 	fctx->box = t->box;
@@ -31,7 +31,9 @@ static struct stats_parser_field mail_stats_fields[] = {
 	EN("mail_lookup_attr", trans_lookup_attr),
 	EN("mail_read_count", trans_files_read_count),
 	EN("mail_read_bytes", trans_files_read_bytes),
-	EN("mail_cache_hits", trans_cache_hit_count)
+	EN("mail_cache_hits", trans_cache_hit_count),
+	EN("mail_prefetch_hits", trans_prefetch_hit_count),
+	EN("mail_prefetch_misses", trans_prefetch_miss_count)
 };
 
 static size_t mail_stats_alloc_size(void)
@@ -86,7 +88,9 @@ mail_stats_have_changed(const struct stats *_prev, const struct stats *_cur)
 	    cur->trans_lookup_attr != prev->trans_lookup_attr ||
 	    cur->trans_files_read_count != prev->trans_files_read_count ||
 	    cur->trans_files_read_bytes != prev->trans_files_read_bytes ||
-	    cur->trans_cache_hit_count != prev->trans_cache_hit_count)
+	    cur->trans_cache_hit_count != prev->trans_cache_hit_count ||
+	    cur->trans_prefetch_hit_count != prev->trans_prefetch_hit_count ||
+	    cur->trans_prefetch_miss_count != prev->trans_prefetch_miss_count)
 		return TRUE;
 
 	/* allow a tiny bit of changes that are caused by this
@@ -136,6 +140,8 @@ void mail_stats_add_transaction(struct mail_stats *stats,
 	stats->trans_files_read_count += trans_stats->files_read_count;
 	stats->trans_files_read_bytes += trans_stats->files_read_bytes;
 	stats->trans_cache_hit_count += trans_stats->cache_hit_count;
+	stats->trans_prefetch_hit_count += trans_stats->prefetch_hit_count;
+	stats->trans_prefetch_miss_count += trans_stats->prefetch_miss_count;
 }
 
 const struct stats_vfuncs mail_stats_vfuncs = {
@@ -178,6 +178,8 @@ static void stats_transaction_free(struct stats_user *suser,
 	dest->files_read_count += src->files_read_count;
 	dest->files_read_bytes += src->files_read_bytes;
 	dest->cache_hit_count += src->cache_hit_count;
+	dest->prefetch_hit_count += src->prefetch_hit_count;
+	dest->prefetch_miss_count += src->prefetch_miss_count;
 	i_free(strans);
 }
 
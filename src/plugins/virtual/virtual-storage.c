@@ -403,6 +403,8 @@ static void virtual_mailbox_close_internal(struct virtual_mailbox *mbox)
 		mailbox_free(&bboxes[i]->box);
 		if (array_is_created(&bboxes[i]->sync_outside_expunges))
 			array_free(&bboxes[i]->sync_outside_expunges);
+		if (array_is_created(&bboxes[i]->sync_changed_uids))
+			array_free(&bboxes[i]->sync_changed_uids);
 		array_free(&bboxes[i]->sync_pending_removes);
 		array_free(&bboxes[i]->uids);
 	}
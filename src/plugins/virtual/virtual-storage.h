@@ -92,6 +92,10 @@ struct virtual_backend_box {
 	/* another process expunged these UIDs. they need to be removed on
 	   next sync. */
 	ARRAY_TYPE(seq_range) sync_outside_expunges;
+	/* UIDs whose flags may have changed since the previous sync. Used
+	   to copy only their flags to the virtual index during the first sync
+	   in this process. */
+	ARRAY_TYPE(seq_range) sync_changed_uids;
 
 	/* name contains a wildcard, this is a glob for it */
 	struct imap_match_glob *glob;
@@ -99,6 +103,11 @@ struct virtual_backend_box {
 
 	unsigned int open_failed:1;
 	unsigned int sync_seen:1;
+	/* uids were updated from the backend mailbox during this sync. the
+	   search_result can't be used for checking this, because the mailbox
+	   may have been already closed to keep the number of open mailboxes
+	   low. */
+	unsigned int sync_uids_updated:1;
 	unsigned int wildcard:1;
 	unsigned int clear_recent:1;
 	unsigned int uids_nonsorted:1;
@@ -157,6 +166,9 @@ struct virtual_mailbox {
 
 	unsigned int uids_mapped:1;
 	unsigned int sync_initialized:1;
+	/* header read while opening the mailbox noticed that the mailbox
+	   list needs to be rewritten. do it on the next sync. */
+	unsigned int ext_header_rewrite:1;
 	unsigned int inconsistent:1;
 	unsigned int have_guid_flags_set:1;
 	unsigned int have_guids:1;
@@ -149,7 +149,7 @@ int virtual_mailbox_ext_header_read(struct virtual_mailbox *mbox,
 	const struct virtual_mail_index_header *ext_hdr;
 	const struct mail_index_header *hdr;
 	const struct virtual_mail_index_mailbox_record *mailboxes;
-	struct virtual_backend_box *bbox, **bboxes;
+	struct virtual_backend_box *bbox, **bboxes, *const *bboxp;
 	const void *ext_data;
 	size_t ext_size;
 	unsigned int i, count, ext_name_offset, ext_mailbox_count;
@@ -191,6 +191,11 @@ int virtual_mailbox_ext_header_read(struct virtual_mailbox *mbox,
 		}
 	}
 
+	/* mailbox IDs that were assigned by an earlier read, but not yet
+	   written to the header, are invalid now. they're reassigned below. */
+	array_foreach(&mbox->backend_boxes, bboxp)
+		(*bboxp)->mailbox_id = 0;
+
 	/* update mailbox backends */
 	prev_mailbox_id = 0;
 	for (i = 0; i < ext_mailbox_count; i++) {
@@ -256,6 +261,8 @@ int virtual_mailbox_ext_header_read(struct virtual_mailbox *mbox,
 	}
 	/* sort the backend mailboxes by mailbox_id. */
 	array_sort(&mbox->backend_boxes, bbox_mailbox_id_cmp);
+	if (ret == 0)
+		mbox->ext_header_rewrite = TRUE;
 	return ret;
 }
 
@@ -756,16 +763,36 @@ static int virtual_sync_backend_box_continue(struct virtual_sync_context *ctx,
 	old_highest_modseq = mail_index_modseq_get_highest(view);
 
 	t_array_init(&flag_update_uids, I_MIN(128, old_msg_count));
-	if (bbox->sync_highest_modseq < old_highest_modseq) {
-		for (seq = 1; seq <= old_msg_count; seq++) {
-			modseq = mail_index_modseq_lookup(view, seq);
-			if (modseq > bbox->sync_highest_modseq) {
-				mail_index_lookup_uid(view, seq, &uid);
-				seq_range_array_add(&flag_update_uids, uid);
+	if (bbox->sync_highest_modseq < old_highest_modseq &&
+	    old_msg_count > 0) {
+		/* the transaction log usually still has all the changes since
+		   the last sync, so the changed UIDs can be found without
+		   looking up every message's modseq. this is done only for
+		   changed backends, so there's no need to fall back to the
+		   scan even when most of them have changed: opening and
+		   syncing the backends costs far more than reading the log. */
+		if (mailbox_get_changed_uids(bbox->box,
+					     bbox->sync_highest_modseq,
+					     &flag_update_uids)) {
+			seq_range_array_remove_range(&flag_update_uids,
+				bbox->sync_next_uid, (uint32_t)-1);
+		} else {
+			array_clear(&flag_update_uids);
+			for (seq = 1; seq <= old_msg_count; seq++) {
+				modseq = mail_index_modseq_lookup(view, seq);
+				if (modseq > bbox->sync_highest_modseq) {
+					mail_index_lookup_uid(view, seq, &uid);
+					seq_range_array_add(&flag_update_uids,
+							    uid);
+				}
 			}
 		}
 	}
 
+	if (!array_is_created(&bbox->sync_changed_uids))
+		i_array_init(&bbox->sync_changed_uids, 32);
+	array_append_array(&bbox->sync_changed_uids, &flag_update_uids);
+
 	/* update the search result based on the flag changes and
 	   new messages */
 	if (index_search_result_update_flags(result, &flag_update_uids) < 0 ||
@@ -1108,6 +1135,9 @@ static int virtual_sync_backend_box(struct virtual_sync_context *ctx,
 	sync_flags = ctx->flags & (MAILBOX_SYNC_FLAG_FULL_READ |
 				   MAILBOX_SYNC_FLAG_FULL_WRITE |
 				   MAILBOX_SYNC_FLAG_FAST);
+	bbox->sync_uids_updated = FALSE;
+	if (array_is_created(&bbox->sync_changed_uids))
+		array_clear(&bbox->sync_changed_uids);
 
 	if (bbox->search_result == NULL) {
 		/* a) first sync in this process.
@@ -1165,10 +1195,15 @@ static int virtual_sync_backend_box(struct virtual_sync_context *ctx,
 		}
 
 		virtual_backend_box_sync_mail_set(bbox);
+		bbox->sync_uids_updated = TRUE;
 		if (status.uidvalidity != bbox->sync_uid_validity) {
 			/* UID validity changed since last sync (or this is
 			   the first sync), do a full search */
 			i_assert(ctx->expunge_removed);
+			if (!array_is_created(&bbox->sync_changed_uids))
+				i_array_init(&bbox->sync_changed_uids, 1);
+			seq_range_array_add_range(&bbox->sync_changed_uids,
+						  1, (uint32_t)-1);
 			ret = virtual_sync_backend_box_init(bbox);
 		} else {
 			/* build the initial search using the saved modseq. */
@@ -1190,7 +1225,7 @@ static int virtual_sync_backend_box(struct virtual_sync_context *ctx,
 	return ret;
 }
 
-static void virtual_sync_backend_map_uids(struct virtual_sync_context *ctx)
+static int virtual_sync_backend_map_uids(struct virtual_sync_context *ctx)
 {
 	uint32_t virtual_ext_id = ctx->mbox->virtual_ext_id;
 	struct virtual_sync_mail *vmails;
@@ -1204,7 +1239,7 @@ static void virtual_sync_backend_map_uids(struct virtual_sync_context *ctx)
 
 	messages = mail_index_view_get_messages_count(ctx->sync_view);
 	if (messages == 0)
-		return;
+		return 0;
 
 	/* sort the messages in current view by their backend mailbox and
 	   real UID */
@@ -1228,8 +1263,7 @@ static void virtual_sync_backend_map_uids(struct virtual_sync_context *ctx)
 
 		if (bbox == NULL || bbox->mailbox_id != vrec->mailbox_id) {
 			/* add the rest of the newly seen messages */
-			i_assert(j == uidmap_count ||
-				 bbox->search_result != NULL);
+			i_assert(j == uidmap_count || bbox->sync_uids_updated);
 			for (; j < uidmap_count; j++) {
 				add_rec.rec.real_uid = uidmap[j].real_uid;
 				array_append(&ctx->all_adds, &add_rec, 1);
@@ -1246,8 +1280,19 @@ static void virtual_sync_backend_map_uids(struct virtual_sync_context *ctx)
 			j = 0;
 			add_rec.rec.mailbox_id = bbox->mailbox_id;
 			bbox->sync_seen = TRUE;
+			if (bbox->sync_uids_updated &&
+			    array_count(&bbox->sync_changed_uids) > 0) {
+				/* the mailbox may have been closed already
+				   to keep the number of open mailboxes low */
+				if (!bbox->box->opened &&
+				    virtual_backend_box_open(ctx->mbox, bbox) < 0) {
+					i_free(vmails);
+					return -1;
+				}
+				virtual_backend_box_sync_mail_set(bbox);
+			}
 		}
-		if (bbox->search_result == NULL) {
+		if (!bbox->sync_uids_updated) {
 			/* mailbox is completely unchanged since last sync */
 			j = uidmap_count;
 			continue;
@@ -1266,10 +1311,14 @@ static void virtual_sync_backend_map_uids(struct virtual_sync_context *ctx)
 		if (j == uidmap_count || uidmap[j].real_uid != vrec->real_uid)
 			mail_index_expunge(ctx->trans, vseq);
 		else {
-			/* exists - update uidmap and flags */
+			/* exists - update uidmap and the flags that have
+			   changed since the previous sync */
 			uidmap[j++].virtual_uid = vuid;
-			virtual_sync_external_flags(ctx, bbox, vseq,
-						    vrec->real_uid);
+			if (seq_range_exists(&bbox->sync_changed_uids,
+					     vrec->real_uid)) {
+				virtual_sync_external_flags(ctx, bbox, vseq,
+							    vrec->real_uid);
+			}
 		}
 	}
 	i_free(vmails);
@@ -1279,6 +1328,7 @@ static void virtual_sync_backend_map_uids(struct virtual_sync_context *ctx)
 		add_rec.rec.real_uid = uidmap[j].real_uid;
 		array_append(&ctx->all_adds, &add_rec, 1);
 	}
+	return 0;
 }
 
 static void virtual_sync_new_backend_boxes(struct virtual_sync_context *ctx)
@@ -1575,14 +1625,18 @@ static int virtual_sync_backend_boxes(struct virtual_sync_context *ctx)
 		}
 	}
 
-	if (!ctx->mbox->uids_mapped) {
+	if (ctx->mbox->uids_mapped)
+		ret = 0;
+	else {
 		/* initial sync: assign virtual UIDs to existing messages and
-		   sync all flags */
+		   sync the changed flags */
 		ctx->mbox->uids_mapped = TRUE;
-		virtual_sync_backend_map_uids(ctx);
-		virtual_sync_new_backend_boxes(ctx);
+		ret = virtual_sync_backend_map_uids(ctx);
+		if (ret == 0)
+			virtual_sync_new_backend_boxes(ctx);
 	}
-	ret = virtual_sync_backend_add_new(ctx);
+	if (ret == 0)
+		ret = virtual_sync_backend_add_new(ctx);
 	array_free(&ctx->all_adds);
 	if (array_is_created(&ctx->all_mails))
 		array_free(&ctx->all_mails);
@@ -1608,6 +1662,8 @@ static int virtual_sync_finish(struct virtual_sync_context *ctx, bool success)
 		if (mail_index_sync_commit(&ctx->index_sync_ctx) < 0) {
 			mailbox_set_index_error(&ctx->mbox->box);
 			ret = -1;
+		} else if (ctx->ext_header_rewrite) {
+			ctx->mbox->ext_header_rewrite = FALSE;
 		}
 	} else {
 		if (ctx->index_broken) {
@@ -1662,7 +1718,7 @@ static int virtual_sync(struct virtual_mailbox *mbox,
 	ret = virtual_mailbox_ext_header_read(mbox, ctx->sync_view, &broken);
 	if (ret < 0)
 		return virtual_sync_finish(ctx, FALSE);
-	if (ret == 0)
+	if (ret == 0 || mbox->ext_header_rewrite)
 		ctx->ext_header_rewrite = TRUE;
 	if (broken)
 		ctx->index_broken = TRUE;
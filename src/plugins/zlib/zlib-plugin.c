@@ -48,6 +48,8 @@ struct zlib_user {
 
 	const struct compression_handler *save_handler;
 	unsigned int save_level;
+
+	const struct compression_handler *log_archive_handler;
 };
 
 const char *zlib_plugin_version = DOVECOT_ABI_VERSION;
@@ -326,6 +328,26 @@ static int zlib_mailbox_open_input(struct mailbox *box)
 static int zlib_mailbox_open(struct mailbox *box)
 {
 	union mailbox_module_context *zbox = ZLIB_CONTEXT(box);
+	struct zlib_user *zuser = ZLIB_USER_CONTEXT(box->storage->user);
+	enum mailbox_existence existence;
+
+	if (zuser->log_archive_handler != NULL &&
+	    INDEX_STORAGE_CONTEXT(box) != NULL) {
+		/* this needs to be set before the index is opened. allocating
+		   the index creates the missing directories, so don't do it
+		   for nonexistent mailboxes. their open fails anyway. */
+		if (box->index == NULL) {
+			if (mailbox_exists(box, FALSE, &existence) < 0)
+				return -1;
+			if (existence == MAILBOX_EXISTENCE_SELECT &&
+			    index_storage_mailbox_alloc_index(box) < 0)
+				return -1;
+		}
+		if (box->index != NULL) {
+			mail_index_set_log_archive_compression(box->index,
+				zuser->log_archive_handler, zuser->save_level);
+		}
+	}
 
 	if (box->input == NULL &&
 	    (box->storage->class_flags &
@@ -405,6 +427,20 @@ static void zlib_mail_user_created(struct mail_user *user)
 	}
 	if (zuser->save_level == 0)
 		zuser->save_level = ZLIB_PLUGIN_DEFAULT_LEVEL;
+
+	name = mail_user_plugin_getenv(user, "zlib_index_log_archive");
+	if (name != NULL && *name != '\0') {
+		zuser->log_archive_handler = compression_lookup_handler(name);
+		if (zuser->log_archive_handler == NULL)
+			i_error("zlib_index_log_archive: Unknown handler: %s", name);
+		else if (zuser->log_archive_handler->create_ostream == NULL) {
+			i_error("zlib_index_log_archive: Support not compiled in for handler: %s", name);
+			zuser->log_archive_handler = NULL;
+		} else if (zuser->log_archive_handler->is_compressed == NULL) {
+			i_error("zlib_index_log_archive: Handler can't be used for archiving: %s", name);
+			zuser->log_archive_handler = NULL;
+		}
+	}
 	MODULE_CONTEXT_SET(user, zlib_user_module, zuser);
 }
 